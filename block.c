@@ -384,6 +384,7 @@ BlockDriverState *bdrv_new(void)
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
+    qemu_co_queue_init(&bs->untracked_queue);
     qemu_co_queue_init(&bs->flush_queue);
 
     for (i = 0; i < bdrv_drain_all_count; i++) {
@@ -1303,6 +1304,8 @@ static void bdrv_child_cb_attach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
 
+    bdrv_chain_invalidate(bs, 0, INT64_MAX);
+
     if (child->role & BDRV_CHILD_COW) {
         bdrv_backing_attach(child);
     }
@@ -1314,6 +1317,8 @@ static void bdrv_child_cb_detach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
 
+    bdrv_chain_invalidate(bs, 0, INT64_MAX);
+
     if (child->role & BDRV_CHILD_COW) {
         bdrv_backing_detach(child);
     }
@@ -4414,6 +4419,9 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    bdrv_chain_map_free(bs->chain_map);
+    bs->chain_map = NULL;
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -4641,6 +4649,8 @@ static void bdrv_delete(BlockDriverState *bs)
 static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
     }
@@ -4649,7 +4659,12 @@ static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    ret = bs->drv->bdrv_co_check(bs, res, fix);
+    if (fix) {
+        /* Repairs may have deallocated clusters */
+        bdrv_chain_invalidate(bs, 0, INT64_MAX);
+    }
+    return ret;
 }
 
 typedef struct CheckCo {
@@ -5704,6 +5719,9 @@ static void coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs,
             bdrv_dirty_bitmap_skip_store(bm, false);
         }
 
+        /* The image may have been changed by the migration source */
+        bdrv_chain_invalidate(bs, 0, INT64_MAX);
+
         ret = refresh_total_sectors(bs, bs->total_sectors);
         if (ret < 0) {
             bs->open_flags |= BDRV_O_INACTIVE;
@@ -6504,6 +6522,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        bool force,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -6513,8 +6533,10 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb,
-                                       cb_opaque, force, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb,
+                                      cb_opaque, force, errp);
+    bdrv_chain_invalidate(bs, 0, INT64_MAX);
+    return ret;
 }
 
 /*
@@ -6929,6 +6951,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_chain_invalidate(c->bs, 0, INT64_MAX);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -50,7 +50,12 @@ void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    unsigned i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            timed_average_destroy(&s->latency[i]);
+        }
         g_free(s);
     }
     qemu_mutex_destroy(&stats->lock);
@@ -71,6 +76,10 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
         timed_average_init(&s->latency[i], clock_type,
                            (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
     }
+    /* query-blockstats reports latency percentiles only for these */
+    timed_average_enable_percentiles(&s->latency[BLOCK_ACCT_READ]);
+    timed_average_enable_percentiles(&s->latency[BLOCK_ACCT_WRITE]);
+    timed_average_enable_percentiles(&s->latency[BLOCK_ACCT_FLUSH]);
     qemu_mutex_unlock(&stats->lock);
 }
 
@@ -109,8 +118,8 @@ static int block_latency_histogram_compare_func(const void *key, const void *it)
     return k < a ? -1 : (k < b ? 0 : 1);
 }
 
-static void block_latency_histogram_account(BlockLatencyHistogram *hist,
-                                            int64_t latency_ns)
+void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                     int64_t latency_ns)
 {
     uint64_t *pos;
 
@@ -138,10 +147,9 @@ static void block_latency_histogram_account(BlockLatencyHistogram *hist,
     hist->bins[pos - hist->boundaries + 1]++;
 }
 
-int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
-                                uint64List *boundaries)
+int block_latency_histogram_init(BlockLatencyHistogram *hist,
+                                 uint64List *boundaries)
 {
-    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
     uint64List *entry;
     uint64_t *ptr;
     uint64_t prev = 0;
@@ -170,15 +178,26 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
     return 0;
 }
 
+void block_latency_histogram_destroy(BlockLatencyHistogram *hist)
+{
+    g_free(hist->bins);
+    g_free(hist->boundaries);
+    memset(hist, 0, sizeof(*hist));
+}
+
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    return block_latency_histogram_init(&stats->latency_histogram[type],
+                                        boundaries);
+}
+
 void block_latency_histograms_clear(BlockAcctStats *stats)
 {
     int i;
 
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
-        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
-        g_free(hist->bins);
-        g_free(hist->boundaries);
-        memset(hist, 0, sizeof(*hist));
+        block_latency_histogram_destroy(&stats->latency_histogram[i]);
     }
 }
 
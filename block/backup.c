@@ -183,7 +183,7 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
 static int coroutine_fn backup_loop(BackupBlockJob *job)
 {
     bool error_is_read;
-    int64_t offset;
+    int64_t offset, bytes;
     BdrvDirtyBitmapIter *bdbi;
     int ret = 0;
 
@@ -193,7 +193,14 @@ static int coroutine_fn backup_loop(BackupBlockJob *job)
             if (yield_and_check(job)) {
                 goto out;
             }
-            ret = backup_do_cow(job, offset, job->cluster_size, &error_is_read);
+            /*
+             * Unless the job is rate limited, hand block-copy enough dirty
+             * data at once that it can keep as many requests in flight as it
+             * currently finds useful.
+             */
+            bytes = job->common.speed ? job->cluster_size :
+                    MIN(block_copy_batch_size(job->bcs), job->len - offset);
+            ret = backup_do_cow(job, offset, bytes, &error_is_read);
             if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
                            BLOCK_ERROR_ACTION_REPORT)
             {
@@ -279,6 +286,14 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
     return ret;
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    info->block_copy = block_copy_query(s->bcs);
+    info->has_block_copy = !!info->block_copy;
+}
+
 static const BlockJobDriver backup_job_driver = {
     .job_driver = {
         .instance_size          = sizeof(BackupBlockJob),
@@ -289,7 +304,8 @@ static const BlockJobDriver backup_job_driver = {
         .commit                 = backup_commit,
         .abort                  = backup_abort,
         .clean                  = backup_clean,
-    }
+    },
+    .query                  = backup_query,
 };
 
 static int64_t backup_calculate_cluster_size(BlockDriverState *target,
@@ -2404,6 +2404,28 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+int coroutine_fn blk_co_splice(BlockBackend *blk, int64_t offset,
+                               int64_t bytes, int pipe_fd)
+{
+    int ret;
+
+    /* The data would bypass the I/O limits */
+    if (blk->public.throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (!ret) {
+        ret = bdrv_co_splice(blk->root, offset, bytes, pipe_fd);
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
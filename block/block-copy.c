@@ -20,6 +20,7 @@
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "block/aio_task.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
@@ -27,6 +28,9 @@
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
 
+/* Throughput changes smaller than 1/BLOCK_COPY_TUNE_NOISE are ignored */
+#define BLOCK_COPY_TUNE_NOISE 20
+
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
@@ -91,6 +95,8 @@ typedef struct BlockCopyState {
     void *progress_opaque;
 
     SharedResource *mem;
+
+    BlockCopyTuner tune;
 } BlockCopyState;
 
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
@@ -125,6 +131,17 @@ static bool coroutine_fn block_copy_wait_one(BlockCopyState *s, int64_t offset,
     return true;
 }
 
+static int64_t block_copy_chunk_size(BlockCopyState *s)
+{
+    return block_copy_tuner_chunk_size(&s->tune);
+}
+
+static void block_copy_set_copy_size(BlockCopyState *s, int64_t copy_size)
+{
+    s->copy_size = copy_size;
+    s->tune.max_chunk_size = copy_size;
+}
+
 /*
  * Search for the first dirty area in offset/bytes range and create task at
  * the beginning of it.
@@ -137,7 +154,8 @@ static BlockCopyTask *block_copy_task_create(BlockCopyState *s,
 
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
-                                           s->copy_size, &offset, &bytes))
+                                           block_copy_chunk_size(s),
+                                           &offset, &bytes))
     {
         return NULL;
     }
@@ -261,6 +279,16 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
     }
 
+    /*
+     * Start with the largest requests and the most workers, which is what
+     * block-copy did before it had a controller.  copy_size limits the
+     * request size from the start.
+     */
+    block_copy_tuner_init(&s->tune,
+                          MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
+                          s->cluster_size, BLOCK_COPY_MAX_WORKERS);
+    s->tune.max_chunk_size = s->copy_size;
+
     QLIST_INIT(&s->tasks);
 
     return s;
@@ -299,6 +327,7 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
         return ret;
     }
 
+    aio_task_pool_set_max_busy_tasks(pool, task->s->tune.max_workers);
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
         co_put_to_shres(task->s->mem, task->bytes);
@@ -354,7 +383,8 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         if (ret < 0) {
             trace_block_copy_copy_range_fail(s, offset, ret);
             s->use_copy_range = false;
-            s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+            block_copy_set_copy_size(s, MAX(s->cluster_size,
+                                            BLOCK_COPY_MAX_BUFFER));
             /* Fallback to read+write with allocated buffer */
         } else {
             if (s->use_copy_range) {
@@ -367,11 +397,11 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
                  * parallel block-copy request unsets it during previous
                  * bdrv_co_copy_range call.
                  */
-                s->copy_size =
+                block_copy_set_copy_size(s,
                         MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
                             QEMU_ALIGN_DOWN(block_copy_max_transfer(s->source,
                                                                     s->target),
-                                            s->cluster_size));
+                                            s->cluster_size)));
             }
             goto out;
         }
@@ -409,14 +439,184 @@ out:
     return ret;
 }
 
+/* Adaptive controller */
+
+void block_copy_tuner_init(BlockCopyTuner *t, int64_t chunk_size,
+                           int64_t min_chunk_size, int max_workers)
+{
+    *t = (BlockCopyTuner) {
+        .chunk_size = chunk_size,
+        .max_workers = max_workers,
+        .min_chunk_size = min_chunk_size,
+        .max_chunk_size = chunk_size,
+        .workers_limit = max_workers,
+        .knob = BLOCK_COPY_TUNE_WORKERS,
+        .direction = {
+            [BLOCK_COPY_TUNE_CHUNK_SIZE] = 1,
+            [BLOCK_COPY_TUNE_WORKERS] = -1,
+        },
+    };
+}
+
+int64_t block_copy_tuner_chunk_size(BlockCopyTuner *t)
+{
+    return MIN(t->chunk_size, t->max_chunk_size);
+}
+
+/*
+ * Double or halve the setting controlled by @knob in its current direction.
+ * Returns false if the setting is already at its limit.
+ */
+static bool block_copy_tune_step(BlockCopyTuner *t, BlockCopyTuneKnob knob)
+{
+    bool up = t->direction[knob] > 0;
+
+    if (knob == BLOCK_COPY_TUNE_CHUNK_SIZE) {
+        int64_t old = block_copy_tuner_chunk_size(t);
+        int64_t new = up ? MIN(old * 2, t->max_chunk_size)
+                         : MAX(QEMU_ALIGN_DOWN(old / 2, t->min_chunk_size),
+                               t->min_chunk_size);
+
+        t->chunk_size = new;
+        return new != old;
+    } else {
+        int old = t->max_workers;
+
+        t->max_workers = up ? MIN(old * 2, t->workers_limit)
+                            : MAX(old / 2, 1);
+        return t->max_workers != old;
+    }
+}
+
+static void block_copy_tuner_reset_interval(BlockCopyTuner *t)
+{
+    t->busy_ns = 0;
+    t->active_ns = 0;
+    t->bytes = 0;
+    t->requests = 0;
+    t->latency_ns = 0;
+}
+
+static bool block_copy_tune(BlockCopyTuner *t, int64_t now)
+{
+    int64_t throughput, latency, noise;
+
+    if (t->busy_ns < BLOCK_COPY_TUNE_INTERVAL_NS ||
+        t->requests < BLOCK_COPY_TUNE_MIN_REQUESTS)
+    {
+        return false;
+    }
+
+    /*
+     * By Little's law, requests complete at the rate of the average number
+     * of requests in flight divided by their average latency.  Unlike the
+     * bytes per busy time, this does not depend on how many requests
+     * happen to complete just before the end of the interval.
+     */
+    throughput = (double)t->bytes * NANOSECONDS_PER_SECOND / t->latency_ns *
+                 t->active_ns / t->busy_ns;
+    latency = t->latency_ns / t->requests;
+    noise = t->throughput / BLOCK_COPY_TUNE_NOISE;
+
+    if (t->undoing) {
+        /* Back at the previous setting, the other knob is next */
+        t->undoing = false;
+        t->knob = (t->knob + 1) % BLOCK_COPY_TUNE__MAX;
+    } else if (t->throughput && throughput < t->throughput - noise) {
+        /* The last step hurt: undo it and go the other way next time */
+        t->direction[t->knob] = -t->direction[t->knob];
+        t->undoing = true;
+    } else if (t->throughput && throughput <= t->throughput + noise) {
+        /*
+         * No gain.  If requests are just waiting longer, there are more
+         * workers than the target can serve; otherwise try the other knob.
+         */
+        if (latency > t->avg_latency_ns + t->avg_latency_ns / 4) {
+            t->knob = BLOCK_COPY_TUNE_WORKERS;
+            t->direction[t->knob] = -1;
+        } else {
+            t->knob = (t->knob + 1) % BLOCK_COPY_TUNE__MAX;
+        }
+    }
+    /* else: the last step helped (or this is the first interval), repeat it */
+
+    if (!block_copy_tune_step(t, t->knob) && !t->undoing) {
+        /* At the limit, turn around and try the other knob */
+        t->direction[t->knob] = -t->direction[t->knob];
+        t->knob = (t->knob + 1) % BLOCK_COPY_TUNE__MAX;
+        block_copy_tune_step(t, t->knob);
+    }
+
+    t->throughput = throughput;
+    t->avg_latency_ns = latency;
+    t->changed_ns = now;
+    t->old_requests = t->active_requests;
+    block_copy_tuner_reset_interval(t);
+    return true;
+}
+
+static void block_copy_tuner_account_time(BlockCopyTuner *t, int64_t now)
+{
+    if (t->active_requests) {
+        t->busy_ns += now - t->last_event_ns;
+        t->active_ns += (now - t->last_event_ns) * t->active_requests;
+    }
+    t->last_event_ns = now;
+}
+
+void block_copy_tuner_request_start(BlockCopyTuner *t, int64_t now)
+{
+    block_copy_tuner_account_time(t, now);
+    t->active_requests++;
+}
+
+bool block_copy_tuner_request_end(BlockCopyTuner *t, int64_t start,
+                                  int64_t now, int64_t bytes, bool account)
+{
+    assert(t->active_requests > 0);
+    block_copy_tuner_account_time(t, now);
+    t->active_requests--;
+
+    /*
+     * Requests that were started with the previous settings would distort
+     * the measurement of the new ones, so the interval only starts once
+     * they are done.
+     */
+    if (start < t->changed_ns) {
+        if (--t->old_requests == 0) {
+            block_copy_tuner_reset_interval(t);
+        }
+        return false;
+    }
+
+    if (!account) {
+        return false;
+    }
+    t->bytes += bytes;
+    t->requests++;
+    t->latency_ns += now - start;
+    return block_copy_tune(t, now);
+}
+
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bool error_is_read = false;
     int ret;
 
+    block_copy_tuner_request_start(&t->s->tune, start);
     ret = block_copy_do_copy(t->s, t->offset, t->bytes, t->zeroes,
                              &error_is_read);
+    /* Writing zeroes says nothing about the data path, don't count it */
+    if (block_copy_tuner_request_end(&t->s->tune, start,
+                                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+                                     t->bytes, ret >= 0 && !t->zeroes)) {
+        trace_block_copy_tune(t->s, t->s->tune.throughput,
+                              t->s->tune.avg_latency_ns,
+                              block_copy_chunk_size(t->s),
+                              t->s->tune.max_workers);
+    }
     if (ret < 0 && !t->call_state->failed) {
         t->call_state->failed = true;
         t->call_state->error_is_read = error_is_read;
@@ -672,6 +872,30 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
     return ret;
 }
 
+int64_t block_copy_batch_size(BlockCopyState *s)
+{
+    return block_copy_chunk_size(s) * s->tune.max_workers;
+}
+
+BlockCopyInfo *block_copy_query(BlockCopyState *s)
+{
+    BlockCopyInfo *info;
+
+    if (!s->tune.throughput) {
+        return NULL;
+    }
+
+    info = g_new(BlockCopyInfo, 1);
+    *info = (BlockCopyInfo) {
+        .chunk_size = block_copy_chunk_size(s),
+        .workers = s->tune.max_workers,
+        .throughput = s->tune.throughput,
+        .latency = s->tune.avg_latency_ns,
+    };
+
+    return info;
+}
+
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s)
 {
     return s->copy_bitmap;
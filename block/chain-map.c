@@ -0,0 +1,321 @@
+/*
+ * Backing chain allocation map
+ *
+ * For a node with a backing chain, remember which layer of the chain
+ * allocates each guest range, as found by walking the chain in block-status
+ * queries.  Later queries that fall into a known range go to that layer
+ * directly instead of querying every layer above it, which makes
+ * block-status on deep chains independent of the depth.
+ *
+ * The map is only a cache.  A write to a layer invalidates the range in the
+ * map of that layer and of every node above it in the chain, and any change
+ * to the children of a layer drops the maps above it completely.  Driver
+ * operations that change the allocation of a layer without going through
+ * block/io.c (e.g. reverting to an internal snapshot) must do the same, see
+ * bdrv_chain_invalidate().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+
+/* Drop the whole map rather than letting it grow without bounds */
+#define BDRV_CHAIN_MAP_MAX_EXTENTS 65536
+
+typedef struct BdrvChainExtent {
+    int64_t offset;
+    int64_t bytes;
+    int depth; /* of the allocating layer, or BDRV_CHAIN_UNALLOCATED */
+} BdrvChainExtent;
+
+struct BdrvChainMap {
+    GTree *tree;
+
+    /*
+     * The layers of the chain, starting with the node itself.  NULL if the
+     * chain has not been looked up since the map was last cleared.
+     */
+    BlockDriverState **layers;
+    int nb_layers;
+
+    /* False if the layers differ in length, the map is unused then */
+    bool usable;
+
+    /* Incremented on every invalidation */
+    uint64_t gen;
+};
+
+/* Overlapping extents compare equal, so lookups find the containing extent */
+static gint bdrv_chain_extent_compare(gconstpointer a, gconstpointer b,
+                                      gpointer opaque)
+{
+    const BdrvChainExtent *e1 = a, *e2 = b;
+
+    if (e1->offset + e1->bytes <= e2->offset) {
+        return -1;
+    }
+    if (e2->offset + e2->bytes <= e1->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+static GTree *bdrv_chain_map_new_tree(void)
+{
+    /* Keys and values are the same BdrvChainExtent */
+    return g_tree_new_full(bdrv_chain_extent_compare, NULL, g_free, NULL);
+}
+
+void bdrv_chain_map_free(BdrvChainMap *map)
+{
+    if (!map) {
+        return;
+    }
+
+    g_tree_destroy(map->tree);
+    g_free(map->layers);
+    g_free(map);
+}
+
+static BdrvChainExtent *bdrv_chain_map_find(BdrvChainMap *map,
+                                            int64_t offset, int64_t bytes)
+{
+    BdrvChainExtent key = {
+        .offset = offset,
+        .bytes = bytes,
+    };
+
+    return g_tree_lookup(map->tree, &key);
+}
+
+static void bdrv_chain_map_add(BdrvChainMap *map, int64_t offset,
+                               int64_t bytes, int depth)
+{
+    BdrvChainExtent *e = g_new(BdrvChainExtent, 1);
+
+    *e = (BdrvChainExtent) {
+        .offset = offset,
+        .bytes = bytes,
+        .depth = depth,
+    };
+    g_tree_insert(map->tree, e, e);
+}
+
+/* Forgets all extents and the layers of the chain */
+static void bdrv_chain_map_clear(BdrvChainMap *map)
+{
+    map->gen++;
+    g_tree_destroy(map->tree);
+    map->tree = bdrv_chain_map_new_tree();
+    g_free(map->layers);
+    map->layers = NULL;
+    map->nb_layers = 0;
+}
+
+static void bdrv_chain_map_invalidate(BdrvChainMap *map, int64_t offset,
+                                      int64_t bytes)
+{
+    BdrvChainExtent *e;
+
+    map->gen++;
+
+    while ((e = bdrv_chain_map_find(map, offset, bytes))) {
+        BdrvChainExtent old = *e;
+        int64_t old_end = old.offset + old.bytes;
+
+        g_tree_remove(map->tree, e);
+
+        if (old.offset < offset) {
+            bdrv_chain_map_add(map, old.offset, offset - old.offset,
+                               old.depth);
+        }
+        if (old_end > offset + bytes) {
+            bdrv_chain_map_add(map, offset + bytes, old_end - offset - bytes,
+                               old.depth);
+        }
+    }
+}
+
+/*
+ * bdrv_chain_invalidate()
+ *
+ * Must be called whenever the allocation status of [@offset, @offset +
+ * @bytes) may have changed in @bs.  Removes the range from the map of @bs
+ * and of all nodes that have @bs in their backing chain, including filters
+ * such as commit_top or mirror_top whose backing child is @bs.  Invalidating
+ * [0, INT64_MAX) also forgets the layers of the chains, so that they are
+ * looked up again.
+ */
+void bdrv_chain_invalidate(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes)
+{
+    BdrvChild *c;
+
+    if (!bytes) {
+        return;
+    }
+    bytes = MIN(bytes, INT64_MAX - offset);
+
+    if (bs->chain_map) {
+        if (offset == 0 && bytes == INT64_MAX) {
+            bdrv_chain_map_clear(bs->chain_map);
+        } else {
+            bdrv_chain_map_invalidate(bs->chain_map, offset, bytes);
+        }
+    }
+
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        BlockDriverState *parent = c->opaque;
+
+        /* The layers of a chain are those returned by backing_bs() */
+        if (c->klass->parent_is_bds && c == parent->backing) {
+            bdrv_chain_invalidate(parent, offset, bytes);
+        }
+    }
+}
+
+/*
+ * bdrv_chain_map_get()
+ *
+ * Returns the map of @bs, creating it and looking up the layers of the chain
+ * if necessary, or NULL if the map cannot be used for @bs because the layers
+ * of its chain differ in length.
+ */
+BdrvChainMap *bdrv_chain_map_get(BlockDriverState *bs)
+{
+    BdrvChainMap *map = bs->chain_map;
+    BlockDriverState *p;
+    int64_t length, len;
+    int i;
+
+    if (!map) {
+        map = g_new0(BdrvChainMap, 1);
+        map->tree = bdrv_chain_map_new_tree();
+        bs->chain_map = map;
+    }
+
+    if (!map->layers) {
+        for (p = bs; p; p = backing_bs(p)) {
+            map->nb_layers++;
+        }
+        map->layers = g_new(BlockDriverState *, map->nb_layers);
+
+        /*
+         * Reading beyond the end of a shorter backing file returns zeroes
+         * from the layer above, which the map cannot express
+         */
+        length = bdrv_getlength(bs);
+        map->usable = length >= 0;
+        for (i = 0, p = bs; p; i++, p = backing_bs(p)) {
+            map->layers[i] = p;
+            len = bdrv_getlength(p);
+            map->usable &= len == length;
+        }
+    }
+
+    return map->usable ? map : NULL;
+}
+
+BlockDriverState *bdrv_chain_map_layer(BdrvChainMap *map, int depth)
+{
+    assert(depth >= 0 && depth < map->nb_layers);
+    return map->layers[depth];
+}
+
+/*
+ * Returns the depth of @base in the chain, the number of layers if @base is
+ * NULL or -1 if @base is not in the chain.
+ */
+int bdrv_chain_map_depth(BdrvChainMap *map, BlockDriverState *base)
+{
+    int i;
+
+    if (!base) {
+        return map->nb_layers;
+    }
+
+    for (i = 0; i < map->nb_layers; i++) {
+        if (map->layers[i] == base) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Returns a counter that changes whenever anything is invalidated */
+uint64_t bdrv_chain_map_gen(BdrvChainMap *map)
+{
+    return map->gen;
+}
+
+/*
+ * bdrv_chain_map_lookup()
+ *
+ * Looks up @offset in the map.  On success, *@depth is set to the depth of
+ * the layer that allocates @offset, or BDRV_CHAIN_UNALLOCATED if no layer
+ * does, and *@bytes to the number of bytes starting at @offset for which
+ * the same holds.
+ *
+ * Returns false if @offset is not in the map.
+ */
+bool bdrv_chain_map_lookup(BdrvChainMap *map, int64_t offset, int64_t *bytes,
+                           int *depth)
+{
+    BdrvChainExtent *e = bdrv_chain_map_find(map, offset, 1);
+
+    if (!e) {
+        return false;
+    }
+
+    *bytes = e->offset + e->bytes - offset;
+    *depth = e->depth;
+
+    return true;
+}
+
+/*
+ * bdrv_chain_map_insert()
+ *
+ * Records that [@offset, @offset + @bytes) is allocated in the layer at
+ * @depth (or in no layer for BDRV_CHAIN_UNALLOCATED).  The new extent is
+ * merged with adjacent extents of the same layer.
+ */
+void bdrv_chain_map_insert(BdrvChainMap *map, int64_t offset, int64_t bytes,
+                           int depth)
+{
+    BdrvChainExtent *e;
+
+    if (!bytes) {
+        return;
+    }
+
+    /* Not a change of the status, so don't bump the generation */
+    while ((e = bdrv_chain_map_find(map, offset, bytes))) {
+        g_tree_remove(map->tree, e);
+    }
+
+    if (offset > 0) {
+        e = bdrv_chain_map_find(map, offset - 1, 1);
+        if (e && e->depth == depth) {
+            bytes += offset - e->offset;
+            offset = e->offset;
+            g_tree_remove(map->tree, e);
+        }
+    }
+
+    e = bdrv_chain_map_find(map, offset + bytes, 1);
+    if (e && e->depth == depth) {
+        bytes += e->bytes;
+        g_tree_remove(map->tree, e);
+    }
+
+    if (g_tree_nnodes(map->tree) >= BDRV_CHAIN_MAP_MAX_EXTENTS) {
+        g_tree_destroy(map->tree);
+        map->tree = bdrv_chain_map_new_tree();
+    }
+
+    bdrv_chain_map_add(map, offset, bytes, depth);
+}
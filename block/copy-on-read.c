@@ -23,11 +23,125 @@
 #include "qemu/osdep.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
+#include "qemu/host-utils.h"
+#include "qemu/option.h"
+#include "qemu/ratelimit.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "trace.h"
 
+#define COR_OPT_PREFETCH        "prefetch"
+#define COR_OPT_PREFETCH_SIZE   "prefetch-size"
+#define COR_OPT_PREFETCH_WINDOW "prefetch-window"
+#define COR_OPT_PREFETCH_SPEED  "prefetch-speed"
+
+/* Number of sequential read streams that are tracked at the same time */
+#define COR_STREAMS 8
+
+/* Reads that must follow each other before prefetching starts */
+#define COR_STREAM_MIN_HITS 2
+
+#define COR_SLICE_TIME 100000000ULL /* ns */
+
+/*
+ * A sequence of guest reads where each one starts at most prefetch_size
+ * bytes after the end of the previous one.
+ */
+typedef struct CorStream {
+    uint64_t next;      /* end of the last guest read */
+    uint64_t ahead;     /* data up to here has been prefetched */
+    unsigned hits;      /* number of reads in the stream */
+    unsigned last_use;
+} CorStream;
+
+typedef struct BDRVCopyOnReadState {
+    bool prefetch;
+    uint64_t prefetch_size;
+    uint64_t prefetch_window;
+    uint64_t prefetch_speed;
+    RateLimit limit;
+
+    CorStream streams[COR_STREAMS];
+    unsigned clock;
+
+    bool worker_running;
+    QemuCoSleepState *sleep_state;
+} BDRVCopyOnReadState;
+
+static QemuOptsList cor_runtime_opts = {
+    .name = "copy-on-read",
+    .head = QTAILQ_HEAD_INITIALIZER(cor_runtime_opts.head),
+    .desc = {
+        {
+            .name = COR_OPT_PREFETCH,
+            .type = QEMU_OPT_BOOL,
+            .help = "Read ahead of sequential guest reads in the background",
+        },
+        {
+            .name = COR_OPT_PREFETCH_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a prefetch request",
+        },
+        {
+            .name = COR_OPT_PREFETCH_WINDOW,
+            .type = QEMU_OPT_SIZE,
+            .help = "How far to read ahead of the guest",
+        },
+        {
+            .name = COR_OPT_PREFETCH_SPEED,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum prefetch speed in bytes per second "
+                    "(0 = unlimited)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int cor_parse_options(BlockDriverState *bs, QDict *options,
+                             Error **errp)
+{
+    BDRVCopyOnReadState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret = -EINVAL;
+
+    opts = qemu_opts_create(&cor_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto out;
+    }
+
+    s->prefetch = qemu_opt_get_bool(opts, COR_OPT_PREFETCH, false);
+    s->prefetch_size = qemu_opt_get_size(opts, COR_OPT_PREFETCH_SIZE, 1 * MiB);
+    s->prefetch_window = qemu_opt_get_size(opts, COR_OPT_PREFETCH_WINDOW,
+                                           16 * MiB);
+    s->prefetch_speed = qemu_opt_get_size(opts, COR_OPT_PREFETCH_SPEED, 0);
+
+    if (s->prefetch_size < 64 * KiB || s->prefetch_size > 64 * MiB ||
+        !is_power_of_2(s->prefetch_size))
+    {
+        error_setg(errp, "prefetch-size must be a power of 2 between 64 KiB "
+                   "and 64 MiB");
+        goto out;
+    }
+    if (s->prefetch_window < s->prefetch_size) {
+        error_setg(errp, "prefetch-window must not be smaller than "
+                   "prefetch-size");
+        goto out;
+    }
+    if (s->prefetch_speed) {
+        ratelimit_set_speed(&s->limit, s->prefetch_speed, COR_SLICE_TIME);
+    }
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
 
 static int cor_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
+    int ret;
+
     bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
                                BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
                                false, errp);
@@ -35,6 +149,11 @@ static int cor_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
+    ret = cor_parse_options(bs, options, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
     bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
         (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
 
@@ -74,10 +193,164 @@ static int64_t cor_getlength(BlockDriverState *bs)
 }
 
 
+/* Return the stream that the data closest to the guest is missing from */
+static CorStream *cor_next_stream(BDRVCopyOnReadState *s)
+{
+    CorStream *best = NULL;
+    int i;
+
+    for (i = 0; i < COR_STREAMS; i++) {
+        CorStream *st = &s->streams[i];
+
+        if (st->hits < COR_STREAM_MIN_HITS ||
+            st->ahead >= st->next + s->prefetch_window) {
+            continue;
+        }
+        if (!best || st->ahead - st->next < best->ahead - best->next) {
+            best = st;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Prefetch one chunk of @st. Data that is already allocated in the top
+ * image is skipped without any I/O.
+ */
+static int coroutine_fn cor_prefetch_chunk(BlockDriverState *bs, CorStream *st,
+                                           int64_t end)
+{
+    BDRVCopyOnReadState *s = bs->opaque;
+    uint64_t offset = st->ahead;
+    int64_t bytes, pnum;
+    int ret;
+
+    bytes = MIN(QEMU_ALIGN_DOWN(offset, s->prefetch_size) + s->prefetch_size,
+                end) - offset;
+    ret = bdrv_is_allocated(bs->file->bs, offset, bytes, &pnum);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!ret && atomic_read(&bs->quiesce_counter)) {
+        /* Drained while looking up the block status, prefetch it later */
+        return 0;
+    }
+
+    st->ahead += pnum;
+    if (ret) {
+        return 0;
+    }
+
+    trace_cor_prefetch(bs, offset, pnum);
+    ret = bdrv_co_preadv(bs->file, offset, pnum, NULL,
+                         BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->prefetch_speed) {
+        int64_t delay_ns = ratelimit_calculate_delay(&s->limit, pnum);
+        if (delay_ns > 0 && !atomic_read(&bs->quiesce_counter)) {
+            qemu_co_sleep_ns_wakeable(QEMU_CLOCK_REALTIME, delay_ns,
+                                      &s->sleep_state);
+        }
+    }
+
+    return 0;
+}
+
+static void coroutine_fn cor_prefetch_worker(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVCopyOnReadState *s = bs->opaque;
+    CorStream *st;
+    int64_t end = bdrv_getlength(bs->file->bs);
+
+    if (end < 0) {
+        goto out;
+    }
+    end = QEMU_ALIGN_DOWN(end, bs->file->bs->bl.request_alignment);
+
+    while (!atomic_read(&bs->quiesce_counter) && (st = cor_next_stream(s))) {
+        if (st->ahead >= end ||
+            cor_prefetch_chunk(bs, st, end) < 0) {
+            /* Prefetching is best effort, the guest will see any error */
+            st->hits = 0;
+        }
+    }
+
+out:
+
+    s->worker_running = false;
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Start the prefetch worker if a stream needs it. It never runs in a drained
+ * section; cor_co_drain_end() starts it again afterwards.
+ */
+static void cor_prefetch_start(BlockDriverState *bs)
+{
+    BDRVCopyOnReadState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->worker_running || atomic_read(&bs->quiesce_counter) ||
+        !cor_next_stream(s))
+    {
+        return;
+    }
+
+    co = qemu_coroutine_create(cor_prefetch_worker, bs);
+    s->worker_running = true;
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+/* Update the read streams with a guest read and start prefetching */
+static void cor_prefetch_note_read(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t bytes)
+{
+    BDRVCopyOnReadState *s = bs->opaque;
+    CorStream *st = NULL;
+    int i;
+
+    for (i = 0; i < COR_STREAMS; i++) {
+        CorStream *cur = &s->streams[i];
+
+        if (cur->hits && offset >= cur->next &&
+            offset - cur->next <= s->prefetch_size) {
+            st = cur;
+            break;
+        }
+        if (!st || cur->last_use < st->last_use) {
+            st = cur;
+        }
+    }
+
+    if (i == COR_STREAMS) {
+        /* No stream continues here, replace the least recently used one */
+        *st = (CorStream) { .ahead = offset + bytes };
+    }
+
+    st->next = offset + bytes;
+    st->ahead = MAX(st->ahead, st->next);
+    st->hits++;
+    st->last_use = ++s->clock;
+
+    cor_prefetch_start(bs);
+}
+
 static int coroutine_fn cor_co_preadv(BlockDriverState *bs,
                                       uint64_t offset, uint64_t bytes,
                                       QEMUIOVector *qiov, int flags)
 {
+    BDRVCopyOnReadState *s = bs->opaque;
+
+    if (s->prefetch) {
+        cor_prefetch_note_read(bs, offset, bytes);
+    }
+
     return bdrv_co_preadv(bs->file, offset, bytes, qiov,
                           flags | BDRV_REQ_COPY_ON_READ);
 }
@@ -119,8 +392,30 @@ static void cor_lock_medium(BlockDriverState *bs, bool locked)
 }
 
 
+static void coroutine_fn cor_co_drain_begin(BlockDriverState *bs)
+{
+    BDRVCopyOnReadState *s = bs->opaque;
+
+    /*
+     * A running prefetch worker sees bs->quiesce_counter, finishes its current
+     * request and stops
+     */
+    if (s->sleep_state) {
+        qemu_co_sleep_wake(s->sleep_state);
+    }
+}
+
+
+static void coroutine_fn cor_co_drain_end(BlockDriverState *bs)
+{
+    /* bs->quiesce_counter is already decremented when this runs */
+    cor_prefetch_start(bs);
+}
+
+
 static BlockDriver bdrv_copy_on_read = {
     .format_name                        = "copy-on-read",
+    .instance_size                      = sizeof(BDRVCopyOnReadState),
 
     .bdrv_open                          = cor_open,
     .bdrv_child_perm                    = cor_child_perm,
@@ -135,6 +430,9 @@ static BlockDriver bdrv_copy_on_read = {
     .bdrv_eject                         = cor_eject,
     .bdrv_lock_medium                   = cor_lock_medium,
 
+    .bdrv_co_drain_begin                = cor_co_drain_begin,
+    .bdrv_co_drain_end                  = cor_co_drain_end,
+
     .bdrv_co_block_status               = bdrv_co_block_status_from_file,
 
     .has_variable_length                = true,
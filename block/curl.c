@@ -27,7 +27,11 @@
 #include "qemu/error-report.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
+#include "qemu/host-utils.h"
+#include "qemu/units.h"
 #include "block/block_int.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "crypto/secret.h"
@@ -74,10 +78,15 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_BLOCK_OPT_PASSWORD_SECRET "password-secret"
 #define CURL_BLOCK_OPT_PROXY_USERNAME "proxy-username"
 #define CURL_BLOCK_OPT_PROXY_PASSWORD_SECRET "proxy-password-secret"
+#define CURL_BLOCK_OPT_CACHE_DIR "cache-dir"
+#define CURL_BLOCK_OPT_CHUNK_SIZE "chunk-size"
+#define CURL_BLOCK_OPT_CONNECTIONS "connections"
 
 #define CURL_BLOCK_OPT_READAHEAD_DEFAULT (256 * 1024)
 #define CURL_BLOCK_OPT_SSLVERIFY_DEFAULT true
 #define CURL_BLOCK_OPT_TIMEOUT_DEFAULT 5
+#define CURL_BLOCK_OPT_CHUNK_SIZE_DEFAULT (1 * MiB)
+#define CURL_BLOCK_OPT_CONNECTIONS_DEFAULT 1
 
 struct BDRVCURLState;
 struct CURLState;
@@ -90,10 +99,14 @@ typedef struct CURLAIOCB {
 
     uint64_t offset;
     uint64_t bytes;
+    uint64_t readahead;
     int ret;
 
     size_t start;
     size_t end;
+
+    /* The response came from another version of the image than was opened */
+    bool changed;
 } CURLAIOCB;
 
 typedef struct CURLSocket {
@@ -115,6 +128,10 @@ typedef struct CURLState
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
+
+    /* Validators of the last response, may be NULL */
+    char *etag;
+    char *last_modified;
 } CURLState;
 
 typedef struct BDRVCURLState {
@@ -135,6 +152,24 @@ typedef struct BDRVCURLState {
     char *password;
     char *proxyusername;
     char *proxypassword;
+
+    /*
+     * With a cache directory or more than one connection, the image is
+     * read in aligned chunks of chunk_size bytes, up to connections of
+     * them in parallel.
+     */
+    uint64_t chunk_size;
+    int connections;
+
+    /* Validators of the image when it was opened, may be NULL */
+    char *etag;
+    char *last_modified;
+    bool changed_warned;
+
+    /* Chunks are stored in cache_dir as <cache_key>.<offset in hex> */
+    char *cache_dir;
+    char *cache_key;
+    bool cache_warned;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
@@ -209,15 +244,55 @@ static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
     return 0;
 }
 
+/*
+ * If @header is the header @name, return a copy of its value without
+ * surrounding whitespace. Otherwise return NULL.
+ */
+static char *curl_header_value(const char *header, size_t len,
+                               const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *p, *end = header + len;
+
+    if (len <= name_len || header[name_len] != ':' ||
+        g_ascii_strncasecmp(header, name, name_len) != 0) {
+        return NULL;
+    }
+
+    p = header + name_len + 1;
+    while (p < end && g_ascii_isspace(*p)) {
+        p++;
+    }
+    while (end > p && (g_ascii_isspace(end[-1]) || !end[-1])) {
+        end--;
+    }
+
+    return g_strndup(p, end - p);
+}
+
 /* Called from curl_multi_do_locked, with s->mutex held.  */
 static size_t curl_header_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
-    BDRVCURLState *s = opaque;
+    CURLState *state = opaque;
+    BDRVCURLState *s = state->s;
     size_t realsize = size * nmemb;
     const char *header = (char *)ptr;
     const char *end = header + realsize;
     const char *accept_ranges = "accept-ranges:";
     const char *bytes = "bytes";
+    char *value;
+
+    /* After a redirect, the headers of the last response count */
+    value = curl_header_value(header, realsize, "etag");
+    if (value) {
+        g_free(state->etag);
+        state->etag = value;
+    }
+    value = curl_header_value(header, realsize, "last-modified");
+    if (value) {
+        g_free(state->last_modified);
+        state->last_modified = value;
+    }
 
     if (realsize >= strlen(accept_ranges)
         && g_ascii_strncasecmp(header, accept_ranges,
@@ -248,6 +323,15 @@ static size_t curl_header_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+/* Whether the last response on @state is for the image that was opened */
+static bool curl_state_is_current(CURLState *state)
+{
+    BDRVCURLState *s = state->s;
+
+    return !g_strcmp0(state->etag, s->etag) &&
+           !g_strcmp0(state->last_modified, s->last_modified);
+}
+
 /* Called from curl_multi_do_locked, with s->mutex held.  */
 static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
@@ -304,6 +388,7 @@ static bool curl_find_buf(BDRVCURLState *s, uint64_t start, uint64_t len,
             if (clamped_len < len) {
                 qemu_iovec_memset(acb->qiov, clamped_len, 0, len - clamped_len);
             }
+            acb->changed = !curl_state_is_current(state);
             acb->ret = 0;
             return true;
         }
@@ -391,6 +476,7 @@ static void curl_multi_check_completion(BDRVCURLState *s)
                     }
                 }
 
+                acb->changed = !curl_state_is_current(state);
                 acb->ret = error ? -EIO : 0;
                 state->acb[i] = NULL;
                 qemu_mutex_unlock(&s->mutex);
@@ -486,6 +572,8 @@ static int curl_init_state(BDRVCURLState *s, CURLState *state)
         curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION,
                          (void *)curl_read_cb);
         curl_easy_setopt(state->curl, CURLOPT_WRITEDATA, (void *)state);
+        curl_easy_setopt(state->curl, CURLOPT_HEADERFUNCTION, curl_header_cb);
+        curl_easy_setopt(state->curl, CURLOPT_HEADERDATA, (void *)state);
         curl_easy_setopt(state->curl, CURLOPT_PRIVATE, (void *)state);
         curl_easy_setopt(state->curl, CURLOPT_AUTOREFERER, 1);
         curl_easy_setopt(state->curl, CURLOPT_FOLLOWLOCATION, 1);
@@ -527,6 +615,11 @@ static int curl_init_state(BDRVCURLState *s, CURLState *state)
     QLIST_INIT(&state->sockets);
     state->s = s;
 
+    g_free(state->etag);
+    g_free(state->last_modified);
+    state->etag = NULL;
+    state->last_modified = NULL;
+
     return 0;
 }
 
@@ -575,6 +668,10 @@ static void curl_detach_aio_context(BlockDriverState *bs)
         }
         g_free(s->states[i].orig_buf);
         s->states[i].orig_buf = NULL;
+        g_free(s->states[i].etag);
+        g_free(s->states[i].last_modified);
+        s->states[i].etag = NULL;
+        s->states[i].last_modified = NULL;
     }
     if (s->multi) {
         curl_multi_cleanup(s->multi);
@@ -658,6 +755,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of secret used as password for HTTP proxy auth",
         },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_DIR,
+            .type = QEMU_OPT_STRING,
+            .help = "Directory to keep downloaded chunks of the image in",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CHUNK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the chunks that are fetched and cached",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of chunks fetched in parallel",
+        },
         { /* end of list */ }
     },
 };
@@ -675,6 +787,7 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     double d;
     const char *secretid;
     const char *protocol_delimiter;
+    char *validators;
     int ret;
 
     ret = bdrv_apply_auto_read_only(bs, "curl driver does not support writes",
@@ -706,6 +819,30 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->chunk_size = qemu_opt_get_size(opts, CURL_BLOCK_OPT_CHUNK_SIZE,
+                                      CURL_BLOCK_OPT_CHUNK_SIZE_DEFAULT);
+    if (s->chunk_size < BDRV_SECTOR_SIZE || s->chunk_size > 64 * MiB ||
+        !is_power_of_2(s->chunk_size)) {
+        error_setg(errp, "chunk-size must be a power of 2 between 512 and "
+                   "64M");
+        goto out_noclean;
+    }
+
+    s->connections = qemu_opt_get_number(opts, CURL_BLOCK_OPT_CONNECTIONS,
+                                         CURL_BLOCK_OPT_CONNECTIONS_DEFAULT);
+    if (s->connections < 1 || s->connections > CURL_NUM_STATES) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   CURL_NUM_STATES);
+        goto out_noclean;
+    }
+
+    s->cache_dir = g_strdup(qemu_opt_get(opts, CURL_BLOCK_OPT_CACHE_DIR));
+    if (s->cache_dir && g_mkdir_with_parents(s->cache_dir, 0700) < 0) {
+        error_setg_errno(errp, errno, "Could not create cache directory '%s'",
+                         s->cache_dir);
+        goto out_noclean;
+    }
+
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_BLOCK_OPT_TIMEOUT_DEFAULT);
     if (s->timeout > CURL_TIMEOUT_MAX) {
@@ -788,11 +925,13 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->accept_range = false;
     curl_easy_setopt(state->curl, CURLOPT_NOBODY, 1);
-    curl_easy_setopt(state->curl, CURLOPT_HEADERFUNCTION,
-                     curl_header_cb);
-    curl_easy_setopt(state->curl, CURLOPT_HEADERDATA, s);
     if (curl_easy_perform(state->curl))
         goto out;
+
+    /* Later responses are checked against these */
+    s->etag = g_strdup(state->etag);
+    s->last_modified = g_strdup(state->last_modified);
+
     if (curl_easy_getinfo(state->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d)) {
         goto out;
     }
@@ -824,6 +963,25 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
     }
     trace_curl_open_size(s->len);
 
+    if (s->cache_dir) {
+        /*
+         * Cached chunks are only valid for the same version of the image,
+         * so the server must identify it.
+         */
+        if (!s->etag && !s->last_modified) {
+            warn_report("curl: Server reports neither ETag nor Last-Modified "
+                        "for '%s', not using the cache", s->url);
+        } else {
+            validators = g_strdup_printf("%s\n%s\n%s\n%" PRIu64 "\n%" PRIu64,
+                                         s->url, s->etag ?: "",
+                                         s->last_modified ?: "", s->len,
+                                         s->chunk_size);
+            s->cache_key = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+                                                         validators, -1);
+            g_free(validators);
+        }
+    }
+
     qemu_mutex_lock(&s->mutex);
     curl_clean_state(state);
     qemu_mutex_unlock(&s->mutex);
@@ -839,6 +997,10 @@ out:
     error_setg(errp, "CURL: Error opening file: %s", state->errmsg);
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
+    g_free(state->etag);
+    g_free(state->last_modified);
+    state->etag = NULL;
+    state->last_modified = NULL;
 out_noclean:
     qemu_mutex_destroy(&s->mutex);
     g_free(s->cookie);
@@ -846,6 +1008,10 @@ out_noclean:
     g_free(s->username);
     g_free(s->proxyusername);
     g_free(s->proxypassword);
+    g_free(s->etag);
+    g_free(s->last_modified);
+    g_free(s->cache_dir);
+    g_free(s->cache_key);
     qemu_opts_del(opts);
     return -EINVAL;
 }
@@ -889,7 +1055,7 @@ static void curl_setup_preadv(BlockDriverState *bs, CURLAIOCB *acb)
     state->buf_off = 0;
     g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = MIN(acb->end + s->readahead_size, s->len - start);
+    state->buf_len = MIN(acb->end + acb->readahead, s->len - start);
     end = start + state->buf_len - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
@@ -918,24 +1084,281 @@ out:
     qemu_mutex_unlock(&s->mutex);
 }
 
-static int coroutine_fn curl_co_preadv(BlockDriverState *bs,
-        uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+/*
+ * Read from the server.  Data from another version of the image than the one
+ * that was opened would be mixed with what the guest has already read (and
+ * with the cache), so the request fails instead.
+ */
+static int coroutine_fn curl_co_fetch(BlockDriverState *bs,
+                                      uint64_t offset, uint64_t bytes,
+                                      QEMUIOVector *qiov, uint64_t readahead)
 {
+    BDRVCURLState *s = bs->opaque;
     CURLAIOCB acb = {
         .co = qemu_coroutine_self(),
         .ret = -EINPROGRESS,
         .qiov = qiov,
         .offset = offset,
-        .bytes = bytes
+        .bytes = bytes,
+        .readahead = readahead,
     };
 
     curl_setup_preadv(bs, &acb);
     while (acb.ret == -EINPROGRESS) {
         qemu_coroutine_yield();
     }
+    if (acb.ret == 0 && acb.changed) {
+        if (!s->changed_warned) {
+            error_report("curl: '%s' changed on the server since it was "
+                         "opened", s->url);
+            s->changed_warned = true;
+        }
+        return -EIO;
+    }
     return acb.ret;
 }
 
+typedef struct CURLCacheOp {
+    char *path;
+    uint8_t *buf;
+    uint64_t offset;
+    size_t bytes;
+} CURLCacheOp;
+
+static int curl_cache_read_worker(void *opaque)
+{
+    CURLCacheOp *op = opaque;
+    size_t done = 0;
+    ssize_t len;
+    int fd, ret = 0;
+
+    fd = qemu_open(op->path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    while (done < op->bytes) {
+        len = pread(fd, op->buf + done, op->bytes - done, op->offset + done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0) {
+            ret = -errno;
+            break;
+        } else if (len == 0) {
+            /* Truncated cache file */
+            ret = -ENODATA;
+            break;
+        }
+        done += len;
+    }
+
+    qemu_close(fd);
+    return ret;
+}
+
+static int curl_cache_write_worker(void *opaque)
+{
+    CURLCacheOp *op = opaque;
+    GError *gerr = NULL;
+
+    /*
+     * The data goes to a temporary file that is renamed, so concurrent
+     * readers (possibly in other processes) never see a partial chunk
+     */
+    if (!g_file_set_contents(op->path, (const gchar *)op->buf, op->bytes,
+                             &gerr)) {
+        g_error_free(gerr);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn curl_cache_co_io(BlockDriverState *bs,
+                                         ThreadPoolFunc *func,
+                                         uint64_t chunk_start, uint8_t *buf,
+                                         uint64_t offset, size_t bytes)
+{
+    BDRVCURLState *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    CURLCacheOp op = {
+        .path = g_strdup_printf("%s/%s.%" PRIx64, s->cache_dir, s->cache_key,
+                                chunk_start),
+        .buf = buf,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    int ret;
+
+    ret = thread_pool_submit_co(pool, func, &op);
+    g_free(op.path);
+    return ret;
+}
+
+/*
+ * Read from a single chunk.  Without a cache, only the requested data is
+ * fetched from the server.  With a cache, a miss fetches the whole chunk so
+ * that it can be written to the cache directory.
+ */
+static int coroutine_fn curl_co_read_chunk(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset)
+{
+    BDRVCURLState *s = bs->opaque;
+    uint64_t chunk_start = QEMU_ALIGN_DOWN(offset, s->chunk_size);
+    uint64_t chunk_len, in_chunk, avail;
+    QEMUIOVector chunk_qiov;
+    uint8_t *buf;
+    int ret;
+
+    if (offset >= s->len) {
+        qemu_iovec_memset(qiov, qiov_offset, 0, bytes);
+        return 0;
+    }
+
+    if (!s->cache_key) {
+        qemu_iovec_init_slice(&chunk_qiov, qiov, qiov_offset, bytes);
+        ret = curl_co_fetch(bs, offset, bytes, &chunk_qiov, 0);
+        qemu_iovec_destroy(&chunk_qiov);
+        return ret;
+    }
+
+    chunk_len = MIN(s->chunk_size, s->len - chunk_start);
+    in_chunk = offset - chunk_start;
+    avail = MIN(bytes, chunk_len - in_chunk);
+
+    buf = g_try_malloc(avail);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    ret = curl_cache_co_io(bs, curl_cache_read_worker, chunk_start, buf,
+                           in_chunk, avail);
+    trace_curl_cache_read(chunk_start, ret);
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf, avail);
+        goto out;
+    }
+    g_free(buf);
+
+    buf = g_try_malloc(chunk_len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    qemu_iovec_init_buf(&chunk_qiov, buf, chunk_len);
+    ret = curl_co_fetch(bs, chunk_start, chunk_len, &chunk_qiov, 0);
+    if (ret < 0) {
+        g_free(buf);
+        return ret;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + in_chunk, avail);
+
+    /* The cache is best effort, failing to fill it is no I/O error */
+    ret = curl_cache_co_io(bs, curl_cache_write_worker, chunk_start, buf,
+                           0, chunk_len);
+    trace_curl_cache_write(chunk_start, chunk_len, ret);
+    if (ret < 0 && !s->cache_warned) {
+        warn_report("curl: Failed to write to cache directory '%s'",
+                    s->cache_dir);
+        s->cache_warned = true;
+    }
+
+out:
+    if (avail < bytes) {
+        qemu_iovec_memset(qiov, qiov_offset + avail, 0, bytes - avail);
+    }
+    g_free(buf);
+    return 0;
+}
+
+typedef struct CURLChunkTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} CURLChunkTask;
+
+static coroutine_fn int curl_co_read_chunk_entry(AioTask *task)
+{
+    CURLChunkTask *t = container_of(task, CURLChunkTask, task);
+
+    return curl_co_read_chunk(t->bs, t->offset, t->bytes, t->qiov,
+                              t->qiov_offset);
+}
+
+static coroutine_fn int curl_add_chunk_task(BlockDriverState *bs,
+                                            AioTaskPool *pool,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            size_t qiov_offset)
+{
+    CURLChunkTask local_task;
+    CURLChunkTask *task = pool ? g_new(CURLChunkTask, 1) : &local_task;
+
+    *task = (CURLChunkTask) {
+        .task.func = curl_co_read_chunk_entry,
+        .bs = bs,
+        .offset = offset,
+        .bytes = bytes,
+        .qiov = qiov,
+        .qiov_offset = qiov_offset,
+    };
+
+    if (!pool) {
+        return curl_co_read_chunk_entry(&task->task);
+    }
+
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+static int coroutine_fn curl_co_preadv(BlockDriverState *bs,
+        uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    BDRVCURLState *s = bs->opaque;
+    AioTaskPool *aio = NULL;
+    size_t qiov_offset = 0;
+    uint64_t cur_bytes;
+    int ret = 0;
+
+    if (!s->cache_key && s->connections == 1) {
+        return curl_co_fetch(bs, offset, bytes, qiov, s->readahead_size);
+    }
+
+    /* Requests that span several chunks fetch them in parallel */
+    while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        cur_bytes = MIN(bytes, QEMU_ALIGN_DOWN(offset, s->chunk_size) +
+                               s->chunk_size - offset);
+        if (!aio && cur_bytes != bytes) {
+            aio = aio_task_pool_new(s->connections);
+        }
+
+        ret = curl_add_chunk_task(bs, aio, offset, cur_bytes, qiov,
+                                  qiov_offset);
+        if (ret < 0) {
+            break;
+        }
+
+        bytes -= cur_bytes;
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
+        }
+        g_free(aio);
+    }
+
+    return ret;
+}
+
 static void curl_close(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
@@ -949,6 +1372,10 @@ static void curl_close(BlockDriverState *bs)
     g_free(s->username);
     g_free(s->proxyusername);
     g_free(s->proxypassword);
+    g_free(s->etag);
+    g_free(s->last_modified);
+    g_free(s->cache_dir);
+    g_free(s->cache_key);
 }
 
 static int64_t curl_getlength(BlockDriverState *bs)
@@ -961,8 +1388,10 @@ static void curl_refresh_filename(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
 
-    /* "readahead" and "timeout" do not change the guest-visible data,
-     * so ignore them */
+    /*
+     * "readahead", "timeout" and the chunk and cache options do not
+     * change the guest-visible data, so ignore them
+     */
     if (s->sslverify != CURL_BLOCK_OPT_SSLVERIFY_DEFAULT ||
         s->cookie || s->username || s->password || s->proxyusername ||
         s->proxypassword)
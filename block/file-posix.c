@@ -106,6 +106,7 @@
 #include <xfs/xfs.h>
 #endif
 
+
 #include "trace.h"
 
 /* OS X does not have O_DSYNC */
@@ -160,6 +161,8 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool io_uring_fixed_file:1;
+    bool io_uring_sqpoll:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -172,6 +175,14 @@ typedef struct BDRVRawState {
     } stats;
 
     PRManager *pr_mgr;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * Ring used only by this node if any io-uring-* option is set, NULL if
+     * the ring of the AioContext is used
+     */
+    LuringState *io_uring;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -205,6 +216,9 @@ typedef struct RawPosixAIOData {
             int aio_fd2;
             off_t aio_offset2;
         } copy_range;
+        struct {
+            int pipe_fd;
+        } splice;
         struct {
             PreallocMode prealloc;
             Error **errp;
@@ -527,12 +541,98 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "check that page cache was dropped on live migration (default: off)"
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM as io_uring fixed buffers "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-fixed-file",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the image file with io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "use a kernel thread to poll the io_uring submission "
+                    "queue (default: off)",
+        },
+#endif
         { /* end of list */ }
     },
 };
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return s->io_uring ?: aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+}
+
+/*
+ * Register the current fd with the private ring.  Must be called whenever
+ * s->fd changes, because the ring keeps a reference to the registered file.
+ * The callers cannot fail, so if an SQPOLL ring can't use the new fd, the
+ * node stops using io_uring.
+ */
+static void raw_update_luring_fixed_file(BDRVRawState *s)
+{
+    Error *local_err = NULL;
+
+    if (!s->io_uring || !s->io_uring_fixed_file) {
+        return;
+    }
+    if (luring_set_fixed_file(s->io_uring, s->fd, &local_err) < 0) {
+        if (s->io_uring_sqpoll) {
+            /*
+             * Before Linux 5.11, the SQ polling thread cannot access files
+             * that are not registered, so every request would fail
+             */
+            error_reportf_err(local_err, "Unable to use io_uring with "
+                              "io-uring-sqpoll, falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        } else {
+            /* Requests fall back to the normal file descriptor */
+            warn_report_err(local_err);
+        }
+    }
+}
+
+static int raw_setup_private_luring(BlockDriverState *bs, unsigned int flags,
+                                    Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    s->io_uring = luring_init_flags(flags, errp);
+    if (!s->io_uring) {
+        return -EINVAL;
+    }
+    luring_attach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+
+    if (s->io_uring_fixed_file &&
+        luring_set_fixed_file(s->io_uring, s->fd, errp) < 0) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void raw_cleanup_private_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+        luring_cleanup(s->io_uring);
+        s->io_uring = NULL;
+    }
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -546,6 +646,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     int fd, ret;
     struct stat st;
     OnOffAuto locking;
+#ifdef CONFIG_LINUX_IO_URING
+    unsigned int luring_flags = 0;
+#endif
 
     opts = qemu_opts_create(&raw_runtime_opts, NULL, 0, &error_abort);
     if (!qemu_opts_absorb_qdict(opts, options, errp)) {
@@ -582,6 +685,27 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+
+    if (qemu_opt_get_bool(opts, "io-uring-fixed-buffers", false)) {
+        luring_flags |= LURING_FIXED_BUFFERS;
+    }
+    if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false)) {
+        luring_flags |= LURING_SQPOLL;
+    }
+    s->io_uring_sqpoll = luring_flags & LURING_SQPOLL;
+    /*
+     * Before Linux 5.11, the SQ polling thread can only access registered
+     * files, so always register the image file in that case.
+     */
+    s->io_uring_fixed_file = qemu_opt_get_bool(opts, "io-uring-fixed-file",
+                                               false) ||
+                             (luring_flags & LURING_SQPOLL);
+    if ((luring_flags || s->io_uring_fixed_file) && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed-buffers, io-uring-fixed-file and "
+                   "io-uring-sqpoll require aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
@@ -678,7 +802,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
+    if (s->use_linux_io_uring &&
+        (luring_flags || s->io_uring_fixed_file)) {
+        ret = raw_setup_private_luring(bs, luring_flags, errp);
+        if (ret < 0) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            goto fail;
+        }
+    } else if (s->use_linux_io_uring) {
         if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
@@ -773,6 +904,11 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
     ret = 0;
 fail:
+#ifdef CONFIG_LINUX_IO_URING
+    if (ret < 0) {
+        raw_cleanup_private_luring(bs);
+    }
+#endif
     if (ret < 0 && s->fd != -1) {
         qemu_close(s->fd);
     }
@@ -1133,6 +1269,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     qemu_close(s->fd);
     s->fd = rs->fd;
+#ifdef CONFIG_LINUX_IO_URING
+    raw_update_luring_fixed_file(s);
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1756,6 +1895,81 @@ static int handle_aiocb_copy_range(void *opaque)
     return 0;
 }
 
+#ifdef CONFIG_SPLICE
+/* Fill the pipe with zeroes until it is full; returns the bytes written */
+static ssize_t splice_write_zeroes(int fd, uint64_t bytes)
+{
+    static const uint8_t zeroes[4096];
+    ssize_t done = 0;
+
+    while (bytes) {
+        ssize_t ret = write(fd, zeroes, MIN(bytes, sizeof(zeroes)));
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return done ? done : -errno;
+        }
+        done += ret;
+        bytes -= ret;
+    }
+    return done;
+}
+
+/*
+ * Move up to aio_nbytes bytes from the file into the pipe.  The pipe is
+ * non-blocking and we never wait for it to drain: the caller holds a
+ * request on the node, so waiting for a slow reader on the other end of the
+ * pipe would stall drain.  Whatever doesn't fit is left to the next call.
+ */
+static int handle_aiocb_splice(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    int pipe_fd = aiocb->splice.pipe_fd;
+    uint64_t bytes = aiocb->aio_nbytes;
+    loff_t offset = aiocb->aio_offset;
+    int done = 0;
+
+    while (bytes) {
+        ssize_t ret = splice(aiocb->aio_fildes, &offset, pipe_fd, NULL, bytes,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        int err = errno;
+
+        trace_file_splice(aiocb->bs, aiocb->aio_fildes, offset, pipe_fd,
+                          bytes, ret);
+        if (ret == 0) {
+            /* Beyond EOF, which reads as zeroes */
+            ret = splice_write_zeroes(pipe_fd, bytes);
+            if (ret < 0) {
+                err = -ret;
+            } else {
+                done += ret;
+                break;
+            }
+        }
+        if (ret < 0) {
+            switch (err) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                /* The pipe is full */
+                return done ? done : -EAGAIN;
+            case EINVAL:
+            case ENOSYS:
+                /* The file doesn't support splice() */
+                return done ? done : -ENOTSUP;
+            default:
+                return done ? done : -err;
+            }
+        }
+        done += ret;
+        bytes -= ret;
+    }
+    return done;
+}
+#endif
+
 static int handle_aiocb_discard(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -1990,7 +2204,7 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         assert(qiov->size == bytes);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -2044,7 +2258,7 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2061,7 +2275,7 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2086,7 +2300,7 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
@@ -2108,7 +2322,9 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
+    if (s->io_uring) {
+        luring_attach_aio_context(s->io_uring, new_context);
+    } else if (s->use_linux_io_uring) {
         Error *local_err;
         if (!aio_setup_linux_io_uring(new_context, &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
@@ -2119,10 +2335,43 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #endif
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_register_buf(s->io_uring, host, size);
+    }
+#endif
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_unregister_buf(s->io_uring, host);
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_cleanup_private_luring(bs);
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3131,6 +3380,9 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+#ifdef CONFIG_LINUX_IO_URING
+        raw_update_luring_fixed_file(s);
+#endif
     }
     s->perm_change_fd = 0;
 
@@ -3200,6 +3452,39 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+#ifdef CONFIG_SPLICE
+static int coroutine_fn raw_co_splice(BlockDriverState *bs, uint64_t offset,
+                                      uint64_t bytes, int pipe_fd)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData acb;
+
+    /* splice() reads through the page cache */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+    if (!bytes) {
+        return 0;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SPLICE,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .splice         = {
+            .pipe_fd        = pipe_fd,
+        },
+    };
+
+    return raw_thread_pool_submit(bs, handle_aiocb_splice, &acb);
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3226,10 +3511,16 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SPLICE
+    .bdrv_co_splice         = raw_co_splice,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3600,10 +3891,16 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SPLICE
+    .bdrv_co_splice         = raw_co_splice,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3728,6 +4025,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3858,6 +4158,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -684,6 +684,21 @@ static void tracked_request_end(BdrvTrackedRequest *req)
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
 
+/**
+ * Finish a request started with untracked_request_begin()
+ */
+static void untracked_request_end(BlockDriverState *bs)
+{
+    atomic_dec(&bs->untracked_in_flight);
+    /* Pairs with smp_mb() in bdrv_wait_untracked_requests_locked() */
+    smp_mb();
+    if (atomic_read(&bs->serialising_in_flight)) {
+        qemu_co_mutex_lock(&bs->reqs_lock);
+        qemu_co_queue_restart_all(&bs->untracked_queue);
+        qemu_co_mutex_unlock(&bs->reqs_lock);
+    }
+}
+
 /**
  * Add an active request to the tracked requests list
  */
@@ -713,6 +728,50 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
+/**
+ * Try to start a request without adding it to the tracked requests list
+ *
+ * Simple requests, i.e. those that can never become serialising and that
+ * nobody needs to look up with bdrv_co_get_self_request(), don't need to be
+ * on the tracked requests list as long as no serialising request is in
+ * flight.  Instead of taking reqs_lock twice, they are only counted in
+ * bs->untracked_in_flight; bdrv_mark_request_serialising() waits for that
+ * counter to drop to zero.
+ *
+ * Returns true if @req has been set up as an untracked request, which must
+ * then be finished with untracked_request_end().  Returns false if the
+ * caller has to use tracked_request_begin() instead.
+ */
+static bool untracked_request_begin(BdrvTrackedRequest *req,
+                                    BlockDriverState *bs,
+                                    int64_t offset,
+                                    uint64_t bytes,
+                                    enum BdrvTrackedRequestType type)
+{
+    assert(bytes <= INT64_MAX && offset <= INT64_MAX - bytes);
+
+    atomic_inc(&bs->untracked_in_flight);
+    /* Pairs with smp_mb() in bdrv_wait_untracked_requests_locked() */
+    smp_mb();
+    if (atomic_read(&bs->serialising_in_flight)) {
+        untracked_request_end(bs);
+        return false;
+    }
+
+    *req = (BdrvTrackedRequest){
+        .bs = bs,
+        .offset         = offset,
+        .bytes          = bytes,
+        .type           = type,
+        .co             = qemu_coroutine_self(),
+        .untracked      = true,
+        .overlap_offset = offset,
+        .overlap_bytes  = bytes,
+    };
+
+    return true;
+}
+
 static bool tracked_request_overlaps(BdrvTrackedRequest *req,
                                      int64_t offset, uint64_t bytes)
 {
@@ -767,6 +826,25 @@ bdrv_wait_serialising_requests_locked(BlockDriverState *bs,
     return waited;
 }
 
+/*
+ * Untracked requests don't show up in bs->tracked_requests, so a request that
+ * becomes serialising has to wait for all of them.  No new untracked requests
+ * are started while serialising_in_flight is non-zero.
+ */
+static bool coroutine_fn
+bdrv_wait_untracked_requests_locked(BlockDriverState *bs)
+{
+    bool waited = false;
+
+    /* Pairs with smp_mb() in untracked_request_begin/end() */
+    smp_mb();
+    while (atomic_read(&bs->untracked_in_flight)) {
+        qemu_co_queue_wait(&bs->untracked_queue, &bs->reqs_lock);
+        waited = true;
+    }
+    return waited;
+}
+
 bool bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 {
     BlockDriverState *bs = req->bs;
@@ -783,7 +861,8 @@ bool bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
-    waited = bdrv_wait_serialising_requests_locked(bs, req);
+    waited = bdrv_wait_untracked_requests_locked(bs);
+    waited |= bdrv_wait_serialising_requests_locked(bs, req);
     qemu_co_mutex_unlock(&bs->reqs_lock);
     return waited;
 }
@@ -860,7 +939,11 @@ static bool coroutine_fn bdrv_wait_serialising_requests(BdrvTrackedRequest *self
     BlockDriverState *bs = self->bs;
     bool waited = false;
 
-    if (!atomic_read(&bs->serialising_in_flight)) {
+    /*
+     * An untracked request was started while no serialising request was in
+     * flight.  Serialising requests that came later wait for it instead.
+     */
+    if (self->untracked || !atomic_read(&bs->serialising_in_flight)) {
         return false;
     }
 
@@ -1409,6 +1492,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                                           &local_qiov, 0,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            bdrv_chain_invalidate(bs, cluster_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -1752,11 +1836,20 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
 
     bdrv_pad_request(bs, &qiov, &qiov_offset, &offset, &bytes, &pad);
 
-    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
-    ret = bdrv_aligned_preadv(child, &req, offset, bytes,
-                              bs->bl.request_alignment,
-                              qiov, qiov_offset, flags);
-    tracked_request_end(&req);
+    if (!(flags & BDRV_REQ_COPY_ON_READ) &&
+        untracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ))
+    {
+        ret = bdrv_aligned_preadv(child, &req, offset, bytes,
+                                  bs->bl.request_alignment,
+                                  qiov, qiov_offset, flags);
+        untracked_request_end(bs);
+    } else {
+        tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+        ret = bdrv_aligned_preadv(child, &req, offset, bytes,
+                                  bs->bl.request_alignment,
+                                  qiov, qiov_offset, flags);
+        tracked_request_end(&req);
+    }
     bdrv_dec_in_flight(bs);
 
     bdrv_padding_destroy(&pad);
@@ -1936,6 +2029,13 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
 
     atomic_inc(&bs->write_gen);
 
+    /* Even a failed request may have changed the allocation */
+    if (req->type == BDRV_TRACKED_TRUNCATE || end_sector > bs->total_sectors) {
+        bdrv_chain_invalidate(bs, 0, INT64_MAX);
+    } else {
+        bdrv_chain_invalidate(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2115,6 +2215,29 @@ out:
     return ret;
 }
 
+/*
+ * Return true if a write request may skip the tracked requests list.  This
+ * excludes requests that need padding (which makes them serialising), zero
+ * writes (drivers may look up the request with bdrv_co_get_self_request())
+ * and nodes with before-write notifiers, which get passed the request.
+ */
+static bool bdrv_write_can_be_untracked(BlockDriverState *bs, int64_t offset,
+                                        unsigned int bytes,
+                                        BdrvRequestFlags flags)
+{
+    if (flags & (BDRV_REQ_ZERO_WRITE | BDRV_REQ_SERIALISING)) {
+        return false;
+    }
+    if (!QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return false;
+    }
+    /* Zero detection turns the request into a zero write */
+    if (bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF) {
+        return false;
+    }
+    return QLIST_EMPTY(&bs->before_write_notifiers.notifiers);
+}
+
 /*
  * Handle a write request in coroutine context
  */
@@ -2166,6 +2289,17 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+
+    if (bdrv_write_can_be_untracked(bs, offset, bytes, flags) &&
+        untracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE))
+    {
+        ret = bdrv_aligned_pwritev(child, &req, offset, bytes, align,
+                                   qiov, qiov_offset, flags);
+        untracked_request_end(bs);
+        bdrv_dec_in_flight(bs);
+        return ret;
+    }
+
     /*
      * Align write if necessary by performing a read-modify-write cycle.
      * Pad qiov with the read parts and be sure to have a tracked request not
@@ -2251,6 +2385,7 @@ typedef struct BdrvCoBlockStatusData {
     int64_t *pnum;
     int64_t *map;
     BlockDriverState **file;
+    int *depth;
 } BdrvCoBlockStatusData;
 
 int coroutine_fn bdrv_co_block_status_from_file(BlockDriverState *bs,
@@ -2463,6 +2598,112 @@ early_out:
     return ret;
 }
 
+/*
+ * Finds the layer in the backing chain of @bs above @base that allocates
+ * @offset, using the chain map of @bs and filling it on a miss.
+ *
+ * Returns 1 if [@offset, @offset + *@pnum) is allocated in *@layer, which
+ * is at *@depth in the chain.  Returns 0 if the range is allocated in no
+ * layer above @base; *@layer is the lowest layer above @base then.
+ * Returns -ENOTSUP if the map cannot be used for the request, or negative
+ * errno on failure.
+ *
+ * If the map had to be filled, the walk through the chain has queried
+ * *@layer already: *@status is set to its block status for the range then,
+ * with *@map and *@file like for bdrv_co_block_status().  Otherwise, it is
+ * set to -1.
+ */
+static int coroutine_fn bdrv_co_chain_lookup(BlockDriverState *bs,
+                                             BlockDriverState *base,
+                                             bool want_zero,
+                                             int64_t offset, int64_t bytes,
+                                             int64_t *pnum,
+                                             BlockDriverState **layer,
+                                             int *depth, int *status,
+                                             int64_t *map,
+                                             BlockDriverState **file)
+{
+    BdrvChainMap *cmap;
+    BlockDriverState *p;
+    uint64_t gen;
+    int64_t n, status_pnum = 0;
+    int base_depth, d, i, ret;
+
+    *status = -1;
+
+    /* A single layer is cheaper to query directly */
+    if (base == bs || base == backing_bs(bs)) {
+        return -ENOTSUP;
+    }
+
+    cmap = bdrv_chain_map_get(bs);
+    if (!cmap || offset >= bdrv_getlength(bs)) {
+        return -ENOTSUP;
+    }
+    base_depth = bdrv_chain_map_depth(cmap, base);
+    if (base_depth <= 0) {
+        return -ENOTSUP;
+    }
+
+    if (!bdrv_chain_map_lookup(cmap, offset, &n, &d)) {
+        /*
+         * Walk the whole chain, so that the result is valid for any base.
+         * Remember the status of the last layer above @base that was
+         * queried, it is the one that is returned in *@layer.
+         */
+        gen = bdrv_chain_map_gen(cmap);
+        n = bytes;
+        d = BDRV_CHAIN_UNALLOCATED;
+        for (p = bs, i = 0; p; p = backing_bs(p), i++) {
+            if (i < base_depth) {
+                ret = bdrv_co_block_status(p, want_zero, offset, n, &n, map,
+                                           file);
+                *status = ret;
+                status_pnum = n;
+            } else {
+                ret = bdrv_co_block_status(p, want_zero, offset, n, &n, NULL,
+                                           NULL);
+            }
+            if (ret < 0) {
+                *status = -1;
+                return ret;
+            }
+            if (ret & BDRV_BLOCK_ALLOCATED) {
+                d = i;
+                break;
+            }
+        }
+
+        /* Don't record a status that was changed by a concurrent write */
+        if (bdrv_chain_map_gen(cmap) != gen || !n) {
+            *status = -1;
+            return -ENOTSUP;
+        }
+        bdrv_chain_map_insert(cmap, offset, n, d);
+
+        /* Lower layers may have shortened the range */
+        if (*status >= 0 && n < status_pnum) {
+            *status &= ~BDRV_BLOCK_EOF;
+        }
+    }
+
+    *pnum = MIN(n, bytes);
+    if (d != BDRV_CHAIN_UNALLOCATED && d < base_depth) {
+        *depth = d;
+        ret = 1;
+    } else {
+        *depth = base_depth - 1;
+        ret = 0;
+    }
+    *layer = bdrv_chain_map_layer(cmap, *depth);
+
+    return ret;
+}
+
+/*
+ * If @depth is not NULL, it is set to the depth of the layer in the chain
+ * that determined the result.
+ */
 static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
                                                    BlockDriverState *base,
                                                    bool want_zero,
@@ -2470,25 +2711,61 @@ static int coroutine_fn bdrv_co_block_status_above(BlockDriverState *bs,
                                                    int64_t bytes,
                                                    int64_t *pnum,
                                                    int64_t *map,
-                                                   BlockDriverState **file)
+                                                   BlockDriverState **file,
+                                                   int *depth)
 {
     BlockDriverState *p;
+    int64_t n;
     int ret = 0;
+    int d, status;
     bool first = true;
 
     assert(bs != base);
-    for (p = bs; p != base; p = backing_bs(p)) {
+
+    ret = bdrv_co_chain_lookup(bs, base, want_zero, offset, bytes, &n, &p,
+                               &d, &status, map, file);
+    if (ret >= 0 && status >= 0) {
+        /* Filled the map, the walk has queried the layer already */
+        *pnum = n;
+        if (depth) {
+            *depth = d;
+        }
+        return status;
+    } else if (ret >= 0) {
+        bool allocated = ret;
+
+        ret = bdrv_co_block_status(p, want_zero, offset, n, pnum, map, file);
+        if (ret < 0) {
+            return ret;
+        }
+        /* A write may have changed the status in the meantime */
+        if (!!(ret & BDRV_BLOCK_ALLOCATED) == allocated) {
+            if (depth) {
+                *depth = d;
+            }
+            return ret;
+        }
+    } else if (ret != -ENOTSUP) {
+        return ret;
+    }
+
+    for (p = bs, d = 0; p != base; p = backing_bs(p), d++) {
         ret = bdrv_co_block_status(p, want_zero, offset, bytes, pnum, map,
                                    file);
         if (ret < 0) {
             break;
         }
-        if (ret & BDRV_BLOCK_ZERO && ret & BDRV_BLOCK_EOF && !first) {
+        if (depth) {
+            *depth = d;
+        }
+        if (ret & BDRV_BLOCK_ZERO && ret & BDRV_BLOCK_EOF && !first &&
+            !depth) {
             /*
              * Reading beyond the end of the file continues to read
              * zeroes, but we can only widen the result to the
              * unallocated length we learned from an earlier
-             * iteration.
+             * iteration.  Callers that want to know the layer get the
+             * range that is actually in this layer.
              */
             *pnum = bytes;
         }
@@ -2511,7 +2788,8 @@ static int coroutine_fn bdrv_block_status_above_co_entry(void *opaque)
     return bdrv_co_block_status_above(data->bs, data->base,
                                       data->want_zero,
                                       data->offset, data->bytes,
-                                      data->pnum, data->map, data->file);
+                                      data->pnum, data->map, data->file,
+                                      data->depth);
 }
 
 /*
@@ -2524,7 +2802,8 @@ static int bdrv_common_block_status_above(BlockDriverState *bs,
                                           bool want_zero, int64_t offset,
                                           int64_t bytes, int64_t *pnum,
                                           int64_t *map,
-                                          BlockDriverState **file)
+                                          BlockDriverState **file,
+                                          int *depth)
 {
     BdrvCoBlockStatusData data = {
         .bs = bs,
@@ -2535,6 +2814,7 @@ static int bdrv_common_block_status_above(BlockDriverState *bs,
         .pnum = pnum,
         .map = map,
         .file = file,
+        .depth = depth,
     };
 
     return bdrv_run_co(bs, bdrv_block_status_above_co_entry, &data);
@@ -2545,7 +2825,20 @@ int bdrv_block_status_above(BlockDriverState *bs, BlockDriverState *base,
                             int64_t *map, BlockDriverState **file)
 {
     return bdrv_common_block_status_above(bs, base, true, offset, bytes,
-                                          pnum, map, file);
+                                          pnum, map, file, NULL);
+}
+
+/*
+ * Like bdrv_block_status_above() with a NULL base, and sets *@depth to the
+ * depth of the layer in the backing chain of @bs that determined the
+ * result.  *@pnum never extends beyond the range that is in that layer.
+ */
+int bdrv_block_status_chain(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, int64_t *pnum, int64_t *map,
+                            BlockDriverState **file, int *depth)
+{
+    return bdrv_common_block_status_above(bs, NULL, true, offset, bytes,
+                                          pnum, map, file, depth);
 }
 
 int bdrv_block_status(BlockDriverState *bs, int64_t offset, int64_t bytes,
@@ -2563,13 +2856,24 @@ int coroutine_fn bdrv_is_allocated(BlockDriverState *bs, int64_t offset,
 
     ret = bdrv_common_block_status_above(bs, backing_bs(bs), false, offset,
                                          bytes, pnum ? pnum : &dummy, NULL,
-                                         NULL);
+                                         NULL, NULL);
     if (ret < 0) {
         return ret;
     }
     return !!(ret & BDRV_BLOCK_ALLOCATED);
 }
 
+static int coroutine_fn bdrv_chain_lookup_co_entry(void *opaque)
+{
+    BdrvCoBlockStatusData *data = opaque;
+    BlockDriverState *layer;
+    int depth, status;
+
+    return bdrv_co_chain_lookup(data->bs, data->base, data->want_zero,
+                                data->offset, data->bytes, data->pnum,
+                                &layer, &depth, &status, NULL, NULL);
+}
+
 /*
  * Given an image chain: ... -> [BASE] -> [INTER1] -> [INTER2] -> [TOP]
  *
@@ -2595,9 +2899,25 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     BlockDriverState *intermediate;
     int ret;
     int64_t n = bytes;
+    BdrvCoBlockStatusData data = {
+        .bs = top,
+        .base = base,
+        .want_zero = false,
+        .offset = offset,
+        .bytes = bytes,
+        .pnum = pnum,
+    };
 
     assert(base || !include_base);
 
+    if (include_base) {
+        data.base = backing_bs(base);
+    }
+    ret = bdrv_run_co(top, bdrv_chain_lookup_co_entry, &data);
+    if (ret != -ENOTSUP) {
+        return ret;
+    }
+
     intermediate = top;
     while (include_base || intermediate != base) {
         int64_t pnum_inter;
@@ -3285,6 +3605,45 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+int coroutine_fn bdrv_co_splice(BdrvChild *child, int64_t offset,
+                                int64_t bytes, int pipe_fd)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    trace_bdrv_co_splice(bs, offset, bytes, pipe_fd);
+
+    if (!bs || !bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(bs, offset, bytes);
+    if (ret) {
+        return ret;
+    }
+
+    /* Copy-on-read needs the data in a buffer to write it back */
+    if (!bs->drv->bdrv_co_splice || bs->encrypted ||
+        atomic_read(&bs->copy_on_read)) {
+        return -ENOTSUP;
+    }
+
+    if (!bytes) {
+        return bs->drv->bdrv_co_splice(bs, offset, 0, pipe_fd);
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_splice(bs, offset, bytes, pipe_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs)
 {
     BdrvChild *c;
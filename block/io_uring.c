@@ -16,12 +16,20 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
+#include "exec/cpu-common.h"
+#include "exec/ramlist.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Kernel limits for IORING_REGISTER_BUFFERS */
+#define MAX_FIXED_BUFFERS 1024
+#define MAX_FIXED_BUFFER_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,6 +64,27 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* LURING_* flags passed to luring_init_flags() */
+    unsigned int flags;
+
+    /* File registered with luring_set_fixed_file(), -1 if none */
+    int fixed_fd;
+
+    /*
+     * Buffers registered for READ_FIXED/WRITE_FIXED.  Each registered region
+     * is split into chunks of at most MAX_FIXED_BUFFER_SIZE; @buf_hosts holds
+     * the start of the region each chunk belongs to.  Protected by AioContext
+     * lock.
+     */
+    struct iovec *bufs;
+    void **buf_hosts;
+    unsigned int nr_bufs;
+    unsigned int last_buf;
+    bool bufs_registered;
+    /* @bufs has changed and not been registered again yet */
+    bool bufs_stale;
+    RAMBlockNotifier ram_notifier;
 } LuringState;
 
 /**
@@ -207,11 +236,55 @@ end:
     qemu_bh_cancel(s->completion_bh);
 }
 
+/**
+ * luring_prep_fixed_buffer:
+ *
+ * Turn a single-buffer readv/writev sqe into READ_FIXED/WRITE_FIXED if the
+ * buffer lies within a registered buffer.  This is done only when the sqe is
+ * copied into the ring, so that re-registering buffers cannot invalidate
+ * requests waiting in submit_queue.  While @bufs doesn't match the registered
+ * table, requests don't use fixed buffers.
+ */
+static void luring_prep_fixed_buffer(LuringState *s, struct io_uring_sqe *sqe,
+                                     LuringAIOCB *luringcb)
+{
+    struct iovec *iov;
+    unsigned int i;
+
+    if (!s->bufs_registered || s->bufs_stale || !luringcb->qiov ||
+        luringcb->qiov->niov != 1 || luringcb->total_read) {
+        return;
+    }
+    if (sqe->opcode != IORING_OP_READV && sqe->opcode != IORING_OP_WRITEV) {
+        return;
+    }
+
+    iov = &luringcb->qiov->iov[0];
+    for (i = 0; i < s->nr_bufs; i++) {
+        unsigned int idx = (s->last_buf + i) % s->nr_bufs;
+        struct iovec *buf = &s->bufs[idx];
+
+        if (iov->iov_base >= buf->iov_base &&
+            iov->iov_base + iov->iov_len <= buf->iov_base + buf->iov_len) {
+            sqe->opcode = sqe->opcode == IORING_OP_READV ?
+                          IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->addr = (__u64)(uintptr_t)iov->iov_base;
+            sqe->len = iov->iov_len;
+            sqe->buf_index = idx;
+            s->last_buf = idx;
+            return;
+        }
+    }
+}
+
+static void luring_update_buffers(LuringState *s);
+
 static int ioq_submit(LuringState *s)
 {
     int ret = 0;
     LuringAIOCB *luringcb, *luringcb_next;
 
+    luring_update_buffers(s);
     while (s->io_q.in_queue > 0) {
         /*
          * Try to fetch sqes from the ring for requests waiting in
@@ -225,6 +298,7 @@ static int ioq_submit(LuringState *s)
             }
             /* Prep sqe for submission */
             *sqes = luringcb->sqeq;
+            luring_prep_fixed_buffer(s, sqes, luringcb);
             QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
         }
         ret = io_uring_submit(&s->ring);
@@ -258,6 +332,8 @@ static void luring_process_completions_and_submit(LuringState *s)
 
     if (!s->io_q.plugged && s->io_q.in_queue > 0) {
         ioq_submit(s);
+    } else {
+        luring_update_buffers(s);
     }
     aio_context_release(s->aio_context);
 }
@@ -347,6 +423,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
         abort();
     }
     io_uring_sqe_set_data(sqes, luringcb);
+    if (fd == s->fixed_fd) {
+        /* Index 0 in the registered file table */
+        sqes->fd = 0;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
@@ -402,7 +483,193 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/*
+ * Called with AioContext lock, if the ring is attached to an AioContext.
+ *
+ * Register @bufs again after it has changed.  sqes that the kernel has not
+ * consumed yet may still refer to an index in the old table, so this is
+ * deferred to the next submission while the submission ring is not empty,
+ * which can only happen with SQPOLL or if io_uring_enter() failed.
+ */
+static void luring_update_buffers(LuringState *s)
+{
+    int ret;
+
+    if (!s->bufs_stale) {
+        return;
+    }
+    if (io_uring_sq_ready(&s->ring)) {
+        /* Hands the sqes to the kernel, or wakes up the SQPOLL thread */
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret > 0) {
+            s->io_q.in_flight += ret;
+            s->io_q.in_queue -= ret;
+        }
+        if (io_uring_sq_ready(&s->ring)) {
+            return;
+        }
+    }
+
+    s->bufs_stale = false;
+    if (s->bufs_registered) {
+        io_uring_unregister_buffers(&s->ring);
+        s->bufs_registered = false;
+    }
+    s->last_buf = 0;
+    if (!s->nr_bufs) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, s->bufs, s->nr_bufs);
+    trace_luring_register_buffers(s, s->nr_bufs, ret);
+    if (ret < 0) {
+        /* Most likely RLIMIT_MEMLOCK, requests just don't use fixed buffers */
+        warn_report_once("io_uring: Failed to register fixed buffers: %s",
+                         strerror(-ret));
+        return;
+    }
+    s->bufs_registered = true;
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Register a buffer so that requests lying within it can use READ_FIXED and
+ * WRITE_FIXED, which avoids mapping the guest pages for every request.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    AioContext *ctx = s->aio_context;
+    unsigned int n = DIV_ROUND_UP(size, MAX_FIXED_BUFFER_SIZE);
+    unsigned int i;
+
+    if (!size) {
+        return;
+    }
+    if (s->nr_bufs + n > MAX_FIXED_BUFFERS) {
+        warn_report_once("io_uring: Too many fixed buffers, not registering "
+                         "%p (%zu bytes)", host, size);
+        return;
+    }
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    s->bufs = g_renew(struct iovec, s->bufs, s->nr_bufs + n);
+    s->buf_hosts = g_renew(void *, s->buf_hosts, s->nr_bufs + n);
+    for (i = 0; i < n; i++) {
+        size_t offset = (size_t)i * MAX_FIXED_BUFFER_SIZE;
+
+        s->bufs[s->nr_bufs] = (struct iovec) {
+            .iov_base = host + offset,
+            .iov_len = MIN(size - offset, MAX_FIXED_BUFFER_SIZE),
+        };
+        s->buf_hosts[s->nr_bufs] = host;
+        s->nr_bufs++;
+    }
+    s->bufs_stale = true;
+    luring_update_buffers(s);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    AioContext *ctx = s->aio_context;
+    unsigned int i, j;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    for (i = j = 0; i < s->nr_bufs; i++) {
+        if (s->buf_hosts[i] != host) {
+            s->bufs[j] = s->bufs[i];
+            s->buf_hosts[j] = s->buf_hosts[i];
+            j++;
+        }
+    }
+    if (j != s->nr_bufs) {
+        s->nr_bufs = j;
+        s->bufs_stale = true;
+        luring_update_buffers(s);
+    }
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    luring_register_buf(s, host, size);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    luring_unregister_buf(s, host);
+}
+
+static int luring_init_ramblock(RAMBlock *rb, void *opaque)
+{
+    void *host_addr = qemu_ram_get_host_addr(rb);
+
+    if (host_addr) {
+        luring_register_buf(opaque, host_addr, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/**
+ * luring_set_fixed_file:
+ * @s: AIO state
+ * @fd: file descriptor to register, or -1
+ *
+ * Register @fd with the ring so that requests for it skip the file table
+ * lookup and reference counting in the kernel.  Only one file can be
+ * registered at a time, which fits rings that are private to one node.
+ * The caller must make sure that no requests are in flight.
+ */
+int luring_set_fixed_file(LuringState *s, int fd, Error **errp)
+{
+    int ret;
+
+    if (s->fixed_fd >= 0) {
+        io_uring_unregister_files(&s->ring);
+        s->fixed_fd = -1;
+    }
+    if (fd < 0) {
+        return 0;
+    }
+
+    ret = io_uring_register_files(&s->ring, &fd, 1);
+    trace_luring_register_file(s, fd, ret);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register file with io_uring");
+        return ret;
+    }
+    s->fixed_fd = fd;
+    return 0;
+}
+
+/**
+ * luring_init_flags:
+ * @flags: LURING_* flags
+ *
+ * Create a ring.  With LURING_SQPOLL, a kernel thread polls the submission
+ * queue so that submitting requests does not need a system call; with
+ * LURING_FIXED_BUFFERS, guest RAM is registered as fixed buffers.
+ */
+LuringState *luring_init_flags(unsigned int flags, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
@@ -410,21 +677,40 @@ LuringState *luring_init(Error **errp)
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    rc = io_uring_queue_init(MAX_ENTRIES, ring,
+                             flags & LURING_SQPOLL ? IORING_SETUP_SQPOLL : 0);
     if (rc < 0) {
         error_setg_errno(errp, errno, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
+    s->flags = flags;
+    s->fixed_fd = -1;
     ioq_init(&s->io_q);
+
+    if (flags & LURING_FIXED_BUFFERS) {
+        s->ram_notifier.ram_block_added = luring_ram_block_added;
+        s->ram_notifier.ram_block_removed = luring_ram_block_removed;
+        ram_block_notifier_add(&s->ram_notifier);
+        qemu_ram_foreach_block(luring_init_ramblock, s);
+    }
     return s;
+}
 
+LuringState *luring_init(Error **errp)
+{
+    return luring_init_flags(0, errp);
 }
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->flags & LURING_FIXED_BUFFERS) {
+        ram_block_notifier_remove(&s->ram_notifier);
+    }
     io_uring_queue_exit(&s->ring);
+    g_free(s->bufs);
+    g_free(s->buf_hosts);
     g_free(s);
     trace_luring_cleanup_state(s);
 }
@@ -36,6 +36,7 @@ typedef struct MirrorBuffer {
 } MirrorBuffer;
 
 typedef struct MirrorOp MirrorOp;
+typedef struct MirrorWriteBatch MirrorWriteBatch;
 
 typedef struct MirrorBlockJob {
     BlockJob common;
@@ -54,6 +55,13 @@ typedef struct MirrorBlockJob {
     /* Whether the target image requires explicit zero-initialization */
     bool zero_target;
     MirrorCopyMode copy_mode;
+    /*
+     * In write-blocking mode, time for which a guest write may wait for
+     * adjacent writes to be sent to the target in a single request
+     */
+    int64_t coalesce_delay_ns;
+    /* The batch that further adjacent guest writes can still join */
+    MirrorWriteBatch *open_batch;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     /* Set when the target is synced (dirty bitmap is clean, nothing
@@ -115,6 +123,34 @@ typedef enum MirrorMethod {
     MIRROR_METHOD_DISCARD,
 } MirrorMethod;
 
+/*
+ * Contiguous guest writes that are copied to the target by one request.  The
+ * first write (the leader) waits for up to coalesce_delay_ns for others to
+ * join, then issues the request; the writers that joined wait on @waiters.
+ */
+struct MirrorWriteBatch {
+    uint64_t offset;
+    uint64_t bytes;
+    int flags;
+    QEMUIOVector qiov;
+    QemuCoSleepState *sleep_state;
+    CoQueue waiters;
+};
+
+/*
+ * Target half of a guest write, running concurrently with the source write
+ * when coalescing is enabled
+ */
+typedef struct MirrorActiveTargetWrite {
+    MirrorBlockJob *job;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    int flags;
+    Coroutine *waiter;
+    bool done;
+} MirrorActiveTargetWrite;
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -1314,6 +1350,79 @@ do_sync_target_write(MirrorBlockJob *job, MirrorMethod method,
     }
 }
 
+static void coroutine_fn
+mirror_coalesced_target_write(MirrorBlockJob *job, uint64_t offset,
+                              uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    MirrorWriteBatch *batch = job->open_batch;
+
+    if (batch && batch->flags == flags &&
+        batch->offset + batch->bytes == offset &&
+        batch->bytes + bytes <= MAX_IO_BYTES &&
+        batch->qiov.niov + qiov->niov <= job->max_iov)
+    {
+        qemu_iovec_concat(&batch->qiov, qiov, 0, bytes);
+        batch->bytes += bytes;
+        trace_mirror_write_coalesced(job, batch->offset, batch->bytes);
+
+        if (batch->bytes == MAX_IO_BYTES) {
+            /* Nothing can be appended any more, don't wait for the timer */
+            job->open_batch = NULL;
+            if (batch->sleep_state) {
+                qemu_co_sleep_wake(batch->sleep_state);
+            }
+        }
+
+        /* @qiov must stay valid until the leader has written it */
+        qemu_co_queue_wait(&batch->waiters, NULL);
+        return;
+    }
+
+    if (bytes >= MAX_IO_BYTES || qiov->niov >= job->max_iov) {
+        do_sync_target_write(job, MIRROR_METHOD_COPY, offset, bytes, qiov,
+                             flags);
+        return;
+    }
+
+    batch = g_new(MirrorWriteBatch, 1);
+    *batch = (MirrorWriteBatch) {
+        .offset = offset,
+        .bytes  = bytes,
+        .flags  = flags,
+    };
+    qemu_iovec_init(&batch->qiov, qiov->niov);
+    qemu_iovec_concat(&batch->qiov, qiov, 0, bytes);
+    qemu_co_queue_init(&batch->waiters);
+
+    /* Replaces a batch which is still open, but can't be extended by us */
+    job->open_batch = batch;
+    qemu_co_sleep_ns_wakeable(QEMU_CLOCK_REALTIME, job->coalesce_delay_ns,
+                              &batch->sleep_state);
+    if (job->open_batch == batch) {
+        job->open_batch = NULL;
+    }
+
+    do_sync_target_write(job, MIRROR_METHOD_COPY, batch->offset, batch->bytes,
+                         &batch->qiov, batch->flags);
+
+    qemu_co_queue_restart_all(&batch->waiters);
+    qemu_iovec_destroy(&batch->qiov);
+    g_free(batch);
+}
+
+static void coroutine_fn mirror_active_target_write_entry(void *opaque)
+{
+    MirrorActiveTargetWrite *tw = opaque;
+
+    mirror_coalesced_target_write(tw->job, tw->offset, tw->bytes, tw->qiov,
+                                  tw->flags);
+
+    tw->done = true;
+    if (tw->waiter) {
+        aio_co_wake(tw->waiter);
+    }
+}
+
 static MirrorOp *coroutine_fn active_write_prepare(MirrorBlockJob *s,
                                                    uint64_t offset,
                                                    uint64_t bytes)
@@ -1389,6 +1498,43 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
         op = active_write_prepare(s->job, offset, bytes);
     }
 
+    if (copy_to_target && method == MIRROR_METHOD_COPY &&
+        s->job->coalesce_delay_ns)
+    {
+        /*
+         * The region is locked by @op, so the source and the target can be
+         * written at the same time instead of one after another.  Without
+         * coalescing, the target is only written once the source write has
+         * succeeded, so that it never gets ahead of the source.
+         */
+        MirrorActiveTargetWrite tw = {
+            .job    = s->job,
+            .offset = offset,
+            .bytes  = bytes,
+            .qiov   = qiov,
+            .flags  = flags,
+        };
+
+        qemu_coroutine_enter(qemu_coroutine_create(
+                                 mirror_active_target_write_entry, &tw));
+        ret = bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+        if (!tw.done) {
+            tw.waiter = qemu_coroutine_self();
+            qemu_coroutine_yield();
+        }
+        assert(tw.done);
+
+        if (ret < 0) {
+            /* The target has data that the source may not have, resync */
+            int64_t start = QEMU_ALIGN_DOWN(offset, s->job->granularity);
+            int64_t end = QEMU_ALIGN_UP(offset + bytes, s->job->granularity);
+
+            bdrv_set_dirty_bitmap(s->job->dirty_bitmap, start, end - start);
+            s->job->actively_synced = false;
+        }
+        goto out;
+    }
+
     switch (method) {
     case MIRROR_METHOD_COPY:
         ret = bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
@@ -1550,7 +1696,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             Error **errp)
+                             int64_t coalesce_delay_ns, Error **errp)
 {
     MirrorBlockJob *s;
     MirrorBDSOpaque *bs_opaque;
@@ -1671,6 +1817,7 @@ static BlockJob *mirror_start_job(
     s->backing_mode = backing_mode;
     s->zero_target = zero_target;
     s->copy_mode = copy_mode;
+    s->coalesce_delay_ns = coalesce_delay_ns;
     s->base = base;
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
@@ -1762,7 +1909,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, int64_t coalesce_delay_ns,
+                  Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1779,7 +1927,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, coalesce_delay_ns,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1806,7 +1955,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      MIRROR_LEAVE_BACKING_CHAIN, false,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
-                     filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
+                     filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND, 0,
                      &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
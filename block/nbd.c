@@ -31,6 +31,7 @@
 #include "qemu/osdep.h"
 
 #include "trace.h"
+#include "qemu/error-report.h"
 #include "qemu/uri.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
@@ -45,6 +46,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -62,7 +64,14 @@ typedef enum NBDClientState {
     NBD_CLIENT_QUIT
 } NBDClientState;
 
-typedef struct BDRVNBDState {
+/*
+ * One connection to the server.  Each connection has its own socket,
+ * connection_co, request slots and reconnect state; requests of the node are
+ * distributed over all of them.
+ */
+typedef struct NBDConnection {
+    struct BDRVNBDState *s;
+
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     NBDExportInfo info;
@@ -72,7 +81,6 @@ typedef struct BDRVNBDState {
     Coroutine *connection_co;
     Coroutine *teardown_co;
     QemuCoSleepState *connection_co_sleep_ns_state;
-    bool drained;
     bool wait_drained_end;
     int in_flight;
     NBDClientState state;
@@ -80,12 +88,29 @@ typedef struct BDRVNBDState {
     Error *connect_err;
     bool wait_in_flight;
 
+    /* A write completed on this connection since its last flush */
+    bool need_flush;
+
     NBDClientRequest requests[MAX_NBD_REQUESTS];
     NBDReply reply;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    /*
+     * The export as negotiated by the first connection.  Additional
+     * connections must see the same size and flags.
+     */
+    NBDExportInfo info;
+    bool drained;
+
+    NBDConnection *conns;
+    int nb_conns;
+    int next_conn;
     BlockDriverState *bs;
 
     /* Connection parameters */
     uint32_t reconnect_delay;
+    uint32_t connections;
     SocketAddress *saddr;
     char *export, *tlscredsid;
     QCryptoTLSCreds *tlscreds;
@@ -93,10 +118,18 @@ typedef struct BDRVNBDState {
     char *x_dirty_bitmap;
 } BDRVNBDState;
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp);
+static int nbd_client_connect(NBDConnection *c, Error **errp);
 
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
 {
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        error_free(s->conns[i].connect_err);
+    }
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nb_conns = 0;
     object_unref(OBJECT(s->tlscreds));
     qapi_free_SocketAddress(s->saddr);
     s->saddr = NULL;
@@ -108,27 +141,27 @@ static void nbd_clear_bdrvstate(BDRVNBDState *s)
     s->x_dirty_bitmap = NULL;
 }
 
-static void nbd_channel_error(BDRVNBDState *s, int ret)
+static void nbd_channel_error(NBDConnection *c, int ret)
 {
     if (ret == -EIO) {
-        if (s->state == NBD_CLIENT_CONNECTED) {
-            s->state = s->reconnect_delay ? NBD_CLIENT_CONNECTING_WAIT :
-                                            NBD_CLIENT_CONNECTING_NOWAIT;
+        if (c->state == NBD_CLIENT_CONNECTED) {
+            c->state = c->s->reconnect_delay ? NBD_CLIENT_CONNECTING_WAIT :
+                                               NBD_CLIENT_CONNECTING_NOWAIT;
         }
     } else {
-        if (s->state == NBD_CLIENT_CONNECTED) {
-            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        if (c->state == NBD_CLIENT_CONNECTED) {
+            qio_channel_shutdown(c->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
-        s->state = NBD_CLIENT_QUIT;
+        c->state = NBD_CLIENT_QUIT;
     }
 }
 
-static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
+static void nbd_recv_coroutines_wake_all(NBDConnection *c)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        NBDClientRequest *req = &s->requests[i];
+        NBDClientRequest *req = &c->requests[i];
 
         if (req->coroutine && req->receiving) {
             aio_co_wake(req->coroutine);
@@ -136,17 +169,32 @@ static void nbd_recv_coroutines_wake_all(BDRVNBDState *s)
     }
 }
 
+/* Drop the I/O channels of @c, which must not be in use any more */
+static void nbd_conn_free_channel(NBDConnection *c)
+{
+    qio_channel_detach_aio_context(QIO_CHANNEL(c->ioc));
+    object_unref(OBJECT(c->sioc));
+    c->sioc = NULL;
+    object_unref(OBJECT(c->ioc));
+    c->ioc = NULL;
+}
+
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].ioc) {
+            qio_channel_detach_aio_context(QIO_CHANNEL(s->conns[i].ioc));
+        }
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *c = opaque;
+    BlockDriverState *bs = c->s->bs;
 
     /*
      * The node is still drained, so we know the coroutine has yielded in
@@ -154,7 +202,7 @@ static void nbd_client_attach_aio_context_bh(void *opaque)
      * entered for the first time. Both places are safe for entering the
      * coroutine.
      */
-    qemu_aio_coroutine_enter(bs->aio_context, s->connection_co);
+    qemu_aio_coroutine_enter(bs->aio_context, c->connection_co);
     bdrv_dec_in_flight(bs);
 }
 
@@ -162,107 +210,118 @@ static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    /*
-     * s->connection_co is either yielded from nbd_receive_reply or from
-     * nbd_co_reconnect_loop()
-     */
-    if (s->state == NBD_CLIENT_CONNECTED) {
-        qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
-    }
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *c = &s->conns[i];
 
-    bdrv_inc_in_flight(bs);
+        /*
+         * c->connection_co is either yielded from nbd_receive_reply or from
+         * nbd_co_reconnect_loop()
+         */
+        if (c->state == NBD_CLIENT_CONNECTED) {
+            qio_channel_attach_aio_context(QIO_CHANNEL(c->ioc), new_context);
+        }
 
-    /*
-     * Need to wait here for the BH to run because the BH must run while the
-     * node is still drained.
-     */
-    aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, bs);
+        bdrv_inc_in_flight(bs);
+
+        /*
+         * Need to wait here for the BH to run because the BH must run while
+         * the node is still drained.
+         */
+        aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, c);
+    }
 }
 
 static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     s->drained = true;
-    if (s->connection_co_sleep_ns_state) {
-        qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].connection_co_sleep_ns_state) {
+            qemu_co_sleep_wake(s->conns[i].connection_co_sleep_ns_state);
+        }
     }
 }
 
 static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
     s->drained = false;
-    if (s->wait_drained_end) {
-        s->wait_drained_end = false;
-        aio_co_wake(s->connection_co);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *c = &s->conns[i];
+
+        if (c->wait_drained_end) {
+            c->wait_drained_end = false;
+            aio_co_wake(c->connection_co);
+        }
     }
 }
 
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDConnection *c)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-
-    if (s->state == NBD_CLIENT_CONNECTED) {
+    if (c->state == NBD_CLIENT_CONNECTED) {
         /* finish any pending coroutines */
-        assert(s->ioc);
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        assert(c->ioc);
+        qio_channel_shutdown(c->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
-    s->state = NBD_CLIENT_QUIT;
-    if (s->connection_co) {
-        if (s->connection_co_sleep_ns_state) {
-            qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
+    c->state = NBD_CLIENT_QUIT;
+    if (c->connection_co) {
+        if (c->connection_co_sleep_ns_state) {
+            qemu_co_sleep_wake(c->connection_co_sleep_ns_state);
         }
     }
     if (qemu_in_coroutine()) {
-        s->teardown_co = qemu_coroutine_self();
+        c->teardown_co = qemu_coroutine_self();
         /* connection_co resumes us when it terminates */
         qemu_coroutine_yield();
-        s->teardown_co = NULL;
+        c->teardown_co = NULL;
     } else {
-        BDRV_POLL_WHILE(bs, s->connection_co);
+        BDRV_POLL_WHILE(c->s->bs, c->connection_co);
     }
-    assert(!s->connection_co);
+    assert(!c->connection_co);
 }
 
-static bool nbd_client_connecting(BDRVNBDState *s)
+static bool nbd_client_connecting(NBDConnection *c)
 {
-    return s->state == NBD_CLIENT_CONNECTING_WAIT ||
-        s->state == NBD_CLIENT_CONNECTING_NOWAIT;
+    return c->state == NBD_CLIENT_CONNECTING_WAIT ||
+        c->state == NBD_CLIENT_CONNECTING_NOWAIT;
 }
 
-static bool nbd_client_connecting_wait(BDRVNBDState *s)
+static bool nbd_client_connecting_wait(NBDConnection *c)
 {
-    return s->state == NBD_CLIENT_CONNECTING_WAIT;
+    return c->state == NBD_CLIENT_CONNECTING_WAIT;
 }
 
-static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
+static coroutine_fn void nbd_reconnect_attempt(NBDConnection *c)
 {
     Error *local_err = NULL;
 
-    if (!nbd_client_connecting(s)) {
+    if (!nbd_client_connecting(c)) {
         return;
     }
 
     /* Wait for completion of all in-flight requests */
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&c->send_mutex);
 
-    while (s->in_flight > 0) {
-        qemu_co_mutex_unlock(&s->send_mutex);
-        nbd_recv_coroutines_wake_all(s);
-        s->wait_in_flight = true;
+    while (c->in_flight > 0) {
+        qemu_co_mutex_unlock(&c->send_mutex);
+        nbd_recv_coroutines_wake_all(c);
+        c->wait_in_flight = true;
         qemu_coroutine_yield();
-        s->wait_in_flight = false;
-        qemu_co_mutex_lock(&s->send_mutex);
+        c->wait_in_flight = false;
+        qemu_co_mutex_lock(&c->send_mutex);
     }
 
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&c->send_mutex);
 
-    if (!nbd_client_connecting(s)) {
+    if (!nbd_client_connecting(c)) {
         return;
     }
 
@@ -272,51 +331,48 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
      */
 
     /* Finalize previous connection if any */
-    if (s->ioc) {
-        nbd_client_detach_aio_context(s->bs);
-        object_unref(OBJECT(s->sioc));
-        s->sioc = NULL;
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+    if (c->ioc) {
+        nbd_conn_free_channel(c);
     }
 
-    s->connect_status = nbd_client_connect(s->bs, &local_err);
-    error_free(s->connect_err);
-    s->connect_err = NULL;
-    error_propagate(&s->connect_err, local_err);
+    c->connect_status = nbd_client_connect(c, &local_err);
+    error_free(c->connect_err);
+    c->connect_err = NULL;
+    error_propagate(&c->connect_err, local_err);
 
-    if (s->connect_status < 0) {
+    if (c->connect_status < 0) {
         /* failed attempt */
         return;
     }
 
     /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
-    qemu_co_queue_restart_all(&s->free_sema);
+    c->state = NBD_CLIENT_CONNECTED;
+    qemu_co_queue_restart_all(&c->free_sema);
 }
 
-static coroutine_fn void nbd_co_reconnect_loop(BDRVNBDState *s)
+static coroutine_fn void nbd_co_reconnect_loop(NBDConnection *c)
 {
+    BDRVNBDState *s = c->s;
     uint64_t start_time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     uint64_t delay_ns = s->reconnect_delay * NANOSECONDS_PER_SECOND;
     uint64_t timeout = 1 * NANOSECONDS_PER_SECOND;
     uint64_t max_timeout = 16 * NANOSECONDS_PER_SECOND;
 
-    nbd_reconnect_attempt(s);
+    nbd_reconnect_attempt(c);
 
-    while (nbd_client_connecting(s)) {
-        if (s->state == NBD_CLIENT_CONNECTING_WAIT &&
+    while (nbd_client_connecting(c)) {
+        if (c->state == NBD_CLIENT_CONNECTING_WAIT &&
             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time_ns > delay_ns)
         {
-            s->state = NBD_CLIENT_CONNECTING_NOWAIT;
-            qemu_co_queue_restart_all(&s->free_sema);
+            c->state = NBD_CLIENT_CONNECTING_NOWAIT;
+            qemu_co_queue_restart_all(&c->free_sema);
         }
 
         qemu_co_sleep_ns_wakeable(QEMU_CLOCK_REALTIME, timeout,
-                                  &s->connection_co_sleep_ns_state);
+                                  &c->connection_co_sleep_ns_state);
         if (s->drained) {
             bdrv_dec_in_flight(s->bs);
-            s->wait_drained_end = true;
+            c->wait_drained_end = true;
             while (s->drained) {
                 /*
                  * We may be entered once from nbd_client_attach_aio_context_bh
@@ -330,18 +386,19 @@ static coroutine_fn void nbd_co_reconnect_loop(BDRVNBDState *s)
             timeout *= 2;
         }
 
-        nbd_reconnect_attempt(s);
+        nbd_reconnect_attempt(c);
     }
 }
 
 static coroutine_fn void nbd_connection_entry(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *c = opaque;
+    BDRVNBDState *s = c->s;
     uint64_t i;
     int ret = 0;
     Error *local_err = NULL;
 
-    while (s->state != NBD_CLIENT_QUIT) {
+    while (c->state != NBD_CLIENT_QUIT) {
         /*
          * The NBD client can only really be considered idle when it has
          * yielded from qio_channel_readv_all_eof(), waiting for data. This is
@@ -352,16 +409,16 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * only drop it temporarily here.
          */
 
-        if (nbd_client_connecting(s)) {
-            nbd_co_reconnect_loop(s);
+        if (nbd_client_connecting(c)) {
+            nbd_co_reconnect_loop(c);
         }
 
-        if (s->state != NBD_CLIENT_CONNECTED) {
+        if (c->state != NBD_CLIENT_CONNECTED) {
             continue;
         }
 
-        assert(s->reply.handle == 0);
-        ret = nbd_receive_reply(s->bs, s->ioc, &s->reply, &local_err);
+        assert(c->reply.handle == 0);
+        ret = nbd_receive_reply(s->bs, c->ioc, &c->reply, &local_err);
 
         if (local_err) {
             trace_nbd_read_reply_entry_fail(ret, error_get_pretty(local_err));
@@ -369,7 +426,7 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
             local_err = NULL;
         }
         if (ret <= 0) {
-            nbd_channel_error(s, ret ? ret : -EIO);
+            nbd_channel_error(c, ret ? ret : -EIO);
             continue;
         }
 
@@ -378,13 +435,13 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          * handler acts as a synchronization point and ensures that only
          * one coroutine is called until the reply finishes.
          */
-        i = HANDLE_TO_INDEX(s, s->reply.handle);
+        i = HANDLE_TO_INDEX(c, c->reply.handle);
         if (i >= MAX_NBD_REQUESTS ||
-            !s->requests[i].coroutine ||
-            !s->requests[i].receiving ||
-            (nbd_reply_is_structured(&s->reply) && !s->info.structured_reply))
+            !c->requests[i].coroutine ||
+            !c->requests[i].receiving ||
+            (nbd_reply_is_structured(&c->reply) && !c->info.structured_reply))
         {
-            nbd_channel_error(s, -EINVAL);
+            nbd_channel_error(c, -EINVAL);
             continue;
         }
 
@@ -400,50 +457,76 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
          *   connection_co happens through a bottom half, which can only
          *   run after we yield.
          */
-        aio_co_wake(s->requests[i].coroutine);
+        aio_co_wake(c->requests[i].coroutine);
         qemu_coroutine_yield();
     }
 
-    qemu_co_queue_restart_all(&s->free_sema);
-    nbd_recv_coroutines_wake_all(s);
+    qemu_co_queue_restart_all(&c->free_sema);
+    nbd_recv_coroutines_wake_all(c);
     bdrv_dec_in_flight(s->bs);
 
-    s->connection_co = NULL;
-    if (s->ioc) {
-        nbd_client_detach_aio_context(s->bs);
-        object_unref(OBJECT(s->sioc));
-        s->sioc = NULL;
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+    c->connection_co = NULL;
+    if (c->ioc) {
+        nbd_conn_free_channel(c);
     }
 
-    if (s->teardown_co) {
-        aio_co_wake(s->teardown_co);
+    if (c->teardown_co) {
+        aio_co_wake(c->teardown_co);
     }
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection for a new request: the connected one with the fewest
+ * requests in flight.  If no connection is up, prefer one that is waiting
+ * for a reconnect so that the request is delayed rather than failed.
+ */
+static NBDConnection *nbd_choose_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i;
+
+    if (s->nb_conns == 1) {
+        return &s->conns[0];
+    }
+
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *c = &s->conns[(s->next_conn + i) % s->nb_conns];
+
+        if (c->state == NBD_CLIENT_CONNECTED) {
+            if (!best || best->state != NBD_CLIENT_CONNECTED ||
+                c->in_flight < best->in_flight) {
+                best = c;
+            }
+        } else if (!best && nbd_client_connecting_wait(c)) {
+            best = c;
+        }
+    }
+    s->next_conn = (s->next_conn + 1) % s->nb_conns;
+
+    return best ?: &s->conns[0];
+}
+
+static int nbd_co_send_request(NBDConnection *c,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    while (s->in_flight == MAX_NBD_REQUESTS || nbd_client_connecting_wait(s)) {
-        qemu_co_queue_wait(&s->free_sema, &s->send_mutex);
+    qemu_co_mutex_lock(&c->send_mutex);
+    while (c->in_flight == MAX_NBD_REQUESTS || nbd_client_connecting_wait(c)) {
+        qemu_co_queue_wait(&c->free_sema, &c->send_mutex);
     }
 
-    if (s->state != NBD_CLIENT_CONNECTED) {
+    if (c->state != NBD_CLIENT_CONNECTED) {
         rc = -EIO;
         goto err;
     }
 
-    s->in_flight++;
+    c->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->requests[i].coroutine == NULL) {
+        if (c->requests[i].coroutine == NULL) {
             break;
         }
     }
@@ -451,44 +534,46 @@ static int nbd_co_send_request(BlockDriverState *bs,
     g_assert(qemu_in_coroutine());
     assert(i < MAX_NBD_REQUESTS);
 
-    s->requests[i].coroutine = qemu_coroutine_self();
-    s->requests[i].offset = request->from;
-    s->requests[i].receiving = false;
+    c->requests[i].coroutine = qemu_coroutine_self();
+    c->requests[i].offset = request->from;
+    c->requests[i].receiving = false;
 
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(c, i);
+    trace_nbd_co_send_request(c - c->s->conns, request->handle, request->type,
+                              request->from, request->len);
 
-    assert(s->ioc);
+    assert(c->ioc);
 
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
-        if (rc >= 0 && s->state == NBD_CLIENT_CONNECTED) {
-            if (qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+        qio_channel_set_cork(c->ioc, true);
+        rc = nbd_send_request(c->ioc, request);
+        if (rc >= 0 && c->state == NBD_CLIENT_CONNECTED) {
+            if (qio_channel_writev_all(c->ioc, qiov->iov, qiov->niov,
                                        NULL) < 0) {
                 rc = -EIO;
             }
         } else if (rc >= 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(c->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(c->ioc, request);
     }
 
 err:
     if (rc < 0) {
-        nbd_channel_error(s, rc);
+        nbd_channel_error(c, rc);
         if (i != -1) {
-            s->requests[i].coroutine = NULL;
-            s->in_flight--;
+            c->requests[i].coroutine = NULL;
+            c->in_flight--;
         }
-        if (s->in_flight == 0 && s->wait_in_flight) {
-            aio_co_wake(s->connection_co);
+        if (c->in_flight == 0 && c->wait_in_flight) {
+            aio_co_wake(c->connection_co);
         } else {
-            qemu_co_queue_next(&s->free_sema);
+            qemu_co_queue_next(&c->free_sema);
         }
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
@@ -510,7 +595,7 @@ static inline uint64_t payload_advance64(uint8_t **payload)
     return ldq_be_p(*payload - 8);
 }
 
-static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
+static int nbd_parse_offset_hole_payload(NBDConnection *c,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_offset,
                                          QEMUIOVector *qiov, Error **errp)
@@ -533,8 +618,8 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
                          " region");
         return -EINVAL;
     }
-    if (s->info.min_block &&
-        !QEMU_IS_ALIGNED(hole_size, s->info.min_block)) {
+    if (c->info.min_block &&
+        !QEMU_IS_ALIGNED(hole_size, c->info.min_block)) {
         trace_nbd_structured_read_compliance("hole");
     }
 
@@ -548,7 +633,7 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
  * Based on our request, we expect only one extent in reply, for the
  * base:allocation context.
  */
-static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
+static int nbd_parse_blockstatus_payload(NBDConnection *c,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_length,
                                          NBDExtent *extent, Error **errp)
@@ -563,11 +648,11 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
     }
 
     context_id = payload_advance32(&payload);
-    if (s->info.context_id != context_id) {
+    if (c->info.context_id != context_id) {
         error_setg(errp, "Protocol error: unexpected context id %d for "
                          "NBD_REPLY_TYPE_BLOCK_STATUS, when negotiated context "
                          "id is %d", context_id,
-                         s->info.context_id);
+                         c->info.context_id);
         return -EINVAL;
     }
 
@@ -592,14 +677,14 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
      * up to the full block and change the status to fully-allocated
      * (always a safe status, even if it loses information).
      */
-    if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
-                                                   s->info.min_block)) {
+    if (c->info.min_block && !QEMU_IS_ALIGNED(extent->length,
+                                                   c->info.min_block)) {
         trace_nbd_parse_blockstatus_compliance("extent length is unaligned");
-        if (extent->length > s->info.min_block) {
+        if (extent->length > c->info.min_block) {
             extent->length = QEMU_ALIGN_DOWN(extent->length,
-                                             s->info.min_block);
+                                             c->info.min_block);
         } else {
-            extent->length = s->info.min_block;
+            extent->length = c->info.min_block;
             extent->flags = 0;
         }
     }
@@ -665,7 +750,7 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
-static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
+static int nbd_co_receive_offset_data_payload(NBDConnection *c,
                                               uint64_t orig_offset,
                                               QEMUIOVector *qiov, Error **errp)
 {
@@ -673,9 +758,9 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &c->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&c->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -684,7 +769,7 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
         return -EINVAL;
     }
 
-    if (nbd_read64(s->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
+    if (nbd_read64(c->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
         return -EIO;
     }
 
@@ -696,13 +781,13 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
                          " region");
         return -EINVAL;
     }
-    if (s->info.min_block && !QEMU_IS_ALIGNED(data_size, s->info.min_block)) {
+    if (c->info.min_block && !QEMU_IS_ALIGNED(data_size, c->info.min_block)) {
         trace_nbd_structured_read_compliance("data");
     }
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(c->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -710,14 +795,14 @@ static int nbd_co_receive_offset_data_payload(BDRVNBDState *s,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDConnection *c, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&c->reply));
 
-    len = s->reply.structured.length;
+    len = c->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -734,7 +819,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, "structured payload", errp);
+    ret = nbd_read(c->ioc, *payload, len, "structured payload", errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -760,11 +845,11 @@ static coroutine_fn int nbd_co_receive_structured_payload(
  * corresponding to the server's error reply), and errp is unchanged.
  */
 static coroutine_fn int nbd_co_do_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *c, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, void **payload, Error **errp)
 {
     int ret;
-    int i = HANDLE_TO_INDEX(s, handle);
+    int i = HANDLE_TO_INDEX(c, handle);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
 
@@ -774,36 +859,36 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
     *request_ret = 0;
 
     /* Wait until we're woken up by nbd_connection_entry.  */
-    s->requests[i].receiving = true;
+    c->requests[i].receiving = true;
     qemu_coroutine_yield();
-    s->requests[i].receiving = false;
-    if (s->state != NBD_CLIENT_CONNECTED) {
+    c->requests[i].receiving = false;
+    if (c->state != NBD_CLIENT_CONNECTED) {
         error_setg(errp, "Connection closed");
         return -EIO;
     }
-    assert(s->ioc);
+    assert(c->ioc);
 
-    assert(s->reply.handle == handle);
+    assert(c->reply.handle == handle);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&c->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(c->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(c->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
-    assert(s->info.structured_reply);
-    chunk = &s->reply.structured;
+    assert(c->info.structured_reply);
+    chunk = &c->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -825,7 +910,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
+        return nbd_co_receive_offset_data_payload(c, c->requests[i].offset,
                                                   qiov, errp);
     }
 
@@ -833,7 +918,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    ret = nbd_co_receive_structured_payload(c, payload, errp);
     if (ret < 0) {
         return ret;
     }
@@ -853,29 +938,29 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
  * Return value is a fatal error code or normal nbd reply error code
  */
 static coroutine_fn int nbd_co_receive_one_chunk(
-        BDRVNBDState *s, uint64_t handle, bool only_structured,
+        NBDConnection *c, uint64_t handle, bool only_structured,
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
-    int ret = nbd_co_do_receive_one_chunk(s, handle, only_structured,
+    int ret = nbd_co_do_receive_one_chunk(c, handle, only_structured,
                                           request_ret, qiov, payload, errp);
 
     if (ret < 0) {
         memset(reply, 0, sizeof(*reply));
-        nbd_channel_error(s, ret);
+        nbd_channel_error(c, ret);
     } else {
         /* For assert at loop start in nbd_connection_entry */
-        *reply = s->reply;
+        *reply = c->reply;
     }
-    s->reply.handle = 0;
+    c->reply.handle = 0;
 
-    if (s->connection_co && !s->wait_in_flight) {
+    if (c->connection_co && !c->wait_in_flight) {
         /*
-         * We must check s->wait_in_flight, because we may entered by
+         * We must check c->wait_in_flight, because we may entered by
          * nbd_recv_coroutines_wake_all(), in this case we should not
          * wake connection_co here, it will woken by last request.
          */
-        aio_co_wake(s->connection_co);
+        aio_co_wake(c->connection_co);
     }
 
     return ret;
@@ -917,16 +1002,16 @@ static void nbd_iter_request_error(NBDReplyChunkIter *iter, int ret)
  * NBD_FOREACH_REPLY_CHUNK
  * The pointer stored in @payload requires g_free() to free it.
  */
-#define NBD_FOREACH_REPLY_CHUNK(s, iter, handle, structured, \
+#define NBD_FOREACH_REPLY_CHUNK(c, iter, handle, structured, \
                                 qiov, reply, payload) \
     for (iter = (NBDReplyChunkIter) { .only_structured = structured }; \
-         nbd_reply_chunk_iter_receive(s, &iter, handle, qiov, reply, payload);)
+         nbd_reply_chunk_iter_receive(c, &iter, handle, qiov, reply, payload);)
 
 /*
  * nbd_reply_chunk_iter_receive
  * The pointer stored in @payload requires g_free() to free it.
  */
-static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
+static bool nbd_reply_chunk_iter_receive(NBDConnection *c,
                                          NBDReplyChunkIter *iter,
                                          uint64_t handle,
                                          QEMUIOVector *qiov, NBDReply *reply,
@@ -936,7 +1021,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     NBDReply local_reply;
     NBDStructuredReplyChunk *chunk;
     Error *local_err = NULL;
-    if (s->state != NBD_CLIENT_CONNECTED) {
+    if (c->state != NBD_CLIENT_CONNECTED) {
         error_setg(&local_err, "Connection closed");
         nbd_iter_channel_error(iter, -EIO, &local_err);
         goto break_loop;
@@ -951,7 +1036,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
         reply = &local_reply;
     }
 
-    ret = nbd_co_receive_one_chunk(s, handle, iter->only_structured,
+    ret = nbd_co_receive_one_chunk(c, handle, iter->only_structured,
                                    &request_ret, qiov, reply, payload,
                                    &local_err);
     if (ret < 0) {
@@ -961,7 +1046,7 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     }
 
     /* Do not execute the body of NBD_FOREACH_REPLY_CHUNK for simple reply. */
-    if (nbd_reply_is_simple(reply) || s->state != NBD_CLIENT_CONNECTED) {
+    if (nbd_reply_is_simple(reply) || c->state != NBD_CLIENT_CONNECTED) {
         goto break_loop;
     }
 
@@ -983,26 +1068,26 @@ static bool nbd_reply_chunk_iter_receive(BDRVNBDState *s,
     return true;
 
 break_loop:
-    s->requests[HANDLE_TO_INDEX(s, handle)].coroutine = NULL;
+    c->requests[HANDLE_TO_INDEX(c, handle)].coroutine = NULL;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->in_flight--;
-    if (s->in_flight == 0 && s->wait_in_flight) {
-        aio_co_wake(s->connection_co);
+    qemu_co_mutex_lock(&c->send_mutex);
+    c->in_flight--;
+    if (c->in_flight == 0 && c->wait_in_flight) {
+        aio_co_wake(c->connection_co);
     } else {
-        qemu_co_queue_next(&s->free_sema);
+        qemu_co_queue_next(&c->free_sema);
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&c->send_mutex);
 
     return false;
 }
 
-static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_return_code(NBDConnection *c, uint64_t handle,
                                       int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, NULL, NULL) {
+    NBD_FOREACH_REPLY_CHUNK(c, iter, handle, false, NULL, NULL, NULL) {
         /* nbd_reply_chunk_iter_receive does all the work */
     }
 
@@ -1011,7 +1096,7 @@ static int nbd_co_receive_return_code(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
+static int nbd_co_receive_cmdread_reply(NBDConnection *c, uint64_t handle,
                                         uint64_t offset, QEMUIOVector *qiov,
                                         int *request_ret, Error **errp)
 {
@@ -1020,7 +1105,7 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     void *payload = NULL;
     Error *local_err = NULL;
 
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, s->info.structured_reply,
+    NBD_FOREACH_REPLY_CHUNK(c, iter, handle, c->info.structured_reply,
                             qiov, &reply, &payload)
     {
         int ret;
@@ -1036,17 +1121,17 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
              */
             break;
         case NBD_REPLY_TYPE_OFFSET_HOLE:
-            ret = nbd_parse_offset_hole_payload(s, &reply.structured, payload,
+            ret = nbd_parse_offset_hole_payload(c, &reply.structured, payload,
                                                 offset, qiov, &local_err);
             if (ret < 0) {
-                nbd_channel_error(s, ret);
+                nbd_channel_error(c, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
             }
             break;
         default:
             if (!nbd_reply_type_is_error(chunk->type)) {
                 /* not allowed reply type */
-                nbd_channel_error(s, -EINVAL);
+                nbd_channel_error(c, -EINVAL);
                 error_setg(&local_err,
                            "Unexpected reply type: %d (%s) for CMD_READ",
                            chunk->type, nbd_reply_type_lookup(chunk->type));
@@ -1063,7 +1148,7 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
     return iter.ret;
 }
 
-static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
+static int nbd_co_receive_blockstatus_reply(NBDConnection *c,
                                             uint64_t handle, uint64_t length,
                                             NBDExtent *extent,
                                             int *request_ret, Error **errp)
@@ -1075,7 +1160,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     bool received = false;
 
     assert(!extent->length);
-    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, &reply, &payload) {
+    NBD_FOREACH_REPLY_CHUNK(c, iter, handle, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
 
@@ -1084,23 +1169,23 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
         switch (chunk->type) {
         case NBD_REPLY_TYPE_BLOCK_STATUS:
             if (received) {
-                nbd_channel_error(s, -EINVAL);
+                nbd_channel_error(c, -EINVAL);
                 error_setg(&local_err, "Several BLOCK_STATUS chunks in reply");
                 nbd_iter_channel_error(&iter, -EINVAL, &local_err);
             }
             received = true;
 
-            ret = nbd_parse_blockstatus_payload(s, &reply.structured,
+            ret = nbd_parse_blockstatus_payload(c, &reply.structured,
                                                 payload, length, extent,
                                                 &local_err);
             if (ret < 0) {
-                nbd_channel_error(s, ret);
+                nbd_channel_error(c, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
             }
             break;
         default:
             if (!nbd_reply_type_is_error(chunk->type)) {
-                nbd_channel_error(s, -EINVAL);
+                nbd_channel_error(c, -EINVAL);
                 error_setg(&local_err,
                            "Unexpected reply type: %d (%s) "
                            "for CMD_BLOCK_STATUS",
@@ -1123,12 +1208,17 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
-                          QEMUIOVector *write_qiov)
+/*
+ * Send @request and wait for its reply.  The request goes to connection @c,
+ * or to the least busy connection if @c is NULL.
+ */
+static int nbd_co_request(BlockDriverState *bs, NBDConnection *c,
+                          NBDRequest *request, QEMUIOVector *write_qiov)
 {
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *conn;
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1139,12 +1229,13 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     }
 
     do {
-        ret = nbd_co_send_request(bs, request, write_qiov);
+        conn = c ?: nbd_choose_connection(s);
+        ret = nbd_co_send_request(conn, request, write_qiov);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_return_code(s, request->handle,
+        ret = nbd_co_receive_return_code(conn, request->handle,
                                          &request_ret, &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request->from, request->len,
@@ -1155,7 +1246,12 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
             error_free(local_err);
             local_err = NULL;
         }
-    } while (ret < 0 && nbd_client_connecting_wait(s));
+    } while (ret < 0 && nbd_client_connecting_wait(conn));
+
+    /* Everything but flush modifies the image, see nbd_client_co_flush() */
+    if (request->type != NBD_CMD_FLUSH) {
+        conn->need_flush = true;
+    }
 
     return ret ? ret : request_ret;
 }
@@ -1166,6 +1262,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *c;
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1198,12 +1295,13 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     }
 
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        c = nbd_choose_connection(s);
+        ret = nbd_co_send_request(c, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_cmdread_reply(s, request.handle, offset, qiov,
+        ret = nbd_co_receive_cmdread_reply(c, request.handle, offset, qiov,
                                            &request_ret, &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.handle,
@@ -1213,7 +1311,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
             error_free(local_err);
             local_err = NULL;
         }
-    } while (ret < 0 && nbd_client_connecting_wait(s));
+    } while (ret < 0 && nbd_client_connecting_wait(c));
 
     return ret ? ret : request_ret;
 }
@@ -1239,7 +1337,7 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(bs, NULL, &request, qiov);
 }
 
 static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
@@ -1272,22 +1370,105 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(bs, NULL, &request, NULL);
+}
+
+typedef struct NBDFlushData {
+    BlockDriverState *bs;
+    Coroutine *co;
+    int pending;
+    int ret;
+} NBDFlushData;
+
+typedef struct NBDFlushConnData {
+    NBDFlushData *data;
+    NBDConnection *c;
+} NBDFlushConnData;
+
+static int coroutine_fn nbd_co_flush_conn(BlockDriverState *bs,
+                                          NBDConnection *c)
+{
+    NBDRequest request = { .type = NBD_CMD_FLUSH };
+    int ret;
+
+    /* Writes completing from now on need another flush */
+    c->need_flush = false;
+
+    ret = nbd_co_request(bs, c, &request, NULL);
+    if (ret < 0) {
+        c->need_flush = true;
+    }
+    return ret;
+}
+
+static void coroutine_fn nbd_co_flush_conn_entry(void *opaque)
+{
+    NBDFlushConnData *fc = opaque;
+    NBDFlushData *data = fc->data;
+    int ret;
+
+    ret = nbd_co_flush_conn(data->bs, fc->c);
+    if (ret < 0 && !data->ret) {
+        data->ret = ret;
+    }
+
+    data->pending--;
+    if (!data->pending) {
+        aio_co_wake(data->co);
+    }
 }
 
 static int nbd_client_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-    NBDRequest request = { .type = NBD_CMD_FLUSH };
+    NBDFlushData data = {
+        .bs = bs,
+        .co = qemu_coroutine_self(),
+        .pending = 1,
+    };
+    g_autofree NBDFlushConnData *fcs = NULL;
+    int i;
 
     if (!(s->info.flags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.from = 0;
-    request.len = 0;
+    if (s->nb_conns == 1) {
+        return nbd_co_flush_conn(bs, &s->conns[0]);
+    }
+
+    /*
+     * With NBD_FLAG_CAN_MULTI_CONN, a flush on one connection is enough to
+     * cover the writes completed on all of them.  Servers are known to get
+     * this wrong, though, and the flushes run in parallel, so send one on
+     * every connection that wrote data since its last flush.
+     */
+    fcs = g_new0(NBDFlushConnData, s->nb_conns);
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *c = &s->conns[i];
+        Coroutine *co;
+
+        if (!c->need_flush) {
+            continue;
+        }
+
+        fcs[i] = (NBDFlushConnData) { .data = &data, .c = c };
+        data.pending++;
+        co = qemu_coroutine_create(nbd_co_flush_conn_entry, &fcs[i]);
+        qemu_coroutine_enter(co);
+    }
+
+    if (data.pending == 1) {
+        /* Nothing written since the last flush, but still pass it on */
+        return nbd_co_flush_conn(bs, nbd_choose_connection(s));
+    }
+
+    data.pending--;
+    while (data.pending) {
+        qemu_coroutine_yield();
+    }
 
-    return nbd_co_request(bs, &request, NULL);
+    return data.ret;
 }
 
 static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
@@ -1305,7 +1486,7 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(bs, NULL, &request, NULL);
 }
 
 static int coroutine_fn nbd_client_co_block_status(
@@ -1315,6 +1496,7 @@ static int coroutine_fn nbd_client_co_block_status(
     int ret, request_ret;
     NBDExtent extent = { 0 };
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDConnection *c;
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -1350,12 +1532,13 @@ static int coroutine_fn nbd_client_co_block_status(
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        c = nbd_choose_connection(s);
+        ret = nbd_co_send_request(c, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
-        ret = nbd_co_receive_blockstatus_reply(s, request.handle, bytes,
+        ret = nbd_co_receive_blockstatus_reply(c, request.handle, bytes,
                                                &extent, &request_ret,
                                                &local_err);
         if (local_err) {
@@ -1366,7 +1549,7 @@ static int coroutine_fn nbd_client_co_block_status(
             error_free(local_err);
             local_err = NULL;
         }
-    } while (ret < 0 && nbd_client_connecting_wait(s));
+    } while (ret < 0 && nbd_client_connecting_wait(c));
 
     if (ret < 0 || request_ret < 0) {
         return ret ? ret : request_ret;
@@ -1397,12 +1580,17 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i].ioc) {
+            nbd_send_request(s->conns[i].ioc, &request);
+        }
     }
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_teardown_connection(&s->conns[i]);
+    }
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -1425,9 +1613,57 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
-static int nbd_client_connect(BlockDriverState *bs, Error **errp)
+/* The first connection defines the export that the node represents */
+static int nbd_apply_conn_info(NBDConnection *c, Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = c->s;
+    BlockDriverState *bs = s->bs;
+    int ret;
+
+    s->info = c->info;
+    if (s->info.flags & NBD_FLAG_READ_ONLY) {
+        ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only", errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (s->info.flags & NBD_FLAG_SEND_FUA) {
+        bs->supported_write_flags = BDRV_REQ_FUA;
+        bs->supported_zero_flags |= BDRV_REQ_FUA;
+    }
+    if (s->info.flags & NBD_FLAG_SEND_WRITE_ZEROES) {
+        bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
+        if (s->info.flags & NBD_FLAG_SEND_FAST_ZERO) {
+            bs->supported_zero_flags |= BDRV_REQ_NO_FALLBACK;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Check that an additional connection sees the same export as the first one,
+ * so that requests can be sent on either of them.
+ */
+static int nbd_check_conn_info(NBDConnection *c, Error **errp)
+{
+    BDRVNBDState *s = c->s;
+
+    if (c->info.size != s->info.size || c->info.flags != s->info.flags ||
+        c->info.structured_reply != s->info.structured_reply ||
+        c->info.base_allocation != s->info.base_allocation) {
+        error_setg(errp, "Server sent different export parameters on "
+                   "connection %d", (int)(c - s->conns));
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int nbd_client_connect(NBDConnection *c, Error **errp)
+{
+    BDRVNBDState *s = c->s;
+    BlockDriverState *bs = s->bs;
     AioContext *aio_context = bdrv_get_aio_context(bs);
     int ret;
 
@@ -1446,49 +1682,48 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     qio_channel_attach_aio_context(QIO_CHANNEL(sioc), aio_context);
 
-    s->info.request_sizes = true;
-    s->info.structured_reply = true;
-    s->info.base_allocation = true;
-    s->info.x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
-    s->info.name = g_strdup(s->export ?: "");
+    c->info.request_sizes = true;
+    c->info.structured_reply = true;
+    c->info.base_allocation = true;
+    c->info.x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
+    c->info.name = g_strdup(s->export ?: "");
     ret = nbd_receive_negotiate(aio_context, QIO_CHANNEL(sioc), s->tlscreds,
-                                s->hostname, &s->ioc, &s->info, errp);
-    g_free(s->info.x_dirty_bitmap);
-    g_free(s->info.name);
+                                s->hostname, &c->ioc, &c->info, errp);
+    g_free(c->info.x_dirty_bitmap);
+    g_free(c->info.name);
     if (ret < 0) {
         object_unref(OBJECT(sioc));
         return ret;
     }
-    if (s->x_dirty_bitmap && !s->info.base_allocation) {
+    if (s->x_dirty_bitmap && !c->info.base_allocation) {
         error_setg(errp, "requested x-dirty-bitmap %s not found",
                    s->x_dirty_bitmap);
         ret = -EINVAL;
         goto fail;
     }
-    if (s->info.flags & NBD_FLAG_READ_ONLY) {
-        ret = bdrv_apply_auto_read_only(bs, "NBD export is read-only", errp);
-        if (ret < 0) {
-            goto fail;
-        }
-    }
-    if (s->info.flags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-        bs->supported_zero_flags |= BDRV_REQ_FUA;
+    if (c == &s->conns[0]) {
+        ret = nbd_apply_conn_info(c, errp);
+    } else {
+        ret = nbd_check_conn_info(c, errp);
     }
-    if (s->info.flags & NBD_FLAG_SEND_WRITE_ZEROES) {
-        bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
-        if (s->info.flags & NBD_FLAG_SEND_FAST_ZERO) {
-            bs->supported_zero_flags |= BDRV_REQ_NO_FALLBACK;
-        }
+    if (ret < 0) {
+        goto fail;
     }
 
-    s->sioc = sioc;
+    c->sioc = sioc;
 
-    if (!s->ioc) {
-        s->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(s->ioc));
+    if (!c->ioc) {
+        c->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(c->ioc));
     }
 
+    /*
+     * Reply payloads and requests are transferred with the io_uring of the
+     * AioContext if it has one.  nbd_read_eof() still waits for the reply
+     * headers with qio_channel_yield() so that the node can be drained.
+     */
+    qio_channel_set_completion_io(c->ioc, true);
+
     trace_nbd_client_connect_success(s->export);
 
     return 0;
@@ -1501,7 +1736,7 @@ static int nbd_client_connect(BlockDriverState *bs, Error **errp)
     {
         NBDRequest request = { .type = NBD_CMD_DISC };
 
-        nbd_send_request(s->ioc ?: QIO_CHANNEL(sioc), &request);
+        nbd_send_request(c->ioc ?: QIO_CHANNEL(sioc), &request);
 
         object_unref(OBJECT(sioc));
 
@@ -1823,6 +2058,13 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server over which requests "
+                    "are distributed, if the server supports multiple "
+                    "connections. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1879,6 +2121,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1892,7 +2141,7 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
-    int ret;
+    int ret, i;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     ret = nbd_process_options(bs, options, errp);
@@ -1901,20 +2150,57 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->bs = bs;
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_queue_init(&s->free_sema);
+    s->conns = g_new0(NBDConnection, s->connections);
+    for (i = 0; i < s->connections; i++) {
+        s->conns[i].s = s;
+        qemu_co_mutex_init(&s->conns[i].send_mutex);
+        qemu_co_queue_init(&s->conns[i].free_sema);
+    }
 
-    ret = nbd_client_connect(bs, errp);
+    ret = nbd_client_connect(&s->conns[0], errp);
     if (ret < 0) {
         nbd_clear_bdrvstate(s);
         return ret;
     }
-    /* successfully connected */
-    s->state = NBD_CLIENT_CONNECTED;
 
-    s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    /*
+     * Only a server that advertises NBD_FLAG_CAN_MULTI_CONN guarantees that
+     * all connections see each other's writes, and that a flush on one of
+     * them covers writes on the others.  A server without it may also limit
+     * the number of clients, so that another connection would never complete
+     * negotiation.
+     */
+    if (s->connections > 1 && !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        warn_report("nbd: Server does not support multiple connections to "
+                    "export '%s', using one", s->export ?: "");
+        s->connections = 1;
+    }
+
+    for (i = 1; i < s->connections; i++) {
+        ret = nbd_client_connect(&s->conns[i], errp);
+        if (ret < 0) {
+            NBDRequest request = { .type = NBD_CMD_DISC };
+
+            while (--i >= 0) {
+                nbd_send_request(s->conns[i].ioc, &request);
+                nbd_conn_free_channel(&s->conns[i]);
+            }
+            nbd_clear_bdrvstate(s);
+            return ret;
+        }
+    }
+    s->nb_conns = s->connections;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        NBDConnection *c = &s->conns[i];
+
+        /* successfully connected */
+        c->state = NBD_CLIENT_CONNECTED;
+
+        c->connection_co = qemu_coroutine_create(nbd_connection_entry, c);
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), c->connection_co);
+    }
 
     return 0;
 }
@@ -32,6 +32,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_MAX_IO_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -68,7 +69,18 @@ typedef struct {
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
 
+    /*
+     * The AioContext that has bound this queue, NULL if the queue belongs to
+     * the AioContext of the BDS (the admin queue, the first I/O queue and
+     * unused I/O queues).  Completions of a bound queue are only processed in
+     * that AioContext, through @poll_notifier.  Written under @lock, read
+     * with atomic ops.
+     */
+    AioContext      *aio_context;
+    EventNotifier   poll_notifier;
+
     /* Fields protected by @lock */
+    bool        plugged;
     CoQueue     free_req_queue;
     NVMeQueue   sq, cq;
     int         cq_phase;
@@ -77,7 +89,10 @@ typedef struct {
     int         need_kick;
     int         inflight;
 
-    /* Thread-safe, no lock necessary */
+    /*
+     * Thread-safe, no lock necessary.  Runs in the AioContext that processes
+     * the completions of this queue, replaced under @lock when it changes.
+     */
     QEMUBH      *completion_bh;
 } NVMeQueuePair;
 
@@ -113,6 +128,8 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* Number of io queues requested with the io-queues option */
+    int nr_io_queues;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -124,7 +141,6 @@ struct BDRVNVMeState {
     int blkshift;
 
     uint64_t max_transfer;
-    bool plugged;
 
     bool supports_write_zeroes;
     bool supports_discard;
@@ -141,8 +157,11 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_IO_QUEUES "io-queues"
 
 static void nvme_process_completion_bh(void *opaque);
+static void nvme_queue_handle_event(EventNotifier *n);
+static bool nvme_queue_poll_cb(void *opaque);
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -158,6 +177,12 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_IO_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of I/O queue pairs, one per AioContext "
+                    "submitting requests (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -183,8 +208,32 @@ static void nvme_init_queue(BlockDriverState *bs, NVMeQueue *q,
     }
 }
 
+/*
+ * Give @q back to the AioContext of the BDS.  The caller must make sure that
+ * no requests are in flight, e.g. by draining the BDS.
+ */
+static void nvme_unbind_queue_pair(NVMeQueuePair *q)
+{
+    AioContext *ctx = q->aio_context;
+
+    if (!ctx) {
+        return;
+    }
+    assert(!q->inflight);
+    aio_set_event_notifier(ctx, &q->poll_notifier, false, NULL, NULL);
+
+    qemu_mutex_lock(&q->lock);
+    qemu_bh_delete(q->completion_bh);
+    q->completion_bh = aio_bh_new(q->s->aio_context,
+                                  nvme_process_completion_bh, q);
+    atomic_set(&q->aio_context, NULL);
+    qemu_mutex_unlock(&q->lock);
+}
+
 static void nvme_free_queue_pair(NVMeQueuePair *q)
 {
+    nvme_unbind_queue_pair(q);
+    event_notifier_cleanup(&q->poll_notifier);
     if (q->completion_bh) {
         qemu_bh_delete(q->completion_bh);
     }
@@ -219,6 +268,7 @@ static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
     qemu_mutex_init(&q->lock);
     q->s = s;
     q->index = idx;
+    event_notifier_init(&q->poll_notifier, 0);
     qemu_co_queue_init(&q->free_req_queue);
     q->prp_list_pages = qemu_blockalign0(bs, s->page_size * NVME_NUM_REQS);
     q->completion_bh = aio_bh_new(bdrv_get_aio_context(bs),
@@ -264,7 +314,7 @@ static void nvme_kick(NVMeQueuePair *q)
 {
     BDRVNVMeState *s = q->s;
 
-    if (s->plugged || !q->need_kick) {
+    if (q->plugged || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -361,7 +411,7 @@ static bool nvme_process_completion(NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (s->plugged) {
+    if (q->plugged) {
         trace_nvme_process_completion_queue_plugged(s, q->index);
         return false;
     }
@@ -577,7 +627,13 @@ out:
     qemu_vfree(resp);
 }
 
-static bool nvme_poll_queues(BDRVNVMeState *s)
+/*
+ * Process completions on the queues that belong to the AioContext of the BDS.
+ * If @notify is true, also wake up the AioContexts that have bound the other
+ * queues and have completions pending; this is needed when handling an
+ * interrupt because they may not be polling at the moment.
+ */
+static bool nvme_poll_queues(BDRVNVMeState *s, bool notify)
 {
     bool progress = false;
     int i;
@@ -589,13 +645,22 @@ static bool nvme_poll_queues(BDRVNVMeState *s)
 
         /*
          * Do an early check for completions. q->lock isn't needed because
-         * nvme_process_completion() only runs in the event loop thread and
-         * cannot race with itself.
+         * nvme_process_completion() only runs in the thread that the queue
+         * belongs to and cannot race with itself.  For a queue that another
+         * AioContext has bound, a stale value only causes a spurious
+         * notification, or none for completions that it will poll anyway.
          */
         if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
             continue;
         }
 
+        if (atomic_read(&q->aio_context)) {
+            if (notify) {
+                event_notifier_set(&q->poll_notifier);
+            }
+            continue;
+        }
+
         qemu_mutex_lock(&q->lock);
         while (nvme_process_completion(q)) {
             /* Keep polling */
@@ -612,7 +677,107 @@ static void nvme_handle_event(EventNotifier *n)
 
     trace_nvme_handle_event(s);
     event_notifier_test_and_clear(n);
-    nvme_poll_queues(s);
+    nvme_poll_queues(s, true);
+}
+
+static void nvme_queue_handle_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, poll_notifier);
+
+    event_notifier_test_and_clear(n);
+    nvme_queue_poll_cb(q);
+}
+
+/*
+ * Poll a bound io queue from its AioContext.  There is a single interrupt for
+ * all queues, which is handled in the AioContext of the BDS; it notifies
+ * @poll_notifier when completions arrive while nobody polls.
+ */
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    NVMeQueuePair *q = opaque;
+    const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
+    NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
+    bool progress = false;
+
+    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+        return false;
+    }
+
+    qemu_mutex_lock(&q->lock);
+    while (nvme_process_completion(q)) {
+        progress = true;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return progress;
+}
+
+/*
+ * Make sure that the completions of @q are processed, from whichever thread
+ * the caller runs in.  With q->lock.
+ */
+static void nvme_queue_process_or_notify(NVMeQueuePair *q)
+{
+    AioContext *ctx = q->aio_context ?: q->s->aio_context;
+
+    if (ctx == qemu_get_current_aio_context()) {
+        nvme_process_completion(q);
+    } else if (q->aio_context) {
+        event_notifier_set(&q->poll_notifier);
+    } else {
+        event_notifier_set(&q->s->irq_notifier);
+    }
+}
+
+/*
+ * Return the io queue that requests from the current AioContext are submitted
+ * to.  The AioContext of the BDS uses the first io queue.  Other AioContexts
+ * bind one of the others as long as there are unused ones, so that submission
+ * and completion polling for different iothreads do not contend on a single
+ * queue.  Once all queues are taken, they share the first one, whose
+ * completions are then processed in the AioContext of the BDS.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    int i;
+
+    assert(s->nr_queues > 1);
+    if (ctx == s->aio_context) {
+        return s->queues[1];
+    }
+
+    for (i = 2; i < s->nr_queues; i++) {
+        if (atomic_read(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    for (i = 2; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        bool bound = false;
+
+        qemu_mutex_lock(&q->lock);
+        if (!q->aio_context) {
+            assert(!q->inflight);
+            qemu_bh_delete(q->completion_bh);
+            q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+            aio_set_event_notifier(ctx, &q->poll_notifier, false,
+                                   nvme_queue_handle_event,
+                                   nvme_queue_poll_cb);
+            atomic_set(&q->aio_context, ctx);
+            bound = true;
+        }
+        qemu_mutex_unlock(&q->lock);
+
+        if (bound) {
+            trace_nvme_bind_queue(s, q->index, ctx);
+            return q;
+        }
+    }
+
+    return s->queues[1];
 }
 
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
@@ -661,7 +826,7 @@ static bool nvme_poll_cb(void *opaque)
     BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
 
     trace_nvme_poll_cb(s);
-    return nvme_poll_queues(s);
+    return nvme_poll_queues(s, false);
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
@@ -772,8 +937,32 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
+    if (s->nr_io_queues > 1) {
+        NvmeCmd cmd = {
+            .opcode = NVME_ADM_CMD_SET_FEATURES,
+            .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+            .cdw11 = cpu_to_le32(((s->nr_io_queues - 1) << 16) |
+                                 (s->nr_io_queues - 1)),
+        };
+
+        if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+            warn_report("nvme: Failed to request %d I/O queues, using one",
+                        s->nr_io_queues);
+            s->nr_io_queues = 1;
+        }
+    }
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
+        goto out;
+    }
+    while (s->nr_queues <= s->nr_io_queues) {
+        /* Additional queues are optional, the controller may not have them */
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            warn_reportf_err(local_err, "nvme: Using %d I/O queues: ",
+                             s->nr_queues - 1);
+            local_err = NULL;
+            break;
+        }
     }
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
@@ -874,6 +1063,13 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
+    s->nr_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_IO_QUEUES, 1);
+    if (s->nr_io_queues < 1 || s->nr_io_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IO_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
     ret = nvme_init(bs, device, namespace, errp);
     qemu_opts_del(opts);
     if (ret) {
@@ -1045,7 +1241,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1058,7 +1254,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1160,14 +1356,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1191,7 +1387,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1208,7 +1404,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1244,7 +1440,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -1258,7 +1454,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1349,6 +1545,8 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     for (int i = 0; i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        /* Queues are bound again by the next request from an iothread */
+        nvme_unbind_queue_pair(q);
         qemu_bh_delete(q->completion_bh);
         q->completion_bh = NULL;
     }
@@ -1374,24 +1572,36 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     }
 }
 
+/*
+ * The block layer plugs and unplugs the BDS as a whole, possibly from
+ * different AioContexts, so every io queue is plugged.
+ */
 static void nvme_aio_plug(BlockDriverState *bs)
 {
+    int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(!s->plugged);
-    s->plugged = true;
+
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        qemu_mutex_lock(&q->lock);
+        assert(!q->plugged);
+        q->plugged = true;
+        qemu_mutex_unlock(&q->lock);
+    }
 }
 
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
     int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    s->plugged = false;
+
     for (i = 1; i < s->nr_queues; i++) {
         NVMeQueuePair *q = s->queues[i];
         qemu_mutex_lock(&q->lock);
+        assert(q->plugged);
+        q->plugged = false;
         nvme_kick(q);
-        nvme_process_completion(q);
+        nvme_queue_process_or_notify(q);
         qemu_mutex_unlock(&q->lock);
     }
 }
@@ -1420,6 +1630,7 @@ static void nvme_unregister_buf(BlockDriverState *bs, void *host)
 static const char *const nvme_strong_runtime_opts[] = {
     NVME_BLOCK_OPT_DEVICE,
     NVME_BLOCK_OPT_NAMESPACE,
+    NVME_BLOCK_OPT_IO_QUEUES,
 
     NULL
 };
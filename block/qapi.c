@@ -440,6 +440,18 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static BlockLatencyPercentiles *bdrv_latency_percentiles(TimedAverage *ta)
+{
+    BlockLatencyPercentiles *p = g_new0(BlockLatencyPercentiles, 1);
+
+    p->p50 = timed_average_percentile(ta, 50);
+    p->p90 = timed_average_percentile(ta, 90);
+    p->p99 = timed_average_percentile(ta, 99);
+    p->p999 = timed_average_percentile(ta, 99.9);
+
+    return p;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -510,6 +522,10 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
             block_acct_queue_depth(ts, BLOCK_ACCT_READ);
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+
+        dev_stats->rd_latency_percentiles = bdrv_latency_percentiles(rd);
+        dev_stats->wr_latency_percentiles = bdrv_latency_percentiles(wr);
+        dev_stats->flush_latency_percentiles = bdrv_latency_percentiles(fl);
     }
 
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_READ],
@@ -39,6 +39,8 @@ int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t exact_size)
         return 0;
     }
 
+    qcow2_extent_map_clear(s->extent_map);
+
     new_l1_size = exact_size;
 
 #ifdef DEBUG_ALLOC2
@@ -758,6 +760,9 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
         return 0;
     }
 
+    qcow2_extent_map_invalidate(s->extent_map, start_of_cluster(s, offset),
+                                s->cluster_size);
+
     ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
@@ -951,6 +956,9 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
     assert(m->nb_clusters > 0);
 
+    qcow2_extent_map_invalidate(s->extent_map, m->offset,
+                                (uint64_t) m->nb_clusters << s->cluster_bits);
+
     old_cluster = g_try_new(uint64_t, m->nb_clusters);
     if (old_cluster == NULL) {
         ret = -ENOMEM;
@@ -1019,6 +1027,116 @@ err:
     return ret;
  }
 
+/*
+ * Maps the guest cluster at @guest_offset to the data cluster at
+ * @host_offset, which has been verified to contain the data that is being
+ * written to the guest cluster, and increases the refcount of the data
+ * cluster. @orig_guest_offset is the guest cluster that the data cluster
+ * was allocated for and that must still map it; it loses QCOW_OFLAG_COPIED
+ * if the data cluster wasn't shared yet.
+ *
+ * Returns 1 if the cluster was mapped, 0 if the guest cluster isn't
+ * unallocated or the data cluster can't be shared (any more), and -errno on
+ * failure.
+ */
+int qcow2_dedup_link_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                             uint64_t host_offset, uint64_t orig_guest_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCowL2Meta *m;
+    uint64_t *l2_slice;
+    uint64_t refcount, l2_entry;
+    int l2_index, ret;
+
+    /* Leave the guest cluster alone while an allocating write is running */
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (guest_offset < l2meta_cow_end(m) &&
+            guest_offset + s->cluster_size > l2meta_cow_start(m))
+        {
+            return 0;
+        }
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    }
+    if (refcount == 0 || refcount >= s->refcount_max) {
+        return 0;
+    }
+
+    /*
+     * The data cluster must still be mapped where it was written, otherwise
+     * it may have been freed and reused since it was remembered
+     */
+    ret = get_cluster_table(bs, orig_guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    l2_entry = be64_to_cpu(l2_slice[l2_index]);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        (l2_entry & L2E_OFFSET_MASK) != host_offset ||
+        !!(l2_entry & QCOW_OFLAG_COPIED) != (refcount == 1))
+    {
+        return 0;
+    }
+
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    l2_entry = be64_to_cpu(l2_slice[l2_index]);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    switch (qcow2_get_cluster_type(bs, l2_entry)) {
+    case QCOW2_CLUSTER_UNALLOCATED:
+    case QCOW2_CLUSTER_ZERO_PLAIN:
+        break;
+    default:
+        return 0;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits, 1,
+                                        false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Update L2 tables, a failure from here on only leaks the cluster */
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    if (refcount == 1) {
+        qcow2_extent_map_invalidate(s->extent_map, orig_guest_offset,
+                                    s->cluster_size);
+        ret = get_cluster_table(bs, orig_guest_offset, &l2_slice, &l2_index);
+        if (ret < 0) {
+            return ret;
+        }
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        l2_slice[l2_index] &= cpu_to_be64(~QCOW_OFLAG_COPIED);
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    qcow2_extent_map_invalidate(s->extent_map, guest_offset, s->cluster_size);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    l2_slice[l2_index] = cpu_to_be64(host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 1;
+}
+
 /**
  * Frees the allocated clusters because the request failed and they won't
  * actually be linked.
@@ -1689,6 +1807,8 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
     int64_t cleared;
     int ret;
 
+    qcow2_extent_map_invalidate(s->extent_map, offset, bytes);
+
     /* Caller must pass aligned values, except at image end */
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
     assert(QEMU_IS_ALIGNED(end_offset, s->cluster_size) ||
@@ -1782,6 +1902,8 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
     int64_t cleared;
     int ret;
 
+    qcow2_extent_map_invalidate(s->extent_map, offset, bytes);
+
     /* If we have to stay in sync with an external data file, zero out
      * s->data_file first. */
     if (data_file_is_raw(bs)) {
@@ -2048,6 +2170,8 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
     int ret;
     int i, j;
 
+    qcow2_extent_map_clear(s->extent_map);
+
     if (status_cb) {
         l1_entries = s->l1_size;
         for (i = 0; i < s->nb_snapshots; i++) {
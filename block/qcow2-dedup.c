@@ -0,0 +1,281 @@
+/*
+ * qcow2 cluster deduplication
+ *
+ * Remember a hash of the data of every full cluster that is newly written
+ * to the image. When a full cluster with the same data is written later to
+ * an unallocated guest cluster, map it to the existing host cluster and
+ * increase its refcount instead of allocating a new one. Shared clusters
+ * are copied on write like clusters shared with snapshots.
+ *
+ * The hash only selects a candidate; the data is always compared with the
+ * host cluster before it is shared. The table is an in-memory cache, so
+ * every code path that frees a host cluster must invalidate it, see
+ * qcow2_dedup_invalidate().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Stop remembering new clusters rather than letting the table grow forever */
+#define QCOW2_DEDUP_MAX_ENTRIES (1024 * 1024)
+
+#define QCOW2_DEDUP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define QCOW2_DEDUP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define QCOW2_DEDUP_PRIME64_3 0x165667B19E3779F9ULL
+
+typedef struct Qcow2DedupEntry {
+    uint64_t hash;
+    uint64_t host_offset;
+    uint64_t guest_offset; /* guest cluster the host cluster was written for */
+} Qcow2DedupEntry;
+
+struct Qcow2Dedup {
+    GHashTable *by_hash; /* owns the entries */
+    GHashTable *by_host;
+
+    /*
+     * Writes that may modify existing host clusters in place.  A cluster
+     * that is verified for sharing while such a write is running, or while
+     * one was started, could change before it is shared.
+     */
+    uint64_t inplace_gen;
+    int inplace_writes;
+};
+
+static inline uint64_t qcow2_dedup_round(uint64_t acc, uint64_t input)
+{
+    acc += input * QCOW2_DEDUP_PRIME64_2;
+    acc = rol64(acc, 31);
+    return acc * QCOW2_DEDUP_PRIME64_1;
+}
+
+/*
+ * 64-bit non-cryptographic hash with four independent lanes, following the
+ * structure of xxHash64.  @len must be a multiple of 32.
+ */
+static uint64_t qcow2_dedup_hash(const void *buf, size_t len)
+{
+    const uint64_t *p = buf;
+    uint64_t v1 = QCOW2_DEDUP_PRIME64_1 + QCOW2_DEDUP_PRIME64_2;
+    uint64_t v2 = QCOW2_DEDUP_PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -QCOW2_DEDUP_PRIME64_1;
+    uint64_t h;
+    size_t i;
+
+    assert(len % 32 == 0);
+    for (i = 0; i < len / sizeof(uint64_t); i += 4) {
+        v1 = qcow2_dedup_round(v1, p[i]);
+        v2 = qcow2_dedup_round(v2, p[i + 1]);
+        v3 = qcow2_dedup_round(v3, p[i + 2]);
+        v4 = qcow2_dedup_round(v4, p[i + 3]);
+    }
+
+    h = rol64(v1, 1) + rol64(v2, 7) + rol64(v3, 12) + rol64(v4, 18);
+    h += len;
+    h ^= h >> 33;
+    h *= QCOW2_DEDUP_PRIME64_2;
+    h ^= h >> 29;
+    h *= QCOW2_DEDUP_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+Qcow2Dedup *qcow2_dedup_new(void)
+{
+    Qcow2Dedup *d = g_new0(Qcow2Dedup, 1);
+
+    /* The keys point into the entries */
+    d->by_hash = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                       NULL, g_free);
+    d->by_host = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    return d;
+}
+
+void qcow2_dedup_free(Qcow2Dedup *d)
+{
+    if (!d) {
+        return;
+    }
+
+    g_hash_table_destroy(d->by_host);
+    g_hash_table_destroy(d->by_hash);
+    g_free(d);
+}
+
+static void qcow2_dedup_remove(Qcow2Dedup *d, Qcow2DedupEntry *e)
+{
+    g_hash_table_remove(d->by_host, &e->host_offset);
+    g_hash_table_remove(d->by_hash, &e->hash);
+}
+
+/* Forgets all clusters */
+void qcow2_dedup_clear(Qcow2Dedup *d)
+{
+    if (!d) {
+        return;
+    }
+
+    g_hash_table_remove_all(d->by_host);
+    g_hash_table_remove_all(d->by_hash);
+}
+
+/*
+ * qcow2_dedup_invalidate()
+ *
+ * Forgets the host clusters in [@offset, @offset + @bytes), which must be
+ * cluster aligned. Must be called whenever a host cluster is freed, because
+ * it may be reused for metadata afterwards.
+ */
+void qcow2_dedup_invalidate(Qcow2Dedup *d, uint64_t offset, uint64_t bytes,
+                            int cluster_size)
+{
+    Qcow2DedupEntry *e;
+    uint64_t end = offset + bytes;
+
+    if (!d || !g_hash_table_size(d->by_host)) {
+        return;
+    }
+
+    for (; offset < end; offset += cluster_size) {
+        e = g_hash_table_lookup(d->by_host, &offset);
+        if (e) {
+            qcow2_dedup_remove(d, e);
+        }
+    }
+}
+
+/*
+ * qcow2_dedup_insert()
+ *
+ * Remembers that the host cluster at @host_offset was newly allocated for the
+ * guest cluster at @guest_offset and now contains data with hash @hash.
+ */
+void qcow2_dedup_insert(Qcow2Dedup *d, uint64_t hash, uint64_t host_offset,
+                        uint64_t guest_offset)
+{
+    Qcow2DedupEntry *e;
+
+    if (!d) {
+        return;
+    }
+
+    e = g_hash_table_lookup(d->by_host, &host_offset);
+    if (e) {
+        qcow2_dedup_remove(d, e);
+    }
+    e = g_hash_table_lookup(d->by_hash, &hash);
+    if (e) {
+        /* Keep the older cluster, it may already be shared */
+        return;
+    }
+    if (g_hash_table_size(d->by_hash) >= QCOW2_DEDUP_MAX_ENTRIES) {
+        return;
+    }
+
+    e = g_new(Qcow2DedupEntry, 1);
+    *e = (Qcow2DedupEntry) {
+        .hash           = hash,
+        .host_offset    = host_offset,
+        .guest_offset   = guest_offset,
+    };
+    g_hash_table_insert(d->by_hash, &e->hash, e);
+    g_hash_table_insert(d->by_host, &e->host_offset, e);
+}
+
+/*
+ * Must be called around writes that may modify an existing host cluster in
+ * place, i.e. any write whose clusters were not all newly allocated.
+ */
+void qcow2_dedup_inplace_write_begin(Qcow2Dedup *d)
+{
+    if (d) {
+        d->inplace_gen++;
+        d->inplace_writes++;
+    }
+}
+
+void qcow2_dedup_inplace_write_end(Qcow2Dedup *d)
+{
+    if (d) {
+        assert(d->inplace_writes > 0);
+        d->inplace_writes--;
+    }
+}
+
+/*
+ * qcow2_co_dedup_write()
+ *
+ * Try to write the full cluster at @offset by mapping it to a host cluster
+ * that already contains the same data. The hash of the data is returned in
+ * @hash, so that the caller can insert the cluster into the table if it has
+ * to be written normally.
+ *
+ * Returns 1 if the cluster was written, 0 if it must be written normally, or
+ * -errno on failure.
+ */
+int coroutine_fn qcow2_co_dedup_write(BlockDriverState *bs, uint64_t offset,
+                                      QEMUIOVector *qiov, size_t qiov_offset,
+                                      uint64_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Dedup *d = s->dedup;
+    Qcow2DedupEntry *e;
+    uint64_t host_offset, guest_offset, gen;
+    uint8_t *buf, *host_buf = NULL;
+    int ret = 0;
+
+    assert(offset_into_cluster(s, offset) == 0);
+
+    buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, s->cluster_size);
+    *hash = qcow2_dedup_hash(buf, s->cluster_size);
+
+    e = g_hash_table_lookup(d->by_hash, hash);
+    if (!e || d->inplace_writes) {
+        goto out;
+    }
+    host_offset = e->host_offset;
+    guest_offset = e->guest_offset;
+    gen = d->inplace_gen;
+
+    host_buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (!host_buf) {
+        goto out;
+    }
+    ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size, host_buf,
+                        0);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = 0;
+    if (memcmp(buf, host_buf, s->cluster_size)) {
+        /* Hash collision */
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    /* The cluster may have been freed or modified while it was being read */
+    e = g_hash_table_lookup(d->by_host, &host_offset);
+    if (e && e->hash == *hash && d->inplace_gen == gen && !d->inplace_writes) {
+        ret = qcow2_dedup_link_cluster(bs, offset, host_offset, guest_offset);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    trace_qcow2_dedup_write(qemu_coroutine_self(), offset, host_offset, ret);
+
+out:
+    qemu_vfree(host_buf);
+    qemu_vfree(buf);
+    return ret;
+}
@@ -0,0 +1,525 @@
+/*
+ * qcow2 extent index
+ *
+ * The extent map of an image (see qcow2-extent-map.c) can be stored in the
+ * image as a sorted table of guest offset -> host offset extents, so that
+ * requests bypass the L2 tables right after the image has been opened. For
+ * large, mostly contiguous images the index needs only a few entries, while
+ * the L2 tables and the L2 cache that is needed to cover them grow with the
+ * size of the image.
+ *
+ * Like the map, the index only caches information from the L2 tables. It is
+ * guarded by an autoclear feature bit: it is written when the image is closed
+ * or inactivated, and removed from the image file as soon as the image is
+ * opened read-write, so that it never describes a mapping that has changed
+ * since. Programs that do not know the index clear the bit when they modify
+ * the image, which invalidates the index.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qcow2.h"
+
+/* Looks up the L2 entry of the guest cluster at @offset */
+static int qcow2_extent_index_l2_entry(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t *l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, slice_offset;
+    uint64_t *l2_slice;
+    int slice_index, ret;
+
+    *l2_entry = 0;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+    if (offset_into_cluster(s, l2_offset)) {
+        return -EIO;
+    }
+
+    slice_index = offset_to_l2_slice_index(s, offset);
+    slice_offset = l2_offset + (offset_to_l2_index(s, offset) - slice_index) *
+                               sizeof(uint64_t);
+    ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                          (void **) &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *l2_entry = be64_to_cpu(l2_slice[slice_index]);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
+/* Adds all allocated, uncompressed clusters of the active L2 tables to @map */
+static int qcow2_extent_index_scan(BlockDriverState *bs, Qcow2ExtentMap *map,
+                                   Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int n_slices = s->cluster_size / (s->l2_slice_size * sizeof(uint64_t));
+    uint64_t l2_offset, l2_entry, guest_offset;
+    uint64_t *l2_slice;
+    int i, slice, j, ret;
+
+    for (i = 0; i < s->l1_size; i++) {
+        l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+        if (!l2_offset) {
+            continue;
+        }
+        if (offset_into_cluster(s, l2_offset)) {
+            error_setg(errp, "L2 table offset %#" PRIx64 " unaligned "
+                       "(L1 index: %#x)", l2_offset, i);
+            return -EIO;
+        }
+
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset +
+                slice * s->l2_slice_size * sizeof(uint64_t);
+
+            ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                                  (void **) &l2_slice);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read L2 table");
+                return ret;
+            }
+
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_index = slice * s->l2_slice_size + j;
+
+                guest_offset = ((uint64_t) i * s->l2_size + l2_index) <<
+                               s->cluster_bits;
+                if (guest_offset >= disk_size) {
+                    break;
+                }
+
+                l2_entry = be64_to_cpu(l2_slice[j]);
+                if (qcow2_get_cluster_type(bs, l2_entry) !=
+                    QCOW2_CLUSTER_NORMAL)
+                {
+                    continue;
+                }
+
+                if (qcow2_extent_map_size(map) >=
+                    QCOW2_MAX_EXTENT_INDEX_ENTRIES)
+                {
+                    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+                    error_setg(errp, "The image is too fragmented for an "
+                               "extent index (more than %d extents)",
+                               QCOW2_MAX_EXTENT_INDEX_ENTRIES);
+                    return -EFBIG;
+                }
+
+                qcow2_extent_map_insert(map, guest_offset,
+                                        l2_entry & L2E_OFFSET_MASK,
+                                        s->cluster_size,
+                                        l2_entry & QCOW_OFLAG_COPIED);
+            }
+
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        }
+    }
+
+    return 0;
+}
+
+static void qcow2_extent_index_add_entry(uint64_t guest_offset,
+                                         uint64_t host_offset, uint64_t bytes,
+                                         bool copied, void *opaque)
+{
+    GArray *table = opaque;
+    Qcow2ExtentIndexEntry entry = {
+        .guest_offset = cpu_to_be64(guest_offset),
+        .host_offset = cpu_to_be64(host_offset |
+                                   (copied ? QCOW_OFLAG_COPIED : 0)),
+        .bytes = cpu_to_be64(bytes),
+    };
+
+    g_array_append_val(table, entry);
+}
+
+/* Returns the extents of @map as an array of Qcow2ExtentIndexEntry */
+static GArray *qcow2_extent_index_table(Qcow2ExtentMap *map)
+{
+    GArray *table = g_array_new(false, false, sizeof(Qcow2ExtentIndexEntry));
+
+    qcow2_extent_map_foreach(map, qcow2_extent_index_add_entry, table);
+    return table;
+}
+
+/*
+ * qcow2_drop_extent_index()
+ *
+ * Removes the extent index from the image file. The clusters of the index are
+ * only freed once the header does not point to them any more.
+ */
+int qcow2_drop_extent_index(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->extent_index_offset;
+    uint64_t size = s->extent_index_entries * sizeof(Qcow2ExtentIndexEntry);
+    int ret;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX)) {
+        return 0;
+    }
+
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_INDEX;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_EXTENT_INDEX;
+        return ret;
+    }
+
+    s->extent_index_offset = 0;
+    s->extent_index_entries = 0;
+    if (size) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+
+    return 0;
+}
+
+/*
+ * qcow2_co_drop_stale_extent_index()
+ *
+ * Must be called before anything that may change the cluster mapping of a
+ * writable image. The extent index is normally removed from the image file
+ * when the image becomes writable, but a reopen cannot fail at that point;
+ * if the removal failed, it is retried here, and the write fails as long as
+ * the index stays in the image file, so that it never becomes outdated while
+ * still being valid.
+ */
+int coroutine_fn qcow2_co_drop_stale_extent_index(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX)) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_drop_extent_index(bs);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/*
+ * qcow2_load_extent_index()
+ *
+ * Loads the extent index of the image, if any, into the extent map unless the
+ * map is disabled. If the image is writable, the index is removed from the
+ * image file afterwards and *@header_updated is set.
+ *
+ * An index that is inconsistent with the image size or that overlaps itself
+ * is ignored with a warning, it can be rebuilt with qemu-img amend.
+ */
+int qcow2_load_extent_index(BlockDriverState *bs, bool *header_updated,
+                            Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    Qcow2ExtentIndexEntry *table = NULL;
+    size_t table_size;
+    uint64_t guest_offset, host_offset, bytes, end = 0;
+    uint32_t i;
+    int ret;
+
+    *header_updated = false;
+
+    if (!s->extent_index) {
+        /* The feature bit means nothing without the header extension */
+        if ((s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX) &&
+            !bs->read_only)
+        {
+            s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_INDEX;
+            ret = qcow2_update_header(bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not update qcow2 header");
+                return ret;
+            }
+            *header_updated = true;
+        }
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_INDEX;
+        return 0;
+    }
+
+    table_size = s->extent_index_entries * sizeof(*table);
+    if (table_size && s->extent_map && !s->crypto) {
+        table = g_try_malloc(table_size);
+        if (!table) {
+            error_setg(errp, "Could not allocate the extent index");
+            return -ENOMEM;
+        }
+
+        ret = bdrv_pread(bs->file, s->extent_index_offset, table, table_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the extent index");
+            goto out;
+        }
+    }
+
+    for (i = 0; table && i < s->extent_index_entries; i++) {
+        guest_offset = be64_to_cpu(table[i].guest_offset);
+        host_offset = be64_to_cpu(table[i].host_offset);
+        bytes = be64_to_cpu(table[i].bytes);
+
+        if (offset_into_cluster(s, guest_offset) ||
+            (host_offset & ~(L2E_OFFSET_MASK | QCOW_OFLAG_COPIED)) ||
+            offset_into_cluster(s, bytes) || !bytes ||
+            guest_offset < end || guest_offset > disk_size ||
+            bytes > disk_size - guest_offset)
+        {
+            break;
+        }
+        end = guest_offset + bytes;
+    }
+
+    if (s->crypto) {
+        warn_report("Ignoring the extent index of an encrypted image");
+        s->extent_index = false;
+    } else if (!table) {
+        /* The extent map is disabled, or the index is empty */
+    } else if (i < s->extent_index_entries) {
+        warn_report("Ignoring invalid extent index entry %" PRIu32, i);
+        s->extent_index = false;
+    } else {
+        for (i = 0; i < s->extent_index_entries; i++) {
+            host_offset = be64_to_cpu(table[i].host_offset);
+            qcow2_extent_map_insert(s->extent_map,
+                                    be64_to_cpu(table[i].guest_offset),
+                                    host_offset & L2E_OFFSET_MASK,
+                                    be64_to_cpu(table[i].bytes),
+                                    host_offset & QCOW_OFLAG_COPIED);
+        }
+    }
+
+    ret = 0;
+    if (!bs->read_only) {
+        /* Writes would make the index on disk outdated */
+        ret = qcow2_drop_extent_index(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not remove the extent index "
+                             "from the image");
+            goto out;
+        }
+        *header_updated = true;
+    }
+
+out:
+    g_free(table);
+    return ret;
+}
+
+/*
+ * qcow2_store_extent_index()
+ *
+ * Writes the extent map of the image to the image file as its extent index,
+ * unless the index is disabled or already stored. If the extent map is
+ * disabled at runtime, the index is built from the L2 tables.
+ */
+int qcow2_store_extent_index(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ExtentMap *map = s->extent_map;
+    GArray *table = NULL;
+    int64_t offset = 0;
+    uint64_t size = 0;
+    int ret;
+
+    if (!s->extent_index || bs->read_only ||
+        (s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX))
+    {
+        return 0;
+    }
+
+    if (!map) {
+        map = qcow2_extent_map_new();
+        ret = qcow2_extent_index_scan(bs, map, errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    table = qcow2_extent_index_table(map);
+    size = table->len * sizeof(Qcow2ExtentIndexEntry);
+
+    if (size) {
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            ret = offset;
+            error_setg_errno(errp, -ret, "Could not allocate the extent index");
+            goto out;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, size, false);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the extent index");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, offset, table->data, size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the extent index");
+            goto fail;
+        }
+    }
+
+    /* The index and its refcounts must be stable before the header is */
+    ret = qcow2_flush_caches(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the extent index");
+        goto fail;
+    }
+
+    s->extent_index_offset = offset;
+    s->extent_index_entries = table->len;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_EXTENT_INDEX;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_EXTENT_INDEX;
+        s->extent_index_offset = 0;
+        s->extent_index_entries = 0;
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        goto fail;
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    if (size) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+out:
+    if (table) {
+        g_array_free(table, true);
+    }
+    if (map != s->extent_map) {
+        qcow2_extent_map_free(map);
+    }
+    return ret;
+}
+
+/*
+ * qcow2_build_extent_index()
+ *
+ * Enables the extent index and fills the extent map with all allocated
+ * clusters from the L2 tables, so that the index that is stored when the
+ * image is closed covers the whole image.
+ */
+int qcow2_build_extent_index(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ExtentMap *map;
+    int ret;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "The extent index requires compatibility level 1.1 "
+                   "or above (use compat=1.1 or greater)");
+        return -EINVAL;
+    }
+    if (s->crypto) {
+        error_setg(errp, "The extent index is not supported for encrypted "
+                   "images");
+        return -ENOTSUP;
+    }
+
+    map = qcow2_extent_map_new();
+    ret = qcow2_extent_index_scan(bs, map, errp);
+    if (ret < 0) {
+        qcow2_extent_map_free(map);
+        return ret;
+    }
+
+    qcow2_extent_map_free(s->extent_map);
+    s->extent_map = map;
+    s->extent_index = true;
+
+    return 0;
+}
+
+/*
+ * qcow2_check_extent_index()
+ *
+ * Compares the extent map of an image that has an extent index with the L2
+ * tables. With BDRV_FIX_ERRORS, the map is cleared if any extent does not
+ * match, so that no outdated extent is stored in the index again.
+ */
+int qcow2_check_extent_index(BlockDriverState *bs, BdrvCheckResult *res,
+                             BdrvCheckMode fix)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ExtentIndexEntry *entry;
+    GArray *table;
+    uint64_t guest_offset, host_offset, bytes, l2_entry, off;
+    bool copied, mismatch = false;
+    guint i;
+    int ret = 0;
+
+    if (!s->extent_index || !s->extent_map) {
+        return 0;
+    }
+
+    table = qcow2_extent_index_table(s->extent_map);
+
+    for (i = 0; i < table->len; i++) {
+        entry = &g_array_index(table, Qcow2ExtentIndexEntry, i);
+        guest_offset = be64_to_cpu(entry->guest_offset);
+        host_offset = be64_to_cpu(entry->host_offset);
+        bytes = be64_to_cpu(entry->bytes);
+        copied = host_offset & QCOW_OFLAG_COPIED;
+        host_offset &= L2E_OFFSET_MASK;
+
+        for (off = 0; off < bytes; off += s->cluster_size) {
+            ret = qcow2_extent_index_l2_entry(bs, guest_offset + off,
+                                              &l2_entry);
+            if (ret < 0) {
+                fprintf(stderr, "ERROR could not read the L2 entry of guest "
+                        "offset %#" PRIx64 ": %s\n", guest_offset + off,
+                        strerror(-ret));
+                res->check_errors++;
+                goto out;
+            }
+
+            if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+                (l2_entry & L2E_OFFSET_MASK) != host_offset + off ||
+                (copied && !(l2_entry & QCOW_OFLAG_COPIED)))
+            {
+                fprintf(stderr, "%s extent index entry for guest offset "
+                        "%#" PRIx64 " does not match L2 entry %#" PRIx64 "\n",
+                        fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
+                        guest_offset + off, l2_entry);
+                if (fix & BDRV_FIX_ERRORS) {
+                    res->corruptions_fixed++;
+                } else {
+                    res->corruptions++;
+                }
+                mismatch = true;
+                break;
+            }
+        }
+    }
+
+    if (mismatch && (fix & BDRV_FIX_ERRORS)) {
+        qcow2_extent_map_clear(s->extent_map);
+    }
+
+out:
+    g_array_free(table, true);
+    return ret;
+}
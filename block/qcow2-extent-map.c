@@ -0,0 +1,252 @@
+/*
+ * qcow2 guest to host extent map
+ *
+ * Once the L2 entries of fully allocated, uncompressed clusters have been
+ * looked up, remember them as range-merged guest offset -> host offset
+ * extents. Requests that fall into a known extent can then be passed to the
+ * data file without going through the L2 table cache, and requests that span
+ * many clusters that are contiguous in the data file are issued as a single
+ * request, even across L2 slice boundaries.
+ *
+ * The map is only a cache of information that is stored in the L2 tables, so
+ * every code path that changes the L2 entry of a cluster that may be in the
+ * map (or its QCOW_OFLAG_COPIED flag) must invalidate the corresponding range.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qcow2.h"
+
+typedef struct Qcow2Extent {
+    uint64_t guest_offset;
+    uint64_t host_offset;
+    uint64_t bytes;
+    bool copied; /* All clusters have QCOW_OFLAG_COPIED set */
+} Qcow2Extent;
+
+struct Qcow2ExtentMap {
+    GTree *tree;
+};
+
+/* Overlapping extents compare equal, so lookups find the containing extent */
+static gint qcow2_extent_compare(gconstpointer a, gconstpointer b,
+                                 gpointer opaque)
+{
+    const Qcow2Extent *e1 = a, *e2 = b;
+
+    if (e1->guest_offset + e1->bytes <= e2->guest_offset) {
+        return -1;
+    }
+    if (e2->guest_offset + e2->bytes <= e1->guest_offset) {
+        return 1;
+    }
+    return 0;
+}
+
+Qcow2ExtentMap *qcow2_extent_map_new(void)
+{
+    Qcow2ExtentMap *map = g_new0(Qcow2ExtentMap, 1);
+
+    /* Keys and values are the same Qcow2Extent */
+    map->tree = g_tree_new_full(qcow2_extent_compare, NULL, g_free, NULL);
+
+    return map;
+}
+
+void qcow2_extent_map_free(Qcow2ExtentMap *map)
+{
+    if (!map) {
+        return;
+    }
+
+    g_tree_destroy(map->tree);
+    g_free(map);
+}
+
+static Qcow2Extent *qcow2_extent_map_find(Qcow2ExtentMap *map,
+                                          uint64_t offset, uint64_t bytes)
+{
+    Qcow2Extent key = {
+        .guest_offset = offset,
+        .bytes = bytes,
+    };
+
+    return g_tree_lookup(map->tree, &key);
+}
+
+static void qcow2_extent_map_add(Qcow2ExtentMap *map, uint64_t guest_offset,
+                                 uint64_t host_offset, uint64_t bytes,
+                                 bool copied)
+{
+    Qcow2Extent *e = g_new(Qcow2Extent, 1);
+
+    *e = (Qcow2Extent) {
+        .guest_offset = guest_offset,
+        .host_offset = host_offset,
+        .bytes = bytes,
+        .copied = copied,
+    };
+    g_tree_insert(map->tree, e, e);
+}
+
+/*
+ * qcow2_extent_map_lookup()
+ *
+ * Looks up guest @offset in the extent map.
+ *
+ * On success, *@host_offset is set to the corresponding offset in the data
+ * file, *@bytes to the number of bytes starting at @offset that are stored
+ * contiguously there and *@copied to whether all of these bytes belong to
+ * clusters that can be overwritten in place.
+ *
+ * Returns false if @offset is not in the map.
+ */
+bool qcow2_extent_map_lookup(Qcow2ExtentMap *map, uint64_t offset,
+                             uint64_t *host_offset, uint64_t *bytes,
+                             bool *copied)
+{
+    Qcow2Extent *e = qcow2_extent_map_find(map, offset, 1);
+
+    if (!e) {
+        return false;
+    }
+
+    *host_offset = e->host_offset + (offset - e->guest_offset);
+    *bytes = e->guest_offset + e->bytes - offset;
+    *copied = e->copied;
+
+    return true;
+}
+
+/*
+ * qcow2_extent_map_invalidate()
+ *
+ * Removes the guest range [@offset, @offset + @bytes) from the map. Extents
+ * that only partially overlap with it are trimmed.
+ */
+void qcow2_extent_map_invalidate(Qcow2ExtentMap *map, uint64_t offset,
+                                 uint64_t bytes)
+{
+    Qcow2Extent *e;
+
+    if (!map || !bytes) {
+        return;
+    }
+
+    bytes = MIN(bytes, UINT64_MAX - offset);
+
+    while ((e = qcow2_extent_map_find(map, offset, bytes))) {
+        Qcow2Extent old = *e;
+        uint64_t old_end = old.guest_offset + old.bytes;
+
+        g_tree_remove(map->tree, e);
+
+        if (old.guest_offset < offset) {
+            qcow2_extent_map_add(map, old.guest_offset, old.host_offset,
+                                 offset - old.guest_offset, old.copied);
+        }
+        if (old_end > offset + bytes) {
+            uint64_t skip = offset + bytes - old.guest_offset;
+
+            qcow2_extent_map_add(map, offset + bytes, old.host_offset + skip,
+                                 old.bytes - skip, old.copied);
+        }
+    }
+}
+
+/* Removes all extents from the map */
+void qcow2_extent_map_clear(Qcow2ExtentMap *map)
+{
+    if (!map) {
+        return;
+    }
+
+    g_tree_destroy(map->tree);
+    map->tree = g_tree_new_full(qcow2_extent_compare, NULL, g_free, NULL);
+}
+
+/*
+ * qcow2_extent_map_insert()
+ *
+ * Records that the guest range [@offset, @offset + @bytes) is stored at
+ * @host_offset in the data file. The new extent is merged with adjacent
+ * extents if they are contiguous in the data file as well.
+ */
+void qcow2_extent_map_insert(Qcow2ExtentMap *map, uint64_t offset,
+                             uint64_t host_offset, uint64_t bytes,
+                             bool copied)
+{
+    Qcow2Extent *e;
+
+    if (!bytes) {
+        return;
+    }
+
+    qcow2_extent_map_invalidate(map, offset, bytes);
+
+    if (offset > 0) {
+        e = qcow2_extent_map_find(map, offset - 1, 1);
+        if (e && e->copied == copied &&
+            e->host_offset + e->bytes == host_offset)
+        {
+            offset = e->guest_offset;
+            host_offset = e->host_offset;
+            bytes += e->bytes;
+            g_tree_remove(map->tree, e);
+        }
+    }
+
+    e = qcow2_extent_map_find(map, offset + bytes, 1);
+    if (e && e->copied == copied &&
+        host_offset + bytes == e->host_offset)
+    {
+        bytes += e->bytes;
+        g_tree_remove(map->tree, e);
+    }
+
+    /* Drop the whole map rather than letting it grow without bounds */
+    if (g_tree_nnodes(map->tree) >= QCOW2_EXTENT_MAP_MAX_EXTENTS) {
+        qcow2_extent_map_clear(map);
+    }
+
+    qcow2_extent_map_add(map, offset, host_offset, bytes, copied);
+}
+
+/* Returns the number of extents in the map */
+int qcow2_extent_map_size(Qcow2ExtentMap *map)
+{
+    return g_tree_nnodes(map->tree);
+}
+
+typedef struct Qcow2ExtentForeach {
+    Qcow2ExtentFunc *func;
+    void *opaque;
+} Qcow2ExtentForeach;
+
+static gboolean qcow2_extent_foreach_entry(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    Qcow2Extent *e = value;
+    Qcow2ExtentForeach *data = opaque;
+
+    data->func(e->guest_offset, e->host_offset, e->bytes, e->copied,
+               data->opaque);
+    return FALSE;
+}
+
+/*
+ * Calls @func for every extent in the map, in ascending order of the guest
+ * offsets. @func must not modify the map.
+ */
+void qcow2_extent_map_foreach(Qcow2ExtentMap *map, Qcow2ExtentFunc *func,
+                              void *opaque)
+{
+    Qcow2ExtentForeach data = {
+        .func = func,
+        .opaque = opaque,
+    };
+
+    g_tree_foreach(map->tree, qcow2_extent_foreach_entry, &data);
+}
@@ -898,6 +898,11 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            qcow2_compressed_cache_invalidate(s->compressed_cache,
+                                              cluster_offset, s->cluster_size);
+            qcow2_dedup_invalidate(s->dedup, cluster_offset, s->cluster_size,
+                                   s->cluster_size);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -1251,6 +1256,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     assert(addend >= -1 && addend <= 1);
 
+    /* This changes QCOW_OFLAG_COPIED of clusters in the active L1 table */
+    qcow2_extent_map_clear(s->extent_map);
+
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -2181,6 +2189,17 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* extent index */
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->extent_index_offset,
+                                       s->extent_index_entries *
+                                       sizeof(Qcow2ExtentIndexEntry));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
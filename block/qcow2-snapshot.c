@@ -767,6 +767,8 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     }
     sn = &s->snapshots[snapshot_index];
 
+    qcow2_extent_map_clear(s->extent_map);
+
     ret = qcow2_validate_table(bs, sn->l1_table_offset, sn->l1_size,
                                sizeof(uint64_t), QCOW_MAX_L1_SIZE,
                                "Snapshot L1 table", &local_err);
@@ -1028,6 +1030,8 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     }
     sn = &s->snapshots[snapshot_index];
 
+    qcow2_extent_map_clear(s->extent_map);
+
     /* Allocate and read in the snapshot's L1 table */
     ret = qcow2_validate_table(bs, sn->l1_table_offset, sn->l1_size,
                                sizeof(uint64_t), QCOW_MAX_L1_SIZE,
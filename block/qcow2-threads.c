@@ -37,15 +37,20 @@
 #include "block/thread-pool.h"
 #include "crypto.h"
 
+/*
+ * Run @func in the thread pool once fewer than @max_threads jobs of this
+ * image are running there
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg,
+                 int max_threads)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -339,6 +344,7 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
@@ -347,7 +353,7 @@ qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg, s->compress_threads);
 
     return arg.ret;
 }
@@ -426,6 +432,243 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
 }
 
 
+/*
+ * Decompressed cluster cache
+ *
+ * Guests booting from compressed images tend to issue many small reads
+ * into the same compressed cluster. Every one of them used to read and
+ * decompress the whole cluster again, so keep a small LRU cache of
+ * decompressed clusters.
+ *
+ * Entries are keyed by the compressed cluster descriptor (host offset and
+ * size) rather than by guest offset: a compressed cluster is never modified
+ * in place, so an entry only becomes stale once the host cluster containing
+ * it is freed and may be reused, see qcow2_compressed_cache_invalidate().
+ *
+ * An entry is reserved by the coroutine that is going to fill it, and other
+ * coroutines looking for the same cluster wait until it is ready instead of
+ * decompressing it a second time.
+ */
+
+typedef struct Qcow2CompressedCacheEntry {
+    uint64_t l2_entry;      /* 0 if the entry is unused */
+    uint64_t coffset;
+    int csize;
+    uint64_t lru_counter;
+    bool ready;             /* @data holds the decompressed cluster */
+    bool stale;             /* invalidated while it was being filled */
+    void *data;
+} Qcow2CompressedCacheEntry;
+
+struct Qcow2CompressedCache {
+    BlockDriverState *bs;
+    Qcow2CompressedCacheEntry *entries;
+    int size;
+    uint64_t lru_counter;
+    CoQueue ready_queue;
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                   int nb_entries)
+{
+    Qcow2CompressedCache *c;
+
+    assert(nb_entries > 0);
+
+    c = g_new0(Qcow2CompressedCache, 1);
+    c->bs = bs;
+    c->size = nb_entries;
+    c->entries = g_new0(Qcow2CompressedCacheEntry, nb_entries);
+    qemu_co_queue_init(&c->ready_queue);
+
+    return c;
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].l2_entry == 0 || c->entries[i].ready);
+        qemu_vfree(c->entries[i].data);
+    }
+
+    g_free(c->entries);
+    g_free(c);
+}
+
+static Qcow2CompressedCacheEntry *
+qcow2_compressed_cache_find(Qcow2CompressedCache *c, uint64_t l2_entry)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->l2_entry == l2_entry && !e->stale) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * qcow2_compressed_cache_lookup()
+ *
+ * Returns the decompressed data of the cluster described by @l2_entry, or
+ * NULL if it is not cached. If the cluster is being decompressed by another
+ * coroutine, wait for it to finish first.
+ *
+ * The returned buffer is only valid until the caller yields.
+ */
+void *coroutine_fn qcow2_compressed_cache_lookup(Qcow2CompressedCache *c,
+                                                 uint64_t l2_entry)
+{
+    Qcow2CompressedCacheEntry *e;
+
+    while ((e = qcow2_compressed_cache_find(c, l2_entry)) && !e->ready) {
+        qemu_co_queue_wait(&c->ready_queue, NULL);
+    }
+
+    if (!e) {
+        return NULL;
+    }
+
+    e->lru_counter = ++c->lru_counter;
+    return e->data;
+}
+
+/* Returns whether @l2_entry is cached or being decompressed */
+bool qcow2_compressed_cache_contains(Qcow2CompressedCache *c,
+                                     uint64_t l2_entry)
+{
+    return qcow2_compressed_cache_find(c, l2_entry) != NULL;
+}
+
+/*
+ * qcow2_compressed_cache_reserve()
+ *
+ * Reserves a cache entry for the cluster described by @l2_entry, evicting
+ * the least recently used ready entry if necessary. The caller must
+ * decompress the cluster into the returned buffer and then call
+ * qcow2_compressed_cache_complete().
+ *
+ * Returns NULL if all entries are currently being filled.
+ */
+void *qcow2_compressed_cache_reserve(Qcow2CompressedCache *c,
+                                     uint64_t l2_entry)
+{
+    BDRVQcow2State *s = c->bs->opaque;
+    Qcow2CompressedCacheEntry *e = NULL;
+    uint64_t min_lru_counter = UINT64_MAX;
+    int i;
+
+    assert(!qcow2_compressed_cache_contains(c, l2_entry));
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *cur = &c->entries[i];
+
+        if (cur->l2_entry == 0) {
+            e = cur;
+            break;
+        }
+        if (cur->ready && cur->lru_counter < min_lru_counter) {
+            min_lru_counter = cur->lru_counter;
+            e = cur;
+        }
+    }
+
+    if (!e) {
+        return NULL;
+    }
+
+    if (!e->data) {
+        e->data = qemu_try_blockalign(c->bs, s->cluster_size);
+        if (!e->data) {
+            return NULL;
+        }
+    }
+
+    e->l2_entry = l2_entry;
+    qcow2_parse_compressed_l2_entry(s, l2_entry, &e->coffset, &e->csize);
+    e->lru_counter = ++c->lru_counter;
+    e->ready = false;
+    e->stale = false;
+
+    return e->data;
+}
+
+/*
+ * qcow2_compressed_cache_complete()
+ *
+ * Makes the entry reserved with @data available to lookups if @success is
+ * true and the entry has not been invalidated in the meantime, and drops it
+ * otherwise.
+ */
+void coroutine_fn qcow2_compressed_cache_complete(Qcow2CompressedCache *c,
+                                                  void *data, bool success)
+{
+    Qcow2CompressedCacheEntry *e = NULL;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].data == data) {
+            e = &c->entries[i];
+            break;
+        }
+    }
+    assert(e && e->l2_entry && !e->ready);
+
+    if (success && !e->stale) {
+        e->ready = true;
+    } else {
+        e->l2_entry = 0;
+    }
+    e->stale = false;
+
+    qemu_co_queue_restart_all(&c->ready_queue);
+}
+
+/*
+ * qcow2_compressed_cache_invalidate()
+ *
+ * Drops all entries whose compressed data overlaps the host range
+ * [@offset, @offset + @bytes). Must be called whenever such a range is
+ * freed, because it may be reused for new compressed clusters afterwards.
+ */
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CompressedCacheEntry *e = &c->entries[i];
+
+        if (e->l2_entry == 0 || e->coffset >= offset + bytes ||
+            e->coffset + e->csize <= offset)
+        {
+            continue;
+        }
+
+        if (e->ready) {
+            e->l2_entry = 0;
+        } else {
+            /* The coroutine filling it drops it on completion */
+            e->stale = true;
+        }
+    }
+}
+
+
 /*
  * Cryptography
  */
@@ -475,7 +718,9 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    /* There are only QCOW2_MAX_THREADS cipher instances */
+    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg,
+                                           QCOW2_MAX_THREADS);
 }
 
 /*
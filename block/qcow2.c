@@ -71,6 +71,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_EXTENT_INDEX 0x45585449
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -427,6 +428,72 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_EXTENT_INDEX:
+        {
+            Qcow2ExtentIndexHeaderExt index_ext;
+
+            if (ext.len != sizeof(index_ext)) {
+                error_setg(errp, "extent_index_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX)) {
+                warn_report("a program lacking extent index support modified "
+                            "this file, so the extent index is outdated");
+                error_printf("Some clusters may be leaked, "
+                             "run 'qemu-img check -r' on the image "
+                             "file to fix.");
+                if (need_update_header != NULL) {
+                    /* Updating is needed to drop the outdated index */
+                    *need_update_header = true;
+                }
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &index_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "extent_index_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (index_ext.reserved32 != 0) {
+                error_setg(errp, "extent_index_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            index_ext.nb_entries = be32_to_cpu(index_ext.nb_entries);
+            index_ext.index_offset = be64_to_cpu(index_ext.index_offset);
+
+            if (index_ext.nb_entries > QCOW2_MAX_EXTENT_INDEX_ENTRIES) {
+                error_setg(errp,
+                           "extent_index_ext: Index has %" PRIu32 " entries, "
+                           "exceeding the QEMU supported maximum of %d",
+                           index_ext.nb_entries,
+                           QCOW2_MAX_EXTENT_INDEX_ENTRIES);
+                return -EINVAL;
+            }
+
+            if (offset_into_cluster(s, index_ext.index_offset) ||
+                (index_ext.nb_entries && !index_ext.index_offset)) {
+                error_setg(errp, "extent_index_ext: "
+                           "invalid extent index offset");
+                return -EINVAL;
+            }
+
+            s->extent_index = true;
+            s->extent_index_entries = index_ext.nb_entries;
+            s->extent_index_offset = index_ext.index_offset;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got extent index extension: "
+                   "offset=%" PRIu64 " nb_entries=%" PRIu32 "\n",
+                   s->extent_index_offset, s->extent_index_entries);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -605,12 +672,27 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
                                               BdrvCheckResult *result,
                                               BdrvCheckMode fix)
 {
+    BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
+    BdrvCheckResult index_res = {};
+    Error *local_err = NULL;
     int ret;
 
     memset(result, 0, sizeof(*result));
 
+    ret = qcow2_check_extent_index(bs, &index_res, fix);
+    qcow2_add_check_result(result, &index_res, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (fix) {
+        /* Repairs may change any L2 entry and rebuild the refcounts */
+        qcow2_extent_map_clear(s->extent_map);
+        qcow2_dedup_clear(s->dedup);
+    }
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -630,6 +712,16 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
         return ret;
     }
 
+    if (fix && s->extent_index) {
+        /* The extent map was cleared above, rebuild the index completely */
+        ret = qcow2_build_extent_index(bs, &local_err);
+        if (ret < 0) {
+            error_reportf_err(local_err, "Dropping the extent index: ");
+            s->extent_index = false;
+            ret = 0;
+        }
+    }
+
     if (fix && result->check_errors == 0 && result->corruptions == 0) {
         ret = qcow2_mark_clean(bs);
         if (ret < 0) {
@@ -697,6 +789,11 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+    QCOW2_OPT_COMPRESSED_READ_AHEAD,
+    QCOW2_OPT_EXTENT_MAP,
+    QCOW2_OPT_COMPRESS_THREADS,
+    QCOW2_OPT_DEDUP,
     NULL
 };
 
@@ -808,6 +905,35 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum decompressed cluster cache size",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_READ_AHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of adjacent compressed clusters to read and "
+                    "decompress ahead of a compressed cluster read",
+        },
+        {
+            .name = QCOW2_OPT_EXTENT_MAP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Cache the mapping of allocated clusters as extents and "
+                    "bypass the L2 table cache for requests they cover",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESS_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of clusters that are compressed or "
+                    "decompressed in parallel",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share host clusters between newly written guest "
+                    "clusters with identical data",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -967,6 +1093,12 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    int compressed_cache_size; /* entries */
+    int compressed_read_ahead; /* clusters */
+    bool use_extent_map;
+    bool extent_map_explicit;
+    int compress_threads;
+    bool use_dedup;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -980,6 +1112,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compressed_cache_size, compressed_read_ahead, compress_threads;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1071,6 +1204,68 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Decompressed cluster cache and compressed read-ahead */
+    compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                          DEFAULT_COMPRESSED_CACHE_SIZE) / s->cluster_size;
+    if (compressed_cache_size > INT_MAX) {
+        error_setg(errp, "Compressed cluster cache size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->compressed_cache_size = compressed_cache_size;
+
+    compressed_read_ahead =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESSED_READ_AHEAD,
+                            DEFAULT_COMPRESSED_READ_AHEAD);
+    if (compressed_read_ahead > MAX_COMPRESSED_READ_AHEAD) {
+        error_setg(errp, QCOW2_OPT_COMPRESSED_READ_AHEAD " may not exceed %d",
+                   MAX_COMPRESSED_READ_AHEAD);
+        ret = -EINVAL;
+        goto fail;
+    }
+    /* Leave room in the cache for the cluster that is actually requested */
+    r->compressed_read_ahead = MIN(compressed_read_ahead,
+                                   MAX(r->compressed_cache_size - 1, 0));
+
+    compress_threads = qemu_opt_get_number(opts, QCOW2_OPT_COMPRESS_THREADS,
+                                           DEFAULT_COMPRESS_THREADS);
+    if (compress_threads < 1 || compress_threads > MAX_COMPRESS_THREADS) {
+        error_setg(errp, QCOW2_OPT_COMPRESS_THREADS " must be between 1 and %d",
+                   MAX_COMPRESS_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->compress_threads = compress_threads;
+
+    /*
+     * When the image is opened, the header extensions haven't been read
+     * yet, so the default is applied in qcow2_do_open() then
+     */
+    r->extent_map_explicit = qemu_opt_get(opts, QCOW2_OPT_EXTENT_MAP) != NULL;
+    r->use_extent_map = qemu_opt_get_bool(opts, QCOW2_OPT_EXTENT_MAP,
+                                          s->extent_index);
+    if (r->use_extent_map && s->crypt_method_header != QCOW_CRYPT_NONE) {
+        error_setg(errp, QCOW2_OPT_EXTENT_MAP " is not supported for "
+                   "encrypted images");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->use_dedup = qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false);
+    if (r->use_dedup && s->crypt_method_header != QCOW_CRYPT_NONE) {
+        error_setg(errp, QCOW2_OPT_DEDUP " is not supported for encrypted "
+                   "images");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->use_dedup && (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE)) {
+        error_setg(errp, QCOW2_OPT_DEDUP " is not supported for images with "
+                   "an external data file");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1208,6 +1403,29 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
 
+    if (s->compressed_cache_size != r->compressed_cache_size) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+        s->compressed_cache = NULL;
+        s->compressed_cache_size = r->compressed_cache_size;
+    }
+    s->compressed_read_ahead = r->compressed_read_ahead;
+    s->compress_threads = r->compress_threads;
+
+    if (r->use_extent_map && !s->extent_map) {
+        s->extent_map = qcow2_extent_map_new();
+    } else if (!r->use_extent_map) {
+        qcow2_extent_map_free(s->extent_map);
+        s->extent_map = NULL;
+    }
+    s->extent_map_explicit = r->extent_map_explicit;
+
+    if (r->use_dedup && !s->dedup) {
+        s->dedup = qcow2_dedup_new();
+    } else if (!r->use_dedup) {
+        qcow2_dedup_free(s->dedup);
+        s->dedup = NULL;
+    }
+
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
 
@@ -1599,6 +1817,13 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
+    /* Images with an extent index use the extent map by default */
+    if (s->extent_index && !s->extent_map_explicit && !s->extent_map &&
+        s->crypt_method_header == QCOW_CRYPT_NONE)
+    {
+        s->extent_map = qcow2_extent_map_new();
+    }
+
     /* Open external data file */
     s->data_file = bdrv_open_child(NULL, options, "data-file", bs,
                                    &child_of_bds, BDRV_CHILD_DATA,
@@ -1784,6 +2009,12 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
 
         update_header = update_header && !header_updated;
+
+        ret = qcow2_load_extent_index(bs, &header_updated, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        update_header = update_header && !header_updated;
     }
 
     if (update_header) {
@@ -1845,6 +2076,10 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_extent_map_free(s->extent_map);
+    s->extent_map = NULL;
+    qcow2_dedup_free(s->dedup);
+    s->dedup = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -1934,6 +2169,11 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        ret = qcow2_store_extent_index(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1963,6 +2203,7 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
 {
     if (state->flags & BDRV_O_RDWR) {
         Error *local_err = NULL;
+        int ret;
 
         if (qcow2_reopen_bitmaps_rw(state->bs, &local_err) < 0) {
             /*
@@ -1974,11 +2215,31 @@ static void qcow2_reopen_commit_post(BDRVReopenState *state)
                               "%s: Failed to make dirty bitmaps writable: ",
                               bdrv_get_node_name(state->bs));
         }
+
+        /*
+         * Writes would make the index on disk outdated.  If it can't be
+         * removed now, writes retry and fail until it is removed, see
+         * qcow2_co_drop_stale_extent_index().
+         */
+        ret = qcow2_drop_extent_index(state->bs);
+        if (ret < 0) {
+            error_report("%s: Failed to remove the extent index, writes will "
+                         "fail until it can be removed: %s",
+                         bdrv_get_node_name(state->bs), strerror(-ret));
+        }
     }
 }
 
 static void qcow2_reopen_abort(BDRVReopenState *state)
 {
+    if (!(state->flags & BDRV_O_RDWR) && !state->bs->read_only) {
+        /*
+         * The index may have been stored in prepare, but we stay writable.
+         * On failure, writes retry to remove it.
+         */
+        qcow2_drop_extent_index(state->bs);
+    }
+
     qcow2_update_options_abort(state->bs, state->opaque);
     g_free(state->opaque);
 }
@@ -2281,6 +2542,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     int ret = 0;
     unsigned int cur_bytes; /* number of bytes in current iteration */
     uint64_t cluster_offset = 0;
+    uint64_t host_offset, map_bytes;
+    bool copied;
     AioTaskPool *aio = NULL;
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
@@ -2291,11 +2554,30 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        if (s->extent_map &&
+            qcow2_extent_map_lookup(s->extent_map, offset, &host_offset,
+                                    &map_bytes, &copied))
+        {
+            cur_bytes = MIN(cur_bytes, map_bytes);
+            cluster_offset = host_offset - offset_into_cluster(s, offset);
+            ret = QCOW2_CLUSTER_NORMAL;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes,
+                                           &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
+
+            if (ret == QCOW2_CLUSTER_NORMAL && s->extent_map) {
+                qcow2_extent_map_insert(s->extent_map,
+                                        start_of_cluster(s, offset),
+                                        cluster_offset,
+                                        ROUND_UP(offset_into_cluster(s, offset)
+                                                 + cur_bytes, s->cluster_size),
+                                        false);
+            }
         }
 
         if (ret == QCOW2_CLUSTER_ZERO_PLAIN ||
@@ -2545,6 +2827,27 @@ static coroutine_fn int qcow2_co_pwritev_task_entry(AioTask *task)
                                  t->l2meta);
 }
 
+/*
+ * Returns whether all clusters touched by a write of @bytes at
+ * @offset_in_cluster were newly allocated by qcow2_alloc_cluster_offset(),
+ * so that no data that is visible to other requests is modified.
+ */
+static bool qcow2_l2meta_all_new(BDRVQcow2State *s, QCowL2Meta *l2meta,
+                                 int offset_in_cluster, uint64_t bytes)
+{
+    QCowL2Meta *m;
+    uint64_t nb_clusters = 0;
+
+    for (m = l2meta; m; m = m->next) {
+        if (m->keep_old_clusters) {
+            return false;
+        }
+        nb_clusters += m->nb_clusters;
+    }
+
+    return nb_clusters == size_to_clusters(s, offset_in_cluster + bytes);
+}
+
 static coroutine_fn int qcow2_co_pwritev_part(
         BlockDriverState *bs, uint64_t offset, uint64_t bytes,
         QEMUIOVector *qiov, size_t qiov_offset, int flags)
@@ -2554,14 +2857,23 @@ static coroutine_fn int qcow2_co_pwritev_part(
     int ret;
     unsigned int cur_bytes; /* number of sectors in current iteration */
     uint64_t cluster_offset;
+    uint64_t host_offset, map_bytes;
+    uint64_t dedup_hash;
+    bool copied, dedup, inplace;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
+    ret = qcow2_co_drop_stale_extent_index(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
         l2meta = NULL;
+        inplace = false;
 
         trace_qcow2_writev_start_part(qemu_coroutine_self());
         offset_in_cluster = offset_into_cluster(s, offset);
@@ -2572,36 +2884,98 @@ static coroutine_fn int qcow2_co_pwritev_part(
                             - offset_in_cluster);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-
-        ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
-                                         &cluster_offset, &l2meta);
-        if (ret < 0) {
-            goto out_locked;
+        /* Only full clusters are deduplicated */
+        dedup = s->dedup && offset_in_cluster == 0 &&
+                cur_bytes >= s->cluster_size;
+        if (dedup) {
+            cur_bytes = s->cluster_size;
+            ret = qcow2_co_dedup_write(bs, offset, qiov, qiov_offset,
+                                       &dedup_hash);
+            if (ret < 0) {
+                goto fail_nometa;
+            } else if (ret > 0) {
+                goto next;
+            }
         }
 
-        assert(offset_into_cluster(s, cluster_offset) == 0);
+        /*
+         * The in-place path bypasses qcow2_dedup_inplace_write_begin(), so
+         * it can't be used together with deduplication
+         */
+        if (s->extent_map && !s->dedup &&
+            qcow2_extent_map_lookup(s->extent_map, offset, &host_offset,
+                                    &map_bytes, &copied) && copied)
+        {
+            /* The clusters can be overwritten in place, no need for l2meta */
+            cur_bytes = MIN(cur_bytes, map_bytes);
+            cluster_offset = host_offset - offset_in_cluster;
 
-        ret = qcow2_pre_write_overlap_check(bs, 0,
-                                            cluster_offset + offset_in_cluster,
-                                            cur_bytes, true);
-        if (ret < 0) {
-            goto out_locked;
-        }
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offset, cur_bytes,
+                                                true);
+            if (ret < 0) {
+                goto fail_nometa;
+            }
+        } else {
+            qemu_co_mutex_lock(&s->lock);
 
-        qemu_co_mutex_unlock(&s->lock);
+            ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
+                                             &cluster_offset, &l2meta);
+            if (ret < 0) {
+                goto out_locked;
+            }
+
+            assert(offset_into_cluster(s, cluster_offset) == 0);
+
+            ret = qcow2_pre_write_overlap_check(bs, 0,
+                                                cluster_offset +
+                                                offset_in_cluster,
+                                                cur_bytes, true);
+            if (ret < 0) {
+                goto out_locked;
+            }
+
+            /* Without l2meta, all clusters were allocated with COPIED set */
+            if (!l2meta && s->extent_map) {
+                qcow2_extent_map_insert(s->extent_map,
+                                        offset - offset_in_cluster,
+                                        cluster_offset,
+                                        ROUND_UP(offset_in_cluster + cur_bytes,
+                                                 s->cluster_size),
+                                        true);
+            }
+
+            /*
+             * Existing clusters are overwritten in place, don't let other
+             * requests share them while they may be changing
+             */
+            if (s->dedup && !qcow2_l2meta_all_new(s, l2meta, offset_in_cluster,
+                                                  cur_bytes))
+            {
+                qcow2_dedup_inplace_write_begin(s->dedup);
+                inplace = true;
+            }
+
+            qemu_co_mutex_unlock(&s->lock);
+        }
 
-        if (!aio && cur_bytes != bytes) {
+        /* With deduplication, requests are processed cluster by cluster */
+        if (!aio && !s->dedup && cur_bytes != bytes) {
             aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
         }
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
                              cluster_offset, offset, cur_bytes,
                              qiov, qiov_offset, l2meta);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
+        if (inplace) {
+            qcow2_dedup_inplace_write_end(s->dedup);
+        } else if (dedup && ret == 0) {
+            qcow2_dedup_insert(s->dedup, dedup_hash, cluster_offset, offset);
+        }
         if (ret < 0) {
             goto fail_nometa;
         }
 
+next:
         bytes -= cur_bytes;
         offset += cur_bytes;
         qiov_offset += cur_bytes;
@@ -2642,6 +3016,15 @@ static int qcow2_inactivate(BlockDriverState *bs)
         error_reportf_err(local_err, "Lost persistent bitmaps during "
                           "inactivation of node '%s': ",
                           bdrv_get_device_or_node_name(bs));
+        local_err = NULL;
+    }
+
+    ret = qcow2_store_extent_index(bs, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_reportf_err(local_err, "Lost the extent index during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
     }
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -2668,17 +3051,25 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
-    qemu_vfree(s->l1_table);
-    /* else pre-write overlap checks in cache_destroy may crash */
-    s->l1_table = NULL;
 
+    /* Storing the extent index may need the L1 table */
     if (!(s->flags & BDRV_O_INACTIVE)) {
         qcow2_inactivate(bs);
     }
 
+    qemu_vfree(s->l1_table);
+    /* else pre-write overlap checks in cache_destroy may crash */
+    s->l1_table = NULL;
+
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+    qcow2_extent_map_free(s->extent_map);
+    s->extent_map = NULL;
+    qcow2_dedup_free(s->dedup);
+    s->dedup = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -2945,6 +3336,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_EXTENT_INDEX_BITNR,
+                .name = "extent index",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2975,6 +3371,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Extent index extension */
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_EXTENT_INDEX) {
+        Qcow2ExtentIndexHeaderExt index_header = {
+            .nb_entries = cpu_to_be32(s->extent_index_entries),
+            .index_offset = cpu_to_be64(s->extent_index_offset),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_EXTENT_INDEX,
+                             &index_header, sizeof(index_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -3834,6 +4246,12 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     uint32_t tail = (offset + bytes) % s->cluster_size;
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
+
+    ret = qcow2_co_drop_stale_extent_index(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
         tail = 0;
     }
@@ -3898,6 +4316,11 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
         }
     }
 
+    ret = qcow2_co_drop_stale_extent_index(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_cluster_discard(bs, offset, bytes, QCOW2_DISCARD_REQUEST,
                                 false);
@@ -4002,6 +4425,11 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
 
     assert(!bs->encrypted);
 
+    ret = qcow2_co_drop_stale_extent_index(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
@@ -4084,6 +4512,12 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
         return -EINVAL;
     }
 
+    ret = qcow2_co_drop_stale_extent_index(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to remove the extent index");
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     /*
@@ -4510,6 +4944,11 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -ENOTSUP;
     }
 
+    ret = qcow2_co_drop_stale_extent_index(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (bytes == 0) {
         /*
          * align end of file to a sector boundary to ease reading with
@@ -4560,6 +4999,84 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+typedef struct Qcow2DecompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    void *dest;
+    const uint8_t *src;
+    int src_size;
+} Qcow2DecompressTask;
+
+/*
+ * Decompresses a read-ahead cluster into its compressed cluster cache
+ * entry. Failing to do so is not an error for the request that triggered
+ * the read-ahead, the entry is just dropped.
+ */
+static coroutine_fn int qcow2_co_decompress_task_entry(AioTask *task)
+{
+    Qcow2DecompressTask *t = container_of(task, Qcow2DecompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    ssize_t ret;
+
+    ret = qcow2_co_decompress(t->bs, t->dest, s->cluster_size,
+                              t->src, t->src_size);
+    qcow2_compressed_cache_complete(s->compressed_cache, t->dest, ret == 0);
+
+    return 0;
+}
+
+/*
+ * Looks up to @max guest clusters ahead of @offset for compressed clusters
+ * whose data directly follows the host range starting at @start and ending
+ * at *@end, so that they can be read together with it. The descriptors of
+ * such clusters are stored in @l2_entries and *@end is extended to cover
+ * them.
+ *
+ * Returns the number of clusters found.
+ */
+static int coroutine_fn
+qcow2_compressed_read_ahead(BlockDriverState *bs, uint64_t offset,
+                            uint64_t *l2_entries, int max,
+                            uint64_t start, uint64_t *end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t guest_offset = start_of_cluster(s, offset);
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    int n = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (n < max) {
+        unsigned int cur_bytes = s->cluster_size;
+        uint64_t l2_entry, coffset;
+        int ret, csize;
+
+        guest_offset += s->cluster_size;
+        if (guest_offset >= disk_size) {
+            break;
+        }
+
+        ret = qcow2_get_cluster_offset(bs, guest_offset, &cur_bytes,
+                                       &l2_entry);
+        if (ret != QCOW2_CLUSTER_COMPRESSED) {
+            break;
+        }
+
+        qcow2_parse_compressed_l2_entry(s, l2_entry, &coffset, &csize);
+        if (coffset < start || coffset > *end ||
+            qcow2_compressed_cache_contains(s->compressed_cache, l2_entry))
+        {
+            break;
+        }
+
+        l2_entries[n++] = l2_entry;
+        *end = MAX(*end, coffset + csize);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return n;
+}
+
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t file_cluster_offset,
@@ -4569,30 +5086,114 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize, nb_csectors;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
+    int ret = 0, csize;
+    uint64_t coffset, end;
+    uint64_t ra_entries[MAX_COMPRESSED_READ_AHEAD];
+    void *ra_bufs[MAX_COMPRESSED_READ_AHEAD];
+    int i, nb_ra = 0;
+    uint8_t *buf = NULL, *out_buf = NULL;
+    bool cached = false;
     int offset_in_cluster = offset_into_cluster(s, offset);
 
-    coffset = file_cluster_offset & s->cluster_offset_mask;
-    nb_csectors = ((file_cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-    csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
-        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+    if (!s->compressed_cache && s->compressed_cache_size) {
+        s->compressed_cache =
+            qcow2_compressed_cache_create(bs, s->compressed_cache_size);
+    }
 
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
+    if (s->compressed_cache) {
+        out_buf = qcow2_compressed_cache_lookup(s->compressed_cache,
+                                                file_cluster_offset);
+        if (out_buf) {
+            qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                                bytes);
+            return 0;
+        }
+
+        out_buf = qcow2_compressed_cache_reserve(s->compressed_cache,
+                                                 file_cluster_offset);
+        cached = out_buf != NULL;
+    }
+    if (!out_buf) {
+        out_buf = qemu_blockalign(bs, s->cluster_size);
+    }
+
+    qcow2_parse_compressed_l2_entry(s, file_cluster_offset, &coffset, &csize);
+    end = coffset + csize;
+
+    if (cached && s->compressed_read_ahead) {
+        uint64_t ra_end = end;
+
+        nb_ra = qcow2_compressed_read_ahead(bs, offset, ra_entries,
+                                            s->compressed_read_ahead,
+                                            coffset, &ra_end);
+
+        /* Other coroutines may have started to read some of them meanwhile */
+        for (i = 0; i < nb_ra; i++) {
+            uint64_t ra_coffset;
+            int ra_csize;
+
+            if (qcow2_compressed_cache_contains(s->compressed_cache,
+                                                ra_entries[i])) {
+                break;
+            }
+            ra_bufs[i] = qcow2_compressed_cache_reserve(s->compressed_cache,
+                                                        ra_entries[i]);
+            if (!ra_bufs[i]) {
+                break;
+            }
+
+            qcow2_parse_compressed_l2_entry(s, ra_entries[i], &ra_coffset,
+                                            &ra_csize);
+            end = MAX(end, ra_coffset + ra_csize);
+        }
+        nb_ra = i;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
+    buf = g_try_malloc(end - coffset);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
 
     BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
+    ret = bdrv_co_pread(bs->file, coffset, end - coffset, buf, 0);
     if (ret < 0) {
         goto fail;
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+    if (nb_ra) {
+        AioTaskPool *aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+
+        trace_qcow2_compressed_read_ahead(qemu_coroutine_self(), offset,
+                                          nb_ra, end - coffset);
+
+        for (i = 0; i < nb_ra; i++) {
+            Qcow2DecompressTask *t = g_new(Qcow2DecompressTask, 1);
+            uint64_t ra_coffset;
+            int ra_csize;
+
+            qcow2_parse_compressed_l2_entry(s, ra_entries[i], &ra_coffset,
+                                            &ra_csize);
+            *t = (Qcow2DecompressTask) {
+                .task.func = qcow2_co_decompress_task_entry,
+                .bs = bs,
+                .dest = ra_bufs[i],
+                .src = buf + (ra_coffset - coffset),
+                .src_size = ra_csize,
+            };
+            aio_task_pool_start_task(aio, &t->task);
+        }
+        nb_ra = 0;
+
+        ret = qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize);
+
+        aio_task_pool_wait_all(aio);
+        aio_task_pool_free(aio);
+    } else {
+        ret = qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize);
+    }
+
+    if (ret < 0) {
         ret = -EIO;
         goto fail;
     }
@@ -4600,7 +5201,14 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
 fail:
-    qemu_vfree(out_buf);
+    for (i = 0; i < nb_ra; i++) {
+        qcow2_compressed_cache_complete(s->compressed_cache, ra_bufs[i], false);
+    }
+    if (cached) {
+        qcow2_compressed_cache_complete(s->compressed_cache, out_buf, ret == 0);
+    } else {
+        qemu_vfree(out_buf);
+    }
     g_free(buf);
 
     return ret;
@@ -4630,6 +5238,9 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    qcow2_compressed_cache_invalidate(s->compressed_cache, 0, UINT64_MAX);
+    qcow2_extent_map_clear(s->extent_map);
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -5034,6 +5645,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs,
             .has_data_file_raw  = has_data_file(bs),
             .data_file_raw      = data_file_is_raw(bs),
             .compression_type   = s->compression_type,
+            .has_extent_index   = s->extent_index,
+            .extent_index       = s->extent_index,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -5184,6 +5797,7 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
 
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
+    s->extent_index = false;
 
     ret = qcow2_expand_zero_clusters(bs, status_cb, cb_opaque);
     if (ret < 0) {
@@ -5346,6 +5960,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     const char *backing_file = NULL, *backing_format = NULL, *data_file = NULL;
     bool lazy_refcounts = s->use_lazy_refcounts;
     bool data_file_raw = data_file_is_raw(bs);
+    bool extent_index = s->extent_index;
     const char *compat = NULL;
     int refcount_bits = s->refcount_bits;
     int ret;
@@ -5419,6 +6034,9 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                                  "images");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTENT_INDEX)) {
+            extent_index = qemu_opt_get_bool(opts, BLOCK_OPT_EXTENT_INDEX,
+                                             extent_index);
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -5504,6 +6122,29 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         s->image_data_file = *data_file ? g_strdup(data_file) : NULL;
     }
 
+    if (qemu_opt_find(opts, BLOCK_OPT_EXTENT_INDEX)) {
+        if (extent_index) {
+            if (new_version < 3) {
+                error_setg(errp, "The extent index requires compatibility "
+                           "level 1.1 or above (use compat=1.1 or greater)");
+                return -EINVAL;
+            }
+            /* Stored when the image is closed */
+            ret = qcow2_build_extent_index(bs, errp);
+            if (ret < 0) {
+                return ret;
+            }
+        } else {
+            ret = qcow2_drop_extent_index(bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Failed to remove the extent "
+                                 "index");
+                return ret;
+            }
+            s->extent_index = false;
+        }
+    }
+
     ret = qcow2_update_header(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to update the image header");
@@ -5780,6 +6421,12 @@ static QemuOptsList qcow2_amend_opts = {
         BLOCK_CRYPTO_OPT_DEF_LUKS_OLD_SECRET("encrypt."),
         BLOCK_CRYPTO_OPT_DEF_LUKS_NEW_SECRET("encrypt."),
         BLOCK_CRYPTO_OPT_DEF_LUKS_ITER_TIME("encrypt."),
+        {
+            .name = BLOCK_OPT_EXTENT_INDEX,
+            .type = QEMU_OPT_BOOL,
+            .help = "Store an index of the allocated clusters as extents "
+                    "in the image",
+        },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
     }
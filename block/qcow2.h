@@ -68,6 +68,10 @@
 #define QCOW2_MAX_BITMAPS 65535
 #define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
 
+/* Extent map and extent index constraints */
+#define QCOW2_EXTENT_MAP_MAX_EXTENTS 65536
+#define QCOW2_MAX_EXTENT_INDEX_ENTRIES QCOW2_EXTENT_MAP_MAX_EXTENTS
+
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
@@ -102,6 +106,15 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Decompressed cluster cache, allocated on first compressed read */
+#define DEFAULT_COMPRESSED_CACHE_SIZE (4 * MiB)
+#define DEFAULT_COMPRESSED_READ_AHEAD 4 /* clusters */
+#define MAX_COMPRESSED_READ_AHEAD 64 /* clusters */
+
+/* Concurrent (de)compression jobs in the thread pool */
+#define DEFAULT_COMPRESS_THREADS 4
+#define MAX_COMPRESS_THREADS 64
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -123,6 +136,11 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_COMPRESSED_READ_AHEAD "compressed-read-ahead"
+#define QCOW2_OPT_EXTENT_MAP "extent-map"
+#define QCOW2_OPT_COMPRESS_THREADS "compress-threads"
+#define QCOW2_OPT_DEDUP "dedup"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -201,6 +219,13 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+typedef struct Qcow2Dedup Qcow2Dedup;
+typedef struct Qcow2ExtentMap Qcow2ExtentMap;
+
+typedef void Qcow2ExtentFunc(uint64_t guest_offset, uint64_t host_offset,
+                             uint64_t bytes, bool copied, void *opaque);
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -248,11 +273,14 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_EXTENT_INDEX_BITNR  = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_EXTENT_INDEX        = 1 << QCOW2_AUTOCLEAR_EXTENT_INDEX_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_EXTENT_INDEX,
 };
 
 enum qcow2_discard_type {
@@ -289,6 +317,19 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2ExtentIndexHeaderExt {
+    uint32_t nb_entries;
+    uint32_t reserved32;
+    uint64_t index_offset;
+} QEMU_PACKED Qcow2ExtentIndexHeaderExt;
+
+/* Entry of the on-disk extent index, all fields are big endian */
+typedef struct Qcow2ExtentIndexEntry {
+    uint64_t guest_offset;
+    uint64_t host_offset; /* QCOW_OFLAG_COPIED if all refcounts are 1 */
+    uint64_t bytes;
+} QEMU_PACKED Qcow2ExtentIndexEntry;
+
 #define QCOW2_MAX_THREADS 4
 
 typedef struct BDRVQcow2State {
@@ -338,6 +379,15 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /*
+     * Whether an extent index should be stored in the image when it is
+     * closed.  The index is only on disk (at extent_index_offset) while
+     * QCOW2_AUTOCLEAR_EXTENT_INDEX is set.
+     */
+    bool extent_index;
+    uint32_t extent_index_entries;
+    uint64_t extent_index_offset;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -372,6 +422,20 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int compress_threads; /* limit of nb_threads for (de)compression */
+
+    /* Decompressed clusters, keyed by their compressed cluster descriptor */
+    Qcow2CompressedCache *compressed_cache;
+    int compressed_cache_size; /* entries, 0 disables the cache */
+    int compressed_read_ahead; /* clusters */
+
+    /* Cached guest -> host mapping of allocated clusters, may be NULL */
+    Qcow2ExtentMap *extent_map;
+    /* Whether the extent-map option was given rather than defaulted */
+    bool extent_map_explicit;
+
+    /* Hashes of written clusters for deduplication, may be NULL */
+    Qcow2Dedup *dedup;
 
     BdrvChild *data_file;
 
@@ -537,6 +601,23 @@ static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
 }
 
+/*
+ * Returns the host offset and the number of bytes to read for the compressed
+ * cluster described by @l2_entry
+ */
+static inline void qcow2_parse_compressed_l2_entry(BDRVQcow2State *s,
+                                                   uint64_t l2_entry,
+                                                   uint64_t *coffset,
+                                                   int *csize)
+{
+    int nb_csectors;
+
+    *coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    *csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
+        (*coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+}
+
 static inline int64_t size_to_l1(BDRVQcow2State *s, int64_t size)
 {
     int shift = s->cluster_bits + s->l2_bits;
@@ -705,6 +786,8 @@ int qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                           uint64_t *host_offset);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+int qcow2_dedup_link_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                             uint64_t host_offset, uint64_t orig_guest_offset);
 void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, enum qcow2_discard_type type,
@@ -763,6 +846,46 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-extent-map.c functions */
+Qcow2ExtentMap *qcow2_extent_map_new(void);
+void qcow2_extent_map_free(Qcow2ExtentMap *map);
+bool qcow2_extent_map_lookup(Qcow2ExtentMap *map, uint64_t offset,
+                             uint64_t *host_offset, uint64_t *bytes,
+                             bool *copied);
+void qcow2_extent_map_insert(Qcow2ExtentMap *map, uint64_t offset,
+                             uint64_t host_offset, uint64_t bytes,
+                             bool copied);
+void qcow2_extent_map_invalidate(Qcow2ExtentMap *map, uint64_t offset,
+                                 uint64_t bytes);
+void qcow2_extent_map_clear(Qcow2ExtentMap *map);
+int qcow2_extent_map_size(Qcow2ExtentMap *map);
+void qcow2_extent_map_foreach(Qcow2ExtentMap *map, Qcow2ExtentFunc *func,
+                              void *opaque);
+
+/* qcow2-extent-index.c functions */
+int qcow2_load_extent_index(BlockDriverState *bs, bool *header_updated,
+                            Error **errp);
+int qcow2_store_extent_index(BlockDriverState *bs, Error **errp);
+int qcow2_drop_extent_index(BlockDriverState *bs);
+int coroutine_fn qcow2_co_drop_stale_extent_index(BlockDriverState *bs);
+int qcow2_build_extent_index(BlockDriverState *bs, Error **errp);
+int qcow2_check_extent_index(BlockDriverState *bs, BdrvCheckResult *res,
+                             BdrvCheckMode fix);
+
+/* qcow2-dedup.c functions */
+Qcow2Dedup *qcow2_dedup_new(void);
+void qcow2_dedup_free(Qcow2Dedup *d);
+void qcow2_dedup_clear(Qcow2Dedup *d);
+void qcow2_dedup_invalidate(Qcow2Dedup *d, uint64_t offset, uint64_t bytes,
+                            int cluster_size);
+void qcow2_dedup_insert(Qcow2Dedup *d, uint64_t hash, uint64_t host_offset,
+                        uint64_t guest_offset);
+void qcow2_dedup_inplace_write_begin(Qcow2Dedup *d);
+void qcow2_dedup_inplace_write_end(Qcow2Dedup *d);
+int coroutine_fn qcow2_co_dedup_write(BlockDriverState *bs, uint64_t offset,
+                                      QEMUIOVector *qiov, size_t qiov_offset,
+                                      uint64_t *hash);
+
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                   void **refcount_table,
@@ -792,6 +915,21 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(BlockDriverState *bs,
+                                                   int nb_entries);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+void *coroutine_fn qcow2_compressed_cache_lookup(Qcow2CompressedCache *c,
+                                                 uint64_t l2_entry);
+bool qcow2_compressed_cache_contains(Qcow2CompressedCache *c,
+                                     uint64_t l2_entry);
+void *qcow2_compressed_cache_reserve(Qcow2CompressedCache *c,
+                                     uint64_t l2_entry);
+void coroutine_fn qcow2_compressed_cache_complete(Qcow2CompressedCache *c,
+                                                  void *data, bool success);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes);
+
 int coroutine_fn
 qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
@@ -199,6 +199,8 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        /* Reverting changes the allocation of the whole image */
+        bdrv_chain_invalidate(bs, 0, INT64_MAX);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to load snapshot");
         }
@@ -62,7 +62,22 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * While no request of a given type is throttled or queued anywhere in the
+ * group, requests don't need the lock: they are admitted with tokens that
+ * are lent to the AioContext of their ThrottleGroupMember (see
+ * ThrottleShard). Only when a shard runs out the lock is taken to account
+ * the request normally and lend more tokens. Before any request is
+ * throttled, all tokens are taken back, so the round-robin scheduling
+ * between members works as usual while the limits are reached.
  */
+struct ThrottleGroupShard {
+    AioContext *ctx;
+    unsigned refcnt;
+    ThrottleShard shard;
+    QLIST_ENTRY(ThrottleGroupShard) next;
+};
+
 typedef struct ThrottleGroup {
     Object parent_obj;
 
@@ -70,12 +85,20 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
     QEMUClockType clock_type;
+    unsigned pending_reqs[2];   /* sum over all members */
+
+    QLIST_HEAD(, ThrottleGroupShard) shards; /* one per AioContext */
+    unsigned nb_shards;
+    bool shards_lent;           /* whether any shard may hold tokens */
+
+    /* Whether requests may be admitted from shards; read without the lock */
+    bool fast_path[2];
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -170,6 +193,82 @@ const char *throttle_group_get_name(ThrottleGroupMember *tgm)
     return tg->name;
 }
 
+/* Return the shard of the group for an AioContext, creating it if needed.
+ *
+ * This assumes that tg->lock is held.
+ */
+static ThrottleGroupShard *throttle_group_get_shard(ThrottleGroup *tg,
+                                                   AioContext *ctx)
+{
+    ThrottleGroupShard *tgs;
+
+    QLIST_FOREACH(tgs, &tg->shards, next) {
+        if (tgs->ctx == ctx) {
+            tgs->refcnt++;
+            return tgs;
+        }
+    }
+
+    tgs = g_new0(ThrottleGroupShard, 1);
+    tgs->ctx = ctx;
+    tgs->refcnt = 1;
+    QLIST_INSERT_HEAD(&tg->shards, tgs, next);
+    tg->nb_shards++;
+    return tgs;
+}
+
+/* Drop a reference to a shard, giving its tokens back to the group when
+ * the last member in its AioContext leaves.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_put_shard(ThrottleGroup *tg, ThrottleGroupShard *tgs)
+{
+    assert(tgs->refcnt > 0);
+    if (--tgs->refcnt) {
+        return;
+    }
+
+    /* Nobody can be consuming from it anymore */
+    throttle_shard_revoke(&tg->ts, &tgs->shard);
+    QLIST_REMOVE(tgs, next);
+    tg->nb_shards--;
+    g_free(tgs);
+}
+
+/* Take back the tokens of all shards.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_revoke_shards(ThrottleGroup *tg)
+{
+    ThrottleGroupShard *tgs;
+    bool in_use = false;
+
+    if (!tg->shards_lent) {
+        return;
+    }
+
+    QLIST_FOREACH(tgs, &tg->shards, next) {
+        in_use |= throttle_shard_revoke(&tg->ts, &tgs->shard);
+    }
+    tg->shards_lent = in_use;
+}
+
+/* Allow or forbid admitting requests of one type from the shards. This is
+ * only allowed while no request of that type is throttled or queued, so
+ * that lock-free requests can't overtake them.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_update_fast_path(ThrottleGroup *tg, bool is_write)
+{
+    bool enable = !tg->any_timer_armed[is_write] &&
+                  !tg->pending_reqs[is_write];
+
+    atomic_set(&tg->fast_path[is_write], enable);
+}
+
 /* Return the next ThrottleGroupMember in the round-robin sequence, simulating
  * a circular list.
  *
@@ -281,12 +380,19 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
         return true;
     }
 
+    /* The wait must be computed without the tokens lent to the shards */
+    if (tg->shards_lent &&
+        throttle_must_wait(ts, is_write, qemu_clock_get_ns(tg->clock_type))) {
+        throttle_group_revoke_shards(tg);
+    }
+
     must_wait = throttle_schedule_timer(ts, tt, is_write);
 
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[is_write] = tgm;
         tg->any_timer_armed[is_write] = true;
+        throttle_group_update_fast_path(tg, is_write);
     }
 
     return must_wait;
@@ -344,6 +450,7 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[is_write], now);
             tg->any_timer_armed[is_write] = true;
+            throttle_group_update_fast_path(tg, is_write);
         }
         tg->tokens[is_write] = token;
     }
@@ -364,6 +471,14 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     bool must_wait;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupShard *tgs = atomic_read(&tgm->shard);
+
+    /* Nothing is throttled, try to admit the request without the lock */
+    if (atomic_read(&tg->fast_path[is_write]) && tgs &&
+        throttle_shard_consume(&tgs->shard, is_write, bytes)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -373,6 +488,8 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
         tgm->pending_reqs[is_write]++;
+        tg->pending_reqs[is_write]++;
+        throttle_group_update_fast_path(tg, is_write);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
@@ -380,6 +497,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        tg->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
@@ -388,6 +506,21 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /*
+     * If nothing is throttled, lend tokens to the AioContext of this member
+     * so that its next requests don't need the lock. Half of the free space
+     * is kept in the group for the other shards and for the slow path.
+     * Both types are checked, because requests of the other type may not
+     * have updated their flag yet.
+     */
+    throttle_group_update_fast_path(tg, false);
+    throttle_group_update_fast_path(tg, true);
+    if (tgm->shard && tg->fast_path[0] && tg->fast_path[1]) {
+        throttle_shard_grant(&tg->ts, &tgm->shard->shard, 2 * tg->nb_shards,
+                             qemu_clock_get_ns(tg->clock_type));
+        tg->shards_lent = true;
+    }
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -471,6 +604,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
+    throttle_group_revoke_shards(tg);
     throttle_config(ts, tg->clock_type, cfg);
     qemu_mutex_unlock(&tg->lock);
 
@@ -507,6 +641,7 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write)
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
     tg->any_timer_armed[is_write] = false;
+    throttle_group_update_fast_path(tg, is_write);
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -565,6 +700,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     qemu_co_mutex_init(&tgm->throttled_reqs_lock);
     qemu_co_queue_init(&tgm->throttled_reqs[0]);
     qemu_co_queue_init(&tgm->throttled_reqs[1]);
+    tgm->shard = throttle_group_get_shard(tg, ctx);
 
     qemu_mutex_unlock(&tg->lock);
 }
@@ -612,6 +748,10 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
     /* remove the current tgm from the list */
     QLIST_REMOVE(tgm, round_robin);
     throttle_timers_destroy(&tgm->throttle_timers);
+    if (tgm->shard) {
+        throttle_group_put_shard(tg, tgm->shard);
+        tgm->shard = NULL;
+    }
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_unref(&tg->ts);
@@ -621,9 +761,15 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 void throttle_group_attach_aio_context(ThrottleGroupMember *tgm,
                                        AioContext *new_context)
 {
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
     ThrottleTimers *tt = &tgm->throttle_timers;
     throttle_timers_attach_aio_context(tt, new_context);
     tgm->aio_context = new_context;
+
+    qemu_mutex_lock(&tg->lock);
+    assert(!tgm->shard);
+    tgm->shard = throttle_group_get_shard(tg, new_context);
+    qemu_mutex_unlock(&tg->lock);
 }
 
 void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
@@ -643,8 +789,11 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
         if (timer_pending(tt->timers[i])) {
             tg->any_timer_armed[i] = false;
             schedule_next_request(tgm, i);
+            throttle_group_update_fast_path(tg, i);
         }
     }
+    throttle_group_put_shard(tg, tgm->shard);
+    tgm->shard = NULL;
     qemu_mutex_unlock(&tg->lock);
 
     throttle_timers_detach_aio_context(tt);
@@ -760,6 +909,7 @@ static void throttle_group_obj_init(Object *obj)
     qemu_mutex_init(&tg->lock);
     throttle_init(&tg->ts);
     QLIST_INIT(&tg->head);
+    QLIST_INIT(&tg->shards);
 }
 
 /* This function edits throttle_groups and must be called under the global
@@ -800,6 +950,7 @@ static void throttle_group_obj_finalize(Object *obj)
     if (tg->is_initialized) {
         QTAILQ_REMOVE(&throttle_groups, tg, list);
     }
+    assert(QLIST_EMPTY(&tg->shards));
     qemu_mutex_destroy(&tg->lock);
     g_free(tg->name);
 }
@@ -898,6 +1049,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
     if (local_err) {
         goto unlock;
     }
+    throttle_group_revoke_shards(tg);
     throttle_config(&tg->ts, tg->clock_type, &cfg);
 
 unlock:
@@ -13,6 +13,7 @@
 #include "sysemu/blockdev.h"
 #include "sysemu/block-backend.h"
 #include "hw/block/block.h"
+#include "sysemu/iothread.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
 #include "block/nbd.h"
@@ -155,12 +156,26 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
     NBDExport *exp;
     int64_t len;
     AioContext *aio_context;
+    g_autofree AioContext **conn_ctxs = NULL;
+    strList *e;
+    int nb_conn_ctxs = 0;
 
     if (!nbd_server) {
         error_setg(errp, "NBD server not running");
         return;
     }
 
+    for (e = arg->has_iothreads ? arg->iothreads : NULL; e; e = e->next) {
+        IOThread *iothread = iothread_by_id(e->value);
+
+        if (!iothread) {
+            error_setg(errp, "Cannot find iothread %s", e->value);
+            return;
+        }
+        conn_ctxs = g_renew(AioContext *, conn_ctxs, nb_conn_ctxs + 1);
+        conn_ctxs[nb_conn_ctxs++] = iothread_get_aio_context(iothread);
+    }
+
     if (!arg->has_name) {
         arg->name = arg->device;
     }
@@ -204,12 +219,17 @@ void qmp_nbd_server_add(BlockExportNbd *arg, Error **errp)
     }
 
     exp = nbd_export_new(bs, 0, len, arg->name, arg->description, arg->bitmap,
-                         !arg->writable, !arg->writable,
+                         !arg->writable,
+                         !arg->writable || arg->multi_conn,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         goto out;
     }
 
+    if (nb_conn_ctxs) {
+        nbd_export_set_connection_contexts(exp, conn_ctxs, nb_conn_ctxs);
+    }
+
     /* The list of named exports has a strong reference to this export now and
      * our only way of accessing it is through nbd_export_find(), so we can drop
      * the strong reference that is @exp. */
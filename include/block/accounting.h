@@ -116,6 +116,11 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+int block_latency_histogram_init(BlockLatencyHistogram *hist,
+                                 uint64List *boundaries);
+void block_latency_histogram_destroy(BlockLatencyHistogram *hist);
+void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                     int64_t latency_ns);
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
@@ -120,6 +120,25 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct AioIOUringOp AioIOUringOp;
+typedef void AioIOUringOpFunc(AioIOUringOp *op, int ret);
+
+/*
+ * An asynchronous operation submitted with aio_io_uring_submit().  The caller
+ * fills in @sqe using the io_uring_prep_*() helpers and @cb; the user_data
+ * field of @sqe and the remaining fields are private to the AioContext.
+ */
+struct AioIOUringOp {
+    struct io_uring_sqe sqe;
+    AioIOUringOpFunc *cb;
+
+    int ret;
+    unsigned int state;
+    QSIMPLEQ_ENTRY(AioIOUringOp) next;
+};
+#endif
+
 struct AioContext {
     GSource source;
 
@@ -213,6 +232,16 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /*
+     * AioIOUringOps that still have to be placed on the sq ring, that need
+     * to be cancelled and whose callbacks still have to be invoked.  Only
+     * accessed from the AioContext's home thread.
+     */
+    QSIMPLEQ_HEAD(, AioIOUringOp) io_uring_ops_pending;
+    QSIMPLEQ_HEAD(, AioIOUringOp) io_uring_ops_cancel;
+    QSIMPLEQ_HEAD(, AioIOUringOp) io_uring_ops_done;
+    unsigned int io_uring_ops_in_flight;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -491,6 +520,46 @@ struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
 
 /* Return the LuringState bound to this AioContext */
 struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_io_uring_available:
+ * @ctx: the aio context
+ *
+ * Returns: true if @ctx monitors file descriptors with io_uring, so that
+ * aio_io_uring_submit() can be used.
+ */
+bool aio_io_uring_available(AioContext *ctx);
+
+/**
+ * aio_io_uring_submit:
+ * @ctx: the aio context
+ * @op: the operation to submit
+ *
+ * Submit @op on the io_uring that @ctx uses for file descriptor monitoring.
+ * The sqe is placed on the sq ring the next time the event loop waits for
+ * events, so that submitting it and reaping its completion share the system
+ * call that the event loop makes anyway.  @op->cb is invoked from aio_poll()
+ * once the operation has completed, with the cqe result as @ret.
+ *
+ * Must be called from @ctx's home thread and only if
+ * aio_io_uring_available() returns true.  @op must stay valid until its
+ * callback has been invoked.
+ */
+void aio_io_uring_submit(AioContext *ctx, AioIOUringOp *op);
+
+/**
+ * aio_io_uring_cancel:
+ * @ctx: the aio context
+ * @op: the operation to cancel
+ *
+ * Request cancellation of an operation submitted with aio_io_uring_submit().
+ * The callback is still invoked, with -ECANCELED if the operation was
+ * cancelled before it completed.  Does nothing if the operation has already
+ * completed.  Must be called from @ctx's home thread.
+ */
+void aio_io_uring_cancel(AioContext *ctx, AioIOUringOp *op);
+#endif
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -654,6 +723,15 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_co_schedule(AioContext *ctx, struct Coroutine *co);
 
+/**
+ * aio_co_reschedule_self:
+ * @new_ctx: the new context
+ *
+ * Move the currently running coroutine to new_ctx. If the coroutine is already
+ * running in new_ctx, do nothing.
+ */
+void aio_co_reschedule_self(AioContext *new_ctx);
+
 /**
  * aio_co_wake:
  * @co: the coroutine
@@ -21,6 +21,86 @@
 typedef void (*ProgressBytesCallbackFunc)(int64_t bytes, void *opaque);
 typedef struct BlockCopyState BlockCopyState;
 
+/*
+ * The adaptive controller compares the throughput of consecutive intervals of
+ * this much busy time (time with at least one request in flight), each of
+ * which must contain at least BLOCK_COPY_TUNE_MIN_REQUESTS requests.
+ */
+#define BLOCK_COPY_TUNE_INTERVAL_NS (250 * SCALE_MS)
+#define BLOCK_COPY_TUNE_MIN_REQUESTS 16
+
+typedef enum BlockCopyTuneKnob {
+    BLOCK_COPY_TUNE_CHUNK_SIZE,
+    BLOCK_COPY_TUNE_WORKERS,
+    BLOCK_COPY_TUNE__MAX,
+} BlockCopyTuneKnob;
+
+/*
+ * Hill-climbing controller for the request size and the number of parallel
+ * requests.  At the end of each measurement interval one of the knobs is
+ * doubled or halved; a step that improved throughput is repeated, a step that
+ * made it worse is undone and the other knob is tried next.
+ */
+typedef struct BlockCopyTuner {
+    /* Current settings; chunk_size is further limited by max_chunk_size */
+    int64_t chunk_size;
+    int max_workers;
+
+    /* Limits; the user of the tuner may change max_chunk_size at any time */
+    int64_t min_chunk_size;
+    int64_t max_chunk_size;
+    int workers_limit;
+
+    /*
+     * Measurement of the current interval: busy_ns is the time with
+     * requests in flight, active_ns the sum of the time that each request
+     * was in flight
+     */
+    int active_requests;
+    int64_t last_event_ns;
+    int64_t busy_ns;
+    int64_t active_ns;
+    int64_t bytes;
+    int64_t requests;
+    int64_t latency_ns;
+
+    /* Settings changed at changed_ns with old_requests in flight */
+    int64_t changed_ns;
+    int old_requests;
+
+    /* Result of the last complete interval, zero if there was none yet */
+    int64_t throughput;
+    int64_t avg_latency_ns;
+
+    BlockCopyTuneKnob knob;
+    int direction[BLOCK_COPY_TUNE__MAX];
+    bool undoing;
+} BlockCopyTuner;
+
+/*
+ * Start with requests of @chunk_size bytes, @max_workers of them in
+ * parallel, which are also the upper limits.  Smaller requests are
+ * multiples of @min_chunk_size.
+ */
+void block_copy_tuner_init(BlockCopyTuner *t, int64_t chunk_size,
+                           int64_t min_chunk_size, int max_workers);
+
+/* Current request size */
+int64_t block_copy_tuner_chunk_size(BlockCopyTuner *t);
+
+/* A request was started at @now, in nanoseconds */
+void block_copy_tuner_request_start(BlockCopyTuner *t, int64_t now);
+
+/*
+ * A request that was started at @start completed at @now.  Its bytes and
+ * latency are only taken into account if @account is true.
+ *
+ * Returns true if a measurement interval ended and the settings were
+ * updated.
+ */
+bool block_copy_tuner_request_end(BlockCopyTuner *t, int64_t start,
+                                  int64_t now, int64_t bytes, bool account);
+
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      int64_t cluster_size,
                                      BdrvRequestFlags write_flags,
@@ -41,6 +121,18 @@ int64_t block_copy_reset_unallocated(BlockCopyState *s,
 int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
                             bool *error_is_read);
 
+/*
+ * Number of bytes a single block_copy() call should cover to keep all
+ * parallel requests busy with the current settings.
+ */
+int64_t block_copy_batch_size(BlockCopyState *s);
+
+/*
+ * Returns the current settings and measurements of the adaptive controller,
+ * or NULL if it has not finished a measurement interval yet.
+ */
+BlockCopyInfo *block_copy_query(BlockCopyState *s);
+
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
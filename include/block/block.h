@@ -491,6 +491,9 @@ int bdrv_block_status(BlockDriverState *bs, int64_t offset,
 int bdrv_block_status_above(BlockDriverState *bs, BlockDriverState *base,
                             int64_t offset, int64_t bytes, int64_t *pnum,
                             int64_t *map, BlockDriverState **file);
+int bdrv_block_status_chain(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, int64_t *pnum, int64_t *map,
+                            BlockDriverState **file, int *depth);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t offset, int64_t bytes,
                       int64_t *pnum);
 int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
@@ -789,4 +792,35 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                     BdrvChild *dst, uint64_t dst_offset,
                                     uint64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
+
+/**
+ *
+ * bdrv_co_splice:
+ *
+ * Read data from @child into the pipe @pipe_fd without copying it through a
+ * buffer in QEMU (like splice(2)), e.g. to pass it on to a socket from
+ * there.  Only protocol drivers that have a file descriptor of their own
+ * can do this, possibly below drivers that just map the request onto their
+ * child.
+ *
+ * This never waits for room in the pipe: if it is full, fewer bytes than
+ * requested are moved.  An error after some data has been moved is
+ * reported as a short transfer, too, so that the data in the pipe is
+ * accounted for; the next call returns the error.
+ *
+ * If the operation is not supported, -ENOTSUP is returned before anything
+ * is written to @pipe_fd.  As with bdrv_co_copy_range(), the block layer
+ * doesn't fall back to a bounce buffer; that is up to the caller.
+ *
+ * @child: Child to read data from
+ * @offset: offset in @child to read data
+ * @bytes: number of bytes to move; 0 only checks whether splicing @child's
+ *         data is supported
+ * @pipe_fd: write end of a non-blocking pipe
+ *
+ * Returns: the number of bytes moved into the pipe if succeeded; negative
+ * error code if failed.
+ **/
+int coroutine_fn bdrv_co_splice(BdrvChild *child, int64_t offset,
+                                int64_t bytes, int pipe_fd);
 #endif
@@ -58,6 +58,7 @@
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
+#define BLOCK_OPT_EXTENT_INDEX      "extent_index"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
@@ -76,6 +77,7 @@ typedef struct BdrvTrackedRequest {
     enum BdrvTrackedRequestType type;
 
     bool serialising;
+    bool untracked; /* not on tracked_requests, see untracked_request_begin */
     int64_t overlap_offset;
     uint64_t overlap_bytes;
 
@@ -315,6 +317,19 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Move [offset, offset + bytes) into the pipe @pipe_fd without a bounce
+     * buffer, or map the range onto a child of @bs and invoke
+     * bdrv_co_splice(child, ...).  Return -ENOTSUP without writing anything
+     * if this isn't possible.  @bytes == 0 only checks whether it is.
+     *
+     * See the comment of bdrv_co_splice for the parameter and return value
+     * semantics.
+     */
+    int coroutine_fn (*bdrv_co_splice)(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes,
+                                       int pipe_fd);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -680,6 +695,7 @@ typedef struct BlockLimits {
 } BlockLimits;
 
 typedef struct BdrvOpBlocker BdrvOpBlocker;
+typedef struct BdrvChainMap BdrvChainMap;
 
 typedef struct BdrvAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
@@ -935,17 +951,25 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Which layer of the backing chain allocates which range, see
+     * block/chain-map.c.  Only used in the node's AioContext.
+     */
+    BdrvChainMap *chain_map;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
      */
     int copy_on_read;
 
-    /* number of in-flight requests; overall and serialising.
+    /* number of in-flight requests; overall, serialising and those that
+     * bypass the tracked requests list.
      * Accessed with atomic ops.
      */
     unsigned int in_flight;
     unsigned int serialising_in_flight;
+    unsigned int untracked_in_flight;
 
     /* counter for nested bdrv_io_plug.
      * Accessed with atomic ops.
@@ -964,6 +988,7 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    CoQueue untracked_queue;              /* Waiting for untracked requests */
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -1204,6 +1229,8 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @coalesce_delay_ns: In write-blocking mode, how long a guest write may wait
+ * to be combined with adjacent writes into one request to the target.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -1220,7 +1247,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, int64_t coalesce_delay_ns,
+                  Error **errp);
 
 /*
  * backup_job_create:
@@ -1322,6 +1350,20 @@ int coroutine_fn bdrv_co_block_status_from_backing(BlockDriverState *bs,
                                                    int64_t *map,
                                                    BlockDriverState **file);
 const char *bdrv_get_parent_name(const BlockDriverState *bs);
+
+#define BDRV_CHAIN_UNALLOCATED (-1)
+
+BdrvChainMap *bdrv_chain_map_get(BlockDriverState *bs);
+void bdrv_chain_map_free(BdrvChainMap *map);
+BlockDriverState *bdrv_chain_map_layer(BdrvChainMap *map, int depth);
+int bdrv_chain_map_depth(BdrvChainMap *map, BlockDriverState *base);
+uint64_t bdrv_chain_map_gen(BdrvChainMap *map);
+bool bdrv_chain_map_lookup(BdrvChainMap *map, int64_t offset, int64_t *bytes,
+                           int *depth);
+void bdrv_chain_map_insert(BdrvChainMap *map, int64_t offset, int64_t bytes,
+                           int depth);
+void bdrv_chain_invalidate(BlockDriverState *bs, int64_t offset,
+                           int64_t bytes);
 void blk_dev_change_media_cb(BlockBackend *blk, bool load, Error **errp);
 bool blk_dev_has_removable_media(BlockBackend *blk);
 bool blk_dev_has_tray(BlockBackend *blk);
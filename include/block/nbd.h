@@ -341,6 +341,8 @@ void nbd_export_put(NBDExport *exp);
 BlockBackend *nbd_export_get_blockdev(NBDExport *exp);
 
 AioContext *nbd_export_aio_context(NBDExport *exp);
+void nbd_export_set_connection_contexts(NBDExport *exp, AioContext **ctxs,
+                                        int nb_ctxs);
 NBDExport *nbd_export_find(const char *name);
 void nbd_export_close_all(void);
 
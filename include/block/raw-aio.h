@@ -29,6 +29,7 @@
 #define QEMU_AIO_WRITE_ZEROES 0x0020
 #define QEMU_AIO_COPY_RANGE   0x0040
 #define QEMU_AIO_TRUNCATE     0x0080
+#define QEMU_AIO_SPLICE       0x0100
 #define QEMU_AIO_TYPE_MASK \
         (QEMU_AIO_READ | \
          QEMU_AIO_WRITE | \
@@ -37,7 +38,8 @@
          QEMU_AIO_DISCARD | \
          QEMU_AIO_WRITE_ZEROES | \
          QEMU_AIO_COPY_RANGE | \
-         QEMU_AIO_TRUNCATE)
+         QEMU_AIO_TRUNCATE | \
+         QEMU_AIO_SPLICE)
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
@@ -60,8 +62,15 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s);
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
+/* luring_init_flags() flags */
+#define LURING_SQPOLL           0x0001  /* kernel submission queue polling */
+#define LURING_FIXED_BUFFERS    0x0002  /* register guest RAM as buffers */
 LuringState *luring_init(Error **errp);
+LuringState *luring_init_flags(unsigned int flags, Error **errp);
 void luring_cleanup(LuringState *s);
+int luring_set_fixed_file(LuringState *s, int fd, Error **errp);
+void luring_register_buf(LuringState *s, void *host, size_t size);
+void luring_unregister_buf(LuringState *s, void *host);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
                                 uint64_t offset, QEMUIOVector *qiov, int type);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
@@ -28,6 +28,8 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+typedef struct ThrottleGroupShard ThrottleGroupShard;
+
 /* The ThrottleGroupMember structure indicates membership in a ThrottleGroup
  * and holds related data.
  */
@@ -56,6 +58,13 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /*
+     * Tokens shared with the members in the same AioContext, NULL while
+     * the member is detached. Changed under the ThrottleGroup lock, but
+     * read without it by requests running in aio_context.
+     */
+    ThrottleGroupShard *shard;
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
@@ -48,6 +48,12 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+#ifdef CONFIG_LINUX_IO_URING
+    /* Operations submitted because of qio_channel_set_completion_io() */
+    struct QIOChannelSocketUringOp *read_op;
+    struct QIOChannelSocketUringOp *write_op;
+    unsigned int uring_in_flight;
+#endif
 };
 
 
@@ -84,6 +84,7 @@ struct QIOChannel {
     AioContext *ctx;
     Coroutine *read_coroutine;
     Coroutine *write_coroutine;
+    bool completion_io; /* see qio_channel_set_completion_io() */
 #ifdef _WIN32
     HANDLE event; /* For use with GSource on Win32 */
 #endif
@@ -141,6 +142,15 @@ struct QIOChannelClass {
                                   IOHandler *io_read,
                                   IOHandler *io_write,
                                   void *opaque);
+    ssize_t coroutine_fn (*io_co_writev)(QIOChannel *ioc,
+                                         const struct iovec *iov,
+                                         size_t niov,
+                                         Error **errp);
+    ssize_t coroutine_fn (*io_co_readv)(QIOChannel *ioc,
+                                        const struct iovec *iov,
+                                        size_t niov,
+                                        Error **errp);
+    void (*io_detach_aio_context)(QIOChannel *ioc);
 };
 
 /* General I/O handling functions */
@@ -575,6 +585,31 @@ void qio_channel_set_delay(QIOChannel *ioc,
 void qio_channel_set_cork(QIOChannel *ioc,
                           bool enabled);
 
+/**
+ * qio_channel_set_completion_io:
+ * @ioc: the channel object
+ * @enabled: the new flag state
+ *
+ * Controls whether reads and writes made from coroutines
+ * by qio_channel_readv_all() and qio_channel_writev_all()
+ * (and the functions built on top of them) are submitted
+ * as asynchronous operations that the coroutine waits for,
+ * instead of being retried after qio_channel_yield()
+ * reports that the channel is ready.
+ *
+ * On channels which are backed by a socket, this uses the
+ * io_uring of the #AioContext the channel is attached to,
+ * if that #AioContext monitors file descriptors with
+ * io_uring.  This saves the readiness notification and
+ * the system call for each read and write.
+ *
+ * This setting is merely a hint, so implementations are
+ * free to ignore this without it being considered an
+ * error.
+ */
+void qio_channel_set_completion_io(QIOChannel *ioc,
+                                   bool enabled);
+
 
 /**
  * qio_channel_seek:
@@ -724,6 +759,10 @@ void qio_channel_attach_aio_context(QIOChannel *ioc,
  * Disable any I/O handlers set by qio_channel_yield().  With the
  * help of aio_co_schedule(), this allows moving a coroutine that was
  * paused by qio_channel_yield() to another context.
+ *
+ * Operations that were submitted because of qio_channel_set_completion_io()
+ * are cancelled and waited for, so that the coroutine can be moved in the
+ * same way.  Data they transferred before being cancelled is not lost.
  */
 void qio_channel_detach_aio_context(QIOChannel *ioc);
 
@@ -349,4 +349,13 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Select the next vectorized implementation of the word array helpers
+ * used by HBitmap.  Returns false once all of them have been tested and
+ * the integer versions are in use.  For use by tests only.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -99,6 +99,30 @@ typedef struct ThrottleState {
     int64_t previous_leak;    /* timestamp of the last leak done */
 } ThrottleState;
 
+/*
+ * Taking the lock that protects a ThrottleState that is shared between
+ * threads for every I/O request is expensive when many threads use it.
+ * As long as no request has to wait, a part of the free space of the
+ * buckets can be lent to each thread in a ThrottleShard instead. Requests
+ * are admitted by atomically taking tokens from the shard; only when it
+ * runs out, the lock must be taken to lend more.
+ *
+ * Lent tokens are accounted in the buckets immediately, so the limits are
+ * never exceeded. Before any request is throttled, unused tokens must be
+ * taken back with throttle_shard_revoke() so that the wait is computed from
+ * the actual bucket levels.
+ */
+
+/* Tokens are kept in 1/THROTTLE_SHARD_SCALE units */
+#define THROTTLE_SHARD_SCALE 1000
+#define THROTTLE_SHARD_UNLIMITED (INT64_MAX / 4)
+
+typedef struct ThrottleShard {
+    /* Accessed atomically; may be temporarily negative */
+    int64_t tokens[BUCKETS_COUNT];
+    uint64_t op_size;          /* accessed atomically */
+} ThrottleShard;
+
 typedef struct ThrottleTimers {
     QEMUTimer *timers[2];     /* timers used to do the throttling */
     QEMUClockType clock_type; /* the clock used */
@@ -151,7 +175,17 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+bool throttle_must_wait(ThrottleState *ts, bool is_write, int64_t now);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+
+/* sharded admission */
+void throttle_shard_grant(ThrottleState *ts, ThrottleShard *shard,
+                          unsigned int divisor, int64_t now);
+bool throttle_shard_revoke(ThrottleState *ts, ThrottleShard *shard);
+bool throttle_shard_consume(ThrottleShard *shard, bool is_write,
+                            uint64_t size);
+
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
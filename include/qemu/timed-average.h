@@ -33,12 +33,25 @@ typedef struct TimedAverage TimedAverage;
 
 /* All fields of both structures are private */
 
+/*
+ * With timed_average_enable_percentiles(), values are also counted in bins
+ * to compute percentiles. Each power of two
+ * is split in 2^TIMED_AVERAGE_BIN_BITS bins of the same width, so the error
+ * of a percentile is below 1 / 2^(TIMED_AVERAGE_BIN_BITS + 1) of its value.
+ * Values of TIMED_AVERAGE_BIN_MAX or more are counted in the last bin.
+ */
+#define TIMED_AVERAGE_BIN_BITS 3
+#define TIMED_AVERAGE_BIN_MAX  (1ULL << 40)
+#define TIMED_AVERAGE_NR_BINS  ((40 - TIMED_AVERAGE_BIN_BITS + 1) << \
+                                TIMED_AVERAGE_BIN_BITS)
+
 struct TimedAverageWindow {
     uint64_t      min;             /* minimum value accounted in the window */
     uint64_t      max;             /* maximum value accounted in the window */
     uint64_t      sum;             /* sum of all values */
     uint64_t      count;           /* number of values */
     int64_t       expiration;      /* the end of the current window in ns */
+    uint64_t      *bins;           /* number of values per bin, or NULL */
 };
 
 struct TimedAverage {
@@ -52,6 +65,8 @@ struct TimedAverage {
 
 void timed_average_init(TimedAverage *ta, QEMUClockType clock_type,
                         uint64_t period);
+void timed_average_enable_percentiles(TimedAverage *ta);
+void timed_average_destroy(TimedAverage *ta);
 
 void timed_average_account(TimedAverage *ta, uint64_t value);
 
@@ -59,5 +74,6 @@ uint64_t timed_average_min(TimedAverage *ta);
 uint64_t timed_average_avg(TimedAverage *ta);
 uint64_t timed_average_max(TimedAverage *ta);
 uint64_t timed_average_sum(TimedAverage *ta, uint64_t *elapsed);
+uint64_t timed_average_percentile(TimedAverage *ta, double percentile);
 
 #endif
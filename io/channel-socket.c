@@ -24,6 +24,7 @@
 #include "qemu/module.h"
 #include "io/channel-socket.h"
 #include "io/channel-watch.h"
+#include "block/aio-wait.h"
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
@@ -658,6 +659,184 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 }
 #endif /* WIN32 */
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct QIOChannelSocketUringOp {
+    AioIOUringOp op;
+    QIOChannelSocket *sioc;
+    AioContext *ctx;
+    Coroutine *co;
+    int ret;
+    bool done;
+    bool detached;
+} QIOChannelSocketUringOp;
+
+static void qio_channel_socket_uring_cb(AioIOUringOp *op, int ret)
+{
+    QIOChannelSocketUringOp *req = container_of(op, QIOChannelSocketUringOp,
+                                                op);
+    QIOChannelSocket *sioc = req->sioc;
+    AioContext *ctx = req->ctx;
+
+    /*
+     * qio_channel_detach_aio_context() sets req->detached with the
+     * AioContext lock held, so either it sees the operation complete or
+     * the coroutine is left for whoever moves it to the new AioContext.
+     */
+    aio_context_acquire(ctx);
+    req->ret = ret;
+    req->done = true;
+    atomic_dec(&sioc->uring_in_flight);
+    if (!req->detached) {
+        /* req and sioc may go away once the coroutine runs */
+        aio_co_wake(req->co);
+    }
+    aio_context_release(ctx);
+
+    aio_wait_kick();
+}
+
+/*
+ * Submit @iov as a recvmsg(2) or sendmsg(2) on the io_uring of the current
+ * AioContext and yield until it completes.
+ *
+ * Returns the number of bytes transferred, -ENOTSUP if the operation could
+ * not be submitted or a negative errno value.
+ */
+static ssize_t coroutine_fn
+qio_channel_socket_uring_rw(QIOChannelSocket *sioc, bool is_write,
+                            const struct iovec *iov, size_t niov)
+{
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
+    AioContext *ctx = qemu_get_current_aio_context();
+    QIOChannelSocketUringOp **slot;
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = niov,
+    };
+    QIOChannelSocketUringOp req = {
+        .op.cb = qio_channel_socket_uring_cb,
+        .sioc = sioc,
+        .ctx = ctx,
+        .co = qemu_coroutine_self(),
+    };
+
+    /* Only the AioContext the channel is attached to can be used */
+    if (ioc->ctx != ctx || !aio_io_uring_available(ctx)) {
+        return -ENOTSUP;
+    }
+
+    slot = is_write ? &sioc->write_op : &sioc->read_op;
+    assert(!*slot);
+
+    if (is_write) {
+        io_uring_prep_sendmsg(&req.op.sqe, sioc->fd, &msg, 0);
+    } else {
+        io_uring_prep_recvmsg(&req.op.sqe, sioc->fd, &msg, 0);
+    }
+
+    *slot = &req;
+    atomic_inc(&sioc->uring_in_flight);
+    aio_io_uring_submit(ctx, &req.op);
+
+    while (!req.done) {
+        qemu_coroutine_yield();
+
+        /*
+         * Entered by someone else to interrupt the operation.  After
+         * qio_channel_detach_aio_context() the operation has completed
+         * already, otherwise it is still on this AioContext.
+         */
+        if (!req.done) {
+            aio_io_uring_cancel(ctx, &req.op);
+        }
+    }
+
+    *slot = NULL;
+    return req.ret;
+}
+
+static ssize_t coroutine_fn
+qio_channel_socket_co_readv(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    ssize_t ret;
+
+    ret = qio_channel_socket_uring_rw(sioc, false, iov, niov);
+    if (ret == -ENOTSUP || ret == -ECANCELED || ret == -EINTR ||
+        ret == -EAGAIN) {
+        /* Nothing was read, fall back to a normal non-blocking read */
+        return qio_channel_socket_readv(ioc, iov, niov, NULL, NULL, errp);
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "Unable to read from socket");
+        return -1;
+    }
+    return ret;
+}
+
+static ssize_t coroutine_fn
+qio_channel_socket_co_writev(QIOChannel *ioc,
+                             const struct iovec *iov,
+                             size_t niov,
+                             Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    ssize_t ret;
+
+    ret = qio_channel_socket_uring_rw(sioc, true, iov, niov);
+    if (ret == -ENOTSUP || ret == -ECANCELED || ret == -EINTR ||
+        ret == -EAGAIN) {
+        /* Nothing was written, fall back to a normal non-blocking write */
+        return qio_channel_socket_writev(ioc, iov, niov, NULL, 0, errp);
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "Unable to write to socket");
+        return -1;
+    }
+    return ret;
+}
+
+static void qio_channel_socket_uring_cancel_bh(void *opaque)
+{
+    QIOChannelSocket *sioc = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    if (sioc->read_op) {
+        aio_io_uring_cancel(ctx, &sioc->read_op->op);
+    }
+    if (sioc->write_op) {
+        aio_io_uring_cancel(ctx, &sioc->write_op->op);
+    }
+    aio_context_release(ctx);
+
+    object_unref(OBJECT(sioc));
+}
+
+static void qio_channel_socket_detach_aio_context(QIOChannel *ioc)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    AioContext *ctx = ioc->ctx;
+
+    if (!atomic_read(&sioc->uring_in_flight)) {
+        return;
+    }
+
+    /* The coroutines are entered again by whoever moves them */
+    if (sioc->read_op) {
+        sioc->read_op->detached = true;
+    }
+    if (sioc->write_op) {
+        sioc->write_op->detached = true;
+    }
+
+    object_ref(OBJECT(sioc));
+    aio_bh_schedule_oneshot(ctx, qio_channel_socket_uring_cancel_bh, sioc);
+    AIO_WAIT_WHILE(ctx, atomic_read(&sioc->uring_in_flight) > 0);
+}
+#endif /* CONFIG_LINUX_IO_URING */
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
@@ -787,6 +966,11 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
     ioc_klass->io_set_aio_fd_handler = qio_channel_socket_set_aio_fd_handler;
+#ifdef CONFIG_LINUX_IO_URING
+    ioc_klass->io_co_readv = qio_channel_socket_co_readv;
+    ioc_klass->io_co_writev = qio_channel_socket_co_writev;
+    ioc_klass->io_detach_aio_context = qio_channel_socket_detach_aio_context;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
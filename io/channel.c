@@ -87,6 +87,40 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
 }
 
 
+/*
+ * Like qio_channel_readv(), but may yield until the data has been read if
+ * completion-based I/O was requested with qio_channel_set_completion_io().
+ */
+static ssize_t qio_channel_readv_maybe_co(QIOChannel *ioc,
+                                          const struct iovec *iov,
+                                          size_t niov,
+                                          Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+
+    if (ioc->completion_io && klass->io_co_readv && qemu_in_coroutine()) {
+        return klass->io_co_readv(ioc, iov, niov, errp);
+    }
+
+    return qio_channel_readv(ioc, iov, niov, errp);
+}
+
+
+static ssize_t qio_channel_writev_maybe_co(QIOChannel *ioc,
+                                           const struct iovec *iov,
+                                           size_t niov,
+                                           Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+
+    if (ioc->completion_io && klass->io_co_writev && qemu_in_coroutine()) {
+        return klass->io_co_writev(ioc, iov, niov, errp);
+    }
+
+    return qio_channel_writev(ioc, iov, niov, errp);
+}
+
+
 int qio_channel_readv_all_eof(QIOChannel *ioc,
                               const struct iovec *iov,
                               size_t niov,
@@ -104,7 +138,7 @@ int qio_channel_readv_all_eof(QIOChannel *ioc,
 
     while (nlocal_iov > 0) {
         ssize_t len;
-        len = qio_channel_readv(ioc, local_iov, nlocal_iov, errp);
+        len = qio_channel_readv_maybe_co(ioc, local_iov, nlocal_iov, errp);
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             if (qemu_in_coroutine()) {
                 qio_channel_yield(ioc, G_IO_IN);
@@ -168,7 +202,7 @@ int qio_channel_writev_all(QIOChannel *ioc,
 
     while (nlocal_iov > 0) {
         ssize_t len;
-        len = qio_channel_writev(ioc, local_iov, nlocal_iov, errp);
+        len = qio_channel_writev_maybe_co(ioc, local_iov, nlocal_iov, errp);
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             if (qemu_in_coroutine()) {
                 qio_channel_yield(ioc, G_IO_OUT);
@@ -374,6 +408,13 @@ void qio_channel_set_delay(QIOChannel *ioc,
 }
 
 
+void qio_channel_set_completion_io(QIOChannel *ioc,
+                                   bool enabled)
+{
+    ioc->completion_io = enabled;
+}
+
+
 void qio_channel_set_cork(QIOChannel *ioc,
                           bool enabled)
 {
@@ -449,6 +490,12 @@ void qio_channel_attach_aio_context(QIOChannel *ioc,
 
 void qio_channel_detach_aio_context(QIOChannel *ioc)
 {
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+
+    if (klass->io_detach_aio_context) {
+        klass->io_detach_aio_context(ioc);
+    }
+
     ioc->read_coroutine = NULL;
     ioc->write_coroutine = NULL;
     qio_channel_set_aio_fd_handlers(ioc);
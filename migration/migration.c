@@ -931,7 +931,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_multifd_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -955,6 +955,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
                                     compression_counters.compression_rate;
     }
 
+    if (migrate_use_multifd()) {
+        multifd_fill_info(info);
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
@@ -2290,6 +2294,29 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    /*
+     * The channels see all pages with multifd-xbzrle, so they must look for
+     * zero pages, too.  Otherwise, those would be sent with their data.
+     */
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] ||
+           s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_XBZRLE];
+}
+
+bool migrate_multifd_xbzrle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_XBZRLE];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -0,0 +1,395 @@
+/*
+ * Multifd adaptive compression
+ *
+ * Choose the compression method for every packet among no compression,
+ * lz4 and, if available, zstd.  Each channel estimates for every method
+ * the time it needs to compress a byte and how much it shrinks the data,
+ * and the time it takes to write a byte to the channel.  A packet is sent
+ * with the method that is expected to compress and write it fastest, so
+ * slow links get compressed data and fast links don't wait for the CPU.
+ * Every ADAPTIVE_PROBE_INTERVAL packets the next method is tried instead,
+ * so that the estimates follow the guest memory and the link.
+ *
+ * The packets carry the compression flags of the method that was used,
+ * and the destination decodes them with that method.  zstd keeps a history
+ * per channel on both sides, which stays in sync because each side feeds
+ * it exactly the packets that were compressed with zstd, in order.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/* Packets between two tries of another method than the best one */
+#define ADAPTIVE_PROBE_INTERVAL 32
+
+/* Weight of the previous estimate against a new measurement */
+#define ADAPTIVE_HISTORY 7
+
+static const struct {
+    int method;
+    uint32_t flag;
+} adaptive_methods[] = {
+    { MULTIFD_COMPRESSION_NONE, MULTIFD_FLAG_NOCOMP },
+    { MULTIFD_COMPRESSION_LZ4, MULTIFD_FLAG_LZ4 },
+#ifdef CONFIG_ZSTD
+    { MULTIFD_COMPRESSION_ZSTD, MULTIFD_FLAG_ZSTD },
+#endif
+};
+
+#define ADAPTIVE_METHODS ARRAY_SIZE(adaptive_methods)
+
+struct adaptive_method {
+    MultiFDMethods *ops;
+    /* data of the method for the channel */
+    void *data;
+    /* nanoseconds to compress a byte */
+    double cpu_cost;
+    /* compressed size divided by the size of the pages */
+    double ratio;
+    /* packets that the estimates are based on */
+    uint64_t samples;
+};
+
+struct adaptive_data {
+    struct adaptive_method method[ADAPTIVE_METHODS];
+    /* method of the packet that is being sent */
+    int current;
+    /* nanoseconds to write a byte to the channel */
+    double net_cost;
+    /* packets that the estimate is based on */
+    uint64_t net_samples;
+    /* packets sent through this channel */
+    uint64_t packets;
+    /* method that was tried last */
+    int probe;
+};
+
+static double adaptive_average(double estimate, double value,
+                               uint64_t samples)
+{
+    if (!samples) {
+        return value;
+    }
+    return (estimate * ADAPTIVE_HISTORY + value) / (ADAPTIVE_HISTORY + 1);
+}
+
+/**
+ * adaptive_choose: choose the method for the next packet
+ *
+ * Returns the index of the method in adaptive_methods
+ *
+ * @a: adaptive data of the channel
+ */
+static int adaptive_choose(struct adaptive_data *a)
+{
+    double cost, best_cost = 0;
+    int best = 0;
+    int i;
+
+    a->packets++;
+
+    /* Measure every method once before trusting the estimates */
+    for (i = 0; i < ADAPTIVE_METHODS; i++) {
+        if (!a->method[i].samples) {
+            return i;
+        }
+    }
+
+    if (a->packets % ADAPTIVE_PROBE_INTERVAL == 0) {
+        a->probe = (a->probe + 1) % ADAPTIVE_METHODS;
+        return a->probe;
+    }
+
+    for (i = 0; i < ADAPTIVE_METHODS; i++) {
+        struct adaptive_method *m = &a->method[i];
+
+        cost = m->cpu_cost + m->ratio * a->net_cost;
+        if (i == 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+/* Multifd adaptive compression */
+
+/**
+ * adaptive_send_cleanup_methods: cleanup the first methods of a channel
+ *
+ * @p: Params for the channel that we are using
+ * @a: adaptive data of the channel
+ * @count: number of methods to cleanup
+ * @errp: pointer to an error
+ */
+static void adaptive_send_cleanup_methods(MultiFDSendParams *p,
+                                          struct adaptive_data *a, int count,
+                                          Error **errp)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        p->data = a->method[i].data;
+        a->method[i].ops->send_cleanup(p, errp);
+    }
+    p->data = NULL;
+    g_free(a);
+}
+
+/**
+ * adaptive_send_setup: setup send side
+ *
+ * Setup every method that the channel can choose.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int adaptive_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct adaptive_data *a = g_new0(struct adaptive_data, 1);
+    int i;
+
+    for (i = 0; i < ADAPTIVE_METHODS; i++) {
+        struct adaptive_method *m = &a->method[i];
+
+        m->ops = multifd_get_ops(adaptive_methods[i].method);
+        p->data = NULL;
+        if (m->ops->send_setup(p, errp)) {
+            adaptive_send_cleanup_methods(p, a, i, NULL);
+            return -1;
+        }
+        m->data = p->data;
+    }
+    p->data = a;
+    return 0;
+}
+
+/**
+ * adaptive_send_cleanup: cleanup send side
+ *
+ * Cleanup every method and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void adaptive_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct adaptive_data *a = p->data;
+
+    if (a) {
+        adaptive_send_cleanup_methods(p, a, ADAPTIVE_METHODS, errp);
+    }
+}
+
+/**
+ * adaptive_send_prepare: prepare data to be able to send
+ *
+ * Choose the method for the packet and let it prepare the data.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int adaptive_send_prepare(MultiFDSendParams *p, uint32_t used,
+                                 Error **errp)
+{
+    struct adaptive_data *a = p->data;
+    struct adaptive_method *m;
+    uint64_t size = (uint64_t)used * qemu_target_page_size();
+    int64_t start, ns;
+    int ret;
+
+    a->current = adaptive_choose(a);
+    m = &a->method[a->current];
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    p->data = m->data;
+    ret = m->ops->send_prepare(p, used, errp);
+    p->data = a;
+    if (ret != 0) {
+        return ret;
+    }
+    ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    m->cpu_cost = adaptive_average(m->cpu_cost, (double)ns / size,
+                                   m->samples);
+    m->ratio = adaptive_average(m->ratio,
+                                (double)p->next_packet_size / size,
+                                m->samples);
+    m->samples++;
+
+    trace_multifd_adaptive_send_prepare(p->id,
+        MultiFDCompression_str(adaptive_methods[a->current].method),
+        size, p->next_packet_size, ns);
+    return 0;
+}
+
+/**
+ * adaptive_send_write: do the actual write of the data
+ *
+ * Let the method of the packet write it and measure how long it takes.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int adaptive_send_write(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct adaptive_data *a = p->data;
+    struct adaptive_method *m = &a->method[a->current];
+    int64_t start, ns;
+    int ret;
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    p->data = m->data;
+    ret = m->ops->send_write(p, used, errp);
+    p->data = a;
+    if (ret != 0) {
+        return ret;
+    }
+    ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    if (p->next_packet_size) {
+        a->net_cost = adaptive_average(a->net_cost,
+                                       (double)ns / p->next_packet_size,
+                                       a->net_samples);
+        a->net_samples++;
+    }
+    return 0;
+}
+
+/**
+ * adaptive_recv_cleanup_methods: cleanup the first methods of a channel
+ *
+ * @p: Params for the channel that we are using
+ * @a: adaptive data of the channel
+ * @count: number of methods to cleanup
+ */
+static void adaptive_recv_cleanup_methods(MultiFDRecvParams *p,
+                                          struct adaptive_data *a, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        p->data = a->method[i].data;
+        a->method[i].ops->recv_cleanup(p);
+    }
+    p->data = NULL;
+    g_free(a);
+}
+
+/**
+ * adaptive_recv_setup: setup receive side
+ *
+ * Setup every method that the source can choose.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int adaptive_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct adaptive_data *a = g_new0(struct adaptive_data, 1);
+    int i;
+
+    for (i = 0; i < ADAPTIVE_METHODS; i++) {
+        struct adaptive_method *m = &a->method[i];
+
+        m->ops = multifd_get_ops(adaptive_methods[i].method);
+        p->data = NULL;
+        if (m->ops->recv_setup(p, errp)) {
+            adaptive_recv_cleanup_methods(p, a, i);
+            return -1;
+        }
+        m->data = p->data;
+    }
+    p->data = a;
+    return 0;
+}
+
+/**
+ * adaptive_recv_cleanup: cleanup receive side
+ *
+ * Cleanup every method and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void adaptive_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct adaptive_data *a = p->data;
+
+    if (a) {
+        adaptive_recv_cleanup_methods(p, a, ADAPTIVE_METHODS);
+    }
+}
+
+/**
+ * adaptive_recv_pages: read the data from the channel into actual pages
+ *
+ * Let the method that the packet was sent with read it.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int adaptive_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                               Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct adaptive_data *a = p->data;
+    struct adaptive_method *m;
+    int ret;
+    int i;
+
+    for (i = 0; i < ADAPTIVE_METHODS; i++) {
+        if (adaptive_methods[i].flag == flags) {
+            break;
+        }
+    }
+    if (i == ADAPTIVE_METHODS) {
+        error_setg(errp, "multifd %d: flags received %x are not supported "
+                   "by adaptive compression", p->id, flags);
+        return -1;
+    }
+
+    m = &a->method[i];
+    p->data = m->data;
+    ret = m->ops->recv_pages(p, used, errp);
+    p->data = a;
+    return ret;
+}
+
+static MultiFDMethods multifd_adaptive_ops = {
+    .send_setup = adaptive_send_setup,
+    .send_cleanup = adaptive_send_cleanup,
+    .send_prepare = adaptive_send_prepare,
+    .send_write = adaptive_send_write,
+    .recv_setup = adaptive_recv_setup,
+    .recv_cleanup = adaptive_recv_cleanup,
+    .recv_pages = adaptive_recv_pages
+};
+
+static void multifd_adaptive_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_ADAPTIVE, &multifd_adaptive_ops);
+}
+
+migration_init(multifd_adaptive_register);
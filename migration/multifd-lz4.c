@@ -0,0 +1,280 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Every page is compressed on its own, so that the channels don't need to
+ * keep a history.  In the compressed buffer, each page is a 32 bit big
+ * endian size followed by that many bytes.  A page that does not shrink is
+ * stored as it is, with its full size.
+ */
+#define LZ4_PAGE_HEADER_SIZE sizeof(uint32_t)
+
+struct lz4_data {
+    /* compression state */
+    void *state;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+static struct lz4_data *lz4_data_new(bool send)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    /* We will never have more than page_count pages */
+    z->zbuff_len = page_count *
+                   (qemu_target_page_size() + LZ4_PAGE_HEADER_SIZE);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (send && z->zbuff) {
+        z->state = g_try_malloc(LZ4_sizeofState());
+    }
+    if (!z->zbuff || (send && !z->state)) {
+        g_free(z->zbuff);
+        g_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static void lz4_data_free(struct lz4_data *z)
+{
+    if (z) {
+        g_free(z->state);
+        g_free(z->zbuff);
+        g_free(z);
+    }
+}
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Allocate the compression state and buffer of the channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = lz4_data_new(true);
+
+    if (!z) {
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare data to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct lz4_data *z = p->data;
+    uint8_t *out = z->zbuff;
+    uint32_t i;
+    int size;
+
+    for (i = 0; i < used; i++) {
+        uint8_t *dst = out + LZ4_PAGE_HEADER_SIZE;
+
+        /* Returns 0 if the page doesn't fit into less than its size */
+        size = LZ4_compress_fast_extState(z->state, iov[i].iov_base,
+                                          (char *)dst, iov[i].iov_len,
+                                          iov[i].iov_len - 1, 1);
+        if (size <= 0) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            size = iov[i].iov_len;
+        }
+        stl_be_p(out, size);
+        out = dst + size;
+    }
+    p->next_packet_size = out - z->zbuff;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_send_write: do the actual write of the data
+ *
+ * Do the actual write of the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Allocate the buffer of the channel.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = lz4_data_new(false);
+
+    if (!z) {
+        error_setg(errp, "multifd %d: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lz4_data *z = p->data;
+    uint8_t *in = z->zbuff;
+    uint8_t *end = z->zbuff + in_size;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %d: packet size received %d exceeds %d",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t size;
+
+        if (end - in < LZ4_PAGE_HEADER_SIZE) {
+            break;
+        }
+        size = ldl_be_p(in);
+        in += LZ4_PAGE_HEADER_SIZE;
+        if (size > end - in || size > iov->iov_len) {
+            break;
+        }
+
+        if (size == iov->iov_len) {
+            memcpy(iov->iov_base, in, size);
+        } else {
+            ret = LZ4_decompress_safe((const char *)in, iov->iov_base, size,
+                                      iov->iov_len);
+            if (ret != iov->iov_len) {
+                error_setg(errp, "multifd %d: decompress of page %d failed",
+                           p->id, i);
+                return -1;
+            }
+        }
+        in += size;
+    }
+    if (i != used || in != end) {
+        error_setg(errp, "multifd %d: packet size received %d does not match "
+                   "%d pages", p->id, in_size, used);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .send_write = lz4_send_write,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -12,6 +12,9 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -22,6 +25,7 @@
 #include "socket.h"
 #include "qemu-file.h"
 #include "trace.h"
+#include "xbzrle.h"
 #include "multifd.h"
 
 /* Multiple fd's */
@@ -172,6 +176,67 @@ void multifd_register_ops(int method, MultiFDMethods *ops)
     multifd_ops[method] = ops;
 }
 
+MultiFDMethods *multifd_get_ops(int method)
+{
+    assert(0 <= method && method < MULTIFD_COMPRESSION__MAX);
+    return multifd_ops[method];
+}
+
+/* Packets sent in the current or last migration, per compression method */
+static MultiFDCodecCounters multifd_codec_counters[MULTIFD_CODECS];
+
+static int multifd_codec_method(int codec)
+{
+    switch (codec << 1) {
+    case MULTIFD_FLAG_NOCOMP:
+        return MULTIFD_COMPRESSION_NONE;
+    case MULTIFD_FLAG_ZLIB:
+        return MULTIFD_COMPRESSION_ZLIB;
+#ifdef CONFIG_ZSTD
+    case MULTIFD_FLAG_ZSTD:
+        return MULTIFD_COMPRESSION_ZSTD;
+#endif
+#ifdef CONFIG_LZ4
+    case MULTIFD_FLAG_LZ4:
+        return MULTIFD_COMPRESSION_LZ4;
+#endif
+    default:
+        return -1;
+    }
+}
+
+/**
+ * multifd_fill_info: report the packets sent with each compression method
+ *
+ * With the adaptive method, this shows how often it chose each method.
+ *
+ * @info: where to add the statistics
+ */
+void multifd_fill_info(MigrationInfo *info)
+{
+    int i;
+
+    for (i = MULTIFD_CODECS - 1; i >= 0; i--) {
+        MultiFDCodecCounters *c = &multifd_codec_counters[i];
+        MultiFDCompressionStatsList *entry;
+        int method = multifd_codec_method(i);
+
+        if (!c->packets || method < 0) {
+            continue;
+        }
+
+        entry = g_new0(MultiFDCompressionStatsList, 1);
+        entry->value = g_new0(MultiFDCompressionStats, 1);
+        entry->value->method = method;
+        entry->value->packets = c->packets;
+        entry->value->pages = c->pages;
+        entry->value->compressed_size = c->bytes;
+        entry->next = info->multifd_compression;
+        info->multifd_compression = entry;
+        info->has_multifd_compression = true;
+    }
+}
+
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg = {};
@@ -241,6 +306,8 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
     pages->allocated = size;
     pages->iov = g_new0(struct iovec, size);
     pages->offset = g_new0(ram_addr_t, size);
+    pages->zero = bitmap_new(ROUND_UP(size, 64));
+    pages->encoded = bitmap_new(ROUND_UP(size, 64));
 
     return pages;
 }
@@ -249,15 +316,65 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
     pages->allocated = 0;
+    pages->normal = 0;
     pages->packet_num = 0;
+    pages->xbzrle = false;
+    pages->xbzrle_age = 0;
     pages->block = NULL;
     g_free(pages->iov);
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    g_free(pages->zero);
+    pages->zero = NULL;
+    g_free(pages->encoded);
+    pages->encoded = NULL;
     g_free(pages);
 }
 
+static uint32_t multifd_packet_bitmap_len(uint32_t page_count)
+{
+    return DIV_ROUND_UP(page_count, 64) * sizeof(uint64_t);
+}
+
+static uint32_t multifd_packet_len(uint32_t page_count)
+{
+    uint32_t len = sizeof(MultiFDPacket_t) + sizeof(uint64_t) * page_count;
+
+    if (migrate_multifd_zero_page()) {
+        len += multifd_packet_bitmap_len(page_count);
+    }
+    if (migrate_multifd_xbzrle()) {
+        len += multifd_packet_bitmap_len(page_count);
+    }
+    return len;
+}
+
+static unsigned long *multifd_packet_zero_bitmap(MultiFDPacket_t *packet,
+                                                 uint32_t pages_alloc)
+{
+    return (unsigned long *)((uint8_t *)packet + sizeof(MultiFDPacket_t) +
+                             sizeof(uint64_t) * pages_alloc);
+}
+
+static unsigned long *multifd_packet_xbzrle_bitmap(MultiFDPacket_t *packet,
+                                                   uint32_t pages_alloc)
+{
+    uint8_t *bitmap = (uint8_t *)multifd_packet_zero_bitmap(packet,
+                                                            pages_alloc);
+
+    if (migrate_multifd_zero_page()) {
+        bitmap += multifd_packet_bitmap_len(pages_alloc);
+    }
+    return (unsigned long *)bitmap;
+}
+
+/* Size of the buffer for the XBZRLE encoded pages of a packet */
+static uint32_t multifd_xbzrle_buf_len(uint32_t page_count)
+{
+    return page_count * (qemu_target_page_size() + sizeof(uint16_t));
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -268,6 +385,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->xbzrle_size = cpu_to_be32(p->xbzrle_size);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -279,6 +397,16 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    if (migrate_multifd_zero_page()) {
+        bitmap_to_le(multifd_packet_zero_bitmap(packet, p->pages->allocated),
+                     p->pages->zero, ROUND_UP(p->pages->allocated, 64));
+    }
+    if (migrate_multifd_xbzrle()) {
+        bitmap_to_le(multifd_packet_xbzrle_bitmap(packet,
+                                                  p->pages->allocated),
+                     p->pages->encoded, ROUND_UP(p->pages->allocated, 64));
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -324,6 +452,11 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     if (packet->pages_alloc > p->pages->allocated) {
         multifd_pages_clear(p->pages);
         p->pages = multifd_pages_init(packet->pages_alloc);
+        if (migrate_multifd_xbzrle()) {
+            g_free(p->xbzrle_buf);
+            p->xbzrle_buf = g_malloc(multifd_xbzrle_buf_len(
+                                         packet->pages_alloc));
+        }
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
@@ -337,10 +470,40 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
+    p->xbzrle_size = 0;
+    if (migrate_multifd_xbzrle()) {
+        p->xbzrle_size = be32_to_cpu(packet->xbzrle_size);
+        if (p->xbzrle_size > multifd_xbzrle_buf_len(p->pages->used)) {
+            error_setg(errp, "multifd: received packet with %d bytes of "
+                       "XBZRLE pages for %d pages", p->xbzrle_size,
+                       p->pages->used);
+            return -1;
+        }
+    }
+
+    p->pages->normal = 0;
     if (p->pages->used == 0) {
         return 0;
     }
 
+    if (migrate_multifd_zero_page() &&
+        multifd_packet_len(packet->pages_alloc) > p->packet_len) {
+        error_setg(errp, "multifd: bitmaps for %d pages exceed the packet",
+                   packet->pages_alloc);
+        return -1;
+    }
+    if (migrate_multifd_zero_page()) {
+        bitmap_from_le(p->pages->zero,
+                       multifd_packet_zero_bitmap(packet, packet->pages_alloc),
+                       ROUND_UP(packet->pages_alloc, 64));
+    }
+    if (migrate_multifd_xbzrle()) {
+        bitmap_from_le(p->pages->encoded,
+                       multifd_packet_xbzrle_bitmap(packet,
+                                                    packet->pages_alloc),
+                       ROUND_UP(packet->pages_alloc, 64));
+    }
+
     /* make sure that ramblock is 0 terminated */
     packet->ramblock[255] = 0;
     block = qemu_ram_block_by_name(packet->ramblock);
@@ -359,9 +522,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = qemu_target_page_size();
+        p->pages->offset[i] = offset;
+        if (migrate_multifd_zero_page() && test_bit(i, p->pages->zero)) {
+            continue;
+        }
+        if (migrate_multifd_xbzrle() && test_bit(i, p->pages->encoded)) {
+            continue;
+        }
+        p->pages->iov[p->pages->normal].iov_base = block->host + offset;
+        p->pages->iov[p->pages->normal].iov_len = qemu_target_page_size();
+        p->pages->normal++;
     }
+    p->pages->block = block;
 
     return 0;
 }
@@ -370,6 +542,13 @@ struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
     MultiFDPages_t *pages;
+    /*
+     * With multifd-xbzrle, the pages that can be XBZRLE encoded are
+     * queued here instead, in one array per channel
+     */
+    MultiFDPages_t **shard_pages;
+    /* a page full of zeroes, for the XBZRLE caches */
+    uint8_t *zero_page;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* send channels ready */
@@ -402,18 +581,180 @@ struct {
  * false.
  */
 
-static int multifd_send_pages(QEMUFile *f)
+/*
+ * With multifd-xbzrle, guest memory is split into shards, each of which
+ * is owned by one channel.  Only that channel sends the pages of the shard
+ * once they can be XBZRLE encoded, so it can keep the XBZRLE cache for
+ * them without locking.  A shard is every Nth chunk of
+ * MULTIFD_XBZRLE_SHARD_SIZE bytes of the ram_addr_t space, where N is the
+ * number of channels.
+ */
+#define MULTIFD_XBZRLE_SHARD_SIZE MULTIFD_PACKET_SIZE
+
+static int multifd_xbzrle_shard(RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t addr = block->offset + offset;
+
+    return addr / MULTIFD_XBZRLE_SHARD_SIZE % migrate_multifd_channels();
+}
+
+/*
+ * The address of a page in the XBZRLE cache of its shard.  The chunks of
+ * other shards are left out, so that the whole cache is used.
+ */
+static uint64_t multifd_xbzrle_cache_addr(RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t addr = block->offset + offset;
+    uint64_t chunk = addr / MULTIFD_XBZRLE_SHARD_SIZE;
+
+    return chunk / migrate_multifd_channels() * MULTIFD_XBZRLE_SHARD_SIZE +
+           addr % MULTIFD_XBZRLE_SHARD_SIZE;
+}
+
+/* Each channel gets a share of xbzrle-cache-size */
+static int64_t multifd_xbzrle_shard_cache_size(int64_t cache_size)
+{
+    int64_t size = pow2floor(cache_size / migrate_multifd_channels());
+
+    return MAX(size, qemu_target_page_size());
+}
+
+/**
+ * multifd_xbzrle_cache_resize: resize the XBZRLE caches of the channels
+ *
+ * The caches can hold the data of pages that are being sent, so each
+ * channel resizes its own cache before it starts its next job.
+ *
+ * @new_size: new size of all the caches together
+ */
+void multifd_xbzrle_cache_resize(int64_t new_size)
+{
+    int i;
+
+    if (!multifd_send_state || !migrate_multifd_xbzrle()) {
+        return;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->new_cache_size = multifd_xbzrle_shard_cache_size(new_size);
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
+/**
+ * multifd_send_account: account what a channel sent
+ *
+ * The migration thread counts every page that it queues as a normal
+ * page.  Correct that for the zero pages that the channel found since
+ * the last call, which were sent without data, and for the XBZRLE
+ * encoded pages, and add up the packets per compression method.
+ *
+ * Must be called with the channel mutex held.
+ *
+ * @f: QEMUFile where to account the transfer
+ * @p: Params for the channel
+ */
+static void multifd_send_account(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint64_t size = p->zero_pages * qemu_target_page_size() +
+                    p->xbzrle_saved;
+    int i;
+
+    for (i = 0; i < MULTIFD_CODECS; i++) {
+        multifd_codec_counters[i].packets += p->codec[i].packets;
+        multifd_codec_counters[i].pages += p->codec[i].pages;
+        multifd_codec_counters[i].bytes += p->codec[i].bytes;
+    }
+    memset(p->codec, 0, sizeof(p->codec));
+
+    xbzrle_counters.pages += p->xbzrle.pages;
+    xbzrle_counters.bytes += p->xbzrle.bytes;
+    xbzrle_counters.cache_miss += p->xbzrle.cache_miss;
+    xbzrle_counters.overflow += p->xbzrle.overflow;
+    memset(&p->xbzrle, 0, sizeof(p->xbzrle));
+
+    qemu_file_update_transfer(f, -(int64_t)size);
+    ram_counters.multifd_bytes -= size;
+    ram_counters.transferred -= size;
+    ram_counters.normal -= p->zero_pages + p->xbzrle_encoded;
+    ram_counters.duplicate += p->zero_pages;
+    p->zero_pages = 0;
+    p->xbzrle_encoded = 0;
+    p->xbzrle_saved = 0;
+}
+
+/**
+ * multifd_send_wait_channel: wait until a channel can take a job
+ *
+ * channels_ready is posted whenever a channel finishes a job.  Posts for
+ * the other channels are given back once @p is free.
+ *
+ * Returns 0 with the mutex of @p held, or -1 if the channel quit
+ *
+ * @p: Params for the channel
+ */
+static int multifd_send_wait_channel(MultiFDSendParams *p)
+{
+    int skipped = 0;
+    int ret = 0;
+
+    while (true) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit!", __func__, p->id);
+            qemu_mutex_unlock(&p->mutex);
+            ret = -1;
+            break;
+        }
+        if (!p->pending_job) {
+            p->pending_job++;
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+        skipped++;
+    }
+
+    while (skipped--) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+    return ret;
+}
+
+/**
+ * multifd_send_pages: send the queued pages
+ *
+ * Returns 1 for success or -1 for error
+ *
+ * @f: QEMUFile where to account the transfer
+ * @shard: -1 to send multifd_send_state->pages on the next free channel,
+ *         or the shard whose XBZRLE pages are sent on its channel
+ */
+static int multifd_send_pages(QEMUFile *f, int shard)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDPages_t **queue = shard < 0 ? &multifd_send_state->pages :
+                             &multifd_send_state->shard_pages[shard];
+    MultiFDPages_t *pages = *queue;
     uint64_t transferred;
 
     if (atomic_read(&multifd_send_state->exiting)) {
         return -1;
     }
 
+    if (shard >= 0) {
+        p = &multifd_send_state->params[shard];
+        if (multifd_send_wait_channel(p) < 0) {
+            return -1;
+        }
+        goto found;
+    }
+
     qemu_sem_wait(&multifd_send_state->channels_ready);
     /*
      * next_channel can remain from a previous migration that was
@@ -437,11 +778,14 @@ static int multifd_send_pages(QEMUFile *f)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+
+found:
     assert(!p->pages->used);
     assert(!p->pages->block);
+    multifd_send_account(f, p);
 
     p->packet_num = multifd_send_state->packet_num++;
-    multifd_send_state->pages = p->pages;
+    *queue = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * qemu_target_page_size()
                 + p->packet_len;
@@ -454,12 +798,27 @@ static int multifd_send_pages(QEMUFile *f)
     return 1;
 }
 
-int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+/**
+ * multifd_queue_page: queue a page to be sent by the channels
+ *
+ * Returns 1 for success or -1 for error
+ *
+ * @f: QEMUFile where to account the transfer
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ * @xbzrle: whether the page can be XBZRLE encoded, only with multifd-xbzrle
+ */
+int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                       bool xbzrle)
 {
-    MultiFDPages_t *pages = multifd_send_state->pages;
+    int shard = xbzrle ? multifd_xbzrle_shard(block, offset) : -1;
+    MultiFDPages_t *pages = xbzrle ? multifd_send_state->shard_pages[shard] :
+                            multifd_send_state->pages;
 
     if (!pages->block) {
         pages->block = block;
+        pages->xbzrle = xbzrle;
+        pages->xbzrle_age = ram_counters.dirty_sync_count;
     }
 
     if (pages->block == block) {
@@ -473,12 +832,12 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
         }
     }
 
-    if (multifd_send_pages(f) < 0) {
+    if (multifd_send_pages(f, shard) < 0) {
         return -1;
     }
 
     if (pages->block != block) {
-        return  multifd_queue_page(f, block, offset);
+        return  multifd_queue_page(f, block, offset, xbzrle);
     }
 
     return 1;
@@ -553,6 +912,14 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        if (p->cache) {
+            cache_fini(p->cache);
+            p->cache = NULL;
+        }
+        g_free(p->xbzrle_page);
+        p->xbzrle_page = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -560,6 +927,15 @@ void multifd_save_cleanup(void)
         }
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    if (multifd_send_state->shard_pages) {
+        for (i = 0; i < migrate_multifd_channels(); i++) {
+            multifd_pages_clear(multifd_send_state->shard_pages[i]);
+        }
+        g_free(multifd_send_state->shard_pages);
+        multifd_send_state->shard_pages = NULL;
+    }
+    g_free(multifd_send_state->zero_page);
+    multifd_send_state->zero_page = NULL;
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -576,11 +952,20 @@ void multifd_send_sync_main(QEMUFile *f)
         return;
     }
     if (multifd_send_state->pages->used) {
-        if (multifd_send_pages(f) < 0) {
+        if (multifd_send_pages(f, -1) < 0) {
             error_report("%s: multifd_send_pages fail", __func__);
             return;
         }
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        if (multifd_send_state->shard_pages &&
+            multifd_send_state->shard_pages[i]->used) {
+            if (multifd_send_pages(f, i) < 0) {
+                error_report("%s: multifd_send_pages fail", __func__);
+                return;
+            }
+        }
+    }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
@@ -608,10 +993,142 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account(f, p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: find the zero pages of a packet
+ *
+ * Marks the zero pages in the bitmap of the packet and moves the
+ * iovecs of the other pages to the front, so that the compression
+ * methods only see pages with data.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    pages->normal = 0;
+    for (i = 0; i < pages->used; i++) {
+        struct iovec *iov = &pages->iov[i];
+
+        if (buffer_is_zero(iov->iov_base, iov->iov_len)) {
+            set_bit(i, pages->zero);
+        } else {
+            clear_bit(i, pages->zero);
+            pages->iov[pages->normal++] = *iov;
+        }
+    }
+    p->zero_pages += pages->used - pages->normal;
+}
+
+/**
+ * multifd_send_xbzrle_resize: apply a new size of the XBZRLE cache
+ *
+ * The cached pages are lost, as with the cache of the migration thread.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_xbzrle_resize(MultiFDSendParams *p)
+{
+    Error *local_err = NULL;
+    PageCache *cache;
+
+    cache = cache_init(p->new_cache_size, qemu_target_page_size(),
+                       &local_err);
+    if (!cache) {
+        warn_report_err(local_err);
+        p->new_cache_size = p->cache_size;
+        return;
+    }
+    cache_fini(p->cache);
+    p->cache = cache;
+    p->cache_size = p->new_cache_size;
+}
+
+/**
+ * multifd_send_xbzrle: XBZRLE encode the pages of a packet
+ *
+ * The pages that are in the cache of the channel are encoded against
+ * the cached data into p->xbzrle_buf, and marked in the encoded bitmap.
+ * The iovecs of the other pages are moved to the front, so that the
+ * compression methods only see those.
+ *
+ * The destination must end up with exactly the cached data, so pages
+ * that are sent whole and in the cache are sent from the cache, like
+ * ram_save_page() does.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_xbzrle(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint8_t *out = p->xbzrle_buf;
+    uint32_t i, next = 0;
+    int len;
+
+    pages->normal = 0;
+    for (i = 0; i < pages->used; i++) {
+        uint64_t addr = multifd_xbzrle_cache_addr(pages->block,
+                                                  pages->offset[i]);
+        struct iovec iov;
+        uint8_t *cached;
+
+        clear_bit(i, pages->encoded);
+        if (migrate_multifd_zero_page() && test_bit(i, pages->zero)) {
+            /* A previous version of the page must not stay in the cache */
+            cache_insert(p->cache, addr, multifd_send_state->zero_page,
+                         pages->xbzrle_age);
+            continue;
+        }
+        iov = pages->iov[next++];
+
+        if (!cache_is_cached(p->cache, addr, pages->xbzrle_age)) {
+            p->xbzrle.cache_miss++;
+            if (cache_insert(p->cache, addr, iov.iov_base,
+                             pages->xbzrle_age) == 0) {
+                iov.iov_base = get_cached_data(p->cache, addr);
+            }
+            pages->iov[pages->normal++] = iov;
+            continue;
+        }
+
+        /* Counted even if the page is unchanged, see save_xbzrle_page() */
+        p->xbzrle.pages++;
+        cached = get_cached_data(p->cache, addr);
+        memcpy(p->xbzrle_page, iov.iov_base, page_size);
+        len = xbzrle_encode_buffer(cached, p->xbzrle_page, page_size,
+                                   out + sizeof(uint16_t), page_size);
+        if (len != 0) {
+            memcpy(cached, p->xbzrle_page, page_size);
+        }
+        if (len < 0) {
+            p->xbzrle.overflow++;
+            p->xbzrle.bytes += page_size;
+            iov.iov_base = cached;
+            pages->iov[pages->normal++] = iov;
+            continue;
+        }
+
+        /* An unchanged page is sent with no XBZRLE data */
+        stw_be_p(out, len);
+        out += sizeof(uint16_t) + len;
+        set_bit(i, pages->encoded);
+        p->xbzrle.bytes += sizeof(uint16_t) + len;
+        p->xbzrle_encoded++;
+        p->xbzrle_saved += page_size - sizeof(uint16_t) - len;
+    }
+    p->xbzrle_size = out - p->xbzrle_buf;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -639,11 +1156,30 @@ static void *multifd_send_thread(void *opaque)
 
         if (p->pending_job) {
             uint32_t used = p->pages->used;
+            uint32_t normal;
+            uint32_t xbzrle_size;
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
-            if (used) {
-                ret = multifd_send_state->ops->send_prepare(p, used,
+            if (migrate_multifd_zero_page()) {
+                multifd_send_zero_page_detect(p);
+            } else {
+                p->pages->normal = used;
+            }
+            p->xbzrle_size = 0;
+            if (p->pages->xbzrle) {
+                if (p->new_cache_size != p->cache_size) {
+                    multifd_send_xbzrle_resize(p);
+                }
+                multifd_send_xbzrle(p);
+            } else if (migrate_multifd_xbzrle()) {
+                bitmap_clear(p->pages->encoded, 0, used);
+            }
+            normal = p->pages->normal;
+
+            p->next_packet_size = 0;
+            if (normal) {
+                ret = multifd_send_state->ops->send_prepare(p, normal,
                                                             &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
@@ -651,15 +1187,25 @@ static void *multifd_send_thread(void *opaque)
                 }
             }
             multifd_send_fill_packet(p);
+            if (normal) {
+                MultiFDCodecCounters *c;
+
+                c = &p->codec[MULTIFD_FLAG_CODEC(p->flags)];
+                c->packets++;
+                c->pages += normal;
+                c->bytes += p->next_packet_size;
+            }
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
             p->pages->used = 0;
             p->pages->block = NULL;
+            p->pages->xbzrle = false;
+            xbzrle_size = p->xbzrle_size;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
-                               p->next_packet_size);
+            trace_multifd_send(p->id, packet_num, used, normal, flags,
+                               p->next_packet_size, xbzrle_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
@@ -667,8 +1213,17 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
+            if (normal) {
+                ret = multifd_send_state->ops->send_write(p, normal,
+                                                          &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+
+            if (xbzrle_size) {
+                ret = qio_channel_write_all(p->c, (void *)p->xbzrle_buf,
+                                            xbzrle_size, &local_err);
                 if (ret != 0) {
                     break;
                 }
@@ -746,6 +1301,30 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     }
 }
 
+/**
+ * multifd_send_xbzrle_setup: setup the XBZRLE cache of a channel
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_send_xbzrle_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+
+    p->cache_size = multifd_xbzrle_shard_cache_size(
+                        migrate_xbzrle_cache_size());
+    p->new_cache_size = p->cache_size;
+    p->cache = cache_init(p->cache_size, qemu_target_page_size(), errp);
+    if (!p->cache) {
+        return -1;
+    }
+    p->xbzrle_page = g_malloc(qemu_target_page_size());
+    p->xbzrle_buf = g_malloc(multifd_xbzrle_buf_len(page_count));
+    return 0;
+}
+
 int multifd_save_setup(Error **errp)
 {
     int thread_count;
@@ -762,6 +1341,16 @@ int multifd_save_setup(Error **errp)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     atomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    memset(multifd_codec_counters, 0, sizeof(multifd_codec_counters));
+    if (migrate_multifd_xbzrle()) {
+        multifd_send_state->shard_pages = g_new0(MultiFDPages_t *,
+                                                 thread_count);
+        for (i = 0; i < thread_count; i++) {
+            multifd_send_state->shard_pages[i] =
+                multifd_pages_init(page_count);
+        }
+        multifd_send_state->zero_page = g_malloc0(qemu_target_page_size());
+    }
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -773,8 +1362,7 @@ int multifd_save_setup(Error **errp)
         p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
+        p->packet_len = multifd_packet_len(page_count);
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
@@ -792,6 +1380,13 @@ int multifd_save_setup(Error **errp)
             error_propagate(errp, local_err);
             return ret;
         }
+        if (migrate_multifd_xbzrle()) {
+            ret = multifd_send_xbzrle_setup(p, &local_err);
+            if (ret) {
+                error_propagate(errp, local_err);
+                return ret;
+            }
+        }
     }
     return 0;
 }
@@ -877,6 +1472,8 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->xbzrle_buf);
+        p->xbzrle_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -915,6 +1512,84 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_zero_pages: clear the zero pages of a packet
+ *
+ * Pages that are already zero are not written, so that they are not
+ * allocated on the destination.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    for (i = 0; i < pages->used; i++) {
+        if (test_bit(i, pages->zero)) {
+            ram_handle_compressed(pages->block->host + pages->offset[i], 0,
+                                  qemu_target_page_size());
+        }
+    }
+}
+
+/**
+ * multifd_recv_xbzrle_pages: read and decode the XBZRLE pages of a packet
+ *
+ * Each page is decoded on top of its current contents, which are the
+ * contents that the source has in its cache.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int multifd_recv_xbzrle_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint8_t *in = p->xbzrle_buf;
+    uint8_t *end = p->xbzrle_buf + p->xbzrle_size;
+    uint32_t i;
+    int ret;
+
+    ret = qio_channel_read_all(p->c, (void *)p->xbzrle_buf, p->xbzrle_size,
+                               errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < pages->used; i++) {
+        uint16_t len;
+
+        if (!test_bit(i, pages->encoded)) {
+            continue;
+        }
+        if (end - in < sizeof(uint16_t)) {
+            break;
+        }
+        len = lduw_be_p(in);
+        in += sizeof(uint16_t);
+        if (len > end - in || len > page_size) {
+            break;
+        }
+        if (len && xbzrle_decode_buffer(in, len,
+                                        pages->block->host + pages->offset[i],
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %d: failed to decode XBZRLE page "
+                       "at offset " RAM_ADDR_FMT, p->id, pages->offset[i]);
+            return -1;
+        }
+        in += len;
+    }
+    if (i != pages->used || in != end) {
+        error_setg(errp, "multifd %d: %d bytes of XBZRLE pages received do "
+                   "not match the packet", p->id, p->xbzrle_size);
+        return -1;
+    }
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -926,6 +1601,8 @@ static void *multifd_recv_thread(void *opaque)
 
     while (true) {
         uint32_t used;
+        uint32_t normal;
+        uint32_t xbzrle_size;
         uint32_t flags;
 
         if (p->quit) {
@@ -949,21 +1626,32 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        normal = p->pages->normal;
+        xbzrle_size = p->xbzrle_size;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, used, normal, flags,
+                           p->next_packet_size, xbzrle_size);
         p->num_packets++;
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
+        if (normal) {
+            ret = multifd_recv_state->ops->recv_pages(p, normal, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+        if (xbzrle_size) {
+            ret = multifd_recv_xbzrle_pages(p, &local_err);
             if (ret != 0) {
                 break;
             }
         }
+        if (migrate_multifd_zero_page() && used > normal) {
+            multifd_recv_zero_pages(p);
+        }
 
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
@@ -1009,9 +1697,11 @@ int multifd_load_setup(Error **errp)
         p->quit = false;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
+        p->packet_len = multifd_packet_len(page_count);
         p->packet = g_malloc0(p->packet_len);
+        if (migrate_multifd_xbzrle()) {
+            p->xbzrle_buf = g_malloc(multifd_xbzrle_buf_len(page_count));
+        }
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
 
@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_MULTIFD_H
 #define QEMU_MIGRATION_MULTIFD_H
 
+#include "page_cache.h"
+
 int multifd_save_setup(Error **errp);
 void multifd_save_cleanup(void);
 int multifd_load_setup(Error **errp);
@@ -21,7 +23,10 @@ bool multifd_recv_all_channels_created(void);
 bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
-int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                       bool xbzrle);
+void multifd_fill_info(MigrationInfo *info);
+void multifd_xbzrle_cache_resize(int64_t new_size);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,10 +37,29 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+
+/* Number of values of the compression flags */
+#define MULTIFD_CODECS 8
+#define MULTIFD_FLAG_CODEC(flags) \
+    (((flags) & MULTIFD_FLAG_COMPRESSION_MASK) >> 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
+/*
+ * With the multifd-zero-page capability, the offsets of a packet are
+ * followed by a little endian bitmap with one bit per allocated page
+ * (rounded up to 64 bits) that marks the zero pages.  Zero pages have no
+ * data in the stream.
+ *
+ * With the multifd-xbzrle capability, another bitmap of the same size
+ * follows, that marks the XBZRLE encoded pages.  They are not part of the
+ * data of the compression method, but come after it as @xbzrle_size
+ * bytes.  Each encoded page is a 16 bit big endian length followed by that
+ * many bytes of XBZRLE data, in the order of the offsets.
+ */
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -46,7 +70,10 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* size of the XBZRLE encoded pages after the data of the packet */
+    uint32_t xbzrle_size;
+    uint32_t unused32;     /* Reserved for future use */
+    uint64_t unused[3];    /* Reserved for future use */
     char ramblock[256];
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -56,15 +83,37 @@ typedef struct {
     uint32_t used;
     /* number of allocated pages */
     uint32_t allocated;
+    /* number of used pages that are not zero pages */
+    uint32_t normal;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* offset of each page */
     ram_addr_t *offset;
-    /* pointer to each page */
+    /*
+     * pointer to each page; once the zero pages are known, only the
+     * first @normal entries are used, for the pages with data
+     */
     struct iovec *iov;
+    /* zero pages among the used pages */
+    unsigned long *zero;
+    /* XBZRLE encoded pages among the used pages */
+    unsigned long *encoded;
+    /* can the pages be XBZRLE encoded */
+    bool xbzrle;
+    /* bitmap generation when the pages were queued, for the XBZRLE cache */
+    uint64_t xbzrle_age;
     RAMBlock *block;
 } MultiFDPages_t;
 
+typedef struct {
+    /* packets with data that were sent with the compression method */
+    uint64_t packets;
+    /* pages in these packets, without zero pages */
+    uint64_t pages;
+    /* size of the page data after compression */
+    uint64_t bytes;
+} MultiFDCodecCounters;
+
 typedef struct {
     /* this fields are not changed once the thread is created */
     /* channel number */
@@ -102,6 +151,27 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found that the migration thread has not accounted yet */
+    uint64_t zero_pages;
+    /* same for the packets, indexed by MULTIFD_FLAG_CODEC() */
+    MultiFDCodecCounters codec[MULTIFD_CODECS];
+    /* XBZRLE cache of the pages of the shard of this channel */
+    PageCache *cache;
+    /* size of the cache */
+    int64_t cache_size;
+    /* size that the cache should have, it is resized before the next job */
+    int64_t new_cache_size;
+    /* copy of the page that is being encoded */
+    uint8_t *xbzrle_page;
+    /* XBZRLE encoded pages of the packet */
+    uint8_t *xbzrle_buf;
+    /* size of the encoded pages */
+    uint32_t xbzrle_size;
+    /* XBZRLE statistics that the migration thread has not accounted yet */
+    XBZRLECacheStats xbzrle;
+    /* same for the pages sent encoded, and the bytes that saved */
+    uint64_t xbzrle_encoded;
+    uint64_t xbzrle_saved;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -137,6 +207,10 @@ typedef struct {
     /* thread local variables */
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
+    /* size of the XBZRLE encoded pages of the packet */
+    uint32_t xbzrle_size;
+    /* XBZRLE encoded pages of the packet */
+    uint8_t *xbzrle_buf;
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
@@ -165,6 +239,7 @@ typedef struct {
 } MultiFDMethods;
 
 void multifd_register_ops(int method, MultiFDMethods *ops);
+MultiFDMethods *multifd_get_ops(int method);
 
 #endif
 
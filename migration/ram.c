@@ -136,6 +136,9 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
         return -1;
     }
 
+    /* The multifd channels compare with the size of their own caches */
+    multifd_xbzrle_cache_resize(new_size);
+
     if (new_size == migrate_xbzrle_cache_size()) {
         /* nothing to do */
         return 0;
@@ -907,7 +910,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
         return;
     }
 
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || migrate_multifd_xbzrle()) {
         double encoded_size, unencoded_size;
 
         xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
@@ -1210,10 +1213,20 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
+/*
+ * With multifd-xbzrle, the multifd channels XBZRLE encode the pages after
+ * the bulk stage, like ram_save_page() does
+ */
+static bool multifd_use_xbzrle(RAMState *rs)
+{
+    return migrate_multifd_xbzrle() && !rs->ram_bulk_stage;
+}
+
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
-    if (multifd_queue_page(rs->f, block, offset) < 0) {
+    if (multifd_queue_page(rs->f, block, offset,
+                           multifd_use_xbzrle(rs)) < 0) {
         return -1;
     }
     ram_counters.normal++;
@@ -1660,6 +1673,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -1670,6 +1684,25 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy as one whole host page should be placed
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd()
+                  && !migration_in_postcopy();
+
+    /*
+     * The multifd channels can look for zero pages in parallel.  This is
+     * always the case with multifd-xbzrle, because the channels must see all
+     * the pages once they keep XBZRLE caches, or the caches would miss the
+     * pages that became zero.
+     */
+    if (use_multifd && migrate_multifd_zero_page()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -1684,14 +1717,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,7 +127,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+static inline QEMU_ALWAYS_INLINE
+int xbzrle_decode_runs(uint8_t *src, int slen, uint8_t *dst, int dlen,
+                       void (*copy)(uint8_t *, const uint8_t *, uint32_t))
 {
     int i = 0, d = 0;
     int ret;
@@ -167,10 +170,377 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        memcpy(dst + d, src + i, count);
+        copy(dst + d, src + i, count);
         d += count;
         i += count;
     }
 
     return d;
 }
+
+static void xbzrle_copy_int(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static int xbzrle_decode_buffer_int(uint8_t *src, int slen, uint8_t *dst,
+                                    int dlen)
+{
+    return xbzrle_decode_runs(src, slen, dst, dlen, xbzrle_copy_int);
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+/*
+ * The vector encoders compare 64 bytes at a time and get a mask with a bit
+ * set for each unchanged byte.  The runs are then found by counting the
+ * trailing ones and zeroes of the mask.  They produce the same output as
+ * xbzrle_encode_buffer_int(), including when they give up on overflow.
+ */
+typedef struct XBZRLEEncoder {
+    uint8_t *new_buf;
+    uint8_t *dst;
+    int dlen;
+    int d;
+    /* is the current run a zrun */
+    bool zrun;
+    uint32_t run_len;
+    /* offset of the current nzrun in new_buf */
+    int nzrun_start;
+} XBZRLEEncoder;
+
+static inline QEMU_ALWAYS_INLINE
+bool xbzrle_encoder_init(XBZRLEEncoder *e, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    *e = (XBZRLEEncoder) {
+        .new_buf = new_buf,
+        .dst = dst,
+        .dlen = dlen,
+        .zrun = true,
+    };
+    /* overflow */
+    return !slen || dlen >= 2;
+}
+
+static int xbzrle_encode_nzrun(XBZRLEEncoder *e)
+{
+    e->d += uleb128_encode_small(e->dst + e->d, e->run_len);
+    /* overflow */
+    if (e->d + e->run_len > e->dlen) {
+        return -1;
+    }
+    memcpy(e->dst + e->d, e->new_buf + e->nzrun_start, e->run_len);
+    e->d += e->run_len;
+    return 0;
+}
+
+/*
+ * Continue the runs with the @n bytes at offset @i, where bit k of @eq is
+ * set if byte i + k is unchanged.  Returns -1 on overflow.
+ */
+static int xbzrle_encode_runs(XBZRLEEncoder *e, int i, uint64_t eq, int n)
+{
+    int pos = 0;
+    int len;
+
+    while (pos < n) {
+        len = ctz64((e->zrun ? ~eq : eq) >> pos);
+        len = MIN(len, n - pos);
+        e->run_len += len;
+        pos += len;
+        if (pos == n) {
+            break;
+        }
+
+        /* the current run ends at i + pos */
+        if (e->zrun) {
+            e->d += uleb128_encode_small(e->dst + e->d, e->run_len);
+            e->nzrun_start = i + pos;
+        } else if (xbzrle_encode_nzrun(e) < 0) {
+            return -1;
+        }
+        /* overflow */
+        if (e->d + 2 > e->dlen) {
+            return -1;
+        }
+        e->zrun = !e->zrun;
+        e->run_len = 0;
+    }
+    return 0;
+}
+
+/* Like xbzrle_encode_runs(), but with all @n bytes in the current run */
+static inline QEMU_ALWAYS_INLINE
+bool xbzrle_encode_extend(XBZRLEEncoder *e, uint64_t eq, int n)
+{
+    uint64_t all = n == 64 ? -1ULL : (1ULL << n) - 1;
+
+    if (eq != (e->zrun ? all : 0)) {
+        return false;
+    }
+    e->run_len += n;
+    return true;
+}
+
+static int xbzrle_encode_finish(XBZRLEEncoder *e, int slen)
+{
+    if (e->zrun) {
+        /* buffer unchanged, or skip last zero run */
+        return e->run_len == slen ? 0 : e->d;
+    }
+    if (xbzrle_encode_nzrun(e) < 0) {
+        return -1;
+    }
+    return e->d;
+}
+#endif /* CONFIG_AVX2_OPT || CONFIG_AVX512BW_OPT */
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Mask of the unchanged bytes for a tail of less than 64 bytes */
+static uint64_t xbzrle_eq_mask(uint8_t *old_buf, uint8_t *new_buf, int n)
+{
+    uint64_t eq = 0;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        eq |= (uint64_t)(old_buf[k] == new_buf[k]) << k;
+    }
+    return eq;
+}
+
+/*
+ * Short nzruns dominate the decoding time, copy them with a pair of
+ * overlapping loads and stores instead of calling memcpy()
+ */
+static inline QEMU_ALWAYS_INLINE
+void xbzrle_copy_small(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+    if (n >= 8) {
+        uint64_t head = ldq_he_p(src), tail = ldq_he_p(src + n - 8);
+
+        stq_he_p(dst, head);
+        stq_he_p(dst + n - 8, tail);
+    } else if (n >= 4) {
+        uint32_t head = ldl_he_p(src), tail = ldl_he_p(src + n - 4);
+
+        stl_he_p(dst, head);
+        stl_he_p(dst + n - 4, tail);
+    } else {
+        while (n--) {
+            *dst++ = *src++;
+        }
+    }
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    XBZRLEEncoder e;
+    uint64_t eq;
+    int i;
+
+    if (!xbzrle_encoder_init(&e, new_buf, slen, dst, dlen)) {
+        return -1;
+    }
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m256i *o = (__m256i *)(old_buf + i);
+        __m256i *n = (__m256i *)(new_buf + i);
+        __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256(o),
+                                       _mm256_loadu_si256(n));
+        __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256(o + 1),
+                                       _mm256_loadu_si256(n + 1));
+
+        eq = (uint32_t)_mm256_movemask_epi8(lo) |
+             (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+        if (!xbzrle_encode_extend(&e, eq, 64) &&
+            xbzrle_encode_runs(&e, i, eq, 64) < 0) {
+            return -1;
+        }
+    }
+    if (i < slen) {
+        eq = xbzrle_eq_mask(old_buf + i, new_buf + i, slen - i);
+        if (xbzrle_encode_runs(&e, i, eq, slen - i) < 0) {
+            return -1;
+        }
+    }
+
+    return xbzrle_encode_finish(&e, slen);
+}
+
+static void xbzrle_copy_avx2(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+    if (n > 64) {
+        memcpy(dst, src, n);
+    } else if (n >= 32) {
+        __m256i head = _mm256_loadu_si256((__m256i *)src);
+        __m256i tail = _mm256_loadu_si256((__m256i *)(src + n - 32));
+
+        _mm256_storeu_si256((__m256i *)dst, head);
+        _mm256_storeu_si256((__m256i *)(dst + n - 32), tail);
+    } else if (n >= 16) {
+        __m128i head = _mm_loadu_si128((__m128i *)src);
+        __m128i tail = _mm_loadu_si128((__m128i *)(src + n - 16));
+
+        _mm_storeu_si128((__m128i *)dst, head);
+        _mm_storeu_si128((__m128i *)(dst + n - 16), tail);
+    } else {
+        xbzrle_copy_small(dst, src, n);
+    }
+}
+
+static int xbzrle_decode_buffer_avx2(uint8_t *src, int slen, uint8_t *dst,
+                                     int dlen)
+{
+    return xbzrle_decode_runs(src, slen, dst, dlen, xbzrle_copy_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    XBZRLEEncoder e;
+    int i;
+
+    if (!xbzrle_encoder_init(&e, new_buf, slen, dst, dlen)) {
+        return -1;
+    }
+
+    for (i = 0; i < slen; i += 64) {
+        int n = MIN(slen - i, 64);
+        __mmask64 m = n == 64 ? -1ULL : (1ULL << n) - 1;
+        __m512i o = _mm512_maskz_loadu_epi8(m, old_buf + i);
+        __m512i v = _mm512_maskz_loadu_epi8(m, new_buf + i);
+        uint64_t eq = _mm512_mask_cmpeq_epi8_mask(m, o, v);
+
+        if (!xbzrle_encode_extend(&e, eq, n) &&
+            xbzrle_encode_runs(&e, i, eq, n) < 0) {
+            return -1;
+        }
+    }
+
+    return xbzrle_encode_finish(&e, slen);
+}
+
+static void xbzrle_copy_avx512(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+    if (n > 64) {
+        memcpy(dst, src, n);
+    } else {
+        __mmask64 m = n == 64 ? -1ULL : (1ULL << n) - 1;
+
+        _mm512_mask_storeu_epi8(dst, m, _mm512_maskz_loadu_epi8(m, src));
+    }
+}
+
+static int xbzrle_decode_buffer_avx512(uint8_t *src, int slen, uint8_t *dst,
+                                       int dlen)
+{
+    return xbzrle_decode_runs(src, slen, dst, dlen, xbzrle_copy_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/* Note that the most preferred ISA must have the least significant bit */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_int;
+static int (*xbzrle_decode_accel)(uint8_t *, int, uint8_t *, int) =
+    xbzrle_decode_buffer_int;
+static const char *xbzrle_accel = "int";
+
+static void init_accel(unsigned cache)
+{
+    xbzrle_encode_accel = xbzrle_encode_buffer_int;
+    xbzrle_decode_accel = xbzrle_decode_buffer_int;
+    xbzrle_accel = "int";
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        xbzrle_encode_accel = xbzrle_encode_buffer_avx2;
+        xbzrle_decode_accel = xbzrle_decode_buffer_avx2;
+        xbzrle_accel = "avx2";
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        xbzrle_encode_accel = xbzrle_encode_buffer_avx512;
+        xbzrle_decode_accel = xbzrle_decode_buffer_avx512;
+        xbzrle_accel = "avx512bw";
+    }
+#endif
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* OPMASK, ZMM, YMM and XMM state are enabled by the OS */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif
+
+bool test_xbzrle_next_accel(void)
+{
+    /* If no bits set, we just tested the int versions */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *xbzrle_accel_name(void)
+{
+    return xbzrle_accel;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_decode_accel(src, slen, dst, dlen);
+}
@@ -18,4 +18,13 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/* Name of the encoder and decoder that are in use, for the benchmark */
+const char *xbzrle_accel_name(void);
+
+/*
+ * Select the next best encoder and decoder, for testing all of them.
+ * Returns false once the generic ones are selected.
+ */
+bool test_xbzrle_next_accel(void);
 #endif
@@ -322,6 +322,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->compression->compression_rate);
     }
 
+    if (info->has_multifd_compression) {
+        MultiFDCompressionStatsList *stats;
+
+        for (stats = info->multifd_compression; stats; stats = stats->next) {
+            monitor_printf(mon, "multifd %s: %" PRIu64 " packets %" PRIu64
+                           " pages %" PRIu64 " kbytes\n",
+                           MultiFDCompression_str(stats->value->method),
+                           stats->value->packets, stats->value->pages,
+                           stats->value->compressed_size >> 10);
+        }
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
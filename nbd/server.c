@@ -19,6 +19,7 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu-common.h"
 #include "qemu/queue.h"
 #include "trace.h"
 #include "nbd-internal.h"
@@ -94,6 +95,25 @@ struct NBDExport {
 
     AioContext *ctx;
 
+    /*
+     * If set, negotiated clients are distributed over these AioContexts
+     * instead of running in @ctx.  Only the block layer calls of their
+     * requests are made in @ctx.
+     */
+    AioContext **conn_ctxs;
+    int nb_conn_ctxs;
+    unsigned next_conn_ctx;
+
+    /*
+     * Protects @ctx and @quiesced against the connection AioContexts.
+     * While the BlockBackend is drained, e.g. to move it to another
+     * AioContext, their requests wait on @quiesce_queue before entering
+     * @ctx.
+     */
+    QemuMutex ctx_lock;
+    bool quiesced;
+    CoQueue quiesce_queue;
+
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
 
@@ -116,6 +136,28 @@ typedef struct NBDExportMetaContexts {
     bool bitmap; /* export qemu:dirty-bitmap:<export bitmap name> */
 } NBDExportMetaContexts;
 
+#ifdef CONFIG_SPLICE
+/*
+ * Read data can go from the image file to the socket without being copied
+ * through QEMU: the block layer splices it into a pipe, and the pipe is
+ * spliced into the socket afterwards.  Each request in flight needs a pipe
+ * of its own, and idle pipes are kept for the next request of the client.
+ */
+#define NBD_SPLICE_PIPE_SIZE (1 * MiB)
+
+typedef struct NBDSplicePipe {
+    int fds[2];
+    /*
+     * How much may be put into the pipe at once.  Data that isn't aligned to
+     * pages takes up one page more than its length in the pipe, so only half
+     * of the pipe's capacity is used.
+     */
+    size_t size;
+    size_t fill; /* Bytes currently in the pipe */
+    QSLIST_ENTRY(NBDSplicePipe) next;
+} NBDSplicePipe;
+#endif
+
 struct NBDClient {
     int refcount;
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -125,6 +167,8 @@ struct NBDClient {
     char *tlsauthz;
     QIOChannelSocket *sioc; /* The underlying data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
+    /* Connection AioContext, or NULL if the client runs in the export's */
+    AioContext *ctx;
 
     Coroutine *recv_coroutine;
 
@@ -143,6 +187,11 @@ struct NBDClient {
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
+
+#ifdef CONFIG_SPLICE
+    /* Idle pipes for sending read data without copying, see NBDSplicePipe */
+    QSLIST_HEAD(, NBDSplicePipe) splice_pipes;
+#endif
 };
 
 static void nbd_client_receive_next_request(NBDClient *client);
@@ -1332,11 +1381,21 @@ static coroutine_fn int nbd_negotiate(NBDClient *client, Error **errp)
         return ret;
     }
 
-    /* Attach the channel to the same AioContext as the export */
-    if (client->exp && client->exp->ctx) {
+    if (client->exp && client->exp->nb_conn_ctxs) {
+        NBDExport *exp = client->exp;
+
+        /* Spread clients over the connection AioContexts */
+        client->ctx = exp->conn_ctxs[atomic_fetch_inc(&exp->next_conn_ctx) %
+                                     exp->nb_conn_ctxs];
+        qio_channel_attach_aio_context(client->ioc, client->ctx);
+    } else if (client->exp && client->exp->ctx) {
+        /* Attach the channel to the same AioContext as the export */
         qio_channel_attach_aio_context(client->ioc, client->exp->ctx);
     }
 
+    /* Transfer requests and replies with the AioContext's io_uring */
+    qio_channel_set_completion_io(client->ioc, true);
+
     assert(!client->optlen);
     trace_nbd_negotiate_success();
 
@@ -1385,32 +1444,93 @@ static int nbd_receive_request(QIOChannel *ioc, NBDRequest *request,
 
 void nbd_client_get(NBDClient *client)
 {
-    client->refcount++;
+    atomic_inc(&client->refcount);
+}
+
+/*
+ * The list of clients, the export and the close_fn callbacks belong to the
+ * main loop.  Clients in a connection AioContext get there with a BH.
+ */
+static bool nbd_client_in_main_loop(NBDClient *client)
+{
+    return !client->ctx ||
+           qemu_get_current_aio_context() == qemu_get_aio_context();
+}
+
+#ifdef CONFIG_SPLICE
+static void nbd_splice_pipe_free(NBDSplicePipe *p)
+{
+    close(p->fds[0]);
+    close(p->fds[1]);
+    g_free(p);
+}
+#endif
+
+static void nbd_client_free(NBDClient *client)
+{
+    qio_channel_detach_aio_context(client->ioc);
+    object_unref(OBJECT(client->sioc));
+    object_unref(OBJECT(client->ioc));
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+    }
+    g_free(client->tlsauthz);
+#ifdef CONFIG_SPLICE
+    while (!QSLIST_EMPTY(&client->splice_pipes)) {
+        NBDSplicePipe *p = QSLIST_FIRST(&client->splice_pipes);
+
+        QSLIST_REMOVE_HEAD(&client->splice_pipes, next);
+        nbd_splice_pipe_free(p);
+    }
+#endif
+    if (client->exp) {
+        QTAILQ_REMOVE(&client->exp->clients, client, next);
+        nbd_export_put(client->exp);
+    }
+    g_free(client);
+}
+
+static void nbd_client_free_bh(void *opaque)
+{
+    NBDClient *client = opaque;
+    AioContext *ctx = client->exp->ctx;
+
+    aio_context_acquire(ctx);
+    nbd_client_free(client);
+    aio_context_release(ctx);
 }
 
 void nbd_client_put(NBDClient *client)
 {
-    if (--client->refcount == 0) {
+    if (atomic_fetch_dec(&client->refcount) == 1) {
         /* The last reference should be dropped by client->close,
          * which is called by client_close.
          */
         assert(client->closing);
 
-        qio_channel_detach_aio_context(client->ioc);
-        object_unref(OBJECT(client->sioc));
-        object_unref(OBJECT(client->ioc));
-        if (client->tlscreds) {
-            object_unref(OBJECT(client->tlscreds));
-        }
-        g_free(client->tlsauthz);
-        if (client->exp) {
-            QTAILQ_REMOVE(&client->exp->clients, client, next);
-            nbd_export_put(client->exp);
+        if (nbd_client_in_main_loop(client)) {
+            nbd_client_free(client);
+        } else {
+            aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                    nbd_client_free_bh, client);
         }
-        g_free(client);
     }
 }
 
+typedef struct NBDClientCloseData {
+    NBDClient *client;
+    bool negotiated;
+} NBDClientCloseData;
+
+static void nbd_client_close_bh(void *opaque)
+{
+    NBDClientCloseData *data = opaque;
+
+    data->client->close_fn(data->client, data->negotiated);
+    nbd_client_put(data->client);
+    g_free(data);
+}
+
 static void client_close(NBDClient *client, bool negotiated)
 {
     if (client->closing) {
@@ -1427,7 +1547,58 @@ static void client_close(NBDClient *client, bool negotiated)
 
     /* Also tell the client, so that they release their reference.  */
     if (client->close_fn) {
-        client->close_fn(client, negotiated);
+        if (nbd_client_in_main_loop(client)) {
+            client->close_fn(client, negotiated);
+        } else {
+            NBDClientCloseData *data = g_new(NBDClientCloseData, 1);
+
+            *data = (NBDClientCloseData) {
+                .client = client,
+                .negotiated = negotiated,
+            };
+            nbd_client_get(client);
+            aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                    nbd_client_close_bh, data);
+        }
+    }
+}
+
+/*
+ * Clients in a connection AioContext receive requests and send replies there,
+ * but the block layer may only be used from the export's AioContext.  These
+ * move the request coroutine back and forth.
+ */
+static void coroutine_fn nbd_client_enter_export(NBDClient *client)
+{
+    NBDExport *exp = client->exp;
+    AioContext *ctx;
+
+    if (!client->ctx) {
+        return;
+    }
+
+    /*
+     * The export's AioContext can only change while the BlockBackend is
+     * drained.  Counting the request as in flight until it has arrived
+     * makes a drain that starts now wait for it, and a drain that has
+     * already started keeps it here until the new context is known.
+     */
+    qemu_mutex_lock(&exp->ctx_lock);
+    while (exp->quiesced) {
+        qemu_co_queue_wait(&exp->quiesce_queue, &exp->ctx_lock);
+    }
+    blk_inc_in_flight(exp->blk);
+    ctx = exp->ctx;
+    qemu_mutex_unlock(&exp->ctx_lock);
+
+    aio_co_reschedule_self(ctx);
+    blk_dec_in_flight(exp->blk);
+}
+
+static void coroutine_fn nbd_client_leave_export(NBDClient *client)
+{
+    if (client->ctx) {
+        aio_co_reschedule_self(client->ctx);
     }
 }
 
@@ -1466,9 +1637,15 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
 
     trace_nbd_blk_aio_attached(exp->name, ctx);
 
+    qemu_mutex_lock(&exp->ctx_lock);
     exp->ctx = ctx;
+    qemu_mutex_unlock(&exp->ctx_lock);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->ctx) {
+            /* Stays in its connection AioContext */
+            continue;
+        }
         qio_channel_attach_aio_context(client->ioc, ctx);
         if (client->recv_coroutine) {
             aio_co_schedule(ctx, client->recv_coroutine);
@@ -1487,12 +1664,41 @@ static void blk_aio_detach(void *opaque)
     trace_nbd_blk_aio_detach(exp->name, exp->ctx);
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->ctx) {
+            continue;
+        }
         qio_channel_detach_aio_context(client->ioc);
     }
 
+    qemu_mutex_lock(&exp->ctx_lock);
     exp->ctx = NULL;
+    qemu_mutex_unlock(&exp->ctx_lock);
 }
 
+static void nbd_drained_begin(void *opaque)
+{
+    NBDExport *exp = opaque;
+
+    qemu_mutex_lock(&exp->ctx_lock);
+    exp->quiesced = true;
+    qemu_mutex_unlock(&exp->ctx_lock);
+}
+
+static void nbd_drained_end(void *opaque)
+{
+    NBDExport *exp = opaque;
+
+    qemu_mutex_lock(&exp->ctx_lock);
+    exp->quiesced = false;
+    qemu_co_queue_restart_all(&exp->quiesce_queue);
+    qemu_mutex_unlock(&exp->ctx_lock);
+}
+
+static const BlockDevOps nbd_block_dev_ops = {
+    .drained_begin = nbd_drained_begin,
+    .drained_end = nbd_drained_end,
+};
+
 static void nbd_eject_notifier(Notifier *n, void *data)
 {
     NBDExport *exp = container_of(n, NBDExport, eject_notifier);
@@ -1526,6 +1732,9 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
     ctx = bdrv_get_aio_context(bs);
     bdrv_invalidate_cache(bs, NULL);
 
+    qemu_mutex_init(&exp->ctx_lock);
+    qemu_co_queue_init(&exp->quiesce_queue);
+
     /* Don't allow resize while the NBD server is running, otherwise we don't
      * care what happens with the node. */
     perm = BLK_PERM_CONSISTENT_READ;
@@ -1552,11 +1761,15 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
     exp->description = g_strdup(desc);
     exp->nbdflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
+    /*
+     * All clients go through exp->blk, so they see each other's writes and
+     * a flush from any of them covers the writes of all of them.
+     */
+    if (shared) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
@@ -1604,6 +1817,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
     exp->close = close;
     exp->ctx = ctx;
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
+    blk_set_dev_ops(blk, &nbd_block_dev_ops, exp);
 
     if (on_eject_blk) {
         blk_ref(on_eject_blk);
@@ -1617,6 +1831,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, uint64_t dev_offset,
 
 fail:
     blk_unref(blk);
+    qemu_mutex_destroy(&exp->ctx_lock);
     g_free(exp->name);
     g_free(exp->description);
     g_free(exp);
@@ -1641,6 +1856,23 @@ nbd_export_aio_context(NBDExport *exp)
     return exp->ctx;
 }
 
+void nbd_export_set_connection_contexts(NBDExport *exp, AioContext **ctxs,
+                                        int nb_ctxs)
+{
+    int i;
+
+    for (i = 0; i < exp->nb_conn_ctxs; i++) {
+        aio_context_unref(exp->conn_ctxs[i]);
+    }
+    g_free(exp->conn_ctxs);
+
+    exp->conn_ctxs = g_memdup(ctxs, nb_ctxs * sizeof(ctxs[0]));
+    exp->nb_conn_ctxs = nb_ctxs;
+    for (i = 0; i < nb_ctxs; i++) {
+        aio_context_ref(exp->conn_ctxs[i]);
+    }
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
@@ -1725,6 +1957,9 @@ void nbd_export_put(NBDExport *exp)
             g_free(exp->export_bitmap_context);
         }
 
+        nbd_export_set_connection_contexts(exp, NULL, 0);
+        qemu_mutex_destroy(&exp->ctx_lock);
+
         QTAILQ_REMOVE(&closed_exports, exp, next);
         g_free(exp);
         aio_wait_kick();
@@ -1769,6 +2004,153 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+#ifdef CONFIG_SPLICE
+/*
+ * Get an empty pipe for sending read data without copying it, or NULL if
+ * this isn't possible.  The pipe is returned with nbd_splice_pipe_put().
+ */
+static NBDSplicePipe *nbd_splice_pipe_get(NBDClient *client)
+{
+    NBDSplicePipe *p;
+    int size;
+
+    /* The data must be encrypted on its way to the socket */
+    if (client->tlscreds) {
+        return NULL;
+    }
+
+    p = QSLIST_FIRST(&client->splice_pipes);
+    if (p) {
+        QSLIST_REMOVE_HEAD(&client->splice_pipes, next);
+        return p;
+    }
+
+    p = g_new0(NBDSplicePipe, 1);
+    if (qemu_pipe(p->fds) < 0) {
+        g_free(p);
+        return NULL;
+    }
+    qemu_set_nonblock(p->fds[0]);
+    qemu_set_nonblock(p->fds[1]);
+
+    /* A larger pipe is only an optimisation, the default is 64k */
+    fcntl(p->fds[1], F_SETPIPE_SZ, NBD_SPLICE_PIPE_SIZE);
+    size = fcntl(p->fds[1], F_GETPIPE_SZ);
+    p->size = (size > 0 ? size : 64 * KiB) / 2;
+
+    return p;
+}
+
+/* Keep @p for the next request, unless data was left behind in it */
+static void nbd_splice_pipe_put(NBDClient *client, NBDSplicePipe *p)
+{
+    if (!p) {
+        return;
+    }
+    if (p->fill) {
+        nbd_splice_pipe_free(p);
+        return;
+    }
+    QSLIST_INSERT_HEAD(&client->splice_pipes, p, next);
+}
+
+/*
+ * Move up to @size bytes of the export at @offset into the pipe @p.  Must be
+ * called in the export's AioContext.  Returns the number of bytes moved, or
+ * a negative errno if nothing was moved; the caller then has to read the data
+ * with blk_pread(), which also reports any read error in the usual way.
+ */
+static int coroutine_fn nbd_splice_pipe_fill(NBDClient *client,
+                                             NBDSplicePipe *p,
+                                             uint64_t offset, size_t size)
+{
+    NBDExport *exp = client->exp;
+    int ret;
+
+    assert(!p->fill);
+    ret = blk_co_splice(exp->blk, offset + exp->dev_offset,
+                        MIN(size, p->size), p->fds[1]);
+    if (ret > 0) {
+        p->fill = ret;
+    }
+    return ret ?: -EAGAIN;
+}
+
+/*
+ * Send the reply header in @iov followed by the data in the pipe @p.  The
+ * export is not entered here, so a client that is slow to receive the data
+ * doesn't hold up requests on the block node.
+ */
+static int coroutine_fn nbd_co_send_iov_splice(NBDClient *client,
+                                               struct iovec *iov,
+                                               unsigned niov,
+                                               NBDSplicePipe *p,
+                                               Error **errp)
+{
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    qio_channel_set_cork(client->ioc, true);
+
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+
+    while (!ret && p->fill) {
+        ssize_t len = splice(p->fds[0], NULL, client->sioc->fd, NULL, p->fill,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0 && errno == EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        } else if (len <= 0) {
+            error_setg_errno(errp, len < 0 ? errno : EPIPE,
+                             "writing to socket failed");
+            ret = -EIO;
+            break;
+        }
+        p->fill -= len;
+    }
+
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+#else
+typedef struct NBDSplicePipe {
+    size_t size;
+} NBDSplicePipe;
+
+static NBDSplicePipe *nbd_splice_pipe_get(NBDClient *client)
+{
+    return NULL;
+}
+
+static void nbd_splice_pipe_put(NBDClient *client, NBDSplicePipe *p)
+{
+}
+
+static int coroutine_fn nbd_splice_pipe_fill(NBDClient *client,
+                                             NBDSplicePipe *p,
+                                             uint64_t offset, size_t size)
+{
+    return -ENOTSUP;
+}
+
+static int coroutine_fn nbd_co_send_iov_splice(NBDClient *client,
+                                               struct iovec *iov,
+                                               unsigned niov,
+                                               NBDSplicePipe *p,
+                                               Error **errp)
+{
+    return -ENOTSUP;
+}
+#endif
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1823,12 +2205,17 @@ static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1, errp);
 }
 
+/*
+ * Send a read reply chunk for @size bytes at @offset.  If @p is non-NULL,
+ * the data is taken from the pipe @p, otherwise from @data.
+ */
 static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                                                     uint64_t handle,
                                                     uint64_t offset,
                                                     void *data,
                                                     size_t size,
                                                     bool final,
+                                                    NBDSplicePipe *p,
                                                     Error **errp)
 {
     NBDStructuredReadData chunk;
@@ -1844,6 +2231,10 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
+    if (p) {
+        trace_nbd_co_send_splice(handle, offset, size);
+        return nbd_co_send_iov_splice(client, iov, 1, p, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -1884,15 +2275,43 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
 {
     int ret = 0;
     NBDExport *exp = client->exp;
+    NBDSplicePipe *p = nbd_splice_pipe_get(client);
     size_t progress = 0;
 
     while (progress < size) {
         int64_t pnum;
-        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
-                                             offset + progress,
-                                             size - progress, &pnum, NULL,
-                                             NULL);
+        int status;
         bool final;
+        bool spliced = false;
+        bool unsupported = false;
+
+        nbd_client_enter_export(client);
+        status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
+                                         offset + progress, size - progress,
+                                         &pnum, NULL, NULL);
+        if (status >= 0 && !(status & BDRV_BLOCK_ZERO)) {
+            if (p) {
+                ret = nbd_splice_pipe_fill(client, p, offset + progress, pnum);
+                if (ret > 0) {
+                    /* The rest of the extent goes in the next chunk */
+                    spliced = true;
+                    pnum = ret;
+                } else if (ret == -ENOTSUP) {
+                    unsupported = true;
+                }
+            }
+            if (!spliced) {
+                ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                                data + progress, pnum);
+            }
+        }
+        nbd_client_leave_export(client);
+
+        /* The pool of pipes belongs to the client's AioContext */
+        if (unsupported) {
+            nbd_splice_pipe_put(client, p);
+            p = NULL;
+        }
 
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
@@ -1901,7 +2320,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             ret = nbd_co_send_structured_error(client, handle, -status, msg,
                                                errp);
             g_free(msg);
-            return ret;
+            break;
         }
         assert(pnum && pnum <= size - progress);
         final = progress + pnum == size;
@@ -1920,15 +2339,13 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
             if (ret < 0) {
                 error_setg_errno(errp, -ret, "reading from file failed");
                 break;
             }
             ret = nbd_co_send_structured_read(client, handle, offset + progress,
                                               data + progress, pnum, final,
-                                              errp);
+                                              spliced ? p : NULL, errp);
         }
 
         if (ret < 0) {
@@ -1936,6 +2353,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
         }
         progress += pnum;
     }
+    nbd_splice_pipe_put(client, p);
     return ret;
 }
 
@@ -2089,7 +2507,9 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
     unsigned int nb_extents = dont_fragment ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
     g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(nb_extents);
 
+    nbd_client_enter_export(client);
     ret = blockstatus_to_extents(bs, offset, length, ea);
+    nbd_client_leave_export(client);
     if (ret < 0) {
         return nbd_co_send_structured_error(
                 client, handle, -ret, "can't get block status", errp);
@@ -2274,14 +2694,18 @@ static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
 static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                         uint8_t *data, Error **errp)
 {
-    int ret;
+    int ret = 0;
     NBDExport *exp = client->exp;
+    NBDSplicePipe *p = NULL;
+    bool spliced = false;
 
     assert(request->type == NBD_CMD_READ);
 
     /* XXX: NBD Protocol only documents use of FUA with WRITE */
     if (request->flags & NBD_CMD_FLAG_FUA) {
+        nbd_client_enter_export(client);
         ret = blk_co_flush(exp->blk);
+        nbd_client_leave_export(client);
         if (ret < 0) {
             return nbd_send_generic_reply(client, request->handle, ret,
                                           "flush failed", errp);
@@ -2295,18 +2719,62 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
-    ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
-                    request->len);
+    /*
+     * The reply must consist of a single chunk, so the whole request has to
+     * fit into the pipe before the header is sent.  This way, read errors
+     * are still reported in the reply.
+     */
+    if (request->len) {
+        p = nbd_splice_pipe_get(client);
+        if (p && request->len > p->size) {
+            nbd_splice_pipe_put(client, p);
+            p = NULL;
+        }
+    }
+
+    nbd_client_enter_export(client);
+    if (p) {
+        spliced = nbd_splice_pipe_fill(client, p, request->from,
+                                       request->len) == request->len;
+    }
+    if (!spliced) {
+        /* Any partial data in the pipe is dropped with it */
+        ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
+                        request->len);
+    }
+    nbd_client_leave_export(client);
+    if (!spliced) {
+        nbd_splice_pipe_put(client, p);
+        p = NULL;
+    }
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "reading from file failed", errp);
     }
 
+    if (p && !client->structured_reply) {
+        NBDSimpleReply reply;
+        struct iovec iov[] = {
+            {.iov_base = &reply, .iov_len = sizeof(reply)},
+        };
+
+        trace_nbd_co_send_simple_reply(request->handle, 0, nbd_err_lookup(0),
+                                       request->len);
+        trace_nbd_co_send_splice(request->handle, request->from,
+                                 request->len);
+        set_be_simple_reply(&reply, 0, request->handle);
+        ret = nbd_co_send_iov_splice(client, iov, 1, p, errp);
+        nbd_splice_pipe_put(client, p);
+        return ret;
+    }
+
     if (client->structured_reply) {
         if (request->len) {
-            return nbd_co_send_structured_read(client, request->handle,
-                                               request->from, data,
-                                               request->len, true, errp);
+            ret = nbd_co_send_structured_read(client, request->handle,
+                                              request->from, data,
+                                              request->len, true, p, errp);
+            nbd_splice_pipe_put(client, p);
+            return ret;
         } else {
             return nbd_co_send_structured_done(client, request->handle, errp);
         }
@@ -2331,8 +2799,10 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
 
     assert(request->type == NBD_CMD_CACHE);
 
+    nbd_client_enter_export(client);
     ret = blk_co_preadv(exp->blk, request->from + exp->dev_offset, request->len,
                         NULL, BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
+    nbd_client_leave_export(client);
 
     return nbd_send_generic_reply(client, request->handle, ret,
                                   "caching data failed", errp);
@@ -2362,8 +2832,10 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (request->flags & NBD_CMD_FLAG_FUA) {
             flags |= BDRV_REQ_FUA;
         }
+        nbd_client_enter_export(client);
         ret = blk_pwrite(exp->blk, request->from + exp->dev_offset,
                          data, request->len, flags);
+        nbd_client_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2378,8 +2850,10 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         if (request->flags & NBD_CMD_FLAG_FAST_ZERO) {
             flags |= BDRV_REQ_NO_FALLBACK;
         }
+        nbd_client_enter_export(client);
         ret = blk_pwrite_zeroes(exp->blk, request->from + exp->dev_offset,
                                 request->len, flags);
+        nbd_client_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "writing to file failed", errp);
 
@@ -2388,16 +2862,20 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         abort();
 
     case NBD_CMD_FLUSH:
+        nbd_client_enter_export(client);
         ret = blk_co_flush(exp->blk);
+        nbd_client_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "flush failed", errp);
 
     case NBD_CMD_TRIM:
+        nbd_client_enter_export(client);
         ret = blk_co_pdiscard(exp->blk, request->from + exp->dev_offset,
                               request->len);
         if (ret == 0 && request->flags & NBD_CMD_FLAG_FUA) {
             ret = blk_co_flush(exp->blk);
         }
+        nbd_client_leave_export(client);
         return nbd_send_generic_reply(client, request->handle, ret,
                                       "discard failed", errp);
 
@@ -2528,7 +3006,8 @@ static void nbd_client_receive_next_request(NBDClient *client)
     if (!client->recv_coroutine && client->nb_requests < MAX_NBD_REQUESTS) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->ctx, client->recv_coroutine);
+        aio_co_schedule(client->ctx ?: client->exp->ctx,
+                        client->recv_coroutine);
     }
 }
 
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include <getopt.h>
+#include <math.h>
 
 #include "qemu-common.h"
 #include "qemu-version.h"
@@ -33,6 +34,8 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
@@ -42,10 +45,13 @@
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/units.h"
+#include "qemu/timer.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/aio_task.h"
 #include "block/qapi.h"
 #include "crypto/init.h"
 #include "trace/control.h"
@@ -80,6 +86,14 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_COMPRESS_THREADS = 277,
+    OPTION_DEDUP = 278,
+    OPTION_WRITE_PERCENT = 279,
+    OPTION_RANDOM = 280,
+    OPTION_ZIPF = 281,
+    OPTION_JOBS = 282,
+    OPTION_IOTHREAD = 283,
+    OPTION_SEED = 284,
 };
 
 typedef enum OutputFormat {
@@ -197,6 +211,9 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--compress-threads' specifies how many clusters are compressed in\n"
+           "       parallel with '-c' (defaults to one at a time)\n"
+           "  '--dedup' stores identical clusters only once in a qcow2 target\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1661,6 +1678,8 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_COMPRESS_THREADS 64
+#define MAX_BUF_SECTORS 32768
 
 typedef struct ImgConvertState {
     BlockBackend **src;
@@ -1688,6 +1707,7 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
+    long compress_threads; /* 0 unless compressed writes are pipelined */
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
     int64_t wait_sector_num[MAX_COROUTINES];
@@ -1854,15 +1874,74 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+typedef struct ConvertCompressTask {
+    AioTask task;
+    ImgConvertState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+} ConvertCompressTask;
+
+static int coroutine_fn convert_co_compress_task_entry(AioTask *task)
+{
+    ConvertCompressTask *t = container_of(task, ConvertCompressTask, task);
+    ImgConvertState *s = t->s;
+    int ret;
+
+    ret = blk_co_pwrite(s->target, t->sector_num << BDRV_SECTOR_BITS,
+                        t->nb_sectors << BDRV_SECTOR_BITS, t->buf,
+                        BDRV_REQ_WRITE_COMPRESSED);
+    if (ret < 0 && s->ret == -EINPROGRESS) {
+        error_report("error while writing at byte %lld: %s",
+                     t->sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
+        s->ret = ret;
+    }
+
+    return ret;
+}
+
+/*
+ * Write @nb_sectors (at most one cluster) of @buf as a compressed cluster.
+ * With @aio, the write is started in a task of the pool and still uses
+ * @buf when this function returns.  The task reports its errors itself and
+ * stores them in s->ret.
+ */
+static int coroutine_fn convert_co_write_compressed(ImgConvertState *s,
+                                                    AioTaskPool *aio,
+                                                    int64_t sector_num,
+                                                    int nb_sectors,
+                                                    uint8_t *buf)
+{
+    ConvertCompressTask *t;
+
+    if (!aio) {
+        return blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
+                             nb_sectors << BDRV_SECTOR_BITS, buf,
+                             BDRV_REQ_WRITE_COMPRESSED);
+    }
+
+    t = g_new(ConvertCompressTask, 1);
+    *t = (ConvertCompressTask) {
+        .task.func  = convert_co_compress_task_entry,
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .buf        = buf,
+    };
+    aio_task_pool_start_task(aio, &t->task);
+
+    return 0;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
-                                         enum ImgConvertBlockStatus status)
+                                         enum ImgConvertBlockStatus status,
+                                         AioTaskPool *aio)
 {
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
-        BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
 
         switch (status) {
         case BLK_BACKING_FILE:
@@ -1877,8 +1956,11 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
+             * case we can only save the write if the cluster is completely
              * zeroed. */
+            if (s->compressed) {
+                n = MIN(n, s->cluster_sectors);
+            }
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
@@ -1886,8 +1968,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 (s->compressed &&
                  !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
             {
-                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, buf, flags);
+                if (s->compressed) {
+                    ret = convert_co_write_compressed(s, aio, sector_num, n,
+                                                      buf);
+                } else {
+                    ret = blk_co_pwrite(s->target,
+                                        sector_num << BDRV_SECTOR_BITS,
+                                        n << BDRV_SECTOR_BITS, buf, 0);
+                }
                 if (ret < 0) {
                     return ret;
                 }
@@ -1953,6 +2041,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    AioTaskPool *aio = NULL;
     int ret, i;
     int index = -1;
 
@@ -1966,6 +2055,14 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (s->compress_threads) {
+        /*
+         * Compress all clusters of the buffer in parallel.  Only starting
+         * the writes is kept in order, so that the next coroutine can start
+         * compressing its data while this one is still busy.
+         */
+        aio = aio_task_pool_new(s->buf_sectors / s->cluster_sectors);
+    }
 
     while (1) {
         int n;
@@ -2032,7 +2129,7 @@ retry:
                     goto retry;
                 }
             } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+                ret = convert_co_write(s, sector_num, n, buf, status, aio);
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2057,8 +2154,14 @@ retry:
                 }
             }
         }
+
+        if (aio) {
+            /* The compressed writes must be done before @buf is reused */
+            aio_task_pool_wait_all(aio);
+        }
     }
 
+    aio_task_pool_free(aio);
     qemu_vfree(buf);
     s->co[index] = NULL;
     s->running_coroutines--;
@@ -2079,14 +2182,19 @@ static int convert_do_copy(ImgConvertState *s)
         s->has_zero_init = bdrv_has_zero_init(blk_bs(s->target));
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /*
+     * Allocate buffer for copied data. For compressed images, only one cluster
+     * can be written at a time, so unless the writes are pipelined, copy only
+     * one cluster at a time.
+     */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = s->cluster_sectors *
+            MAX(1, MIN(s->compress_threads,
+                       MAX_BUF_SECTORS / s->cluster_sectors));
     }
 
     while (sector_num < s->total_sectors) {
@@ -2160,8 +2268,6 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst)
     return 0;
 }
 
-#define MAX_BUF_SECTORS 32768
-
 static int img_convert(int argc, char **argv)
 {
     int c, bs_i, flags, src_flags = 0;
@@ -2182,6 +2288,7 @@ static int img_convert(int argc, char **argv)
     bool force_share = false;
     bool explict_min_sparse = false;
     bool bitmaps = false;
+    bool dedup = false;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2202,6 +2309,9 @@ static int img_convert(int argc, char **argv)
             {"salvage", no_argument, 0, OPTION_SALVAGE},
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
+            {"compress-threads", required_argument, 0,
+             OPTION_COMPRESS_THREADS},
+            {"dedup", no_argument, 0, OPTION_DEDUP},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WU",
@@ -2330,6 +2440,19 @@ static int img_convert(int argc, char **argv)
         case OPTION_BITMAPS:
             bitmaps = true;
             break;
+        case OPTION_COMPRESS_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.compress_threads) ||
+                s.compress_threads < 1 ||
+                s.compress_threads > MAX_COMPRESS_THREADS) {
+                error_report("Invalid number of compression threads. Allowed "
+                             "number of threads is between 1 and %d",
+                             MAX_COMPRESS_THREADS);
+                goto fail_getopt;
+            }
+            break;
+        case OPTION_DEDUP:
+            dedup = true;
+            break;
         }
     }
 
@@ -2337,6 +2460,22 @@ static int img_convert(int argc, char **argv)
         out_fmt = "raw";
     }
 
+    if (s.compress_threads && !s.compressed) {
+        error_report("--compress-threads requires -c");
+        goto fail_getopt;
+    }
+
+    if (dedup && s.compressed) {
+        error_report("--dedup and -c are mutually exclusive");
+        goto fail_getopt;
+    }
+
+    if (dedup && (tgt_image_opts || strcmp(out_fmt, "qcow2"))) {
+        error_report("--dedup requires a qcow2 target; with "
+                     "--target-image-opts, set dedup=on in the target options");
+        goto fail_getopt;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           qemu_img_object_print_help, &error_fatal)) {
@@ -2597,7 +2736,22 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    if (skip_create) {
+    /* Let the qcow2 driver compress as many clusters in parallel as we send */
+    if (s.compress_threads && !tgt_image_opts && !strcmp(out_fmt, "qcow2")) {
+        if (!open_opts) {
+            open_opts = qdict_new();
+        }
+        qdict_put_int(open_opts, "compress-threads", s.compress_threads);
+    }
+
+    if (dedup) {
+        if (!open_opts) {
+            open_opts = qdict_new();
+        }
+        qdict_put_bool(open_opts, "dedup", true);
+    }
+
+    if (skip_create && tgt_image_opts) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -3027,28 +3181,14 @@ static int get_block_status(BlockDriverState *bs, int64_t offset,
     int64_t map;
     char *filename = NULL;
 
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
-     */
-
-    depth = 0;
-    for (;;) {
-        ret = bdrv_block_status(bs, offset, bytes, &bytes, &map, &file);
-        if (ret < 0) {
-            return ret;
-        }
-        assert(bytes);
-        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
-            break;
-        }
-        bs = backing_bs(bs);
-        if (bs == NULL) {
-            ret = 0;
-            break;
-        }
-
-        depth++;
+    ret = bdrv_block_status_chain(bs, offset, bytes, &bytes, &map, &file,
+                                  &depth);
+    if (ret < 0) {
+        return ret;
+    }
+    assert(bytes);
+    if (!(ret & (BDRV_BLOCK_ZERO | BDRV_BLOCK_DATA))) {
+        ret = 0;
     }
 
     has_offset = !!(ret & BDRV_BLOCK_OFFSET_VALID);
@@ -4243,23 +4383,235 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/* Latency histogram boundaries of qemu-img bench in ns, 10 us to 1 s */
+static const uint64_t bench_latency_boundaries[] = {
+    10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+    100000000, 200000000, 500000000, 1000000000,
+};
+
+#define BENCH_MAX_JOBS 64
+
+typedef struct BenchStats {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    BlockLatencyHistogram latency_histogram;
+} BenchStats;
+
+/*
+ * Zipf distributed numbers in [0, n), 0 being the most frequent one, using
+ * rejection-inversion sampling (W. Hormann, G. Derflinger: "Rejection-inversion
+ * to generate variates from monotone discrete distributions"), which needs
+ * neither a table nor any setup that depends on n.
+ */
+typedef struct BenchZipf {
+    uint64_t n;
+    double theta;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+} BenchZipf;
+
+/* log(1 + x) / x, continuous at 0 (log1p() is exact enough near 0) */
+static double bench_zipf_helper1(double x)
+{
+    return x != 0 ? log1p(x) / x : 1;
+}
+
+/* (exp(x) - 1) / x, continuous at 0 */
+static double bench_zipf_helper2(double x)
+{
+    return x != 0 ? expm1(x) / x : 1;
+}
+
+/* Integral of x^-theta, shifted so that H(1) = 0 */
+static double bench_zipf_H(BenchZipf *z, double x)
+{
+    double log_x = log(x);
+
+    return bench_zipf_helper2((1 - z->theta) * log_x) * log_x;
+}
+
+static double bench_zipf_H_inverse(BenchZipf *z, double x)
+{
+    double t = MAX(x * (1 - z->theta), -1);
+
+    return exp(bench_zipf_helper1(t) * x);
+}
+
+static double bench_zipf_h(BenchZipf *z, double x)
+{
+    return exp(-z->theta * log(x));
+}
+
+static void bench_zipf_init(BenchZipf *z, uint64_t n, double theta)
+{
+    *z = (BenchZipf) {
+        .n      = n,
+        .theta  = theta,
+    };
+    z->h_integral_x1 = bench_zipf_H(z, 1.5) - 1;
+    z->h_integral_n = bench_zipf_H(z, n + 0.5);
+    z->s = 2 - bench_zipf_H_inverse(z, bench_zipf_H(z, 2.5) -
+                                       bench_zipf_h(z, 2));
+}
+
+static uint64_t bench_zipf_next(BenchZipf *z, GRand *rand)
+{
+    for (;;) {
+        double u = z->h_integral_n +
+                   g_rand_double(rand) * (z->h_integral_x1 - z->h_integral_n);
+        double x = bench_zipf_H_inverse(z, u);
+        uint64_t k = x + 0.5;
+
+        k = MIN(MAX(k, 1), z->n);
+        if (k - x <= z->s ||
+            u >= bench_zipf_H(z, k + 0.5) - bench_zipf_h(z, k))
+        {
+            return k - 1;
+        }
+    }
+}
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    bool write;
+    int64_t start_ns;
+    QSLIST_ENTRY(BenchRequest) next;
+} BenchRequest;
+
+/* One job, i.e. an independent stream of requests */
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int write_percent;
+    int random_percent;
+    BenchZipf *zipf; /* NULL for uniformly distributed random offsets */
+    GRand *rand;
     int bufsize;
     int step;
     int nrreq;
     int n;
     int flush_interval;
     bool drain_on_flush;
-    uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    QSLIST_HEAD(, BenchRequest) free_reqs;
+
+    /* Shared by all jobs, only accessed in the AioContext of @blk */
+    BenchStats *stats; /* reads and writes */
+    int *jobs_running;
 
     int in_flight;
     bool in_flush;
+    bool done;
     uint64_t offset;
-} BenchData;
+};
+
+static void bench_stats_init(BenchStats *stats)
+{
+    uint64List *boundaries = NULL;
+    int i;
+
+    *stats = (BenchStats) {
+        .min_ns = UINT64_MAX,
+    };
+
+    for (i = ARRAY_SIZE(bench_latency_boundaries) - 1; i >= 0; i--) {
+        uint64List *entry = g_new(uint64List, 1);
+
+        entry->value = bench_latency_boundaries[i];
+        entry->next = boundaries;
+        boundaries = entry;
+    }
+    block_latency_histogram_init(&stats->latency_histogram, boundaries);
+    qapi_free_uint64List(boundaries);
+}
+
+static void bench_stats_account(BenchStats *stats, int64_t latency_ns,
+                                int bytes)
+{
+    stats->ops++;
+    stats->bytes += bytes;
+    stats->total_ns += latency_ns;
+    stats->min_ns = MIN(stats->min_ns, latency_ns);
+    stats->max_ns = MAX(stats->max_ns, latency_ns);
+    block_latency_histogram_account(&stats->latency_histogram, latency_ns);
+}
+
+static void bench_check_done(BenchData *b)
+{
+    if (b->n == 0 && !b->in_flush && !b->done) {
+        b->done = true;
+        atomic_dec(b->jobs_running);
+        aio_wait_kick();
+    }
+}
+
+static int64_t bench_next_offset(BenchData *b)
+{
+    int64_t offset;
+
+    if (b->random_percent == 100 ||
+        (b->random_percent &&
+         g_rand_int_range(b->rand, 0, 100) < b->random_percent))
+    {
+        uint64_t nr_blocks = b->image_size / b->bufsize;
+        uint64_t block;
+
+        if (b->zipf) {
+            block = bench_zipf_next(b->zipf, b->rand);
+        } else {
+            block = MIN(g_rand_double(b->rand) * nr_blocks, nr_blocks - 1);
+        }
+        return block * b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchData *b)
+{
+    BenchRequest *req;
+    BlockAIOCB *acb;
+
+    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
+        int64_t offset = bench_next_offset(b);
+
+        req = QSLIST_FIRST(&b->free_reqs);
+        QSLIST_REMOVE_HEAD(&b->free_reqs, next);
+        req->write = b->write_percent == 100 ||
+                     (b->write_percent &&
+                      g_rand_int_range(b->rand, 0, 100) < b->write_percent);
+
+        /*
+         * blk_aio_* might look for completed I/Os and kick bench_cb
+         * again, so make sure this operation is counted by in_flight
+         * and b->offset is ready for the next submission.
+         */
+        b->in_flight++;
+        req->start_ns = get_clock();
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0, bench_cb, req);
+        } else {
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0, bench_cb, req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4269,9 +4621,25 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
-static void bench_cb(void *opaque, int ret)
+static void bench_drained_flush_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
+
+    bench_undrained_flush_cb(opaque, ret);
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
+    bench_check_done(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int64_t latency_ns = get_clock() - req->start_ns;
+    int remaining = b->n - b->in_flight;
     BlockAIOCB *acb;
 
     if (ret < 0) {
@@ -4279,57 +4647,121 @@ static void bench_cb(void *opaque, int ret)
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
+    bench_stats_account(&b->stats[req->write], latency_ns, b->bufsize);
+    QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+    b->n--;
+    b->in_flight--;
 
-        b->n--;
-        b->in_flight--;
-
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
-
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && remaining % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BlockCompletionFunc *cb;
 
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
-            }
             if (b->drain_on_flush) {
-                return;
+                b->in_flush = true;
+                cb = bench_drained_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
+            }
+
+            acb = blk_aio_flush(b->blk, cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
             }
         }
+        if (b->drain_on_flush) {
+            return;
+        }
     }
 
-    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
-        /* blk_aio_* might look for completed I/Os and kick bench_cb
-         * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
-         */
-        b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
-        } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+    bench_submit(b);
+    bench_check_done(b);
+}
+
+static QDict *bench_stats_to_qdict(BenchStats *stats, double elapsed)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram;
+    QDict *dict = qdict_new();
+    QDict *hist_dict = qdict_new();
+    QList *boundaries = qlist_new();
+    QList *bins = qlist_new();
+    int i;
+
+    qdict_put_int(dict, "ops", stats->ops);
+    qdict_put_int(dict, "bytes", stats->bytes);
+    qdict_put(dict, "iops", qnum_from_double(stats->ops / elapsed));
+    qdict_put(dict, "bandwidth", qnum_from_double(stats->bytes / elapsed));
+    if (stats->ops) {
+        qdict_put_int(dict, "latency-min-ns", stats->min_ns);
+        qdict_put_int(dict, "latency-avg-ns", stats->total_ns / stats->ops);
+        qdict_put_int(dict, "latency-max-ns", stats->max_ns);
+    }
+
+    for (i = 0; i < hist->nbins - 1; i++) {
+        qlist_append_int(boundaries, hist->boundaries[i]);
+    }
+    for (i = 0; i < hist->nbins; i++) {
+        qlist_append_int(bins, hist->bins[i]);
+    }
+    qdict_put(hist_dict, "boundaries", boundaries);
+    qdict_put(hist_dict, "bins", bins);
+    qdict_put(dict, "latency-histogram", hist_dict);
+
+    return dict;
+}
+
+static void bench_dump_json(BenchStats *stats, int jobs, double elapsed)
+{
+    QDict *dict = qdict_new();
+    QString *str;
+
+    qdict_put(dict, "elapsed", qnum_from_double(elapsed));
+    qdict_put_int(dict, "jobs", jobs);
+    qdict_put(dict, "read", bench_stats_to_qdict(&stats[0], elapsed));
+    qdict_put(dict, "write", bench_stats_to_qdict(&stats[1], elapsed));
+
+    str = qobject_to_json_pretty(QOBJECT(dict));
+    printf("%s\n", qstring_get_str(str));
+    qobject_unref(str);
+    qobject_unref(dict);
+}
+
+static void bench_dump_human(BenchStats *stats, double elapsed)
+{
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        BenchStats *s = &stats[i];
+        BlockLatencyHistogram *hist = &s->latency_histogram;
+
+        if (!s->ops) {
+            continue;
         }
-        if (!acb) {
-            error_report("Failed to issue request");
-            exit(EXIT_FAILURE);
+
+        printf("%s: %" PRIu64 " requests, %.2f IOPS, %.2f MiB/s\n",
+               i ? "write" : "read", s->ops, s->ops / elapsed,
+               s->bytes / elapsed / MiB);
+        printf("  latency (us): min %.1f, avg %.1f, max %.1f\n",
+               s->min_ns / 1000.0, s->total_ns / 1000.0 / s->ops,
+               s->max_ns / 1000.0);
+        printf("  latency histogram (us):\n");
+        for (j = 0; j < hist->nbins; j++) {
+            if (!hist->bins[j]) {
+                continue;
+            }
+            if (j == 0) {
+                printf("    [0, %" PRIu64 "): ", hist->boundaries[0] / 1000);
+            } else if (j == hist->nbins - 1) {
+                printf("    [%" PRIu64 ", inf): ",
+                       hist->boundaries[j - 1] / 1000);
+            } else {
+                printf("    [%" PRIu64 ", %" PRIu64 "): ",
+                       hist->boundaries[j - 1] / 1000,
+                       hist->boundaries[j] / 1000);
+            }
+            printf("%" PRIu64 " (%.2f%%)\n", hist->bins[j],
+                   100.0 * hist->bins[j] / s->ops);
         }
     }
 }
@@ -4349,15 +4781,31 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    int write_percent = -1;
+    int random_percent = -1;
+    double zipf_theta = 0;
+    int nb_jobs = 1;
+    bool use_iothread = false;
+    unsigned long seed = 0;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *output = NULL;
     int64_t image_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData *jobs = NULL;
+    BenchStats stats[2] = {};
+    BenchZipf zipf;
+    IOThread *iothread = NULL;
+    AioContext *ctx = qemu_get_aio_context();
+    int jobs_running;
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
-    int i;
+    double elapsed;
+    uint8_t *buf = NULL;
+    int i, j;
     bool force_share = false;
-    size_t buf_size;
+    size_t buf_size = 0;
+    Error *local_err = NULL;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -4367,6 +4815,13 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"write-percent", required_argument, 0, OPTION_WRITE_PERCENT},
+            {"random", required_argument, 0, OPTION_RANDOM},
+            {"zipf", required_argument, 0, OPTION_ZIPF},
+            {"jobs", required_argument, 0, OPTION_JOBS},
+            {"iothread", no_argument, 0, OPTION_IOTHREAD},
+            {"seed", required_argument, 0, OPTION_SEED},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4466,7 +4921,6 @@ static int img_bench(int argc, char **argv)
             }
             break;
         case 'w':
-            flags |= BDRV_O_RDWR;
             is_write = true;
             break;
         case 'U':
@@ -4500,6 +4954,47 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_WRITE_PERCENT:
+            if (qemu_strtoi(optarg, NULL, 0, &write_percent) < 0 ||
+                write_percent < 0 || write_percent > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            break;
+        case OPTION_RANDOM:
+            if (qemu_strtoi(optarg, NULL, 0, &random_percent) < 0 ||
+                random_percent < 0 || random_percent > 100) {
+                error_report("Invalid random percentage specified");
+                return 1;
+            }
+            break;
+        case OPTION_ZIPF:
+            if (qemu_strtod(optarg, NULL, &zipf_theta) < 0 ||
+                !(zipf_theta > 0)) {
+                error_report("Invalid Zipf exponent specified");
+                return 1;
+            }
+            break;
+        case OPTION_JOBS:
+            if (qemu_strtoi(optarg, NULL, 0, &nb_jobs) < 0 ||
+                nb_jobs < 1 || nb_jobs > BENCH_MAX_JOBS) {
+                error_report("Invalid number of jobs specified, must be "
+                             "between 1 and %d", BENCH_MAX_JOBS);
+                return 1;
+            }
+            break;
+        case OPTION_IOTHREAD:
+            use_iothread = true;
+            break;
+        case OPTION_SEED:
+            if (qemu_strtoul(optarg, NULL, 0, &seed) < 0 || seed > UINT32_MAX) {
+                error_report("Invalid seed specified");
+                return 1;
+            }
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -4508,7 +5003,34 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    if (is_write && write_percent >= 0) {
+        error_report("-w and --write-percent are mutually exclusive");
+        return 1;
+    } else if (write_percent < 0) {
+        write_percent = is_write ? 100 : 0;
+    }
+    if (write_percent) {
+        flags |= BDRV_O_RDWR;
+    }
+
+    /* --zipf alone makes all requests random */
+    if (random_percent < 0) {
+        random_percent = zipf_theta ? 100 : 0;
+    } else if (zipf_theta && !random_percent) {
+        error_report("--zipf requires random requests");
+        return 1;
+    }
+
+    if (!write_percent && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -4532,56 +5054,151 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (random_percent && image_size < bufsize) {
+        error_report("Image too small for random requests of %zu bytes",
+                     bufsize);
+        ret = -1;
+        goto out;
+    }
+    if (zipf_theta) {
+        bench_zipf_init(&zipf, image_size / bufsize, zipf_theta);
+    }
+
+    if (use_iothread) {
+        iothread = iothread_create("bench-iothread", &local_err);
+        if (!iothread) {
+            error_report_err(local_err);
+            ret = -1;
+            goto out;
+        }
+        ctx = iothread_get_aio_context(iothread);
+
+        aio_context_acquire(qemu_get_aio_context());
+        ret = blk_set_aio_context(blk, ctx, &local_err);
+        aio_context_release(qemu_get_aio_context());
+        if (ret < 0) {
+            error_report_err(local_err);
+            ctx = qemu_get_aio_context();
+            goto out;
+        }
     }
 
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    if (output_format == OFORMAT_HUMAN) {
+        printf("Sending %d %s requests, %zu bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %zu)\n",
+               count, write_percent == 100 ? "write" :
+                      write_percent ? "mixed" : "read",
+               bufsize, depth, offset, step ?: bufsize);
+        if (write_percent && write_percent < 100) {
+            printf("%d%% of the requests are writes\n", write_percent);
+        }
+        if (random_percent) {
+            printf("%d%% of the requests are at %s random offsets\n",
+                   random_percent,
+                   zipf_theta ? "Zipf distributed" : "uniformly distributed");
+        }
+        if (nb_jobs > 1) {
+            printf("Running %d jobs%s\n", nb_jobs,
+                   use_iothread ? " in an I/O thread" : "");
+        } else if (use_iothread) {
+            printf("Running in an I/O thread\n");
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
+    }
+
+    buf_size = nb_jobs * depth * bufsize;
+    buf = blk_blockalign(blk, buf_size);
+    memset(buf, pattern, buf_size);
+
+    blk_register_buf(blk, buf, buf_size);
+
+    bench_stats_init(&stats[0]);
+    bench_stats_init(&stats[1]);
+
+    /* Every job starts in its own part of the image */
+    jobs = g_new0(BenchData, nb_jobs);
+    for (i = 0; i < nb_jobs; i++) {
+        BenchData *b = &jobs[i];
+        int64_t job_offset = i * QEMU_ALIGN_DOWN(image_size / nb_jobs, bufsize);
+
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .write_percent  = write_percent,
+            .random_percent = random_percent,
+            .zipf           = zipf_theta ? &zipf : NULL,
+            .rand           = g_rand_new_with_seed(seed + i),
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .n              = count,
+            .offset         = (offset + job_offset) % image_size,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .reqs           = g_new0(BenchRequest, depth),
+            .stats          = stats,
+            .jobs_running   = &jobs_running,
+        };
 
-    blk_register_buf(blk, data.buf, buf_size);
+        for (j = 0; j < depth; j++) {
+            BenchRequest *req = &b->reqs[j];
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+            req->b = b;
+            qemu_iovec_init(&req->qiov, 1);
+            qemu_iovec_add(&req->qiov, buf + (i * depth + j) * bufsize,
+                           bufsize);
+            QSLIST_INSERT_HEAD(&b->free_reqs, req, next);
+        }
     }
 
+    jobs_running = nb_jobs;
+    aio_context_acquire(ctx);
     gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
-
-    while (data.n > 0) {
-        main_loop_wait(false);
+    for (i = 0; i < nb_jobs; i++) {
+        bench_submit(&jobs[i]);
+        bench_check_done(&jobs[i]);
     }
+    AIO_WAIT_WHILE(ctx, atomic_read(&jobs_running) > 0);
     gettimeofday(&t2, NULL);
+    aio_context_release(ctx);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    elapsed = (t2.tv_sec - t1.tv_sec) +
+              ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    if (output_format == OFORMAT_JSON) {
+        bench_dump_json(stats, nb_jobs, elapsed);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", elapsed);
+        bench_dump_human(stats, elapsed);
+    }
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf);
+    if (iothread) {
+        /* Move the image back so that it can be closed in the main loop */
+        if (ctx != qemu_get_aio_context()) {
+            aio_context_acquire(ctx);
+            blk_set_aio_context(blk, qemu_get_aio_context(), NULL);
+            aio_context_release(ctx);
+        }
+        iothread_destroy(iothread);
+    }
+    if (jobs) {
+        for (i = 0; i < nb_jobs; i++) {
+            for (j = 0; j < depth; j++) {
+                qemu_iovec_destroy(&jobs[i].reqs[j].qiov);
+            }
+            g_free(jobs[i].reqs);
+            g_rand_free(jobs[i].rand);
+        }
+        g_free(jobs);
     }
-    qemu_vfree(data.buf);
+    block_latency_histogram_destroy(&stats[0].latency_histogram);
+    block_latency_histogram_destroy(&stats[1].latency_histogram);
+    if (buf) {
+        blk_unregister_buf(blk, buf);
+    }
+    qemu_vfree(buf);
     blk_unref(blk);
 
     if (ret) {
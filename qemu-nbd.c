@@ -39,6 +39,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/iothread.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
 #include "crypto/init.h"
@@ -62,6 +63,7 @@
 #define QEMU_NBD_OPT_FORK          263
 #define QEMU_NBD_OPT_TLSAUTHZ      264
 #define QEMU_NBD_OPT_PID_FILE      265
+#define QEMU_NBD_OPT_IOTHREADS     266
 
 #define MBR_SIZE 512
 
@@ -72,6 +74,7 @@ static SocketAddress *saddr;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
+static int nb_iothreads;
 static int nb_fds;
 static QIONetListener *server;
 static QCryptoTLSCreds *tlscreds;
@@ -93,6 +96,7 @@ static void usage(const char *name)
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"  --iothreads=NUM           serve client connections in NUM I/O threads\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name (default is empty string)\n"
@@ -560,6 +564,7 @@ int main(int argc, char **argv)
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
         { "pid-file", required_argument, NULL, QEMU_NBD_OPT_PID_FILE },
+        { "iothreads", required_argument, NULL, QEMU_NBD_OPT_IOTHREADS },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -784,6 +789,13 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_PID_FILE:
             pid_file_name = optarg;
             break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            if (qemu_strtoi(optarg, NULL, 0, &nb_iothreads) < 0 ||
+                nb_iothreads < 1) {
+                error_report("Invalid number of I/O threads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         }
     }
 
@@ -1064,6 +1076,19 @@ int main(int argc, char **argv)
                             nbd_export_closed, writethrough, NULL,
                             &error_fatal);
 
+    if (nb_iothreads) {
+        g_autofree AioContext **ctxs = g_new(AioContext *, nb_iothreads);
+        int i;
+
+        for (i = 0; i < nb_iothreads; i++) {
+            g_autofree char *id = g_strdup_printf("nbd-iothread%d", i);
+
+            ctxs[i] = iothread_get_aio_context(iothread_create(id,
+                                                               &error_fatal));
+        }
+        nbd_export_set_connection_contexts(export, ctxs, nb_iothreads);
+    }
+
     if (device) {
 #if HAVE_NBD_DEVICE
         int ret;
@@ -94,8 +94,10 @@ static void help(void)
 "\n"
 "  --export [type=]nbd,device=<node-name>[,name=<export-name>]\n"
 "           [,writable=on|off][,bitmap=<name>]\n"
+"           [,iothreads.0=<iothread-id>[,iothreads.1=...]]\n"
 "                         export the specified block node over NBD\n"
-"                         (requires --nbd-server)\n"
+"                         (requires --nbd-server); client connections\n"
+"                         are spread over the given iothreads\n"
 "\n"
 "  --monitor [chardev=]name[,mode=control][,pretty[=on|off]]\n"
 "                         configure a QMP monitor\n"
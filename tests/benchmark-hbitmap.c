@@ -0,0 +1,129 @@
+/*
+ * HBitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* One bit per 64 KiB cluster of a 4 TiB disk */
+#define BENCH_BITS (64 * MiB)
+
+typedef struct HBitmapBenchOpts {
+    const char *name;
+    /* Every @stride bits, a run of @run bits is set */
+    uint64_t stride;
+    uint64_t run;
+} HBitmapBenchOpts;
+
+static HBitmap *bench_bitmap_new(const HBitmapBenchOpts *opts, uint64_t shift)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_BITS, 0);
+    uint64_t i;
+
+    for (i = shift % opts->stride; i < BENCH_BITS; i += opts->stride) {
+        hbitmap_set(hb, i, MIN(opts->run, BENCH_BITS - i));
+    }
+    return hb;
+}
+
+static void test_merge_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *a = bench_bitmap_new(opts, 0);
+    HBitmap *b = bench_bitmap_new(opts, opts->stride / 2);
+    HBitmap *result = hbitmap_alloc(BENCH_BITS, 0);
+    const int iterations = 50;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        g_assert(hbitmap_merge(a, b, result));
+    }
+    g_test_timer_elapsed();
+
+    g_print("%.2f merges/sec ", iterations / g_test_timer_last());
+
+    hbitmap_free(result);
+    hbitmap_free(b);
+    hbitmap_free(a);
+}
+
+static void test_next_dirty_area_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = bench_bitmap_new(opts, 0);
+    const int iterations = 10;
+    int64_t offset, count;
+    uint64_t areas = 0;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        for (offset = 0;
+             hbitmap_next_dirty_area(hb, offset, BENCH_BITS, INT64_MAX,
+                                     &offset, &count);
+             offset += count) {
+            areas++;
+        }
+    }
+    g_test_timer_elapsed();
+
+    g_print("%.2f scans/sec (%" PRIu64 " areas) ",
+            iterations / g_test_timer_last(), areas / iterations);
+
+    hbitmap_free(hb);
+}
+
+static void test_set_reset_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = bench_bitmap_new(opts, 0);
+    const int iterations = 50;
+    int i;
+
+    /* Both operations recount the bits in the range they touch */
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        hbitmap_set(hb, 0, BENCH_BITS / 2);
+        hbitmap_reset(hb, BENCH_BITS / 4, BENCH_BITS / 2);
+    }
+    g_test_timer_elapsed();
+
+    g_print("%.2f set/reset pairs/sec ", iterations / g_test_timer_last());
+
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    static const HBitmapBenchOpts opts[] = {
+        { .name = "sparse", .stride = 64 * 1024 + 7, .run = 3 },
+        { .name = "dense", .stride = 1024, .run = 1000 },
+    };
+    char *name;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        name = g_strdup_printf("/hbitmap/benchmark/merge/%s", opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_merge_speed);
+        g_free(name);
+
+        name = g_strdup_printf("/hbitmap/benchmark/next-dirty-area/%s",
+                               opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_next_dirty_area_speed);
+        g_free(name);
+
+        name = g_strdup_printf("/hbitmap/benchmark/set-reset/%s",
+                               opts[i].name);
+        g_test_add_data_func(name, &opts[i], test_set_reset_speed);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
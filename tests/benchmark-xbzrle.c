@@ -0,0 +1,104 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+
+typedef struct XBZRLEBenchOpts {
+    const char *name;
+    /* changed runs per page, and their maximum length */
+    int runs;
+    int run_len;
+} XBZRLEBenchOpts;
+
+static const XBZRLEBenchOpts bench_opts[] = {
+    { "unchanged", 0, 0 },
+    { "sparse", 4, 8 },
+    { "dense", 64, 16 },
+    { "long-runs", 8, 256 },
+};
+
+static void xbzrle_bench(const XBZRLEBenchOpts *opts)
+{
+    const int pages = 256;
+    const size_t total = 1 * GiB;
+    uint8_t *old = g_malloc(PAGE_SIZE * pages);
+    uint8_t *new = g_malloc(PAGE_SIZE * pages);
+    uint8_t *compressed = g_malloc(PAGE_SIZE * pages);
+    int *dlen = g_new(int, pages);
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    size_t done;
+    int i, j, k, len;
+    double encode, decode;
+
+    for (i = 0; i < PAGE_SIZE * pages; i++) {
+        old[i] = new[i] = g_test_rand_int();
+    }
+    for (i = 0; i < pages; i++) {
+        for (j = 0; j < opts->runs; j++) {
+            k = g_test_rand_int_range(0, PAGE_SIZE);
+            len = g_test_rand_int_range(1, opts->run_len + 1);
+            for (; len && k < PAGE_SIZE; len--, k++) {
+                new[i * PAGE_SIZE + k] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+
+    g_test_timer_start();
+    for (done = 0; done < total; done += PAGE_SIZE * pages) {
+        for (i = 0; i < pages; i++) {
+            dlen[i] = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                           new + i * PAGE_SIZE, PAGE_SIZE,
+                                           compressed + i * PAGE_SIZE,
+                                           PAGE_SIZE);
+        }
+    }
+    encode = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (done = 0; done < total; done += PAGE_SIZE * pages) {
+        for (i = 0; i < pages; i++) {
+            if (dlen[i] > 0) {
+                xbzrle_decode_buffer(compressed + i * PAGE_SIZE, dlen[i],
+                                     buffer, PAGE_SIZE);
+            }
+        }
+    }
+    decode = g_test_timer_elapsed();
+
+    g_print("\n%s/%s: encode %.2f MB/sec decode %.2f MB/sec ",
+            xbzrle_accel_name(), opts->name, (double)total / MiB / encode,
+            (double)total / MiB / decode);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(dlen);
+    g_free(buffer);
+}
+
+/* Measure every encoder and decoder that the host supports */
+static void test_xbzrle_speed(void)
+{
+    int i;
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(bench_opts); i++) {
+            xbzrle_bench(&bench_opts[i]);
+        }
+    } while (test_xbzrle_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/benchmark", test_xbzrle_speed);
+
+    return g_test_run();
+}
@@ -117,6 +117,18 @@ class Qcow2BitmapExt(Qcow2Struct):
 QCOW2_EXT_MAGIC_BITMAPS = 0x23852875
 
 
+class Qcow2ExtentIndexExt(Qcow2Struct):
+
+    fields = (
+        ('u32', '{}', 'nb_entries'),
+        ('u32', '{}', 'reserved32'),
+        ('u64', '{:#x}', 'index_offset')
+    )
+
+
+QCOW2_EXT_MAGIC_EXTENT_INDEX = 0x45585449
+
+
 class QcowHeaderExtension(Qcow2Struct):
 
     class Magic(Enum):
@@ -125,7 +137,8 @@ class QcowHeaderExtension(Qcow2Struct):
             0x6803f857: 'Feature table',
             0x0537be77: 'Crypto header',
             QCOW2_EXT_MAGIC_BITMAPS: 'Bitmaps',
-            0x44415441: 'Data file'
+            0x44415441: 'Data file',
+            QCOW2_EXT_MAGIC_EXTENT_INDEX: 'Extent index'
         }
 
     fields = (
@@ -167,6 +180,8 @@ class QcowHeaderExtension(Qcow2Struct):
 
         if self.magic == QCOW2_EXT_MAGIC_BITMAPS:
             self.obj = Qcow2BitmapExt(data=self.data)
+        elif self.magic == QCOW2_EXT_MAGIC_EXTENT_INDEX:
+            self.obj = Qcow2ExtentIndexExt(data=self.data)
         else:
             self.obj = None
 
@@ -193,6 +193,42 @@ static void test_multi_co_schedule_10(void)
     test_multi_co_schedule(10);
 }
 
+/* aio_co_reschedule_self test.  */
+
+#define RESCHEDULE_HOPS 100
+
+static int reschedule_hops;
+
+static coroutine_fn void test_multi_co_reschedule_entry(void *opaque)
+{
+    int i, n;
+
+    for (i = 0; i < RESCHEDULE_HOPS; i++) {
+        /* The first hop is to the context we are already running in */
+        n = i % NUM_CONTEXTS;
+        aio_co_reschedule_self(ctx[n]);
+        g_assert_cmpint(id, ==, n);
+        reschedule_hops++;
+    }
+    qemu_event_set(&done_event);
+}
+
+static void test_multi_co_reschedule(void)
+{
+    Coroutine *co;
+
+    reschedule_hops = 0;
+    create_aio_contexts();
+
+    qemu_event_reset(&done_event);
+    co = qemu_coroutine_create(test_multi_co_reschedule_entry, NULL);
+    aio_co_schedule(ctx[0], co);
+    qemu_event_wait(&done_event);
+    g_assert_cmpint(reschedule_hops, ==, RESCHEDULE_HOPS);
+
+    join_aio_contexts();
+}
+
 /* CoMutex thread-safety.  */
 
 static uint32_t atomic_counter;
@@ -439,6 +475,7 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/aio/multi/lifecycle", test_lifecycle);
+    g_test_add_func("/aio/multi/reschedule", test_multi_co_reschedule);
     if (g_test_quick()) {
         g_test_add_func("/aio/multi/schedule", test_multi_co_schedule_1);
         g_test_add_func("/aio/multi/mutex/contended", test_multi_co_mutex_1);
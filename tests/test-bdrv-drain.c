@@ -2131,6 +2131,212 @@ static void test_replace_child_mid_drain(void)
     }
 }
 
+/*
+ * Simple reads and writes bypass the tracked requests list while no
+ * serialising request is in flight.  Requests in this driver wait until the
+ * test releases them, in the order in which they entered the driver.
+ */
+#define UNTRACKED_TEST_MAX_REQS 8
+
+typedef struct BDRVUntrackedTestState {
+    /* requests that entered the driver, and that may leave it */
+    int started;
+    int released;
+    Coroutine *waiting[UNTRACKED_TEST_MAX_REQS];
+} BDRVUntrackedTestState;
+
+static int coroutine_fn bdrv_untracked_test_co_rw(BlockDriverState *bs)
+{
+    BDRVUntrackedTestState *s = bs->opaque;
+    int n = s->started++;
+
+    g_assert_cmpint(n, <, UNTRACKED_TEST_MAX_REQS);
+    if (n >= s->released) {
+        s->waiting[n] = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return 0;
+}
+
+static int coroutine_fn bdrv_untracked_test_co_preadv(BlockDriverState *bs,
+                                                      uint64_t offset,
+                                                      uint64_t bytes,
+                                                      QEMUIOVector *qiov,
+                                                      int flags)
+{
+    return bdrv_untracked_test_co_rw(bs);
+}
+
+static int coroutine_fn bdrv_untracked_test_co_pwritev(BlockDriverState *bs,
+                                                       uint64_t offset,
+                                                       uint64_t bytes,
+                                                       QEMUIOVector *qiov,
+                                                       int flags)
+{
+    return bdrv_untracked_test_co_rw(bs);
+}
+
+static int64_t bdrv_untracked_test_getlength(BlockDriverState *bs)
+{
+    return 64 * 1024;
+}
+
+static BlockDriver bdrv_untracked_test = {
+    .format_name            = "untracked-test",
+    .instance_size          = sizeof(BDRVUntrackedTestState),
+
+    .bdrv_co_preadv         = bdrv_untracked_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_untracked_test_co_pwritev,
+    .bdrv_getlength         = bdrv_untracked_test_getlength,
+
+    .bdrv_child_perm        = bdrv_default_perms,
+};
+
+/* Let the oldest request that entered the driver complete */
+static void untracked_test_wake(BDRVUntrackedTestState *s)
+{
+    int n = s->released++;
+    Coroutine *co = s->waiting[n];
+
+    if (co) {
+        s->waiting[n] = NULL;
+        aio_co_wake(co);
+    }
+}
+
+static void untracked_test_wake_bh(void *opaque)
+{
+    untracked_test_wake(opaque);
+}
+
+static void untracked_test_release(BDRVUntrackedTestState *s)
+{
+    untracked_test_wake(s);
+    while (aio_poll(qemu_get_aio_context(), false)) {
+        /* Let the requests that were waiting for it reach the driver */
+    }
+}
+
+static BlockBackend *untracked_test_blk_new(BDRVUntrackedTestState **s)
+{
+    BlockBackend *blk;
+    BlockDriverState *bs;
+
+    blk = blk_new(qemu_get_aio_context(), BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_untracked_test, "test-node", BDRV_O_RDWR,
+                              &error_abort);
+    blk_insert_bs(blk, bs, &error_abort);
+    bdrv_unref(bs);
+
+    *s = bs->opaque;
+    return blk;
+}
+
+static void test_untracked_drain(void)
+{
+    BDRVUntrackedTestState *s;
+    BlockBackend *blk = untracked_test_blk_new(&s);
+    BlockDriverState *bs = blk_bs(blk);
+    QEMUIOVector qiov = QEMU_IOVEC_INIT_BUF(qiov, NULL, 4096);
+    int aio_ret = -EINPROGRESS;
+
+    blk_aio_preadv(blk, 0, &qiov, 0, aio_ret_cb, &aio_ret);
+    g_assert_cmpint(s->started, ==, 1);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 1);
+    g_assert(QLIST_EMPTY(&bs->tracked_requests));
+
+    /* Drain may only return once the untracked request has completed */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), untracked_test_wake_bh, s);
+    bdrv_drained_begin(bs);
+    g_assert_cmpint(aio_ret, ==, 0);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 0);
+    g_assert_cmpint(bs->in_flight, ==, 0);
+    bdrv_drained_end(bs);
+
+    blk_unref(blk);
+}
+
+static void test_untracked_serialising(void)
+{
+    BDRVUntrackedTestState *s;
+    BlockBackend *blk = untracked_test_blk_new(&s);
+    BlockDriverState *bs = blk_bs(blk);
+    QEMUIOVector qiov = QEMU_IOVEC_INIT_BUF(qiov, NULL, 4096);
+    int ret_simple = -EINPROGRESS;
+    int ret_serialising = -EINPROGRESS;
+    int ret_read = -EINPROGRESS;
+
+    blk_aio_pwritev(blk, 0, &qiov, 0, aio_ret_cb, &ret_simple);
+    g_assert_cmpint(s->started, ==, 1);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 1);
+
+    /* The serialising write waits for the untracked one */
+    blk_aio_pwritev(blk, 0, &qiov, BDRV_REQ_SERIALISING, aio_ret_cb,
+                    &ret_serialising);
+    g_assert_cmpint(s->started, ==, 1);
+    g_assert_cmpint(bs->serialising_in_flight, ==, 1);
+
+    /* A simple read must not bypass the serialising write now */
+    blk_aio_preadv(blk, 0, &qiov, 0, aio_ret_cb, &ret_read);
+    g_assert_cmpint(s->started, ==, 1);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 1);
+
+    untracked_test_release(s);
+    g_assert_cmpint(ret_simple, ==, 0);
+    g_assert_cmpint(s->started, ==, 2);
+    g_assert_cmpint(ret_serialising, ==, -EINPROGRESS);
+
+    untracked_test_release(s);
+    g_assert_cmpint(ret_serialising, ==, 0);
+    g_assert_cmpint(s->started, ==, 3);
+    g_assert_cmpint(ret_read, ==, -EINPROGRESS);
+
+    untracked_test_release(s);
+    g_assert_cmpint(ret_read, ==, 0);
+    g_assert_cmpint(bs->serialising_in_flight, ==, 0);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 0);
+
+    blk_unref(blk);
+}
+
+static void test_untracked_copy_on_read(void)
+{
+    BDRVUntrackedTestState *s;
+    BlockBackend *blk = untracked_test_blk_new(&s);
+    BlockDriverState *bs = blk_bs(blk);
+    QEMUIOVector qiov = QEMU_IOVEC_INIT_BUF(qiov, NULL, 4096);
+    int ret_simple = -EINPROGRESS;
+    int ret_cor = -EINPROGRESS;
+    int ret_write = -EINPROGRESS;
+
+    blk_aio_pwritev(blk, 0, &qiov, 0, aio_ret_cb, &ret_simple);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 1);
+
+    /* Copy-on-read is serialising, so it waits for the untracked write */
+    blk_aio_preadv(blk, 0, &qiov, BDRV_REQ_COPY_ON_READ, aio_ret_cb,
+                   &ret_cor);
+    g_assert_cmpint(s->started, ==, 1);
+
+    untracked_test_release(s);
+    g_assert_cmpint(ret_simple, ==, 0);
+    g_assert_cmpint(s->started, ==, 2);
+
+    /* A simple write must wait for the copy-on-read request */
+    blk_aio_pwritev(blk, 0, &qiov, 0, aio_ret_cb, &ret_write);
+    g_assert_cmpint(s->started, ==, 2);
+    g_assert_cmpint(bs->untracked_in_flight, ==, 0);
+
+    untracked_test_release(s);
+    g_assert_cmpint(ret_cor, ==, 0);
+    g_assert_cmpint(s->started, ==, 3);
+
+    untracked_test_release(s);
+    g_assert_cmpint(ret_write, ==, 0);
+    g_assert_cmpint(bs->serialising_in_flight, ==, 0);
+
+    blk_unref(blk);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -2223,6 +2429,12 @@ int main(int argc, char **argv)
     g_test_add_func("/bdrv-drain/replace_child/mid-drain",
                     test_replace_child_mid_drain);
 
+    g_test_add_func("/bdrv-drain/untracked/drain", test_untracked_drain);
+    g_test_add_func("/bdrv-drain/untracked/serialising",
+                    test_untracked_serialising);
+    g_test_add_func("/bdrv-drain/untracked/copy-on-read",
+                    test_untracked_copy_on_read);
+
     ret = g_test_run();
     qemu_event_destroy(&done_event);
     return ret;
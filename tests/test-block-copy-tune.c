@@ -0,0 +1,230 @@
+/*
+ * Block copy adaptive controller tests
+ *
+ * The controller is fed with the completion times of a simulated target,
+ * driven by a synthetic clock.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/block-copy.h"
+
+#define MAX_WORKERS 64
+
+/*
+ * A simulated target: each request has a fixed overhead plus a transfer time
+ * at the bandwidth a single request can reach, but all requests in flight
+ * together cannot exceed the total bandwidth of the target.
+ */
+typedef struct TestTarget {
+    int64_t overhead_ns;
+    double request_bw;  /* bytes per ns */
+    double total_bw;    /* bytes per ns */
+} TestTarget;
+
+typedef struct TestRun {
+    BlockCopyTuner *tuner;
+    const TestTarget *target;
+    int64_t now;
+    bool busy[MAX_WORKERS];
+    int64_t start[MAX_WORKERS];
+    int64_t end[MAX_WORKERS];
+    int64_t bytes[MAX_WORKERS];
+} TestRun;
+
+static int64_t test_target_latency(const TestTarget *target, int workers,
+                                   int64_t bytes)
+{
+    double single = target->overhead_ns + bytes / target->request_bw;
+    double shared = workers * bytes / target->total_bw;
+
+    return MAX(single, shared);
+}
+
+static void check_limits(BlockCopyTuner *t)
+{
+    int64_t chunk = block_copy_tuner_chunk_size(t);
+
+    g_assert_cmpint(chunk, >=, t->min_chunk_size);
+    g_assert_cmpint(chunk, <=, t->max_chunk_size);
+    g_assert_cmpint(chunk % t->min_chunk_size, ==, 0);
+    g_assert_cmpint(t->max_workers, >=, 1);
+    g_assert_cmpint(t->max_workers, <=, t->workers_limit);
+}
+
+/*
+ * Keep as many requests in flight as the controller allows until the next
+ * measurement interval ends.
+ */
+static void test_run_interval(TestRun *r)
+{
+    BlockCopyTuner *t = r->tuner;
+    bool tuned = false;
+    int i;
+
+    g_assert_cmpint(t->workers_limit, <=, MAX_WORKERS);
+
+    while (!tuned) {
+        int next = -1;
+
+        for (i = 0; i < t->max_workers; i++) {
+            if (!r->busy[i]) {
+                r->busy[i] = true;
+                r->start[i] = r->now;
+                r->bytes[i] = block_copy_tuner_chunk_size(t);
+                r->end[i] = r->now + test_target_latency(r->target,
+                                                         t->max_workers,
+                                                         r->bytes[i]);
+                block_copy_tuner_request_start(t, r->now);
+            }
+        }
+
+        for (i = 0; i < MAX_WORKERS; i++) {
+            if (r->busy[i] && (next < 0 || r->end[i] < r->end[next])) {
+                next = i;
+            }
+        }
+
+        r->now = r->end[next];
+        r->busy[next] = false;
+        tuned = block_copy_tuner_request_end(t, r->start[next], r->now,
+                                             r->bytes[next], true);
+        check_limits(t);
+    }
+}
+
+/*
+ * Each request takes about 10 ms regardless of the others: the largest
+ * requests with the most workers are best, and the controller must not
+ * wander off from there.
+ */
+static void test_latency_bound(void)
+{
+    const TestTarget target = {
+        .overhead_ns = 10 * SCALE_MS,
+        .request_bw = 1.0,
+        .total_bw = 1000.0,
+    };
+    BlockCopyTuner t;
+    TestRun r = { .tuner = &t, .target = &target };
+    int i;
+
+    block_copy_tuner_init(&t, 1 * MiB, 64 * KiB, MAX_WORKERS);
+
+    for (i = 0; i < 20; i++) {
+        test_run_interval(&r);
+        g_assert_cmpint(block_copy_tuner_chunk_size(&t), >=, 512 * KiB);
+        g_assert_cmpint(t.max_workers, >=, MAX_WORKERS / 2);
+    }
+}
+
+/*
+ * The target is saturated by a single request: the controller should cut
+ * down the amount of data in flight, which only adds latency, without
+ * losing throughput.
+ */
+static void test_bandwidth_bound(void)
+{
+    const TestTarget target = {
+        .overhead_ns = 1 * SCALE_MS,
+        .request_bw = 1.0,
+        .total_bw = 0.2,
+    };
+    BlockCopyTuner t;
+    TestRun r = { .tuner = &t, .target = &target };
+    int i;
+
+    block_copy_tuner_init(&t, 1 * MiB, 64 * KiB, MAX_WORKERS);
+
+    for (i = 0; i < 16; i++) {
+        test_run_interval(&r);
+    }
+
+    for (i = 0; i < 8; i++) {
+        test_run_interval(&r);
+        g_assert_cmpint(block_copy_tuner_chunk_size(&t) * t.max_workers, <=,
+                        4 * MiB);
+        g_assert_cmpint(t.throughput, >=,
+                        target.total_bw * NANOSECONDS_PER_SECOND * 95 / 100);
+    }
+}
+
+/*
+ * Requests that are not accounted (e.g. because they only found zeroes)
+ * never end a measurement interval, however long they take.
+ */
+static void test_unaccounted(void)
+{
+    BlockCopyTuner t;
+    int64_t now = 0, busy_ns;
+    int i;
+
+    block_copy_tuner_init(&t, 1 * MiB, 64 * KiB, MAX_WORKERS);
+
+    for (i = 0; i < 4 * BLOCK_COPY_TUNE_MIN_REQUESTS; i++) {
+        block_copy_tuner_request_start(&t, now);
+        now += BLOCK_COPY_TUNE_INTERVAL_NS;
+        g_assert_false(block_copy_tuner_request_end(&t, now - 1, now,
+                                                    1 * MiB, false));
+    }
+
+    /* Too few requests for a measurement, however long they take */
+    for (i = 0; i < BLOCK_COPY_TUNE_MIN_REQUESTS - 1; i++) {
+        block_copy_tuner_request_start(&t, now);
+        now += BLOCK_COPY_TUNE_INTERVAL_NS;
+        g_assert_false(block_copy_tuner_request_end(&t, now - 1, now,
+                                                    1 * MiB, true));
+    }
+
+    g_assert_cmpint(block_copy_tuner_chunk_size(&t), ==, 1 * MiB);
+    g_assert_cmpint(t.max_workers, ==, MAX_WORKERS);
+
+    /* Idle time does not count as busy time */
+    busy_ns = t.busy_ns;
+    now += 100 * NANOSECONDS_PER_SECOND;
+    block_copy_tuner_request_start(&t, now);
+    g_assert_cmpint(t.busy_ns, ==, busy_ns);
+
+    /* The first complete interval starts reducing the number of workers */
+    now += 1000;
+    g_assert_true(block_copy_tuner_request_end(&t, now - 1000, now,
+                                               1 * MiB, true));
+    g_assert_cmpint(block_copy_tuner_chunk_size(&t), ==, 1 * MiB);
+    g_assert_cmpint(t.max_workers, ==, MAX_WORKERS / 2);
+}
+
+/* The user of the tuner may lower the maximum request size at any time */
+static void test_max_chunk_size(void)
+{
+    const TestTarget target = {
+        .overhead_ns = 10 * SCALE_MS,
+        .request_bw = 1.0,
+        .total_bw = 1000.0,
+    };
+    BlockCopyTuner t;
+    TestRun r = { .tuner = &t, .target = &target };
+    int i;
+
+    block_copy_tuner_init(&t, 1 * MiB, 64 * KiB, MAX_WORKERS);
+    test_run_interval(&r);
+
+    t.max_chunk_size = 192 * KiB;
+    g_assert_cmpint(block_copy_tuner_chunk_size(&t), ==, 192 * KiB);
+
+    for (i = 0; i < 8; i++) {
+        test_run_interval(&r);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/block-copy/tune/latency-bound", test_latency_bound);
+    g_test_add_func("/block-copy/tune/bandwidth-bound", test_bandwidth_bound);
+    g_test_add_func("/block-copy/tune/unaccounted", test_unaccounted);
+    g_test_add_func("/block-copy/tune/max-chunk-size", test_max_chunk_size);
+    return g_test_run();
+}
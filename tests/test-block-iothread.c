@@ -29,6 +29,7 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "iothread.h"
 
 static int coroutine_fn bdrv_test_co_prwv(BlockDriverState *bs,
@@ -625,7 +626,7 @@ static void test_propagate_mirror(void)
     mirror_start("job0", src, target, NULL, JOB_DEFAULT, 0, 0, 0,
                  MIRROR_SYNC_MODE_NONE, MIRROR_OPEN_BACKING_CHAIN, false,
                  BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
-                 false, "filter_node", MIRROR_COPY_MODE_BACKGROUND,
+                 false, "filter_node", MIRROR_COPY_MODE_BACKGROUND, 0,
                  &error_abort);
     job = job_get("job0");
     filter = bdrv_find_node("filter_node");
@@ -749,6 +750,133 @@ static void test_attach_preserve_blk_ctx(void)
     blk_unref(blk);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+#define FIXED_BUF_SIZE (64 * KiB)
+#define FIXED_BUF_REQS 16
+
+typedef struct FixedBufRequest {
+    QEMUIOVector qiov;
+    int ret;
+} FixedBufRequest;
+
+static void fixed_buf_request_cb(void *opaque, int ret)
+{
+    FixedBufRequest *req = opaque;
+
+    req->ret = ret;
+}
+
+/*
+ * Issue a request for each slice of @buf.  @other is unregistered after
+ * the first half has been handed to the ring, which moves @buf to another
+ * index in the table of fixed buffers while those requests may not even
+ * have been consumed by the kernel yet, and registered again afterwards.
+ */
+static void fixed_buf_run_requests(BlockBackend *blk, uint8_t *buf,
+                                   uint8_t *other, bool is_write)
+{
+    const int req_size = FIXED_BUF_SIZE / FIXED_BUF_REQS;
+    FixedBufRequest reqs[FIXED_BUF_REQS];
+    int i;
+
+    blk_io_plug(blk);
+    for (i = 0; i < FIXED_BUF_REQS; i++) {
+        FixedBufRequest *req = &reqs[i];
+
+        if (i == FIXED_BUF_REQS / 2) {
+            blk_io_unplug(blk);
+            blk_unregister_buf(blk, other);
+            blk_io_plug(blk);
+        }
+
+        req->ret = -EINPROGRESS;
+        qemu_iovec_init_buf(&req->qiov, buf + i * req_size, req_size);
+        if (is_write) {
+            blk_aio_pwritev(blk, i * req_size, &req->qiov, 0,
+                            fixed_buf_request_cb, req);
+        } else {
+            blk_aio_preadv(blk, i * req_size, &req->qiov, 0,
+                           fixed_buf_request_cb, req);
+        }
+    }
+    blk_io_unplug(blk);
+
+    for (i = 0; i < FIXED_BUF_REQS; i++) {
+        while (reqs[i].ret == -EINPROGRESS) {
+            aio_poll(qemu_get_aio_context(), true);
+        }
+        g_assert_cmpint(reqs[i].ret, ==, 0);
+    }
+    blk_register_buf(blk, other, FIXED_BUF_SIZE);
+}
+
+static void test_io_uring_fixed_buffers(const void *opaque)
+{
+    bool sqpoll = GPOINTER_TO_INT(opaque);
+    const int req_size = FIXED_BUF_SIZE / FIXED_BUF_REQS;
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    QDict *options;
+    Error *local_err = NULL;
+    uint8_t *buf, *other;
+    char *filename;
+    int fd, i, j;
+
+    fd = g_file_open_tmp("qemu-test-io-uring-XXXXXX", &filename, NULL);
+    g_assert(fd >= 0);
+    g_assert(ftruncate(fd, FIXED_BUF_SIZE) == 0);
+    close(fd);
+
+    options = qdict_new();
+    qdict_put_str(options, "driver", "file");
+    qdict_put_str(options, "filename", filename);
+    qdict_put_str(options, "aio", "io_uring");
+    qdict_put_str(options, "io-uring-fixed-buffers", "on");
+    if (sqpoll) {
+        qdict_put_str(options, "io-uring-sqpoll", "on");
+    }
+
+    bs = bdrv_open(NULL, NULL, options, BDRV_O_RDWR, &local_err);
+    if (!bs) {
+        /* The kernel may lack io_uring, or SQPOLL may need privileges */
+        g_test_skip(error_get_pretty(local_err));
+        error_free(local_err);
+        goto out;
+    }
+
+    blk = blk_new(qemu_get_aio_context(), BLK_PERM_ALL, BLK_PERM_ALL);
+    blk_insert_bs(blk, bs, &error_abort);
+
+    buf = qemu_blockalign(bs, FIXED_BUF_SIZE);
+    other = qemu_blockalign(bs, FIXED_BUF_SIZE);
+    blk_register_buf(blk, other, FIXED_BUF_SIZE);
+    blk_register_buf(blk, buf, FIXED_BUF_SIZE);
+
+    for (i = 0; i < FIXED_BUF_REQS; i++) {
+        memset(buf + i * req_size, i + 1, req_size);
+    }
+    fixed_buf_run_requests(blk, buf, other, true);
+
+    memset(buf, 0, FIXED_BUF_SIZE);
+    fixed_buf_run_requests(blk, buf, other, false);
+    for (i = 0; i < FIXED_BUF_REQS; i++) {
+        for (j = 0; j < req_size; j++) {
+            g_assert_cmpint(buf[i * req_size + j], ==, i + 1);
+        }
+    }
+
+    blk_unregister_buf(blk, buf);
+    blk_unregister_buf(blk, other);
+    qemu_vfree(buf);
+    qemu_vfree(other);
+    blk_unref(blk);
+    bdrv_unref(bs);
+out:
+    unlink(filename);
+    g_free(filename);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     int i;
@@ -769,6 +897,12 @@ int main(int argc, char **argv)
     g_test_add_func("/propagate/basic", test_propagate_basic);
     g_test_add_func("/propagate/diamond", test_propagate_diamond);
     g_test_add_func("/propagate/mirror", test_propagate_mirror);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_data_func("/io_uring/fixed_buffers", GINT_TO_POINTER(false),
+                         test_io_uring_fixed_buffers);
+    g_test_add_data_func("/io_uring/fixed_buffers_sqpoll",
+                         GINT_TO_POINTER(true), test_io_uring_fixed_buffers);
+#endif
 
     return g_test_run();
 }
@@ -911,6 +911,41 @@ static void test_hbitmap_next_x_4(TestHBitmapData *data, const void *unused)
     test_hbitmap_next_x_do(data, 4);
 }
 
+/* Run merge, count and next_zero on dense bitmaps with each of the
+ * vectorized word array helpers.
+ */
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    const uint64_t size = L2 * 4 + 17;
+    HBitmap *other;
+
+    do {
+        hbitmap_test_init(data, size, 0);
+        other = hbitmap_alloc(size, 0);
+
+        hbitmap_test_set(data, 0, L2 * 2);
+        hbitmap_test_set(data, L2 * 2 + 5, L2 - 3);
+        hbitmap_test_reset(data, L2 + L1 * 5 + 3, 1);
+        test_hbitmap_next_x_check(data, 1);
+        test_hbitmap_next_x_check(data, L2 * 2 + 7);
+
+        hbitmap_set(other, 3, L1);
+        hbitmap_set(other, L2 * 3, L2 + 17);
+        hbitmap_merge(data->hb, other, data->hb);
+        bitmap_set(data->bits, 3, L1);
+        bitmap_set(data->bits, L2 * 3, L2 + 17);
+        hbitmap_test_check(data, 0);
+        test_hbitmap_next_x_check(data, 0);
+        test_hbitmap_next_x_check(data, L2 * 3 + 1);
+
+        hbitmap_test_reset(data, L2 * 3 + 1, L2 * 2);
+        hbitmap_test_set(data, 0, size);
+
+        hbitmap_free(other);
+        hbitmap_test_teardown(data, NULL);
+    } while (test_hbitmap_next_accel());
+}
+
 static void test_hbitmap_next_x_after_truncate(TestHBitmapData *data,
                                                const void *unused)
 {
@@ -1104,6 +1139,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_zero/next_x_after_truncate",
                      test_hbitmap_next_x_after_truncate);
 
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_0",
                      test_hbitmap_next_dirty_area_0);
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_1",
@@ -25,6 +25,9 @@
 #include "socket-helpers.h"
 #include "qapi/error.h"
 #include "qemu/module.h"
+#include "qemu/coroutine.h"
+#include "block/aio.h"
+#include "iothread.h"
 
 
 static void test_io_channel_set_socket_bufs(QIOChannel *src,
@@ -551,6 +554,174 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct {
+    QIOChannelSocket *sioc;
+    AioContext *ctx;
+    bool is_write;
+    bool blocking;
+    char *buf;
+    size_t len;
+    int ret;
+    ssize_t probe_ret;
+    bool uring_in_use;
+    bool yielded;
+    QemuEvent waiting;
+    QemuEvent done;
+} TestUringData;
+
+static void test_io_channel_uring_check_bh(void *opaque)
+{
+    TestUringData *data = opaque;
+    QIOChannelSocket *sioc = data->sioc;
+
+    /*
+     * The coroutine is waiting for the peer, either for an operation on
+     * the io_uring or in qio_channel_yield()
+     */
+    data->uring_in_use = data->is_write ? sioc->write_op != NULL :
+                                          sioc->read_op != NULL;
+    data->yielded = data->is_write ? sioc->parent.write_coroutine != NULL :
+                                     sioc->parent.read_coroutine != NULL;
+    qemu_event_set(&data->waiting);
+}
+
+static void coroutine_fn test_io_channel_uring_co(void *opaque)
+{
+    TestUringData *data = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(data->sioc);
+
+    if (!data->blocking && !data->is_write) {
+        /*
+         * The peer hasn't written anything yet.  On a non-blocking socket
+         * the operation fails with EAGAIN instead of waiting for data,
+         * which must be reported like for a normal read.
+         */
+        char c;
+        struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+
+        data->probe_ret = QIO_CHANNEL_GET_CLASS(ioc)->io_co_readv(ioc, &iov, 1,
+                                                                  NULL);
+    }
+
+    /* Runs once the coroutine has yielded */
+    aio_bh_schedule_oneshot(data->ctx, test_io_channel_uring_check_bh, data);
+
+    if (data->is_write) {
+        data->ret = qio_channel_write_all(ioc, data->buf, data->len, NULL);
+    } else {
+        data->ret = qio_channel_read_all(ioc, data->buf, data->len, NULL);
+    }
+    qemu_event_set(&data->done);
+}
+
+/*
+ * Transfer data between a coroutine in an iothread, whose channel uses
+ * completion-based I/O, and a blocking channel in the main thread.  The
+ * socket buffers are much smaller than the data, so the coroutine goes
+ * through many partial operations on the io_uring.
+ *
+ * If @blocking is false, the coroutine's socket is non-blocking like the
+ * ones NBD uses.  Operations on it can fail with EAGAIN, so the coroutine
+ * also goes through QIO_CHANNEL_ERR_BLOCK and qio_channel_yield().
+ */
+static void test_io_channel_uring(bool is_write, bool blocking)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    size_t len = 4 * 1024 * 1024;
+    QIOChannel *ioc, *peer;
+    TestUringData data;
+    char *peer_buf;
+    int fds[2];
+    size_t i;
+
+    if (!aio_io_uring_available(ctx)) {
+        g_test_skip("The AioContext does not monitor fds with io_uring");
+        iothread_join(iothread);
+        return;
+    }
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    ioc = QIO_CHANNEL(qio_channel_socket_new_fd(fds[0], &error_abort));
+    peer = QIO_CHANNEL(qio_channel_socket_new_fd(fds[1], &error_abort));
+    test_io_channel_set_socket_bufs(ioc, peer);
+    qio_channel_set_blocking(ioc, blocking, &error_abort);
+    qio_channel_set_completion_io(ioc, true);
+    qio_channel_attach_aio_context(ioc, ctx);
+
+    data = (TestUringData) {
+        .sioc = QIO_CHANNEL_SOCKET(ioc),
+        .ctx = ctx,
+        .is_write = is_write,
+        .blocking = blocking,
+        .buf = g_malloc0(len),
+        .len = len,
+        .ret = -1,
+        .probe_ret = QIO_CHANNEL_ERR_BLOCK,
+    };
+    qemu_event_init(&data.waiting, false);
+    qemu_event_init(&data.done, false);
+
+    peer_buf = g_malloc0(len);
+    for (i = 0; i < len; i++) {
+        if (is_write) {
+            data.buf[i] = i % 251;
+        } else {
+            peer_buf[i] = i % 251;
+        }
+    }
+
+    aio_co_enter(ctx, qemu_coroutine_create(test_io_channel_uring_co, &data));
+    qemu_event_wait(&data.waiting);
+    g_assert_cmpint(data.probe_ret, ==, QIO_CHANNEL_ERR_BLOCK);
+    if (blocking) {
+        g_assert(data.uring_in_use);
+    } else {
+        g_assert(data.uring_in_use || data.yielded);
+    }
+
+    if (is_write) {
+        qio_channel_read_all(peer, peer_buf, len, &error_abort);
+    } else {
+        qio_channel_write_all(peer, peer_buf, len, &error_abort);
+    }
+    qemu_event_wait(&data.done);
+    g_assert_cmpint(data.ret, ==, 0);
+    g_assert(memcmp(data.buf, peer_buf, len) == 0);
+
+    qio_channel_detach_aio_context(ioc);
+    qemu_event_destroy(&data.waiting);
+    qemu_event_destroy(&data.done);
+    g_free(data.buf);
+    g_free(peer_buf);
+    object_unref(OBJECT(ioc));
+    object_unref(OBJECT(peer));
+    iothread_join(iothread);
+}
+
+static void test_io_channel_uring_read(void)
+{
+    test_io_channel_uring(false, true);
+}
+
+static void test_io_channel_uring_write(void)
+{
+    test_io_channel_uring(true, true);
+}
+
+static void test_io_channel_uring_read_nonblock(void)
+{
+    test_io_channel_uring(false, false);
+}
+
+static void test_io_channel_uring_write_nonblock(void)
+{
+    test_io_channel_uring(true, false);
+}
+#endif /* CONFIG_LINUX_IO_URING */
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -595,6 +766,16 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/socket/unix-listen-cleanup",
                     test_io_channel_unix_listen_cleanup);
 #endif /* _WIN32 */
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/io/channel/socket/io-uring-read",
+                    test_io_channel_uring_read);
+    g_test_add_func("/io/channel/socket/io-uring-write",
+                    test_io_channel_uring_write);
+    g_test_add_func("/io/channel/socket/io-uring-read-nonblock",
+                    test_io_channel_uring_read_nonblock);
+    g_test_add_func("/io/channel/socket/io-uring-write-nonblock",
+                    test_io_channel_uring_write_nonblock);
+#endif
 
 end:
     return g_test_run();
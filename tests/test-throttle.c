@@ -20,6 +20,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/thread.h"
 #include "block/throttle-groups.h"
 #include "sysemu/block-backend.h"
 
@@ -671,6 +672,126 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+#ifdef CONFIG_ATOMIC64
+static void test_shards(void)
+{
+    ThrottleShard shard = { };
+    LeakyBucket *bkt;
+    int64_t now;
+
+    throttle_init(&ts);
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    bkt = &ts.cfg.buckets[THROTTLE_BPS_TOTAL];
+    now = ts.previous_leak;
+
+    /* The whole free space of the bucket (avg / 10) is lent */
+    throttle_shard_grant(&ts, &shard, 1, now);
+    g_assert(double_cmp(bkt->level, 100));
+
+    /* Other buckets are unlimited */
+    g_assert(throttle_shard_consume(&shard, false, 60));
+    g_assert(!throttle_shard_consume(&shard, true, 60));
+    g_assert(throttle_shard_consume(&shard, true, 30));
+
+    /* Unused tokens go back to the bucket */
+    g_assert(!throttle_shard_revoke(&ts, &shard));
+    g_assert(double_cmp(bkt->level, 90));
+    g_assert(!throttle_must_wait(&ts, false, now));
+    g_assert(!throttle_shard_consume(&shard, false, 1));
+
+    /* Only a part of the free space is lent with a divisor */
+    throttle_shard_grant(&ts, &shard, 2, now);
+    g_assert(double_cmp(bkt->level, 95));
+    g_assert(!throttle_shard_consume(&shard, false, 6));
+    g_assert(throttle_shard_consume(&shard, false, 5));
+    g_assert(!throttle_shard_revoke(&ts, &shard));
+    g_assert(double_cmp(bkt->level, 95));
+}
+
+#define SHARD_THREADS 4
+#define SHARD_OPS 200000
+
+static ThrottleShard mt_shard;
+static QemuMutex mt_lock;
+static int64_t mt_admitted[SHARD_THREADS];
+
+static void *shard_consume_thread(void *opaque)
+{
+    int64_t *admitted = opaque;
+
+    while (throttle_shard_consume(&mt_shard, *admitted & 1, 512)) {
+        (*admitted)++;
+    }
+    return NULL;
+}
+
+static void *locked_account_thread(void *opaque)
+{
+    int i;
+
+    for (i = 0; i < SHARD_OPS / SHARD_THREADS; i++) {
+        qemu_mutex_lock(&mt_lock);
+        throttle_account(&ts, i & 1, 512);
+        qemu_mutex_unlock(&mt_lock);
+    }
+    return NULL;
+}
+
+static double run_threads(void *(*fn)(void *))
+{
+    QemuThread threads[SHARD_THREADS];
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < SHARD_THREADS; i++) {
+        qemu_thread_create(&threads[i], "throttle-test", fn, &mt_admitted[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < SHARD_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    return g_test_timer_elapsed();
+}
+
+/* Tokens are neither lost nor created when threads share a shard */
+static void test_shards_multithread(void)
+{
+    LeakyBucket *bkt;
+    int64_t admitted = 0;
+    double shard_time, locked_time;
+    int i;
+
+    throttle_init(&ts);
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = SHARD_OPS * 10;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    bkt = &ts.cfg.buckets[THROTTLE_OPS_TOTAL];
+
+    memset(&mt_shard, 0, sizeof(mt_shard));
+    throttle_shard_grant(&ts, &mt_shard, 1, ts.previous_leak);
+    g_assert(double_cmp(bkt->level, SHARD_OPS));
+
+    shard_time = run_threads(shard_consume_thread);
+    for (i = 0; i < SHARD_THREADS; i++) {
+        admitted += mt_admitted[i];
+    }
+    g_assert_cmpint(admitted, <=, SHARD_OPS);
+
+    g_assert(!throttle_shard_revoke(&ts, &mt_shard));
+    g_assert(double_cmp(bkt->level, admitted));
+
+    /* The same number of requests, accounted under a lock */
+    qemu_mutex_init(&mt_lock);
+    locked_time = run_threads(locked_account_thread);
+    qemu_mutex_destroy(&mt_lock);
+
+    g_test_message("%d threads, %d requests: shard %.3f s, lock %.3f s",
+                   SHARD_THREADS, SHARD_OPS, shard_time, locked_time);
+}
+#endif
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -738,6 +859,120 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+#ifdef CONFIG_ATOMIC64
+typedef struct {
+    ThrottleGroupMember *tgm;
+    int n;
+    bool done;
+} GroupReadData;
+
+static void coroutine_fn group_read_entry(void *opaque)
+{
+    GroupReadData *data = opaque;
+    int i;
+
+    for (i = 0; i < data->n; i++) {
+        throttle_group_co_io_limits_intercept(data->tgm, 512, false);
+    }
+    data->done = true;
+}
+
+/* Admit @n read requests of @tgm, none of which may be throttled */
+static void group_read(ThrottleGroupMember *tgm, int n)
+{
+    GroupReadData data = { .tgm = tgm, .n = n };
+
+    qemu_coroutine_enter(qemu_coroutine_create(group_read_entry, &data));
+    g_assert(data.done);
+}
+
+/* Up to 100 read requests without waiting, the leak is negligible */
+static void group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg1)
+{
+    throttle_config_init(cfg1);
+    cfg1->buckets[THROTTLE_OPS_READ].avg = 1;
+    cfg1->buckets[THROTTLE_OPS_READ].max = 100;
+    throttle_group_config(tgm, cfg1);
+}
+
+static void test_groups_fast_path(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk;
+    ThrottleGroupMember *tgm1;
+    LeakyBucket *bkt;
+    double level;
+
+    blk = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk)->throttle_group_member;
+    throttle_group_register_tgm(tgm1, "fast", blk_get_aio_context(blk));
+    group_config(tgm1, &cfg1);
+    bkt = &tgm1->throttle_state->cfg.buckets[THROTTLE_OPS_READ];
+
+    /* The first request takes the lock and lends half of the rest */
+    group_read(tgm1, 1);
+    g_assert_cmpfloat(bkt->level, >, 50);
+    g_assert_cmpfloat(bkt->level, <=, 50.5);
+    level = bkt->level;
+
+    /* The next ones are admitted from the shard without the group lock */
+    group_read(tgm1, 40);
+    g_assert(bkt->level == level);
+
+    /* Once the shard runs out, the lock is taken to lend more */
+    group_read(tgm1, 20);
+    g_assert_cmpfloat(bkt->level, >, level);
+
+    throttle_group_unregister_tgm(tgm1);
+    blk_unref(blk);
+}
+
+static void test_groups_revoke(void)
+{
+    ThrottleConfig cfg1;
+    AioContext *ctx2 = aio_context_new(&error_abort);
+    BlockBackend *blk1, *blk2;
+    ThrottleGroupMember *tgm1, *tgm2;
+    LeakyBucket *bkt;
+
+    blk1 = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    blk2 = blk_new(ctx2, 0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk1)->throttle_group_member;
+    tgm2 = &blk_get_public(blk2)->throttle_group_member;
+    throttle_group_register_tgm(tgm1, "revoke", blk_get_aio_context(blk1));
+    throttle_group_register_tgm(tgm2, "revoke", ctx2);
+    group_config(tgm1, &cfg1);
+    bkt = &tgm1->throttle_state->cfg.buckets[THROTTLE_OPS_READ];
+
+    /* With two AioContexts, a shard gets a quarter of the free space */
+    group_read(tgm2, 1);
+    g_assert_cmpfloat(bkt->level, >, 25);
+    g_assert_cmpfloat(bkt->level, <=, 25.75);
+
+    /* Its tokens go back to the group when its last member leaves */
+    throttle_group_unregister_tgm(tgm2);
+    g_assert_cmpfloat(bkt->level, >, 0.9);
+    g_assert_cmpfloat(bkt->level, <=, 1);
+
+    /*
+     * New limits take back the tokens, so they hold right away.  A request
+     * that is admitted with stale tokens would leave the bucket empty.
+     */
+    group_read(tgm1, 1);
+    g_assert_cmpfloat(bkt->level, >, 50);
+    cfg1.buckets[THROTTLE_OPS_READ].max = 2;
+    throttle_group_config(tgm1, &cfg1);
+    g_assert(bkt->level == 0);
+    group_read(tgm1, 1);
+    g_assert_cmpfloat(bkt->level, >=, 1);
+
+    throttle_group_unregister_tgm(tgm1);
+    blk_unref(blk1);
+    blk_unref(blk2);
+    aio_context_unref(ctx2);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -765,6 +1000,12 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+#ifdef CONFIG_ATOMIC64
+    g_test_add_func("/throttle/shards",             test_shards);
+    g_test_add_func("/throttle/shards/multithread", test_shards_multithread);
+    g_test_add_func("/throttle/groups/fast_path",   test_groups_fast_path);
+    g_test_add_func("/throttle/groups/revoke",      test_groups_revoke);
+#endif
     return g_test_run();
 }
 
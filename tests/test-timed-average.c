@@ -79,11 +79,67 @@ static void test_average(void)
     }
 }
 
+static void test_percentile(void)
+{
+    TimedAverage ta;
+    uint64_t result;
+    int i;
+
+    timed_average_init(&ta, QEMU_CLOCK_VIRTUAL, NANOSECONDS_PER_SECOND);
+    timed_average_enable_percentiles(&ta);
+
+    result = timed_average_percentile(&ta, 50);
+    g_assert(result == 0);
+
+    /* Small values are counted exactly */
+    account(&ta);
+    result = timed_average_percentile(&ta, 0);
+    g_assert(result == 1);
+    result = timed_average_percentile(&ta, 50);
+    g_assert(result == 3);
+    result = timed_average_percentile(&ta, 60);
+    g_assert(result == 3);
+    result = timed_average_percentile(&ta, 61);
+    g_assert(result == 4);
+    result = timed_average_percentile(&ta, 100);
+    g_assert(result == 5);
+
+    my_clock_value += NANOSECONDS_PER_SECOND * 100;
+
+    /* 1000 values with a slow tail: 1 us to 1 ms */
+    for (i = 1; i <= 1000; i++) {
+        timed_average_account(&ta, i * 1000);
+    }
+
+    result = timed_average_percentile(&ta, 50);
+    g_assert_cmpuint(result, >=, 500000 - 500000 / 16);
+    g_assert_cmpuint(result, <=, 500000 + 500000 / 16);
+    result = timed_average_percentile(&ta, 99);
+    g_assert_cmpuint(result, >=, 990000 - 990000 / 16);
+    g_assert_cmpuint(result, <=, 1000000);
+    result = timed_average_percentile(&ta, 99.9);
+    g_assert_cmpuint(result, >=, 999000 - 999000 / 16);
+    g_assert_cmpuint(result, <=, 1000000);
+
+    /* Values that exceed the histogram are limited by the maximum */
+    timed_average_account(&ta, 1ULL << 50);
+    result = timed_average_percentile(&ta, 100);
+    g_assert(result == 1ULL << 50);
+
+    /* Old values expire with the window */
+    my_clock_value += NANOSECONDS_PER_SECOND * 100;
+    result = timed_average_percentile(&ta, 99);
+    g_assert(result == 0);
+
+    timed_average_destroy(&ta);
+}
+
 int main(int argc, char **argv)
 {
     /* tests in the same order as the header function declarations */
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/timed-average/average", test_average);
+    g_test_add_func("/timed-average/percentile", test_percentile);
     return g_test_run();
 }
 
@@ -174,6 +174,103 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Random runs of all lengths, so that they start and end anywhere in the
+ * blocks that the vector encoders compare at once.  Most buffers are shorter
+ * than a page and end in a partial block, and each one is also encoded into
+ * a destination that is too small for most of them.
+ *
+ * The generic encoder is the last one that is tested, so all of them are
+ * compared with it byte for byte.
+ */
+static void test_encode_decode_runs(void)
+{
+    const int pages = 64;
+    uint8_t *old = g_malloc(PAGE_SIZE * pages);
+    uint8_t *new = g_malloc(PAGE_SIZE * pages);
+    uint8_t *expected = g_malloc(PAGE_SIZE * pages);
+    int *expected_len = g_new(int, pages);
+    int *expected_small_len = g_new(int, pages);
+    int *slen = g_new(int, pages);
+    int *small_dlen = g_new(int, pages);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    bool first = true;
+    int i, j, k, len, dlen, rc;
+
+    for (i = 0; i < PAGE_SIZE * pages; i++) {
+        old[i] = new[i] = g_test_rand_int();
+    }
+    for (i = 0; i < pages; i++) {
+        uint8_t *page = new + i * PAGE_SIZE;
+
+        for (j = 0; j < i; j++) {
+            k = g_test_rand_int_range(0, PAGE_SIZE);
+            len = g_test_rand_int_range(1, j % 2 ? 8 : 256);
+            for (; len && k < PAGE_SIZE; len--, k++) {
+                page[k] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+
+        /* multiples of sizeof(long), as xbzrle_encode_buffer() requires */
+        slen[i] = i % 4 ? 8 * g_test_rand_int_range(1, PAGE_SIZE / 8) :
+                          PAGE_SIZE;
+        small_dlen[i] = g_test_rand_int_range(0, 64);
+    }
+
+    do {
+        for (i = 0; i < pages; i++) {
+            uint8_t *old_page = old + i * PAGE_SIZE;
+            uint8_t *new_page = new + i * PAGE_SIZE;
+
+            dlen = xbzrle_encode_buffer(old_page, new_page, slen[i],
+                                        compressed, PAGE_SIZE);
+
+            /* all the encoders produce the same output */
+            if (first) {
+                expected_len[i] = dlen;
+                if (dlen > 0) {
+                    memcpy(expected + i * PAGE_SIZE, compressed, dlen);
+                }
+            } else {
+                g_assert_cmpint(dlen, ==, expected_len[i]);
+                g_assert(dlen <= 0 ||
+                         !memcmp(expected + i * PAGE_SIZE, compressed, dlen));
+            }
+
+            /* they also give up on overflow at the same point */
+            rc = xbzrle_encode_buffer(old_page, new_page, slen[i],
+                                      compressed, small_dlen[i]);
+            if (first) {
+                expected_small_len[i] = rc;
+            } else {
+                g_assert_cmpint(rc, ==, expected_small_len[i]);
+            }
+            g_assert(rc < 0 || (rc == dlen && (dlen == 0 ||
+                     !memcmp(expected + i * PAGE_SIZE, compressed, dlen))));
+
+            if (dlen <= 0) {
+                continue;
+            }
+            memcpy(buffer, old_page, slen[i]);
+            rc = xbzrle_decode_buffer(compressed, dlen, buffer, slen[i]);
+            g_assert(rc > 0);
+            g_assert(memcmp(buffer, new_page, slen[i]) == 0);
+        }
+        first = false;
+    } while (test_xbzrle_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(expected);
+    g_free(expected_len);
+    g_free(expected_small_len);
+    g_free(slen);
+    g_free(small_dlen);
+    g_free(compressed);
+    g_free(buffer);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +283,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
 
     return g_test_run();
 }
@@ -653,6 +653,8 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
     }
 
+    progress |= fdmon_io_uring_dispatch_ops(ctx);
+
     aio_free_deleted_handlers(ctx);
 
     qemu_lockcnt_dec(&ctx->list_lock);
@@ -19,9 +19,12 @@
  * 4. Nanosecond timeouts are supported so it requires fewer syscalls than
  *    epoll(7).
  *
- * This code only monitors file descriptors and does not do asynchronous disk
- * I/O.  Implementing disk I/O efficiently has other requirements and should
- * use a separate io_uring so it does not make sense to unify the code.
+ * This code does not do asynchronous disk I/O.  Implementing disk I/O
+ * efficiently has other requirements and should use a separate io_uring so it
+ * does not make sense to unify the code.  Other operations that complete when
+ * a file descriptor is ready, like socket reads and writes, can be submitted
+ * with aio_io_uring_submit() though.  They share the io_uring_enter(2) calls
+ * that are made for file descriptor monitoring anyway.
  *
  * File descriptor monitoring is implemented using the following operations:
  *
@@ -33,6 +36,7 @@
  * 3. IORING_OP_TIMEOUT - added every time a blocking syscall is made to wait
  *    for events.  This operation self-cancels if another event completes
  *    before the timeout.
+ * 4. IORING_OP_ASYNC_CANCEL - cancels an AioIOUringOp that is in flight.
  *
  * io_uring calls the submission queue the "sq ring" and the completion queue
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
@@ -40,7 +44,15 @@
  * The code is structured so that sq/cq rings are only modified within
  * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
  * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
- * and/or IORING_OP_POLL_REMOVE sqes for them.
+ * and/or IORING_OP_POLL_REMOVE sqes for them.  AioIOUringOps are likewise
+ * placed on ctx->io_uring_ops_pending and their callbacks are invoked from
+ * fdmon_io_uring_dispatch_ops() once fdmon_io_uring_wait() has reaped them.
+ *
+ * While external clients are disabled, handlers are monitored with fdmon-poll
+ * instead.  This does not work while AioIOUringOps are in flight because they
+ * can only complete through the ring.  In that case the ring keeps being used,
+ * but IORING_OP_POLL_ADD is not submitted for handlers of external clients
+ * until they are enabled again.
  */
 
 #include "qemu/osdep.h"
@@ -55,8 +67,20 @@ enum {
     FDMON_IO_URING_PENDING  = (1 << 0),
     FDMON_IO_URING_ADD      = (1 << 1),
     FDMON_IO_URING_REMOVE   = (1 << 2),
+
+    /* AioIOUringOp::state */
+    FDMON_IO_URING_OP_PENDING = 0,
+    FDMON_IO_URING_OP_IN_FLIGHT,
+    FDMON_IO_URING_OP_CANCEL,
+    FDMON_IO_URING_OP_DONE,
 };
 
+/*
+ * cqe user_data is either an AioHandler or an AioIOUringOp with this bit set.
+ * Both are at least 8-byte aligned.
+ */
+#define FDMON_IO_URING_OP_TAG ((uintptr_t)1)
+
 static inline int poll_events_from_pfd(int pfd_events)
 {
     return (pfd_events & G_IO_IN ? POLLIN : 0) |
@@ -182,6 +206,26 @@ static void add_poll_remove_sqe(AioContext *ctx, AioHandler *node)
     io_uring_prep_poll_remove(sqe, node);
 }
 
+static void add_op_sqe(AioContext *ctx, AioIOUringOp *op)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    *sqe = op->sqe;
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)op | FDMON_IO_URING_OP_TAG));
+    op->state = FDMON_IO_URING_OP_IN_FLIGHT;
+    ctx->io_uring_ops_in_flight++;
+}
+
+static void add_op_cancel_sqe(AioContext *ctx, AioIOUringOp *op)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    /* The cqe of the cancel operation itself has a zero user_data field */
+    io_uring_prep_cancel(sqe, (void *)((uintptr_t)op | FDMON_IO_URING_OP_TAG),
+                         0);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
 /* Add a timeout that self-cancels when another cqe becomes ready */
 static void add_timeout_sqe(AioContext *ctx, int64_t ns)
 {
@@ -195,11 +239,15 @@ static void add_timeout_sqe(AioContext *ctx, int64_t ns)
     io_uring_prep_timeout(sqe, &ts, 1, 0);
 }
 
-/* Add sqes from ctx->submit_list for submission */
-static void fill_sq_ring(AioContext *ctx)
+/*
+ * Add sqes from ctx->submit_list and the AioIOUringOp lists for submission.
+ * If @fallback is true, handlers of external clients are not re-armed yet.
+ */
+static void fill_sq_ring(AioContext *ctx, bool fallback)
 {
     AioHandlerSList submit_list;
     AioHandler *node;
+    AioIOUringOp *op;
     unsigned flags;
 
     QSLIST_MOVE_ATOMIC(&submit_list, &ctx->submit_list);
@@ -207,27 +255,62 @@ static void fill_sq_ring(AioContext *ctx)
     while ((node = dequeue(&submit_list, &flags))) {
         /* Order matters, just in case both flags were set */
         if (flags & FDMON_IO_URING_ADD) {
-            add_poll_add_sqe(ctx, node);
+            if (fallback && node->is_external &&
+                !(flags & FDMON_IO_URING_REMOVE)) {
+                enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+            } else {
+                add_poll_add_sqe(ctx, node);
+            }
         }
         if (flags & FDMON_IO_URING_REMOVE) {
             add_poll_remove_sqe(ctx, node);
         }
     }
+
+    while ((op = QSIMPLEQ_FIRST(&ctx->io_uring_ops_pending))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->io_uring_ops_pending, next);
+        add_op_sqe(ctx, op);
+    }
+
+    while ((op = QSIMPLEQ_FIRST(&ctx->io_uring_ops_cancel))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->io_uring_ops_cancel, next);
+        op->state = FDMON_IO_URING_OP_IN_FLIGHT;
+        add_op_cancel_sqe(ctx, op);
+    }
+}
+
+static void complete_op(AioContext *ctx, AioIOUringOp *op, int ret)
+{
+    /* ctx->io_uring_ops_cancel has been emptied by fill_sq_ring() */
+    assert(op->state == FDMON_IO_URING_OP_IN_FLIGHT);
+
+    op->ret = ret;
+    op->state = FDMON_IO_URING_OP_DONE;
+    ctx->io_uring_ops_in_flight--;
+    QSIMPLEQ_INSERT_TAIL(&ctx->io_uring_ops_done, op, next);
 }
 
 /* Returns true if a handler became ready */
 static bool process_cqe(AioContext *ctx,
                         AioHandlerList *ready_list,
-                        struct io_uring_cqe *cqe)
+                        struct io_uring_cqe *cqe,
+                        bool fallback)
 {
     AioHandler *node = io_uring_cqe_get_data(cqe);
     unsigned flags;
 
-    /* poll_timeout and poll_remove have a zero user_data field */
+    /* poll_timeout, poll_remove and cancel have a zero user_data field */
     if (!node) {
         return false;
     }
 
+    if ((uintptr_t)node & FDMON_IO_URING_OP_TAG) {
+        complete_op(ctx, (AioIOUringOp *)((uintptr_t)node &
+                                          ~FDMON_IO_URING_OP_TAG),
+                    cqe->res);
+        return false;
+    }
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -239,6 +322,12 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
+    /* The handler would not be dispatched, re-arm it later */
+    if (fallback && node->is_external) {
+        enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+        return false;
+    }
+
     aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
 
     /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
@@ -246,7 +335,8 @@ static bool process_cqe(AioContext *ctx,
     return true;
 }
 
-static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
+static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list,
+                           bool fallback)
 {
     struct io_uring *ring = &ctx->fdmon_io_uring;
     struct io_uring_cqe *cqe;
@@ -255,7 +345,7 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
     unsigned head;
 
     io_uring_for_each_cqe(ring, head, cqe) {
-        if (process_cqe(ctx, ready_list, cqe)) {
+        if (process_cqe(ctx, ready_list, cqe, fallback)) {
             num_ready++;
         }
 
@@ -270,20 +360,27 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
                                int64_t timeout)
 {
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    bool fallback = false;
     int ret;
 
     /* Fall back while external clients are disabled */
     if (atomic_read(&ctx->external_disable_cnt)) {
-        return fdmon_poll_ops.wait(ctx, ready_list, timeout);
+        /* AioIOUringOps can only complete through the ring */
+        if (!ctx->io_uring_ops_in_flight &&
+            QSIMPLEQ_EMPTY(&ctx->io_uring_ops_pending) &&
+            QSIMPLEQ_EMPTY(&ctx->io_uring_ops_done)) {
+            return fdmon_poll_ops.wait(ctx, ready_list, timeout);
+        }
+        fallback = true;
     }
 
-    if (timeout == 0) {
-        wait_nr = 0; /* non-blocking */
+    if (timeout == 0 || !QSIMPLEQ_EMPTY(&ctx->io_uring_ops_done)) {
+        wait_nr = 0; /* non-blocking or callbacks are ready to be invoked */
     } else if (timeout > 0) {
         add_timeout_sqe(ctx, timeout);
     }
 
-    fill_sq_ring(ctx);
+    fill_sq_ring(ctx, fallback);
 
     do {
         ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, wait_nr);
@@ -291,7 +388,7 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
 
     assert(ret >= 0);
 
-    return process_cq_ring(ctx, ready_list);
+    return process_cq_ring(ctx, ready_list, fallback);
 }
 
 static bool fdmon_io_uring_need_wait(AioContext *ctx)
@@ -311,6 +408,12 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
         return true;
     }
 
+    /* Are there AioIOUringOps to submit or cancel? */
+    if (!QSIMPLEQ_EMPTY(&ctx->io_uring_ops_pending) ||
+        !QSIMPLEQ_EMPTY(&ctx->io_uring_ops_cancel)) {
+        return true;
+    }
+
     /* Are we falling back to fdmon-poll? */
     return atomic_read(&ctx->external_disable_cnt);
 }
@@ -321,10 +424,67 @@ static const FDMonOps fdmon_io_uring_ops = {
     .need_wait = fdmon_io_uring_need_wait,
 };
 
+bool aio_io_uring_available(AioContext *ctx)
+{
+    return ctx->fdmon_ops == &fdmon_io_uring_ops;
+}
+
+void aio_io_uring_submit(AioContext *ctx, AioIOUringOp *op)
+{
+    assert(aio_io_uring_available(ctx));
+
+    op->state = FDMON_IO_URING_OP_PENDING;
+    QSIMPLEQ_INSERT_TAIL(&ctx->io_uring_ops_pending, op, next);
+}
+
+void aio_io_uring_cancel(AioContext *ctx, AioIOUringOp *op)
+{
+    switch (op->state) {
+    case FDMON_IO_URING_OP_PENDING:
+        /* Never submitted, complete it right away */
+        QSIMPLEQ_REMOVE(&ctx->io_uring_ops_pending, op, AioIOUringOp, next);
+        op->ret = -ECANCELED;
+        op->state = FDMON_IO_URING_OP_DONE;
+        QSIMPLEQ_INSERT_TAIL(&ctx->io_uring_ops_done, op, next);
+        break;
+    case FDMON_IO_URING_OP_IN_FLIGHT:
+        op->state = FDMON_IO_URING_OP_CANCEL;
+        QSIMPLEQ_INSERT_TAIL(&ctx->io_uring_ops_cancel, op, next);
+        break;
+    default:
+        /* Already being cancelled or completed */
+        break;
+    }
+}
+
+/*
+ * Invoke the callbacks of completed AioIOUringOps.  Called by aio_poll()
+ * after fdmon_io_uring_wait() so that callbacks can submit new operations.
+ *
+ * Returns true if a callback was invoked.
+ */
+bool fdmon_io_uring_dispatch_ops(AioContext *ctx)
+{
+    AioIOUringOp *op;
+    bool progress = false;
+
+    while ((op = QSIMPLEQ_FIRST(&ctx->io_uring_ops_done))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->io_uring_ops_done, next);
+        op->cb(op, op->ret);
+        progress = true;
+    }
+
+    return progress;
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
 
+    QSIMPLEQ_INIT(&ctx->io_uring_ops_pending);
+    QSIMPLEQ_INIT(&ctx->io_uring_ops_cancel);
+    QSIMPLEQ_INIT(&ctx->io_uring_ops_done);
+
     ret = io_uring_queue_init(FDMON_IO_URING_ENTRIES, &ctx->fdmon_io_uring, 0);
     if (ret != 0) {
         return false;
@@ -340,6 +500,11 @@ void fdmon_io_uring_destroy(AioContext *ctx)
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
         AioHandler *node;
 
+        /* Users of aio_io_uring_submit() must be gone by now */
+        assert(!ctx->io_uring_ops_in_flight);
+        assert(QSIMPLEQ_EMPTY(&ctx->io_uring_ops_pending));
+        assert(QSIMPLEQ_EMPTY(&ctx->io_uring_ops_done));
+
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */
@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bitmap.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -101,6 +102,197 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/* Word array helpers for the operations that scan a whole level.  They have
+ * vectorized variants that are selected at startup depending on the host.
+ */
+
+/* Store a[i] | b[i] into dst[i]; return the number of bits set in dst.  */
+static uint64_t hb_or_words_int(unsigned long *dst, const unsigned long *a,
+                                const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += ctpopl(dst[i]);
+    }
+    return count;
+}
+
+/* Return the index of the first word in [pos, n) that is not all ones,
+ * or n if there is none.
+ */
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t pos,
+                                   size_t n)
+{
+    while (pos < n && p[pos] == (unsigned long)-1) {
+        pos++;
+    }
+    return pos;
+}
+
+/* Return the number of bits set in p[0..n-1].  */
+static uint64_t hb_popcount_words_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define HB_AVX2_WORDS (32 / sizeof(unsigned long))
+
+/* Population count of each 64-bit lane, using a nibble lookup table with
+ * vpshufb and vpsadbw to sum the bytes.
+ */
+static inline __m256i hb_popcount_avx2(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                  _mm256_shuffle_epi8(lut, hi));
+
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+static inline uint64_t hb_sum_avx2(__m256i acc)
+{
+    uint64_t sum[4];
+
+    _mm256_storeu_si256((__m256i *)sum, acc);
+    return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+static uint64_t hb_or_words_avx2(unsigned long *dst, const unsigned long *a,
+                                 const unsigned long *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + HB_AVX2_WORDS <= n; i += HB_AVX2_WORDS) {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((__m256i *)(a + i)),
+                                    _mm256_loadu_si256((__m256i *)(b + i)));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        acc = _mm256_add_epi64(acc, hb_popcount_avx2(v));
+    }
+
+    return hb_sum_avx2(acc) + hb_or_words_int(dst + i, a + i, b + i, n - i);
+}
+
+static size_t hb_find_not_ones_avx2(const unsigned long *p, size_t pos,
+                                    size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    /* Skip full vectors of ones, the scalar loop finds the exact word */
+    while (pos + HB_AVX2_WORDS <= n &&
+           _mm256_testc_si256(_mm256_loadu_si256((__m256i *)(p + pos)),
+                              ones)) {
+        pos += HB_AVX2_WORDS;
+    }
+
+    return hb_find_not_ones_int(p, pos, n);
+}
+
+static uint64_t hb_popcount_words_avx2(const unsigned long *p, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + HB_AVX2_WORDS <= n; i += HB_AVX2_WORDS) {
+        __m256i v = _mm256_loadu_si256((__m256i *)(p + i));
+
+        acc = _mm256_add_epi64(acc, hb_popcount_avx2(v));
+    }
+
+    return hb_sum_avx2(acc) + hb_popcount_words_int(p + i, n - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_hbitmap_next_accel, the most preferred ISA must have
+ * the least significant bit.
+ */
+#define CACHE_AVX2    1
+
+static unsigned cpuid_cache;
+static uint64_t (*hb_or_words)(unsigned long *, const unsigned long *,
+                               const unsigned long *, size_t) = hb_or_words_int;
+static size_t (*hb_find_not_ones)(const unsigned long *, size_t,
+                                  size_t) = hb_find_not_ones_int;
+static uint64_t (*hb_popcount_words)(const unsigned long *,
+                                     size_t) = hb_popcount_words_int;
+
+static void init_accel(unsigned cache)
+{
+    hb_or_words = hb_or_words_int;
+    hb_find_not_ones = hb_find_not_ones_int;
+    hb_popcount_words = hb_popcount_words_int;
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        hb_or_words = hb_or_words_avx2;
+        hb_find_not_ones = hb_find_not_ones_avx2;
+        hb_popcount_words = hb_popcount_words_avx2;
+    }
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_hbitmap_next_accel(void)
+{
+    /* If no bits set, we just tested the integer versions, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -245,10 +437,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_not_ones(last_lev, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
@@ -345,6 +534,28 @@ static size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_cur)
     return hbi->pos;
 }
 
+/* Count the number of set bits between start and last by scanning the whole
+ * range of the last level.  Unlike hbitmap iteration this cannot skip
+ * zero words, but it is faster when most words have bits set.
+ */
+static uint64_t hb_count_between_dense(HBitmap *hb, uint64_t start,
+                                       uint64_t last)
+{
+    unsigned long *lev = hb->levels[HBITMAP_LEVELS - 1];
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t last_pos = last >> BITS_PER_LEVEL;
+    unsigned long first_mask = BITMAP_FIRST_WORD_MASK(start);
+    unsigned long last_mask = BITMAP_LAST_WORD_MASK(last + 1);
+
+    if (pos == last_pos) {
+        return ctpopl(lev[pos] & first_mask & last_mask);
+    }
+
+    return ctpopl(lev[pos] & first_mask) +
+           hb_popcount_words(lev + pos + 1, last_pos - pos - 1) +
+           ctpopl(lev[last_pos] & last_mask);
+}
+
 /* Count the number of set bits between start and end, not accounting for
  * the granularity.  Also an example of how to use hbitmap_iter_next_word.
  */
@@ -353,9 +564,17 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     HBitmapIter hbi;
     uint64_t count = 0;
     uint64_t end = last + 1;
+    uint64_t words = (last >> BITS_PER_LEVEL) - (start >> BITS_PER_LEVEL);
     unsigned long cur;
     size_t pos;
 
+    /* Iteration only pays off if the bitmap is sparse enough that it can
+     * skip whole words; compare the overall count against the range.
+     */
+    if (words >= BITS_PER_LONG && hb->count >= words) {
+        return hb_count_between_dense(hb, start, last);
+    }
+
     hbitmap_iter_init(&hbi, hb, start << hb->granularity);
     for (;;) {
         pos = hbitmap_iter_next_word(&hbi, &cur);
@@ -875,7 +1094,8 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
+    uint64_t count;
+    unsigned long last;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -910,14 +1130,21 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
-        }
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        hb_or_words(result->levels[i], a->levels[i], b->levels[i],
+                    a->sizes[i]);
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    /* Recompute the dirty count while merging the last level */
+    i = HBITMAP_LEVELS - 1;
+    count = hb_or_words(result->levels[i], a->levels[i], b->levels[i],
+                        a->sizes[i]);
+    if (result->size & (BITS_PER_LONG - 1)) {
+        /* Do not count bits past the end of the bitmap */
+        last = result->levels[i][a->sizes[i] - 1];
+        count -= ctpopl(last & ~BITMAP_LAST_WORD_MASK(result->size));
+    }
+    result->count = count;
 
     return true;
 }
@@ -87,6 +87,28 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute the sizes of the buckets of a LeakyBucket with bkt->avg != 0
+ *
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +124,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -445,6 +456,30 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* Check whether the next I/O request would have to wait, without arming
+ * any timer
+ *
+ * @is_write: the type of operation (read/write)
+ * @now:      the current clock timestamp
+ * @ret:      true if the request would be throttled
+ */
+bool throttle_must_wait(ThrottleState *ts, bool is_write, int64_t now)
+{
+    int64_t next_timestamp;
+
+    return throttle_compute_timer(ts, is_write, now, &next_timestamp);
+}
+
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
@@ -452,14 +487,6 @@ bool throttle_schedule_timer(ThrottleState *ts,
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
     double units = 1.0;
     unsigned i;
 
@@ -485,6 +512,161 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/* Compute how many units a bucket can take before requests must wait
+ *
+ * @bkt: the leaky bucket we operate on
+ * @ret: the free space in units, or a negative value if the bucket is full
+ */
+static double throttle_bucket_headroom(LeakyBucket *bkt)
+{
+    double bucket_size, burst_bucket_size, headroom;
+
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+    headroom = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        headroom = MIN(headroom, burst_bucket_size - bkt->burst_level);
+    }
+
+    return headroom;
+}
+
+#ifdef CONFIG_ATOMIC64
+/* Lend a part of the free space of each bucket to a shard. The lent units
+ * are accounted right away, so the limits hold no matter how the shard uses
+ * them. Must be called with the same lock held that protects @ts.
+ *
+ * @shard:   the shard to lend tokens to
+ * @divisor: lend 1/@divisor of the free space of each bucket
+ * @now:     the current clock timestamp
+ */
+void throttle_shard_grant(ThrottleState *ts, ThrottleShard *shard,
+                          unsigned int divisor, int64_t now)
+{
+    int i;
+
+    throttle_do_leak(ts, now);
+    atomic_set__nocheck(&shard->op_size, ts->cfg.op_size);
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        LeakyBucket *bkt = &ts->cfg.buckets[i];
+        double units;
+        int64_t tokens;
+
+        if (!bkt->avg) {
+            atomic_set__nocheck(&shard->tokens[i], THROTTLE_SHARD_UNLIMITED);
+            continue;
+        }
+
+        units = MIN(throttle_bucket_headroom(bkt) / divisor,
+                    (double) THROTTLE_SHARD_UNLIMITED / THROTTLE_SHARD_SCALE);
+        tokens = units * THROTTLE_SHARD_SCALE;
+        if (tokens <= 0) {
+            continue;
+        }
+
+        units = (double) tokens / THROTTLE_SHARD_SCALE;
+        bkt->level += units;
+        if (bkt->burst_length > 1) {
+            bkt->burst_level += units;
+        }
+        atomic_fetch_add(&shard->tokens[i], tokens);
+    }
+}
+
+/* Take back the tokens of a shard that were not used. Must be called with
+ * the same lock held that protects @ts.
+ *
+ * @shard: the shard to take tokens from
+ * @ret:   true if the shard may still hold tokens because a concurrent
+ *         throttle_shard_consume() is giving back tokens it could not use
+ */
+bool throttle_shard_revoke(ThrottleState *ts, ThrottleShard *shard)
+{
+    bool in_use = false;
+    int i;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        LeakyBucket *bkt = &ts->cfg.buckets[i];
+        int64_t tokens = atomic_xchg__nocheck(&shard->tokens[i], 0);
+        double units;
+
+        if (!bkt->avg) {
+            continue;
+        }
+
+        /*
+         * A negative count means that a consumer took more tokens than
+         * there were and is about to give them back.  Account them as used
+         * until they are revoked the next time.
+         */
+        in_use |= tokens < 0;
+        units = (double) tokens / THROTTLE_SHARD_SCALE;
+        bkt->level = MAX(bkt->level - units, 0);
+        if (bkt->burst_length > 1) {
+            bkt->burst_level = MAX(bkt->burst_level - units, 0);
+        }
+    }
+
+    return in_use;
+}
+
+/* Admit an I/O request with tokens from a shard, without any lock. This
+ * does the accounting for the operation if it succeeds.
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ * @ret:      true if the shard had enough tokens for the request
+ */
+bool throttle_shard_consume(ThrottleShard *shard, bool is_write, uint64_t size)
+{
+    uint64_t op_size = atomic_read__nocheck(&shard->op_size);
+    BucketType types[4];
+    int64_t cost[4];
+    int i;
+
+    types[0] = bucket_types_size[is_write][0];
+    types[1] = bucket_types_size[is_write][1];
+    cost[0] = cost[1] = size * THROTTLE_SHARD_SCALE;
+
+    types[2] = bucket_types_units[is_write][0];
+    types[3] = bucket_types_units[is_write][1];
+    if (op_size && size > op_size) {
+        cost[2] = DIV_ROUND_UP(size * THROTTLE_SHARD_SCALE, op_size);
+    } else {
+        cost[2] = THROTTLE_SHARD_SCALE;
+    }
+    cost[3] = cost[2];
+
+    for (i = 0; i < 4; i++) {
+        if (atomic_fetch_sub(&shard->tokens[types[i]], cost[i]) < cost[i]) {
+            /* Not enough tokens, give back everything taken so far */
+            for (; i >= 0; i--) {
+                atomic_fetch_add(&shard->tokens[types[i]], cost[i]);
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+#else
+/* Without 64-bit atomics, requests always take the lock */
+void throttle_shard_grant(ThrottleState *ts, ThrottleShard *shard,
+                          unsigned int divisor, int64_t now)
+{
+}
+
+bool throttle_shard_revoke(ThrottleState *ts, ThrottleShard *shard)
+{
+    return false;
+}
+
+bool throttle_shard_consume(ThrottleShard *shard, bool is_write, uint64_t size)
+{
+    return false;
+}
+#endif
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
@@ -23,7 +23,9 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 
+#include "qemu/host-utils.h"
 #include "qemu/timed-average.h"
 
 /* This module computes an average of a set of values within a time
@@ -46,6 +48,11 @@
  * Values are returned from:
  *
  *        wnd0---------|wnd1------------|wnd0---------|wnd1-------------|
+ *
+ * Percentiles are computed from a log-linear histogram of the values in
+ * the window, in the style of HdrHistogram: every power of two is split
+ * into bins of the same width, so the relative error is bounded and
+ * accounting a value is only a few instructions.
  */
 
 /* Update the expiration of a time window
@@ -75,6 +82,53 @@ static void window_reset(TimedAverageWindow *w)
     w->max = 0;
     w->sum = 0;
     w->count = 0;
+    if (w->bins) {
+        memset(w->bins, 0, TIMED_AVERAGE_NR_BINS * sizeof(w->bins[0]));
+    }
+}
+
+/* Get the histogram bin of a value
+ *
+ * @value: the value
+ * @ret:   the index of its bin
+ */
+static unsigned value_to_bin(uint64_t value)
+{
+    unsigned shift;
+
+    value = MIN(value, TIMED_AVERAGE_BIN_MAX - 1);
+    if (value < (1 << TIMED_AVERAGE_BIN_BITS)) {
+        return value;
+    }
+
+    /*
+     * The most significant bit selects the power of two, the following
+     * TIMED_AVERAGE_BIN_BITS bits the bin inside it
+     */
+    shift = 63 - clz64(value) - TIMED_AVERAGE_BIN_BITS;
+    return ((shift + 1) << TIMED_AVERAGE_BIN_BITS) +
+           ((value >> shift) & ((1 << TIMED_AVERAGE_BIN_BITS) - 1));
+}
+
+/* Get the range of values in a histogram bin
+ *
+ * @bin:   the index of the bin
+ * @width: the number of values in the bin is stored here
+ * @ret:   the lowest value in the bin
+ */
+static uint64_t bin_to_value(unsigned bin, uint64_t *width)
+{
+    unsigned shift;
+
+    if (bin < (1 << TIMED_AVERAGE_BIN_BITS)) {
+        *width = 1;
+        return bin;
+    }
+
+    shift = (bin >> TIMED_AVERAGE_BIN_BITS) - 1;
+    *width = 1ULL << shift;
+    return ((1ULL << TIMED_AVERAGE_BIN_BITS) |
+            (bin & ((1 << TIMED_AVERAGE_BIN_BITS) - 1))) << shift;
 }
 
 /* Get the current window (that is, the one with the earliest
@@ -107,6 +161,8 @@ void timed_average_init(TimedAverage *ta, QEMUClockType clock_type,
     ta->period = (uint64_t) period * 4 / 3;
     ta->clock_type = clock_type;
     ta->current = 0;
+    ta->windows[0].bins = NULL;
+    ta->windows[1].bins = NULL;
 
     window_reset(&ta->windows[0]);
     window_reset(&ta->windows[1]);
@@ -116,6 +172,36 @@ void timed_average_init(TimedAverage *ta, QEMUClockType clock_type,
     ta->windows[1].expiration = now + ta->period;
 }
 
+/* Count the values in histograms, so that timed_average_percentile() can be
+ * used. Must be called before any values are accounted.
+ *
+ * @ta: the TimedAverage structure
+ */
+void timed_average_enable_percentiles(TimedAverage *ta)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (!ta->windows[i].bins) {
+            ta->windows[i].bins = g_new0(uint64_t, TIMED_AVERAGE_NR_BINS);
+        }
+    }
+}
+
+/* Free the resources of a TimedAverage structure
+ *
+ * @ta: the TimedAverage structure
+ */
+void timed_average_destroy(TimedAverage *ta)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        g_free(ta->windows[i].bins);
+        ta->windows[i].bins = NULL;
+    }
+}
+
 /* Check if the time windows have expired, updating their counters and
  * expiration time if that's the case.
  *
@@ -169,6 +255,9 @@ void timed_average_account(TimedAverage *ta, uint64_t value)
 
         w->sum += value;
         w->count++;
+        if (w->bins) {
+            w->bins[value_to_bin(value)]++;
+        }
 
         if (value < w->min) {
             w->min = value;
@@ -229,3 +318,47 @@ uint64_t timed_average_sum(TimedAverage *ta, uint64_t *elapsed)
     w = current_window(ta);
     return w->sum;
 }
+
+/* Get a percentile of the values. The result is the middle of the
+ * histogram bin that contains the percentile, limited to the minimum and
+ * maximum values. Percentiles must have been enabled with
+ * timed_average_enable_percentiles().
+ *
+ * @ta:         the TimedAverage structure
+ * @percentile: the percentile to compute, between 0 and 100
+ * @ret:        the percentile, or 0 if no values were accounted
+ */
+uint64_t timed_average_percentile(TimedAverage *ta, double percentile)
+{
+    TimedAverageWindow *w;
+    uint64_t rank, seen = 0;
+    uint64_t value, width;
+    unsigned i;
+
+    assert(percentile >= 0 && percentile <= 100);
+    assert(ta->windows[0].bins);
+
+    check_expirations(ta, NULL);
+    w = current_window(ta);
+    if (w->count == 0) {
+        return 0;
+    }
+
+    /* The percentile is the value with this rank, starting at 1 */
+    rank = MAX(ceil(w->count * percentile / 100), 1);
+    for (i = 0; i < TIMED_AVERAGE_NR_BINS - 1; i++) {
+        seen += w->bins[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    if (i == TIMED_AVERAGE_NR_BINS - 1) {
+        /* The last bin has no upper limit */
+        return w->max;
+    }
+
+    value = bin_to_value(i, &width);
+    value += (width - 1) / 2;
+    return MIN(MAX(value, w->min), w->max);
+}